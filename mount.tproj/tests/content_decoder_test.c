@@ -0,0 +1,394 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * content_decoder_test checks the ContentDecoder against the documents in
+ * corpus/ encoded the ways servers send them, and reports how well they
+ * compress and what decoding them costs.
+ *
+ *	usage: content_decoder_test [corpus directory]
+ *
+ * Each document is made into response bodies for gzip, x-gzip and deflate
+ * (with and without the zlib wrapper), bodies sent with a Content-Encoding
+ * but not encoded, bodies with an encoding that wasn't asked for, corrupt
+ * bodies, and a gzip body followed by garbage. Every body is handed to
+ * content_decoder_decode in pieces of every size from one byte to the whole
+ * body, and must decode to the document or fail with EIO as expected.
+ */
+
+#include "../webdav_network.c"
+
+#include <stdarg.h>
+#include "network_harness.h"
+
+/* the response bodies made from a document */
+enum
+{
+	BODY_DOCUMENT,			/* the document itself */
+	BODY_GZIP,				/* gzip */
+	BODY_ZLIB,				/* deflate with the zlib wrapper */
+	BODY_RAW_DEFLATE,		/* deflate without it */
+	BODY_CORRUPT_GZIP,		/* gzip with a bad first block */
+	BODY_CORRUPT_ZLIB,		/* zlib with a bad first block */
+	BODY_GZIP_GARBAGE,		/* gzip followed by garbage */
+	BODY_COUNT
+};
+
+/* what should become of a body */
+enum
+{
+	EXPECT_DOCUMENT,		/* decoded to the document */
+	EXPECT_NOT_ENCODED,		/* content_decoder_create returns no decoder */
+	EXPECT_CREATE_ERROR,	/* content_decoder_create fails with EIO */
+	EXPECT_DECODE_ERROR		/* content_decoder_decode fails with EIO */
+};
+
+struct decoder_case
+{
+	const char *contentEncoding;	/* the Content-Encoding header, or NULL for none */
+	int body;						/* BODY_* */
+	int expect;						/* EXPECT_* */
+};
+
+static const struct decoder_case gDecoderCases[] =
+{
+	{ "gzip", BODY_GZIP, EXPECT_DOCUMENT },
+	{ "x-gzip", BODY_GZIP, EXPECT_DOCUMENT },
+	{ "GZip", BODY_GZIP, EXPECT_DOCUMENT },
+	{ "deflate", BODY_ZLIB, EXPECT_DOCUMENT },
+	{ "deflate", BODY_RAW_DEFLATE, EXPECT_DOCUMENT },
+	{ "gzip", BODY_DOCUMENT, EXPECT_DOCUMENT },
+	{ "deflate", BODY_DOCUMENT, EXPECT_DOCUMENT },
+	{ "identity", BODY_DOCUMENT, EXPECT_NOT_ENCODED },
+	{ NULL, BODY_DOCUMENT, EXPECT_NOT_ENCODED },
+	{ "br", BODY_DOCUMENT, EXPECT_CREATE_ERROR },
+	{ "compress", BODY_GZIP, EXPECT_CREATE_ERROR },
+	{ "gzip", BODY_CORRUPT_GZIP, EXPECT_DECODE_ERROR },
+	{ "deflate", BODY_CORRUPT_ZLIB, EXPECT_DECODE_ERROR },
+	{ "gzip", BODY_GZIP_GARBAGE, EXPECT_DOCUMENT }
+};
+
+#define DECODER_CASE_COUNT (sizeof(gDecoderCases) / sizeof(gDecoderCases[0]))
+
+static const char *gBodyNames[BODY_COUNT] =
+{
+	"document", "gzip", "zlib", "raw deflate", "corrupt gzip", "corrupt zlib", "gzip + garbage"
+};
+
+static const char *gCorpus[] = { "apache.xml", "iis.xml", "nginx.xml", "sabredav.xml" };
+
+#define CORPUS_COUNT (sizeof(gCorpus) / sizeof(gCorpus[0]))
+
+/* times each document's gzip body is decoded to measure the CPU it takes */
+#define DECODE_TIMING_ROUNDS 2000
+
+#define GARBAGE "garbage after the gzip trailer\n"
+
+struct body
+{
+	UInt8 *bytes;
+	size_t length;
+};
+
+static int gFailures = 0;
+
+static void fail(const char *document, const struct decoder_case *test, size_t pieceSize, const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "FAIL %s, %s body, Content-Encoding %s, %zu byte pieces: ", document, gBodyNames[test->body],
+		(test->contentEncoding != NULL) ? test->contentEncoding : "(none)", pieceSize);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	++gFailures;
+}
+
+/*****************************************************************************/
+
+/* reads a corpus file into a malloc'd buffer */
+static UInt8 *read_document(const char *directory, const char *name, size_t *length)
+{
+	char path[MAXPATHLEN];
+	FILE *file;
+	UInt8 *document;
+	long size;
+
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	file = fopen(path, "r");
+	if ( file == NULL )
+	{
+		perror(path);
+		return ( NULL );
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	document = malloc((size_t)size);
+	if ( (document != NULL) && (fread(document, 1, (size_t)size, file) != (size_t)size) )
+	{
+		free(document);
+		document = NULL;
+	}
+	fclose(file);
+	*length = (size_t)size;
+	return ( document );
+}
+
+/* compresses document with windowBits as deflateInit2 takes them, leaving room for extra bytes; returns FALSE if zlib fails */
+static int encode_document(const UInt8 *document, size_t length, int windowBits, size_t extra, struct body *body)
+{
+	z_stream zstream;
+	int zresult;
+
+	memset(&zstream, 0, sizeof(zstream));
+	if ( deflateInit2(&zstream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK )
+	{
+		return ( FALSE );
+	}
+	body->length = deflateBound(&zstream, (uLong)length) + extra;
+	body->bytes = malloc(body->length);
+	zresult = Z_STREAM_ERROR;
+	if ( body->bytes != NULL )
+	{
+		zstream.next_in = (Bytef *)document;
+		zstream.avail_in = (uInt)length;
+		zstream.next_out = body->bytes;
+		zstream.avail_out = (uInt)body->length;
+		zresult = deflate(&zstream, Z_FINISH);
+		body->length = zstream.total_out;
+	}
+	(void) deflateEnd(&zstream);
+	return ( zresult == Z_STREAM_END );
+}
+
+/* makes every BODY_* body from document; returns FALSE if zlib fails */
+static int make_bodies(const UInt8 *document, size_t length, struct body bodies[BODY_COUNT])
+{
+	bodies[BODY_DOCUMENT].bytes = malloc(length);
+	if ( bodies[BODY_DOCUMENT].bytes == NULL )
+	{
+		return ( FALSE );
+	}
+	memcpy(bodies[BODY_DOCUMENT].bytes, document, length);
+	bodies[BODY_DOCUMENT].length = length;
+
+	if ( !encode_document(document, length, 15 + 16, 0, &bodies[BODY_GZIP]) ||
+		!encode_document(document, length, 15, 0, &bodies[BODY_ZLIB]) ||
+		!encode_document(document, length, -15, 0, &bodies[BODY_RAW_DEFLATE]) ||
+		!encode_document(document, length, 15 + 16, 0, &bodies[BODY_CORRUPT_GZIP]) ||
+		!encode_document(document, length, 15, 0, &bodies[BODY_CORRUPT_ZLIB]) ||
+		!encode_document(document, length, 15 + 16, strlen(GARBAGE), &bodies[BODY_GZIP_GARBAGE]) )
+	{
+		return ( FALSE );
+	}
+
+	/* a final block of the reserved type 3 right after the 10 byte gzip and 2 byte zlib headers */
+	bodies[BODY_CORRUPT_GZIP].bytes[10] = 0x07;
+	bodies[BODY_CORRUPT_ZLIB].bytes[2] = 0x07;
+
+	memcpy(bodies[BODY_GZIP_GARBAGE].bytes + bodies[BODY_GZIP_GARBAGE].length, GARBAGE, strlen(GARBAGE));
+	bodies[BODY_GZIP_GARBAGE].length += strlen(GARBAGE);
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/* returns a response with contentEncoding (if not NULL) */
+static CFHTTPMessageRef create_response(const char *contentEncoding)
+{
+	CFHTTPMessageRef response;
+	CFStringRef value;
+
+	response = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 207, NULL, kCFHTTPVersion1_1);
+	if ( (response != NULL) && (contentEncoding != NULL) )
+	{
+		value = CFStringCreateWithCString(kCFAllocatorDefault, contentEncoding, kCFStringEncodingUTF8);
+		if ( value == NULL )
+		{
+			CFRelease(response);
+			return ( NULL );
+		}
+		CFHTTPMessageSetHeaderFieldValue(response, CFSTR("Content-Encoding"), value);
+		CFRelease(value);
+	}
+	return ( response );
+}
+
+/* decodes body in pieceSize pieces and checks the result */
+static void check_case(const char *name, const UInt8 *document, size_t length, const struct decoder_case *test,
+	const struct body *body, size_t pieceSize)
+{
+	CFHTTPMessageRef response;
+	struct ContentDecoder *decoder;
+	struct DecodedBuffer decoded;
+	size_t offset;
+	int error;
+
+	response = create_response(test->contentEncoding);
+	if ( response == NULL )
+	{
+		fail(name, test, pieceSize, "could not create the response");
+		return;
+	}
+	error = content_decoder_create(response, &decoder);
+	CFRelease(response);
+
+	if ( test->expect == EXPECT_CREATE_ERROR )
+	{
+		if ( error != EIO )
+		{
+			fail(name, test, pieceSize, "content_decoder_create returned %d, not EIO", error);
+		}
+		content_decoder_free(decoder);
+		return;
+	}
+	if ( error != 0 )
+	{
+		fail(name, test, pieceSize, "content_decoder_create returned %d", error);
+		return;
+	}
+	if ( (decoder == NULL) != (test->expect == EXPECT_NOT_ENCODED) )
+	{
+		fail(name, test, pieceSize, (decoder == NULL) ? "no decoder" : "a decoder for a body that isn't encoded");
+		content_decoder_free(decoder);
+		return;
+	}
+	if ( decoder == NULL )
+	{
+		return;
+	}
+
+	memset(&decoded, 0, sizeof(decoded));
+	for ( offset = 0; (error == 0) && (offset < body->length); offset += pieceSize )
+	{
+		error = content_decoder_decode(decoder, body->bytes + offset, (CFIndex)MIN(pieceSize, body->length - offset),
+			append_decoded_bytes, &decoded);
+	}
+	content_decoder_free(decoder);
+
+	if ( test->expect == EXPECT_DECODE_ERROR )
+	{
+		if ( error != EIO )
+		{
+			fail(name, test, pieceSize, "content_decoder_decode returned %d, not EIO", error);
+		}
+	}
+	else if ( error != 0 )
+	{
+		fail(name, test, pieceSize, "content_decoder_decode returned %d", error);
+	}
+	else if ( ((size_t)decoded.count != length) || (memcmp(decoded.buffer, document, length) != 0) )
+	{
+		fail(name, test, pieceSize, "decoded %ld bytes that aren't the %zu byte document", (long)decoded.count, length);
+	}
+	free(decoded.buffer);
+}
+
+/* returns the CPU microseconds it takes to decode body in one piece */
+static double decode_microseconds(const struct body *body)
+{
+	CFHTTPMessageRef response;
+	struct ContentDecoder *decoder;
+	struct DecodedBuffer decoded;
+	double start;
+	int round;
+
+	response = create_response("gzip");
+	if ( response == NULL )
+	{
+		return ( -1.0 );
+	}
+	memset(&decoded, 0, sizeof(decoded));
+	start = network_harness_cpu();
+	for ( round = 0; round < DECODE_TIMING_ROUNDS; ++round )
+	{
+		if ( content_decoder_create(response, &decoder) != 0 )
+		{
+			break;
+		}
+		decoded.count = 0;
+		(void) content_decoder_decode(decoder, body->bytes, (CFIndex)body->length, append_decoded_bytes, &decoded);
+		content_decoder_free(decoder);
+	}
+	free(decoded.buffer);
+	CFRelease(response);
+	return ( (network_harness_cpu() - start) * 1000000.0 / DECODE_TIMING_ROUNDS );
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	const char *directory;
+	struct body bodies[BODY_COUNT];
+	UInt8 *document;
+	size_t length;
+	size_t corpus;
+	size_t index;
+	size_t pieceSize;
+	size_t checked;
+	int body;
+
+	directory = (argc > 1) ? argv[1] : "corpus";
+
+	/* network_learn_server_capability takes it */
+	pthread_mutex_init(&gNetworkGlobals_lock, NULL);
+
+	checked = 0;
+	for ( corpus = 0; corpus < CORPUS_COUNT; ++corpus )
+	{
+		document = read_document(directory, gCorpus[corpus], &length);
+		memset(bodies, 0, sizeof(bodies));
+		if ( (document == NULL) || !make_bodies(document, length, bodies) )
+		{
+			fprintf(stderr, "FAIL could not make the bodies for %s\n", gCorpus[corpus]);
+			return ( EXIT_FAILURE );
+		}
+
+		for ( index = 0; index < DECODER_CASE_COUNT; ++index )
+		{
+			for ( pieceSize = 1; pieceSize <= bodies[gDecoderCases[index].body].length; ++pieceSize )
+			{
+				check_case(gCorpus[corpus], document, length, &gDecoderCases[index], &bodies[gDecoderCases[index].body], pieceSize);
+				++checked;
+			}
+		}
+
+		printf("%-13s %5zu bytes  gzip %5zu (%4.1f:1)  deflate %5zu (%4.1f:1)  gzip decode %6.1f us\n",
+			gCorpus[corpus], length,
+			bodies[BODY_GZIP].length, (double)length / (double)bodies[BODY_GZIP].length,
+			bodies[BODY_RAW_DEFLATE].length, (double)length / (double)bodies[BODY_RAW_DEFLATE].length,
+			decode_microseconds(&bodies[BODY_GZIP]));
+
+		for ( body = 0; body < BODY_COUNT; ++body )
+		{
+			free(bodies[body].bytes);
+		}
+		free(document);
+	}
+
+	printf("content_decoder_test: %zu decodes, %d failures\n", checked, gFailures);
+	return ( (gFailures == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * dirent_write_bench counts the writes a directory listing makes to the
+ * directory's cache file.
+ *
+ *	usage: dirent_write_bench [entries [runs]]
+ *
+ * A synthetic listing of entries children (10,000 by default) is parsed runs
+ * times (10 by default), 64K at a time. The write system calls and the wall
+ * time are reported per 10,000 entries. For comparison,
+ * dirent_write_bench_unbatched is built from this file with
+ * WEBDAV_DIRENT_BATCH_COUNT set to 2, the smallest batch parse_opendir_begin
+ * allows (it writes "." and ".." together).
+ */
+
+#include <unistd.h>
+#include "webdavd.h"
+#include "webdav_parse.h"
+
+#ifdef UNBATCHED
+#undef WEBDAV_DIRENT_BATCH_COUNT
+#define WEBDAV_DIRENT_BATCH_COUNT 2
+#endif
+
+/* count the writes webdav_parse.c makes */
+static size_t gWriteCalls = 0;
+
+static ssize_t counted_write(int fd, const void *buf, size_t nbyte)
+{
+	++gWriteCalls;
+	return ( write(fd, buf, nbyte) );
+}
+
+#define write counted_write
+#include "../webdav_parse.c"
+#undef write
+
+#include <stdio.h>
+#include "listing_harness.h"
+
+int main(int argc, char *argv[])
+{
+	char *document;
+	size_t length;
+	size_t entries;
+	int runs;
+	int run;
+	struct listing_result result;
+	double seconds;
+	int error;
+
+	entries = (argc > 1) ? strtoul(argv[1], NULL, 10) : 10000;
+	runs = (argc > 2) ? atoi(argv[2]) : 10;
+	if ( (entries == 0) || (runs <= 0) )
+	{
+		fprintf(stderr, "usage: %s [entries [runs]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	document = listing_document(entries, &length);
+
+	gWriteCalls = 0;
+	seconds = 0.0;
+	for ( run = 0; run < runs; ++run )
+	{
+		error = listing_run(document, length, 0x10000, &result);
+		if ( (error != 0) || (result.entries != entries) )
+		{
+			fprintf(stderr, "listing failed (error %d, %zu of %zu dirents)\n", error, result.entries, entries);
+			return ( EXIT_FAILURE );
+		}
+		seconds += result.seconds;
+	}
+
+	printf("%zu dirents per write: %10.1f writes  %8.2f ms  per 10000 entries\n", (size_t)WEBDAV_DIRENT_BATCH_COUNT,
+		(double)gWriteCalls * 10000.0 / ((double)entries * runs),
+		seconds * 1000.0 * 10000.0 / ((double)entries * runs));
+
+	free(document);
+	return ( EXIT_SUCCESS );
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * download_bench measures how fast a large file downloads over a link where
+ * a single connection is held to a fraction of the bandwidth.
+ *
+ *	usage: download_bench [megabytes [connections [latency_ms [megabytes/s]]]]
+ *
+ * A file of megabytes (256 by default) is read from start to end on a mount
+ * with downloadconnections=1, and then on a fresh mount with
+ * downloadconnections=connections (4 by default). The latency server waits
+ * latency_ms (50 by default) before each response and sends no faster than
+ * megabytes/s (20 by default) on each connection. The time from open to the
+ * last read, the throughput, and the GETs and Range GETs the server answered
+ * are reported for each. The data read is checked.
+ */
+
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+#define READ_SIZE	0x100000
+
+/* reads the file from a fresh mount with options; returns an errno */
+static int run(struct mount_harness *harness, const char *options, off_t size)
+{
+	struct latency_server_counts counts;
+	char path[MAXPATHLEN];
+	char *buffer;
+	off_t offset;
+	ssize_t count;
+	double start;
+	double seconds;
+	int fd;
+	int error;
+
+	error = mount_harness_mount(harness, options);
+	if ( error != 0 )
+	{
+		return ( error );
+	}
+	buffer = malloc(READ_SIZE);
+	snprintf(path, sizeof(path), "%s/file", harness->mount_point);
+	latency_server_reset_counts(&harness->server);
+
+	start = mount_harness_now();
+	fd = open(path, O_RDONLY);
+	error = ((buffer == NULL) || (fd < 0)) ? errno : 0;
+	for ( offset = 0; (error == 0) && (offset < size); offset += count )
+	{
+		count = read(fd, buffer, READ_SIZE);
+		if ( count <= 0 )
+		{
+			error = (count < 0) ? errno : EIO;
+		}
+		else if ( !mount_harness_check(buffer, offset, (size_t)count) )
+		{
+			fprintf(stderr, "%s: wrong data at offset %lld\n", options, (long long)offset);
+			error = EIO;
+		}
+	}
+	seconds = mount_harness_now() - start;
+	if ( fd >= 0 )
+	{
+		close(fd);
+	}
+	free(buffer);
+
+	if ( error == 0 )
+	{
+		latency_server_get_counts(&harness->server, &counts);
+		printf("%-22s %8.2f s %8.1f MB/s %6llu GETs %6llu Range GETs\n", options, seconds,
+			(double)size / seconds / (1024.0 * 1024.0), (unsigned long long)counts.gets,
+			(unsigned long long)counts.range_gets);
+	}
+	mount_harness_unmount(harness);
+	return ( error );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	char options[64];
+	off_t size;
+	int connections;
+	int error;
+
+	size = (off_t)((argc > 1) ? atoll(argv[1]) : 256) * 1024 * 1024;
+	connections = (argc > 2) ? atoi(argv[2]) : 4;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 3) ? atoi(argv[3]) : 50;
+	harness.server.bandwidth = (uint64_t)(((argc > 4) ? atof(argv[4]) : 20.0) * 1024.0 * 1024.0);
+	if ( (size <= 0) || (connections < 1) )
+	{
+		fprintf(stderr, "usage: %s [megabytes [connections [latency_ms [megabytes/s]]]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	error = mount_harness_init(&harness);
+	if ( error == 0 )
+	{
+		error = mount_harness_make_file(&harness, "file", size);
+	}
+	if ( error == 0 )
+	{
+		error = run(&harness, "downloadconnections=1", size);
+	}
+	if ( error == 0 )
+	{
+		snprintf(options, sizeof(options), "downloadconnections=%d", connections);
+		error = run(&harness, options, size);
+	}
+	mount_harness_cleanup(&harness);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "download_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
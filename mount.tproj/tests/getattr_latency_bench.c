@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * getattr_latency_bench measures many concurrent WEBDAV_GETATTRs against a
+ * slow server, with and without the agent's event engine.
+ *
+ *	usage: getattr_latency_bench [files [latency_ms]]
+ *
+ * files (1,000 by default) files are made in the server's directory and each
+ * is stat'ed once through the mount, so the kernel has a vnode for each. Once
+ * the agent's cached attributes for them have timed out, files threads each
+ * stat a different file at the same moment, which sends files WEBDAV_GETATTRs
+ * to the agent, each needing a PROPFIND. The latency server waits latency_ms
+ * (100 by default) before each response. The stat latencies, the time until
+ * the last stat returned, the most threads the agent had during the run, and
+ * the most requests the server was answering at once are reported for a
+ * mount with the event engine and one with noeventengine.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+/* longer than the agent keeps the attributes of a file modified a moment ago (ATTRIBUTES_TIMEOUT_MIN) */
+#define ATTRIBUTES_EXPIRE_SECONDS	3
+
+struct run
+{
+	struct mount_harness *harness;
+	double *latencies;			/* seconds each stat took */
+	int failures;				/* stats that failed */
+	volatile int sampling;		/* cleared to stop sample_agent */
+	int max_threads;			/* most threads the agent had */
+};
+
+static void stat_file(void *context, size_t index)
+{
+	struct run *run;
+	struct stat statbuf;
+	char path[MAXPATHLEN];
+	double start;
+
+	run = (struct run *)context;
+	snprintf(path, sizeof(path), "%s/file%zu", run->harness->mount_point, index);
+	start = mount_harness_now();
+	if ( stat(path, &statbuf) != 0 )
+	{
+		__sync_fetch_and_add(&run->failures, 1);
+	}
+	run->latencies[index] = mount_harness_now() - start;
+}
+
+/* records the most threads the agent has until run->sampling is cleared */
+static void *sample_agent(void *arg)
+{
+	struct run *run;
+	int threads;
+	double cpu;
+
+	run = (struct run *)arg;
+	while ( run->sampling )
+	{
+		if ( (mount_harness_agent_usage(run->harness, &threads, &cpu) == 0) && (threads > run->max_threads) )
+		{
+			run->max_threads = threads;
+		}
+		usleep(5000);
+	}
+	return ( NULL );
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double difference;
+
+	difference = *(const double *)a - *(const double *)b;
+	return ( (difference < 0.0) ? -1 : (difference > 0.0) );
+}
+
+/* stats count files on a mount with options; returns an errno */
+static int run_storm(struct mount_harness *harness, const char *options, size_t count)
+{
+	struct run run;
+	struct latency_server_counts counts;
+	const char *label;
+	pthread_t sampler;
+	int threads;
+	double cpu;
+	double start;
+	double seconds;
+	int error;
+
+	label = (options != NULL) ? options : "event engine";
+	memset(&run, 0, sizeof(run));
+	run.harness = harness;
+	run.latencies = malloc(count * sizeof(double));
+	if ( run.latencies == NULL )
+	{
+		return ( ENOMEM );
+	}
+
+	error = mount_harness_mount(harness, options);
+	if ( error != 0 )
+	{
+		free(run.latencies);
+		return ( error );
+	}
+
+	/* look up every file, and wait for the agent's attributes to time out */
+	error = mount_harness_storm(count, stat_file, &run);
+	sleep(ATTRIBUTES_EXPIRE_SECONDS);
+	if ( (error == 0) && (run.failures != 0) )
+	{
+		fprintf(stderr, "%s: %d of %zu lookups failed\n", label, run.failures, count);
+		error = EIO;
+	}
+
+	if ( error == 0 )
+	{
+		run.sampling = 1;
+		run.max_threads = 0;
+		(void) mount_harness_agent_usage(harness, &threads, &cpu);
+		error = pthread_create(&sampler, NULL, sample_agent, &run);
+	}
+	if ( error == 0 )
+	{
+		latency_server_reset_counts(&harness->server);
+		start = mount_harness_now();
+		error = mount_harness_storm(count, stat_file, &run);
+		seconds = mount_harness_now() - start;
+		run.sampling = 0;
+		pthread_join(sampler, NULL);
+		latency_server_get_counts(&harness->server, &counts);
+
+		qsort(run.latencies, count, sizeof(double), compare_doubles);
+		printf("%-14s %zu stats in %6.2f s  median %7.1f ms  p99 %7.1f ms  max %7.1f ms\n",
+			label, count, seconds,
+			run.latencies[count / 2] * 1000.0, run.latencies[count * 99 / 100] * 1000.0,
+			run.latencies[count - 1] * 1000.0);
+		printf("%-14s agent threads %d (%d before)  server: %llu PROPFINDs, %d at once, %d connections\n", "",
+			run.max_threads, threads, (unsigned long long)counts.propfinds, counts.max_active, counts.max_connections);
+		if ( run.failures != 0 )
+		{
+			fprintf(stderr, "%s: %d of %zu stats failed\n", label, run.failures, count);
+			error = EIO;
+		}
+	}
+
+	mount_harness_unmount(harness);
+	free(run.latencies);
+	return ( error );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	char name[32];
+	size_t count;
+	size_t index;
+	int error;
+
+	count = (argc > 1) ? strtoul(argv[1], NULL, 10) : 1000;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 2) ? atoi(argv[2]) : 100;
+	if ( count == 0 )
+	{
+		fprintf(stderr, "usage: %s [files [latency_ms]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	error = mount_harness_init(&harness);
+	for ( index = 0; (error == 0) && (index < count); ++index )
+	{
+		snprintf(name, sizeof(name), "file%zu", index);
+		error = mount_harness_make_file(&harness, name, 0);
+	}
+	if ( error == 0 )
+	{
+		error = run_storm(&harness, NULL, count);
+	}
+	if ( error == 0 )
+	{
+		error = run_storm(&harness, "noeventengine", count);
+	}
+	mount_harness_cleanup(&harness);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "getattr_latency_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * header_template_bench measures the CPU it takes to build a request's
+ * headers from the header template, against setting each of them with its
+ * own CFHTTPMessageSetHeaderFieldValue the way requests were built before.
+ *
+ *	usage: header_template_bench [iterations]
+ *
+ * The stat PROPFIND (built by create_transaction_request) and the GET of
+ * network_open are each built iterations (200,000 by default) times both
+ * ways, for a plain server, a Microsoft IIS server, and a server that gets
+ * the X-Source-Id and X-Apple-Realm-Support headers. Both ways must produce
+ * the same headers. The CPU time per request is reported.
+ */
+
+#include "../webdav_network.c"
+#include "network_harness.h"
+
+/* builds a request with the headers set one at a time */
+typedef CFHTTPMessageRef (*RequestCreator)(CFURLRef url, CFDataRef bodyData);
+
+struct server_case
+{
+	const char *label;
+	uint32_t serverIdent;		/* gServerIdent */
+	int sourceId;				/* TRUE if the X-Source-Id and X-Apple-Realm-Support headers are sent */
+};
+
+static const struct server_case gServerCases[] =
+{
+	{ "plain", 0, FALSE },
+	{ "IIS", WEBDAV_MICROSOFT_IIS_SERVER, FALSE },
+	{ "sourceid", 0, TRUE }
+};
+
+/*****************************************************************************/
+
+static CFHTTPMessageRef propfind_per_header(CFURLRef url, CFDataRef bodyData)
+{
+	CFHTTPMessageRef message;
+	CFIndex i;
+
+	message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("PROPFIND"), url, kCFHTTPVersion1_1);
+	if ( message == NULL )
+	{
+		return ( NULL );
+	}
+	CFHTTPMessageSetBody(message, bodyData);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("User-Agent"), userAgentHeaderValue);
+	if ( X_Source_Id_HeaderValue != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
+	}
+	if ( X_Apple_Realm_Support_HeaderValue != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Apple-Realm-Support"), X_Apple_Realm_Support_HeaderValue);
+	}
+	if ( gAcceptEncoding )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept-Encoding"), CFSTR("gzip, deflate"));
+	}
+	add_cookie_headers(message, url);
+	for ( i = 0; i < stat_propfind_header_count(); ++i )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, gStatPropfindHeaders[i].headerField, gStatPropfindHeaders[i].value);
+	}
+	return ( message );
+}
+
+static CFHTTPMessageRef propfind_template(CFURLRef url, CFDataRef bodyData)
+{
+	return ( create_transaction_request(url, CFSTR("PROPFIND"), bodyData,
+		stat_propfind_header_count(), gStatPropfindHeaders, FALSE) );
+}
+
+static CFHTTPMessageRef get_per_header(CFURLRef url, CFDataRef bodyData)
+{
+	#pragma unused(bodyData)
+	CFHTTPMessageRef message;
+
+	message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), url, kCFHTTPVersion1_1);
+	if ( message == NULL )
+	{
+		return ( NULL );
+	}
+	if ( gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("translate"), CFSTR("f"));
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Pragma"), CFSTR("no-cache"));
+	}
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("User-Agent"), userAgentHeaderValue);
+	if ( X_Source_Id_HeaderValue != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
+	}
+	add_cookie_headers(message, url);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept"), CFSTR("*/*"));
+	return ( message );
+}
+
+/* the GET network_open builds */
+static CFHTTPMessageRef get_template(CFURLRef url, CFDataRef bodyData)
+{
+	#pragma unused(bodyData)
+	CFHTTPMessageRef message;
+
+	message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), url, kCFHTTPVersion1_1);
+	if ( message == NULL )
+	{
+		return ( NULL );
+	}
+	apply_header_template(message, HEADER_TEMPLATE_NO_CACHE | HEADER_TEMPLATE_SOURCE_ID);
+	add_cookie_headers(message, url);
+	CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Accept"), CFSTR("*/*"));
+	return ( message );
+}
+
+/*****************************************************************************/
+
+/* returns the number of headers if both creators build the same headers, or -1 */
+static CFIndex compare_headers(RequestCreator perHeader, RequestCreator fromTemplate, CFURLRef url, CFDataRef bodyData)
+{
+	CFHTTPMessageRef messages[2];
+	CFDictionaryRef headers[2];
+	CFIndex count;
+	int index;
+
+	messages[0] = perHeader(url, bodyData);
+	messages[1] = fromTemplate(url, bodyData);
+	count = -1;
+	if ( (messages[0] != NULL) && (messages[1] != NULL) )
+	{
+		for ( index = 0; index < 2; ++index )
+		{
+			headers[index] = CFHTTPMessageCopyAllHeaderFields(messages[index]);
+		}
+		if ( (headers[0] != NULL) && (headers[1] != NULL) && CFEqual(headers[0], headers[1]) )
+		{
+			count = CFDictionaryGetCount(headers[0]);
+		}
+		for ( index = 0; index < 2; ++index )
+		{
+			if ( headers[index] != NULL )
+			{
+				CFRelease(headers[index]);
+			}
+		}
+	}
+	for ( index = 0; index < 2; ++index )
+	{
+		if ( messages[index] != NULL )
+		{
+			CFRelease(messages[index]);
+		}
+	}
+	return ( count );
+}
+
+/* returns the CPU microseconds per request creator takes */
+static double time_creator(RequestCreator creator, CFURLRef url, CFDataRef bodyData, long iterations)
+{
+	CFHTTPMessageRef message;
+	double start;
+	long index;
+
+	start = network_harness_cpu();
+	for ( index = 0; index < iterations; ++index )
+	{
+		message = creator(url, bodyData);
+		if ( message != NULL )
+		{
+			CFRelease(message);
+		}
+	}
+	return ( (network_harness_cpu() - start) * 1000000.0 / (double)iterations );
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	static const struct
+	{
+		const char *label;
+		RequestCreator perHeader;
+		RequestCreator fromTemplate;
+	} requests[] =
+	{
+		{ "PROPFIND", propfind_per_header, propfind_template },
+		{ "GET", get_per_header, get_template }
+	};
+	CFURLRef url;
+	CFDataRef bodyData;
+	CFIndex count;
+	double perHeaderTime;
+	double templateTime;
+	long iterations;
+	size_t serverCase;
+	size_t request;
+	int result;
+
+	iterations = (argc > 1) ? atol(argv[1]) : 200000;
+	if ( iterations <= 0 )
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	userAgentHeaderValue = CFSTR("WebDAVFS/3.0.0 (03008000) Darwin/25.0.0 (arm64)");
+	url = CFURLCreateWithString(kCFAllocatorDefault, CFSTR("http://localhost/webdav/some/directory/file.txt"), NULL);
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, gStatPropfindXML,
+		strlen((const char *)gStatPropfindXML), kCFAllocatorNull);
+	if ( (url == NULL) || (bodyData == NULL) )
+	{
+		return ( EXIT_FAILURE );
+	}
+
+	result = EXIT_SUCCESS;
+	for ( serverCase = 0; serverCase < sizeof(gServerCases) / sizeof(gServerCases[0]); ++serverCase )
+	{
+		gServerIdent = gServerCases[serverCase].serverIdent;
+		X_Source_Id_HeaderValue = gServerCases[serverCase].sourceId ? CFSTR("0123456789abcdef") : NULL;
+		X_Apple_Realm_Support_HeaderValue = gServerCases[serverCase].sourceId ? CFSTR(X_APPLE_REALM_SUPPORT_VALUE) : NULL;
+		build_header_template();
+
+		for ( request = 0; request < sizeof(requests) / sizeof(requests[0]); ++request )
+		{
+			count = compare_headers(requests[request].perHeader, requests[request].fromTemplate, url, bodyData);
+			if ( count < 0 )
+			{
+				fprintf(stderr, "%s %s: the template built different headers\n",
+					gServerCases[serverCase].label, requests[request].label);
+				result = EXIT_FAILURE;
+				continue;
+			}
+			perHeaderTime = time_creator(requests[request].perHeader, url, bodyData, iterations);
+			templateTime = time_creator(requests[request].fromTemplate, url, bodyData, iterations);
+			printf("%-9s %-9s %2ld headers  per header %7.3f us  template %7.3f us\n",
+				gServerCases[serverCase].label, requests[request].label, (long)count, perHeaderTime, templateTime);
+		}
+	}
+
+	CFRelease(bodyData);
+	CFRelease(url);
+	return ( result );
+}
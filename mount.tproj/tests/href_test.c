@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * href_test checks that GetComponentName gives the same answer for odd server
+ * hrefs whether it decodes them itself (href_path_decode) or goes through
+ * CFURL, the way it did before href_path_decode existed. For the hrefs listed
+ * under LISTING_PARENT_URL it also checks which of them href_path_decode
+ * handles and the names it gets.
+ */
+
+#include "../webdav_parse.c"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "listing_harness.h"
+
+/* what href_path_decode and GetComponentName should make of an href in LISTING_PARENT_URL */
+enum
+{
+	HREF_CHILD,		/* a child with the name given */
+	HREF_PARENT,	/* the directory itself */
+	HREF_CFURL		/* left to CFURL */
+};
+
+struct href_case
+{
+	const char *href;
+	int kind;
+	const char *name;
+};
+
+static const struct href_case gHrefCases[] =
+{
+	{ "/listing/", HREF_PARENT, NULL },
+	{ "/listing", HREF_PARENT, NULL },
+	{ "http://localhost/listing/", HREF_PARENT, NULL },
+	{ "HTTP://LOCALHOST/listing/file", HREF_CHILD, "file" },
+	{ "https://other.example.com:8443/listing/file", HREF_CHILD, "file" },
+	{ "http://localhost:8080/listing/x", HREF_CHILD, "x" },
+	{ "http://user@localhost/listing/x", HREF_CHILD, "x" },
+	{ "/listing/a%20b.txt", HREF_CHILD, "a b.txt" },
+	{ "/listing/caf%C3%A9", HREF_CHILD, "caf\xc3\xa9" },
+	{ "/listing/cafe%CC%81", HREF_CHILD, "cafe\xcc\x81" },
+	{ "/listing/%c3%a9", HREF_CHILD, "\xc3\xa9" },
+	{ "/listing/%E2%82%AC%20euro/", HREF_CHILD, "\xe2\x82\xac euro" },
+	{ "/listing/emoji%F0%9F%98%80", HREF_CHILD, "emoji\xf0\x9f\x98\x80" },
+	{ "/listing/dir/", HREF_CHILD, "dir" },
+	{ "/listing/a+b", HREF_CHILD, "a+b" },
+	{ "/listing/(1)", HREF_CHILD, "(1)" },
+	{ "/listing/~user", HREF_CHILD, "~user" },
+	{ "relative.txt", HREF_CHILD, "relative.txt" },
+	{ "sub/", HREF_CHILD, "sub" },
+	{ "/listing/a b.txt", HREF_CFURL, NULL },
+	{ "/listing/dir//", HREF_CFURL, NULL },
+	{ "/listing/./x", HREF_CFURL, NULL },
+	{ "/listing/../x", HREF_CFURL, NULL },
+	{ "/listing/x;param", HREF_CFURL, NULL },
+	{ "/listing/x?query", HREF_CFURL, NULL },
+	{ "/listing/x#frag", HREF_CFURL, NULL },
+	{ "/listing/%2F", HREF_CFURL, NULL },
+	{ "/listing/%00", HREF_CFURL, NULL },
+	{ "/listing/100%", HREF_CFURL, NULL },
+	{ "/listing/%zz", HREF_CFURL, NULL },
+	{ "/listing/invalid%C3", HREF_CFURL, NULL },
+	{ "//evil/listing/x", HREF_CFURL, NULL },
+	{ "ftp://localhost/listing/x", HREF_CFURL, NULL },
+	{ "/a dir/sub/child", HREF_CFURL, NULL },
+	{ "/a%20dir/sub/child", HREF_CHILD, "child" },
+	/* a name longer than MAXNAMLEN isn't returned as a child */
+	{ "/listing/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+		"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", HREF_PARENT, NULL },
+	{ "/dav/x", HREF_PARENT, NULL },
+	{ "/x", HREF_PARENT, NULL }
+};
+
+#define HREF_CASE_COUNT (sizeof(gHrefCases) / sizeof(gHrefCases[0]))
+
+/* the parent directories every href is tried against (the last one is relative) */
+static const char *gParents[] = { LISTING_PARENT_URL, "http://localhost/a%20dir/sub/", "https://localhost:8443/dav/", "http://localhost/" };
+#define RELATIVE_PARENT "sub/"
+
+#define PARENT_COUNT (sizeof(gParents) / sizeof(gParents[0]))
+
+static int gFailures = 0;
+
+static void fail(const char *parent, const char *href, const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "FAIL %s + %s: ", parent, href);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	++gFailures;
+}
+
+/* checks one href against one parent; returns TRUE if href_path_decode handled it */
+static int check_href(CFURLRef urlRef, const char *parent, const struct href_case *test, int check_expected)
+{
+	char *parentPath;
+	CFIndex parentPathLength;
+	char uri[WEBDAV_MAX_URI_LEN];
+	char path[WEBDAV_MAX_URI_LEN];
+	char fastName[MAXNAMLEN + 1];
+	char cfurlName[MAXNAMLEN + 1];
+	Boolean fastChild;
+	Boolean cfurlChild;
+	CFIndex utf16Length;
+	ssize_t pathLength;
+
+	parentPathLength = GetNormalizedPathLength(urlRef);
+	parentPath = CopyEscapedPath(urlRef);
+	if ( parentPath == NULL )
+	{
+		fail(parent, test->href, "CopyEscapedPath failed");
+		return ( FALSE );
+	}
+
+	/* GetComponentName may scribble on uri, so each call gets a fresh copy */
+	strlcpy(uri, test->href, sizeof(uri));
+	pathLength = href_path_decode(parentPath, uri, path, sizeof(path), &utf16Length);
+
+	fastName[0] = cfurlName[0] = '\0';
+	strlcpy(uri, test->href, sizeof(uri));
+	fastChild = GetComponentName(urlRef, parentPath, parentPathLength, uri, fastName);
+	strlcpy(uri, test->href, sizeof(uri));
+	cfurlChild = GetComponentName(urlRef, NULL, parentPathLength, uri, cfurlName);
+
+	if ( fastChild != cfurlChild )
+	{
+		fail(parent, test->href, "href_path_decode says %s, CFURL says %s",
+			fastChild ? "child" : "parent", cfurlChild ? "child" : "parent");
+	}
+	else if ( fastChild && (strcmp(fastName, cfurlName) != 0) )
+	{
+		fail(parent, test->href, "href_path_decode name \"%s\", CFURL name \"%s\"", fastName, cfurlName);
+	}
+
+	if ( check_expected )
+	{
+		if ( (test->kind == HREF_CFURL) != (pathLength <= 0) )
+		{
+			fail(parent, test->href, "expected %s CFURL", (test->kind == HREF_CFURL) ? "to go through" : "not to go through");
+		}
+		else if ( (test->kind == HREF_PARENT) && fastChild )
+		{
+			fail(parent, test->href, "expected the parent, got child \"%s\"", fastName);
+		}
+		else if ( (test->kind == HREF_CHILD) && (!fastChild || (strcmp(fastName, test->name) != 0)) )
+		{
+			fail(parent, test->href, "expected child \"%s\", got %s \"%s\"", test->name, fastChild ? "child" : "parent", fastName);
+		}
+	}
+
+	free(parentPath);
+	return ( pathLength > 0 );
+}
+
+int main(void)
+{
+	CFURLRef urlRef;
+	CFURLRef baseRef;
+	size_t parent;
+	size_t index;
+	size_t handled;
+	size_t checked;
+
+	handled = checked = 0;
+	for ( parent = 0; parent <= PARENT_COUNT; ++parent )
+	{
+		if ( parent < PARENT_COUNT )
+		{
+			urlRef = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)gParents[parent], (CFIndex)strlen(gParents[parent]),
+				kCFStringEncodingUTF8, NULL);
+		}
+		else
+		{
+			/* a relative CFURL, which parse_opendir_begin can be given too */
+			baseRef = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)LISTING_PARENT_URL, (CFIndex)strlen(LISTING_PARENT_URL),
+				kCFStringEncodingUTF8, NULL);
+			urlRef = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)RELATIVE_PARENT, (CFIndex)strlen(RELATIVE_PARENT),
+				kCFStringEncodingUTF8, baseRef);
+			CFRelease(baseRef);
+		}
+		if ( urlRef == NULL )
+		{
+			fprintf(stderr, "FAIL could not create the parent URL\n");
+			return ( EXIT_FAILURE );
+		}
+
+		for ( index = 0; index < HREF_CASE_COUNT; ++index )
+		{
+			if ( check_href(urlRef, (parent < PARENT_COUNT) ? gParents[parent] : LISTING_PARENT_URL RELATIVE_PARENT,
+					&gHrefCases[index], (parent == 0)) )
+			{
+				++handled;
+			}
+			++checked;
+		}
+
+		CFRelease(urlRef);
+	}
+
+	printf("href_test: %zu hrefs, %zu decoded without CFURL, %d failures\n", checked, handled, gFailures);
+	return ( (gFailures == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
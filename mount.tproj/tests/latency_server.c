@@ -0,0 +1,1258 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <sys/param.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "latency_server.h"
+
+#define CONNECTION_BUFFER_SIZE	0x10000		/* request headers must fit in this */
+#define BODY_PIECE_SIZE			0x10000		/* bytes per read or write of a body */
+#define URL_SIZE				3072		/* longest request URL */
+
+/* one client connection */
+struct connection
+{
+	struct latency_server *server;
+	int fd;
+	int slot;							/* index in server->connection_fds */
+	char buffer[CONNECTION_BUFFER_SIZE];
+	size_t start;						/* first unconsumed byte in buffer */
+	size_t count;						/* bytes in buffer, from 0 */
+};
+
+/* the parts of a request the server looks at */
+struct request
+{
+	char method[16];
+	char path[MAXPATHLEN];				/* decoded path from the URL */
+	char local[MAXPATHLEN];				/* root + path, without a trailing '/' */
+	char destination[MAXPATHLEN];		/* decoded local path of the Destination header */
+	int depth;							/* Depth header, 1 if missing or infinity */
+	int64_t content_length;				/* Content-Length, or -1 */
+	int chunked;						/* Transfer-Encoding: chunked */
+	int expect_continue;				/* Expect: 100-continue */
+	int close;							/* Connection: close */
+	int overwrite;						/* Overwrite isn't F */
+	int has_range;						/* Range header */
+	off_t range_start;					/* first byte, or -1 for a suffix range */
+	off_t range_end;					/* last byte, or -1 for the end of the file */
+	off_t put_offset;					/* first byte of Content-Range */
+};
+
+/* a growable response body */
+struct text
+{
+	char *bytes;
+	size_t count;
+	size_t size;
+};
+
+/*****************************************************************************/
+
+static void text_append(struct text *text, const char *bytes, size_t length)
+{
+	char *newBytes;
+	size_t newSize;
+
+	if ( (text->size - text->count) <= length )
+	{
+		newSize = MAX(text->size * 2, text->count + length + 1024);
+		newBytes = realloc(text->bytes, newSize);
+		if ( newBytes == NULL )
+		{
+			return;
+		}
+		text->bytes = newBytes;
+		text->size = newSize;
+	}
+	memcpy(text->bytes + text->count, bytes, length);
+	text->count += length;
+	text->bytes[text->count] = '\0';
+}
+
+static void text_printf(struct text *text, const char *format, ...)
+{
+	char line[MAXPATHLEN * 3 + 256];
+	va_list ap;
+	int length;
+
+	va_start(ap, format);
+	length = vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	if ( length > 0 )
+	{
+		text_append(text, line, MIN((size_t)length, sizeof(line) - 1));
+	}
+}
+
+/*****************************************************************************/
+
+/* sends all of bytes; returns FALSE if the connection is gone */
+static int send_all(int fd, const void *bytes, size_t length)
+{
+	ssize_t sent;
+
+	while ( length != 0 )
+	{
+		sent = send(fd, bytes, length, 0);
+		if ( sent < 0 )
+		{
+			if ( errno == EINTR )
+			{
+				continue;
+			}
+			return ( 0 );
+		}
+		bytes = (const char *)bytes + sent;
+		length -= (size_t)sent;
+	}
+	return ( 1 );
+}
+
+/* reads more bytes into the connection buffer; returns FALSE at end of file or if it is full */
+static int connection_fill(struct connection *connection)
+{
+	ssize_t received;
+
+	if ( connection->start != 0 )
+	{
+		memmove(connection->buffer, connection->buffer + connection->start, connection->count - connection->start);
+		connection->count -= connection->start;
+		connection->start = 0;
+	}
+	if ( connection->count == sizeof(connection->buffer) )
+	{
+		return ( 0 );
+	}
+	do
+	{
+		received = recv(connection->fd, connection->buffer + connection->count, sizeof(connection->buffer) - connection->count, 0);
+	} while ( (received < 0) && (errno == EINTR) );
+	if ( received <= 0 )
+	{
+		return ( 0 );
+	}
+	connection->count += (size_t)received;
+	return ( 1 );
+}
+
+/* returns the next line (without its CRLF) in *line, or FALSE if the connection ended first */
+static int connection_line(struct connection *connection, char **line)
+{
+	char *end;
+
+	for ( ;; )
+	{
+		end = memchr(connection->buffer + connection->start, '\n', connection->count - connection->start);
+		if ( end != NULL )
+		{
+			*line = connection->buffer + connection->start;
+			connection->start = (size_t)(end + 1 - connection->buffer);
+			if ( (end > *line) && (end[-1] == '\r') )
+			{
+				--end;
+			}
+			*end = '\0';
+			return ( 1 );
+		}
+		if ( !connection_fill(connection) )
+		{
+			return ( 0 );
+		}
+	}
+}
+
+/* passes up to length body bytes to fd (or drops them if fd is -1); returns FALSE if the connection ended first */
+static int connection_copy(struct connection *connection, uint64_t length, int fd, off_t *offset)
+{
+	size_t piece;
+
+	while ( length != 0 )
+	{
+		if ( (connection->start == connection->count) && !connection_fill(connection) )
+		{
+			return ( 0 );
+		}
+		piece = (size_t)MIN(length, (uint64_t)(connection->count - connection->start));
+		if ( fd >= 0 )
+		{
+			if ( pwrite(fd, connection->buffer + connection->start, piece, *offset) != (ssize_t)piece )
+			{
+				fd = -1;
+			}
+		}
+		*offset += (off_t)piece;
+		connection->start += piece;
+		length -= piece;
+	}
+	return ( 1 );
+}
+
+/*
+ * read_body passes the request body to fd (or drops it if fd is -1) at
+ * offset, and returns the number of body bytes, or -1 if the connection ended
+ * first.
+ */
+static int64_t read_body(struct connection *connection, struct request *request, int fd, off_t offset)
+{
+	off_t start;
+	char *line;
+	uint64_t chunkLength;
+
+	start = offset;
+	if ( request->chunked )
+	{
+		for ( ;; )
+		{
+			if ( !connection_line(connection, &line) )
+			{
+				return ( -1 );
+			}
+			chunkLength = strtoull(line, NULL, 16);
+			if ( chunkLength == 0 )
+			{
+				break;
+			}
+			if ( !connection_copy(connection, chunkLength, fd, &offset) ||
+				 !connection_line(connection, &line) )
+			{
+				return ( -1 );
+			}
+		}
+		/* the trailers end with an empty line */
+		do
+		{
+			if ( !connection_line(connection, &line) )
+			{
+				return ( -1 );
+			}
+		} while ( *line != '\0' );
+	}
+	else if ( request->content_length > 0 )
+	{
+		if ( !connection_copy(connection, (uint64_t)request->content_length, fd, &offset) )
+		{
+			return ( -1 );
+		}
+	}
+	return ( offset - start );
+}
+
+/*****************************************************************************/
+
+/* decodes the path of url into path; returns FALSE if it isn't a path the server will serve */
+static int decode_url_path(const char *url, char *path, size_t size)
+{
+	const char *bytes;
+	size_t count;
+	int high, low;
+
+	bytes = url;
+	if ( strcmp(bytes, "*") == 0 )
+	{
+		bytes = "/";
+	}
+	else if ( strstr(bytes, "://") != NULL )
+	{
+		bytes = strchr(strstr(bytes, "://") + 3, '/');
+		if ( bytes == NULL )
+		{
+			bytes = "/";
+		}
+	}
+	if ( *bytes != '/' )
+	{
+		return ( 0 );
+	}
+
+	count = 0;
+	while ( (*bytes != '\0') && (*bytes != '?') && (*bytes != '#') )
+	{
+		if ( count + 1 >= size )
+		{
+			return ( 0 );
+		}
+		if ( *bytes == '%' )
+		{
+			if ( !isxdigit((unsigned char)bytes[1]) || !isxdigit((unsigned char)bytes[2]) )
+			{
+				return ( 0 );
+			}
+			high = isdigit((unsigned char)bytes[1]) ? bytes[1] - '0' : tolower((unsigned char)bytes[1]) - 'a' + 10;
+			low = isdigit((unsigned char)bytes[2]) ? bytes[2] - '0' : tolower((unsigned char)bytes[2]) - 'a' + 10;
+			path[count] = (char)((high << 4) | low);
+			if ( path[count] == '\0' )
+			{
+				return ( 0 );
+			}
+			bytes += 3;
+		}
+		else
+		{
+			path[count] = *bytes++;
+		}
+		++count;
+	}
+	path[count] = '\0';
+
+	/* nothing outside of the root */
+	return ( (strstr(path, "/../") == NULL) &&
+		((count < 3) || (strcmp(path + count - 3, "/..") != 0)) );
+}
+
+/* makes the local path for a decoded URL path */
+static int local_path(struct latency_server *server, const char *path, char *local, size_t size)
+{
+	size_t length;
+
+	if ( (size_t)snprintf(local, size, "%s%s", server->root, path) >= size )
+	{
+		return ( 0 );
+	}
+	length = strlen(local);
+	while ( (length > 1) && (local[length - 1] == '/') )
+	{
+		local[--length] = '\0';
+	}
+	return ( 1 );
+}
+
+/* parses a "bytes=first-last" Range header */
+static void parse_range(struct request *request, const char *value)
+{
+	char *end;
+
+	if ( strncasecmp(value, "bytes=", 6) != 0 )
+	{
+		return;
+	}
+	value += 6;
+	if ( *value == '-' )
+	{
+		/* the last bytes of the file */
+		request->range_start = -1;
+		request->range_end = (off_t)strtoll(value + 1, NULL, 10);
+	}
+	else
+	{
+		request->range_start = (off_t)strtoll(value, &end, 10);
+		request->range_end = ((*end == '-') && isdigit((unsigned char)end[1])) ? (off_t)strtoll(end + 1, NULL, 10) : -1;
+	}
+	request->has_range = 1;
+}
+
+/* reads the request line and headers; returns FALSE if the connection ended or the request is bad */
+static int read_request(struct connection *connection, struct request *request)
+{
+	struct latency_server *server;
+	char *line;
+	char *value;
+	char url[URL_SIZE];
+	char path[MAXPATHLEN];
+
+	server = connection->server;
+	memset(request, 0, sizeof(*request));
+	request->depth = 1;
+	request->content_length = -1;
+	request->overwrite = 1;
+
+	/* skip any empty lines before the request line */
+	do
+	{
+		if ( !connection_line(connection, &line) )
+		{
+			return ( 0 );
+		}
+	} while ( *line == '\0' );
+
+	if ( (sscanf(line, "%15s %3071s", request->method, url) != 2) ||
+		 !decode_url_path(url, request->path, sizeof(request->path)) ||
+		 !local_path(server, request->path, request->local, sizeof(request->local)) )
+	{
+		return ( 0 );
+	}
+
+	for ( ;; )
+	{
+		if ( !connection_line(connection, &line) )
+		{
+			return ( 0 );
+		}
+		if ( *line == '\0' )
+		{
+			break;
+		}
+		value = strchr(line, ':');
+		if ( value == NULL )
+		{
+			continue;
+		}
+		*value++ = '\0';
+		while ( (*value == ' ') || (*value == '\t') )
+		{
+			++value;
+		}
+
+		if ( strcasecmp(line, "Content-Length") == 0 )
+		{
+			request->content_length = strtoll(value, NULL, 10);
+		}
+		else if ( strcasecmp(line, "Transfer-Encoding") == 0 )
+		{
+			request->chunked = (strcasestr(value, "chunked") != NULL);
+		}
+		else if ( strcasecmp(line, "Expect") == 0 )
+		{
+			request->expect_continue = (strcasestr(value, "100-continue") != NULL);
+		}
+		else if ( strcasecmp(line, "Connection") == 0 )
+		{
+			request->close = (strcasestr(value, "close") != NULL);
+		}
+		else if ( strcasecmp(line, "Depth") == 0 )
+		{
+			request->depth = (strcmp(value, "0") == 0) ? 0 : 1;
+		}
+		else if ( strcasecmp(line, "Range") == 0 )
+		{
+			parse_range(request, value);
+		}
+		else if ( strcasecmp(line, "Content-Range") == 0 )
+		{
+			/* bytes first-last/length */
+			if ( strncasecmp(value, "bytes ", 6) == 0 )
+			{
+				request->put_offset = (off_t)strtoll(value + 6, NULL, 10);
+			}
+		}
+		else if ( strcasecmp(line, "Overwrite") == 0 )
+		{
+			request->overwrite = (toupper((unsigned char)*value) != 'F');
+		}
+		else if ( strcasecmp(line, "Destination") == 0 )
+		{
+			if ( (strlen(value) < sizeof(url)) && decode_url_path(value, path, sizeof(path)) )
+			{
+				(void) local_path(server, path, request->destination, sizeof(request->destination));
+			}
+		}
+	}
+	return ( 1 );
+}
+
+/*****************************************************************************/
+
+static const char *status_text(int status)
+{
+	switch ( status )
+	{
+		case 200: return ( "OK" );
+		case 201: return ( "Created" );
+		case 204: return ( "No Content" );
+		case 206: return ( "Partial Content" );
+		case 207: return ( "Multi-Status" );
+		case 400: return ( "Bad Request" );
+		case 403: return ( "Forbidden" );
+		case 404: return ( "Not Found" );
+		case 405: return ( "Method Not Allowed" );
+		case 409: return ( "Conflict" );
+		case 412: return ( "Precondition Failed" );
+		case 416: return ( "Requested Range Not Satisfiable" );
+		default: return ( "Internal Server Error" );
+	}
+}
+
+/* waits out the server's latency, then sends the status line, headers and body */
+static int send_response(struct connection *connection, struct request *request, int status,
+	const char *headers, const char *body, size_t bodyLength, uint64_t contentLength)
+{
+	struct text response;
+	char date[64];
+	time_t now;
+	struct tm tm;
+	int result;
+
+	if ( connection->server->latency_ms != 0 )
+	{
+		usleep((useconds_t)connection->server->latency_ms * 1000);
+	}
+
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	memset(&response, 0, sizeof(response));
+	text_printf(&response, "HTTP/1.1 %d %s\r\nDate: %s\r\nServer: latency_server\r\nContent-Length: %llu\r\n%s%s\r\n",
+		status, status_text(status), date, (unsigned long long)contentLength,
+		(headers != NULL) ? headers : "", request->close ? "Connection: close\r\n" : "");
+	if ( bodyLength != 0 )
+	{
+		text_append(&response, body, bodyLength);
+	}
+	result = (response.bytes != NULL) && send_all(connection->fd, response.bytes, response.count);
+	free(response.bytes);
+	return ( result );
+}
+
+static int send_status(struct connection *connection, struct request *request, int status)
+{
+	return ( send_response(connection, request, status, NULL, NULL, 0, 0) );
+}
+
+/*****************************************************************************/
+
+/* appends path to text, escaping everything but unreserved characters and '/' */
+static void append_escaped(struct text *text, const char *path)
+{
+	char escaped[MAXPATHLEN * 3 + 1];
+	size_t count;
+	unsigned char c;
+
+	count = 0;
+	for ( ; *path != '\0'; ++path )
+	{
+		c = (unsigned char)*path;
+		if ( isalnum(c) || (strchr("-._~/", c) != NULL) )
+		{
+			escaped[count++] = (char)c;
+		}
+		else
+		{
+			count += (size_t)snprintf(escaped + count, 4, "%%%02X", c);
+		}
+	}
+	text_append(text, escaped, count);
+}
+
+/* appends the multistatus response element for one resource */
+static void append_propstat(struct text *text, const char *path, const char *local)
+{
+	int isCollection;
+	struct stat statbuf;
+	struct statvfs fsbuf;
+	struct tm tm;
+	char modified[64];
+	char created[64];
+
+	if ( stat(local, &statbuf) != 0 )
+	{
+		return;
+	}
+	isCollection = S_ISDIR(statbuf.st_mode);
+	gmtime_r(&statbuf.st_mtime, &tm);
+	strftime(modified, sizeof(modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+	text_printf(text, "<D:response><D:href>");
+	append_escaped(text, path);
+	if ( isCollection && (path[strlen(path) - 1] != '/') )
+	{
+		text_printf(text, "/");
+	}
+	text_printf(text, "</D:href><D:propstat><D:prop>");
+	if ( isCollection )
+	{
+		text_printf(text, "<D:resourcetype><D:collection/></D:resourcetype>");
+		if ( statvfs(local, &fsbuf) == 0 )
+		{
+			text_printf(text, "<D:quota-available-bytes>%llu</D:quota-available-bytes><D:quota-used-bytes>%llu</D:quota-used-bytes>",
+				(unsigned long long)fsbuf.f_bavail * fsbuf.f_frsize,
+				(unsigned long long)(fsbuf.f_blocks - fsbuf.f_bfree) * fsbuf.f_frsize);
+		}
+	}
+	else
+	{
+		text_printf(text, "<D:resourcetype/><D:getcontentlength>%lld</D:getcontentlength>", (long long)statbuf.st_size);
+	}
+	text_printf(text, "<D:getlastmodified>%s</D:getlastmodified><D:creationdate>%s</D:creationdate>"
+		"<D:getetag>\"%llx-%llx-%lx\"</D:getetag>"
+		"</D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response>\n",
+		modified, created, (unsigned long long)statbuf.st_ino, (unsigned long long)statbuf.st_size, (long)statbuf.st_mtime);
+}
+
+static int handle_propfind(struct connection *connection, struct request *request)
+{
+	struct text body;
+	struct stat statbuf;
+	DIR *dir;
+	struct dirent *entry;
+	char childPath[MAXPATHLEN];
+	char childLocal[MAXPATHLEN];
+	int result;
+
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+	if ( stat(request->local, &statbuf) != 0 )
+	{
+		return ( send_status(connection, request, 404) );
+	}
+
+	memset(&body, 0, sizeof(body));
+	text_printf(&body, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<D:multistatus xmlns:D=\"DAV:\">\n");
+	append_propstat(&body, request->path, request->local);
+	if ( S_ISDIR(statbuf.st_mode) && (request->depth != 0) )
+	{
+		dir = opendir(request->local);
+		while ( (dir != NULL) && ((entry = readdir(dir)) != NULL) )
+		{
+			if ( (strcmp(entry->d_name, ".") == 0) || (strcmp(entry->d_name, "..") == 0) )
+			{
+				continue;
+			}
+			snprintf(childPath, sizeof(childPath), "%s%s%s", request->path,
+				(request->path[strlen(request->path) - 1] == '/') ? "" : "/", entry->d_name);
+			snprintf(childLocal, sizeof(childLocal), "%s/%s", request->local, entry->d_name);
+			append_propstat(&body, childPath, childLocal);
+		}
+		if ( dir != NULL )
+		{
+			closedir(dir);
+		}
+	}
+	text_printf(&body, "</D:multistatus>\n");
+
+	result = send_response(connection, request, 207, "Content-Type: text/xml; charset=\"utf-8\"\r\n",
+		body.bytes, body.count, body.count);
+	free(body.bytes);
+	return ( result );
+}
+
+static int handle_proppatch(struct connection *connection, struct request *request)
+{
+	struct text body;
+	int result;
+
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+	memset(&body, 0, sizeof(body));
+	text_printf(&body, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<D:multistatus xmlns:D=\"DAV:\"><D:response><D:href>");
+	append_escaped(&body, request->path);
+	text_printf(&body, "</D:href><D:propstat><D:prop/><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response></D:multistatus>\n");
+	result = send_response(connection, request, 207, "Content-Type: text/xml; charset=\"utf-8\"\r\n",
+		body.bytes, body.count, body.count);
+	free(body.bytes);
+	return ( result );
+}
+
+/* sends length bytes of fd from offset, holding the connection to the server's bandwidth */
+static int send_file_range(struct connection *connection, int fd, off_t offset, uint64_t length)
+{
+	struct latency_server *server;
+	char *piece;
+	size_t pieceSize;
+	ssize_t count;
+	uint64_t sent;
+	struct timeval start, now;
+	double elapsed;
+	double due;
+	int result;
+
+	server = connection->server;
+	pieceSize = BODY_PIECE_SIZE;
+	if ( (server->bandwidth != 0) && (server->bandwidth < BODY_PIECE_SIZE * 16) )
+	{
+		/* small pieces keep a slow connection from sending in bursts */
+		pieceSize = 0x1000;
+	}
+	piece = malloc(pieceSize);
+	if ( piece == NULL )
+	{
+		return ( 0 );
+	}
+
+	result = 1;
+	sent = 0;
+	gettimeofday(&start, NULL);
+	while ( sent < length )
+	{
+		count = pread(fd, piece, (size_t)MIN((uint64_t)pieceSize, length - sent), offset + (off_t)sent);
+		if ( count <= 0 )
+		{
+			/* the file got shorter; fill out the promised length */
+			memset(piece, 0, pieceSize);
+			count = (ssize_t)MIN((uint64_t)pieceSize, length - sent);
+		}
+		if ( !send_all(connection->fd, piece, (size_t)count) )
+		{
+			result = 0;
+			break;
+		}
+		sent += (uint64_t)count;
+
+		pthread_mutex_lock(&server->lock);
+		server->counts.bytes_sent += (uint64_t)count;
+		pthread_mutex_unlock(&server->lock);
+
+		if ( server->bandwidth != 0 )
+		{
+			gettimeofday(&now, NULL);
+			elapsed = (double)(now.tv_sec - start.tv_sec) + (double)(now.tv_usec - start.tv_usec) / 1000000.0;
+			due = (double)sent / (double)server->bandwidth;
+			if ( due > elapsed )
+			{
+				usleep((useconds_t)((due - elapsed) * 1000000.0));
+			}
+		}
+	}
+	free(piece);
+	return ( result );
+}
+
+static int handle_get(struct connection *connection, struct request *request, int sendBody)
+{
+	struct latency_server *server;
+	struct stat statbuf;
+	char headers[512];
+	off_t first, last;
+	int status;
+	int fd;
+	int result;
+
+	server = connection->server;
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+
+	pthread_mutex_lock(&server->lock);
+	if ( sendBody )
+	{
+		++server->counts.gets;
+		if ( request->has_range )
+		{
+			++server->counts.range_gets;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	fd = open(request->local, O_RDONLY);
+	if ( fd < 0 )
+	{
+		return ( send_status(connection, request, 404) );
+	}
+	if ( fstat(fd, &statbuf) != 0 )
+	{
+		close(fd);
+		return ( send_status(connection, request, 500) );
+	}
+	if ( S_ISDIR(statbuf.st_mode) )
+	{
+		/* a collection has no content */
+		close(fd);
+		return ( send_status(connection, request, 200) );
+	}
+
+	status = 200;
+	first = 0;
+	last = statbuf.st_size - 1;
+	if ( request->has_range )
+	{
+		if ( request->range_start < 0 )
+		{
+			first = MAX(statbuf.st_size - request->range_end, 0);
+		}
+		else
+		{
+			first = request->range_start;
+			if ( (request->range_end >= 0) && (request->range_end < last) )
+			{
+				last = request->range_end;
+			}
+		}
+		if ( (first >= statbuf.st_size) || (first > last) )
+		{
+			snprintf(headers, sizeof(headers), "Content-Range: bytes */%lld\r\n", (long long)statbuf.st_size);
+			close(fd);
+			return ( send_response(connection, request, 416, headers, NULL, 0, 0) );
+		}
+		status = 206;
+	}
+
+	snprintf(headers, sizeof(headers), "Content-Type: application/octet-stream\r\nAccept-Ranges: bytes\r\n"
+		"ETag: \"%llx-%llx-%lx\"\r\n",
+		(unsigned long long)statbuf.st_ino, (unsigned long long)statbuf.st_size, (long)statbuf.st_mtime);
+	if ( status == 206 )
+	{
+		snprintf(headers + strlen(headers), sizeof(headers) - strlen(headers), "Content-Range: bytes %lld-%lld/%lld\r\n",
+			(long long)first, (long long)last, (long long)statbuf.st_size);
+	}
+
+	result = send_response(connection, request, status, headers, NULL, 0, (uint64_t)(last + 1 - first));
+	if ( result && sendBody )
+	{
+		result = send_file_range(connection, fd, first, (uint64_t)(last + 1 - first));
+	}
+	close(fd);
+	return ( result );
+}
+
+static int handle_put(struct connection *connection, struct request *request)
+{
+	struct latency_server *server;
+	struct stat statbuf;
+	int created;
+	int fd;
+	int64_t received;
+
+	server = connection->server;
+	pthread_mutex_lock(&server->lock);
+	++server->counts.puts;
+	pthread_mutex_unlock(&server->lock);
+
+	if ( request->expect_continue && !send_all(connection->fd, "HTTP/1.1 100 Continue\r\n\r\n", 25) )
+	{
+		return ( 0 );
+	}
+
+	created = (stat(request->local, &statbuf) != 0);
+	fd = open(request->local, O_WRONLY | O_CREAT | ((request->put_offset == 0) ? O_TRUNC : 0), 0644);
+	received = read_body(connection, request, fd, request->put_offset);
+	if ( fd >= 0 )
+	{
+		close(fd);
+	}
+	if ( received < 0 )
+	{
+		return ( 0 );
+	}
+
+	pthread_mutex_lock(&server->lock);
+	server->counts.bytes_received += (uint64_t)received;
+	pthread_mutex_unlock(&server->lock);
+
+	return ( send_status(connection, request, (fd < 0) ? 409 : (created ? 201 : 204)) );
+}
+
+static int handle_lock(struct connection *connection, struct request *request)
+{
+	struct latency_server *server;
+	struct text body;
+	char headers[128];
+	unsigned long long token;
+	int status;
+	int fd;
+	int result;
+
+	server = connection->server;
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+
+	/* locking a name that doesn't exist creates an empty file */
+	status = 200;
+	fd = open(request->local, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if ( fd >= 0 )
+	{
+		close(fd);
+		status = 201;
+	}
+
+	pthread_mutex_lock(&server->lock);
+	token = (unsigned long long)++server->next_lock_token;
+	pthread_mutex_unlock(&server->lock);
+
+	memset(&body, 0, sizeof(body));
+	text_printf(&body, "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<D:prop xmlns:D=\"DAV:\"><D:lockdiscovery><D:activelock>"
+		"<D:locktype><D:write/></D:locktype><D:lockscope><D:exclusive/></D:lockscope><D:depth>0</D:depth>"
+		"<D:timeout>Second-600</D:timeout><D:locktoken><D:href>opaquelocktoken:latency-server-%llu</D:href></D:locktoken>"
+		"</D:activelock></D:lockdiscovery></D:prop>\n", token);
+	snprintf(headers, sizeof(headers), "Content-Type: text/xml; charset=\"utf-8\"\r\nLock-Token: <opaquelocktoken:latency-server-%llu>\r\n", token);
+	result = send_response(connection, request, status, headers, body.bytes, body.count, body.count);
+	free(body.bytes);
+	return ( result );
+}
+
+static int remove_entry(const char *path, const struct stat *statbuf, int type, struct FTW *ftw)
+{
+	#pragma unused(statbuf, type, ftw)
+	return ( remove(path) );
+}
+
+static int handle_delete(struct connection *connection, struct request *request)
+{
+	struct stat statbuf;
+
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+	if ( lstat(request->local, &statbuf) != 0 )
+	{
+		return ( send_status(connection, request, 404) );
+	}
+	if ( S_ISDIR(statbuf.st_mode) )
+	{
+		(void) nftw(request->local, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+	else
+	{
+		(void) unlink(request->local);
+	}
+	return ( send_status(connection, request, 204) );
+}
+
+static int handle_mkcol(struct connection *connection, struct request *request)
+{
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+	if ( mkdir(request->local, 0755) == 0 )
+	{
+		return ( send_status(connection, request, 201) );
+	}
+	return ( send_status(connection, request, (errno == EEXIST) ? 405 : 409) );
+}
+
+static int handle_move(struct connection *connection, struct request *request)
+{
+	struct stat statbuf;
+	int exists;
+
+	if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		return ( 0 );
+	}
+	if ( request->destination[0] == '\0' )
+	{
+		return ( send_status(connection, request, 400) );
+	}
+	exists = (lstat(request->destination, &statbuf) == 0);
+	if ( exists && !request->overwrite )
+	{
+		return ( send_status(connection, request, 412) );
+	}
+	if ( rename(request->local, request->destination) != 0 )
+	{
+		return ( send_status(connection, request, (errno == ENOENT) ? 404 : 409) );
+	}
+	return ( send_status(connection, request, exists ? 204 : 201) );
+}
+
+/* answers one request; returns FALSE if the connection should close */
+static int handle_request(struct connection *connection, struct request *request)
+{
+	struct latency_server *server;
+	int result;
+
+	server = connection->server;
+	pthread_mutex_lock(&server->lock);
+	++server->counts.requests;
+	if ( strcmp(request->method, "PROPFIND") == 0 )
+	{
+		++server->counts.propfinds;
+	}
+	if ( ++server->active > server->counts.max_active )
+	{
+		server->counts.max_active = server->active;
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	if ( strcmp(request->method, "PROPFIND") == 0 )
+	{
+		result = handle_propfind(connection, request);
+	}
+	else if ( strcmp(request->method, "GET") == 0 )
+	{
+		result = handle_get(connection, request, 1);
+	}
+	else if ( strcmp(request->method, "HEAD") == 0 )
+	{
+		result = handle_get(connection, request, 0);
+	}
+	else if ( strcmp(request->method, "PUT") == 0 )
+	{
+		result = handle_put(connection, request);
+	}
+	else if ( strcmp(request->method, "LOCK") == 0 )
+	{
+		result = handle_lock(connection, request);
+	}
+	else if ( strcmp(request->method, "DELETE") == 0 )
+	{
+		result = handle_delete(connection, request);
+	}
+	else if ( strcmp(request->method, "MKCOL") == 0 )
+	{
+		result = handle_mkcol(connection, request);
+	}
+	else if ( strcmp(request->method, "MOVE") == 0 )
+	{
+		result = handle_move(connection, request);
+	}
+	else if ( strcmp(request->method, "PROPPATCH") == 0 )
+	{
+		result = handle_proppatch(connection, request);
+	}
+	else if ( read_body(connection, request, -1, 0) < 0 )
+	{
+		result = 0;
+	}
+	else if ( strcmp(request->method, "OPTIONS") == 0 )
+	{
+		result = send_response(connection, request, 200, "DAV: 1, 2\r\n"
+			"Allow: OPTIONS, GET, HEAD, PUT, DELETE, MKCOL, MOVE, PROPFIND, PROPPATCH, LOCK, UNLOCK\r\n", NULL, 0, 0);
+	}
+	else if ( strcmp(request->method, "UNLOCK") == 0 )
+	{
+		result = send_status(connection, request, 204);
+	}
+	else
+	{
+		result = send_status(connection, request, 405);
+	}
+
+	pthread_mutex_lock(&server->lock);
+	--server->active;
+	pthread_mutex_unlock(&server->lock);
+
+	return ( result && !request->close );
+}
+
+/*****************************************************************************/
+
+static void *connection_thread(void *arg)
+{
+	struct connection *connection;
+	struct latency_server *server;
+	struct request request;
+
+	connection = (struct connection *)arg;
+	server = connection->server;
+
+	while ( read_request(connection, &request) && handle_request(connection, &request) )
+	{
+		continue;
+	}
+
+	pthread_mutex_lock(&server->lock);
+	close(connection->fd);
+	server->connection_fds[connection->slot] = -1;
+	if ( --server->connections == 0 )
+	{
+		pthread_cond_broadcast(&server->idle);
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	free(connection);
+	return ( NULL );
+}
+
+static void *accept_thread(void *arg)
+{
+	struct latency_server *server;
+	struct connection *connection;
+	struct pollfd pollfd;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd;
+	int slot;
+	int one;
+
+	server = (struct latency_server *)arg;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	while ( !server->stopping )
+	{
+		/* wake up now and then to see if the server is stopping */
+		pollfd.fd = server->listen_fd;
+		pollfd.events = POLLIN;
+		if ( poll(&pollfd, 1, 100) <= 0 )
+		{
+			continue;
+		}
+		fd = accept(server->listen_fd, NULL, NULL);
+		if ( fd < 0 )
+		{
+			continue;
+		}
+		one = 1;
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		connection = malloc(sizeof(struct connection));
+		pthread_mutex_lock(&server->lock);
+		for ( slot = 0; slot < (int)(sizeof(server->connection_fds) / sizeof(int)); ++slot )
+		{
+			if ( server->connection_fds[slot] < 0 )
+			{
+				break;
+			}
+		}
+		if ( (connection == NULL) || (slot == (int)(sizeof(server->connection_fds) / sizeof(int))) )
+		{
+			pthread_mutex_unlock(&server->lock);
+			free(connection);
+			close(fd);
+			continue;
+		}
+		server->connection_fds[slot] = fd;
+		if ( ++server->connections > server->counts.max_connections )
+		{
+			server->counts.max_connections = server->connections;
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		connection->server = server;
+		connection->fd = fd;
+		connection->slot = slot;
+		connection->start = connection->count = 0;
+		if ( pthread_create(&thread, &attr, connection_thread, connection) != 0 )
+		{
+			pthread_mutex_lock(&server->lock);
+			server->connection_fds[slot] = -1;
+			--server->connections;
+			pthread_mutex_unlock(&server->lock);
+			close(fd);
+			free(connection);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	return ( NULL );
+}
+
+/*****************************************************************************/
+
+int latency_server_start(struct latency_server *server)
+{
+	struct sockaddr_in address;
+	socklen_t addressLength;
+	size_t slot;
+	int one;
+	int error;
+
+	/* a client closing a connection early must not kill the process */
+	signal(SIGPIPE, SIG_IGN);
+
+	server->port = 0;
+	server->stopping = 0;
+	server->connections = 0;
+	server->active = 0;
+	server->next_lock_token = 0;
+	memset(&server->counts, 0, sizeof(server->counts));
+	for ( slot = 0; slot < sizeof(server->connection_fds) / sizeof(int); ++slot )
+	{
+		server->connection_fds[slot] = -1;
+	}
+	pthread_mutex_init(&server->lock, NULL);
+	pthread_cond_init(&server->idle, NULL);
+
+	server->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if ( server->listen_fd < 0 )
+	{
+		return ( errno );
+	}
+	one = 1;
+	(void) setsockopt(server->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	address.sin_port = 0;
+	addressLength = sizeof(address);
+	if ( (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+		 (listen(server->listen_fd, 1024) != 0) ||
+		 (getsockname(server->listen_fd, (struct sockaddr *)&address, &addressLength) != 0) )
+	{
+		error = errno;
+		close(server->listen_fd);
+		return ( error );
+	}
+	server->port = ntohs(address.sin_port);
+
+	error = pthread_create(&server->accept_thread, NULL, accept_thread, server);
+	if ( error != 0 )
+	{
+		close(server->listen_fd);
+	}
+	return ( error );
+}
+
+void latency_server_stop(struct latency_server *server)
+{
+	size_t slot;
+
+	server->stopping = 1;
+	pthread_join(server->accept_thread, NULL);
+	close(server->listen_fd);
+
+	/* wake up the connection threads and wait for them */
+	pthread_mutex_lock(&server->lock);
+	for ( slot = 0; slot < sizeof(server->connection_fds) / sizeof(int); ++slot )
+	{
+		if ( server->connection_fds[slot] >= 0 )
+		{
+			(void) shutdown(server->connection_fds[slot], SHUT_RDWR);
+		}
+	}
+	while ( server->connections != 0 )
+	{
+		pthread_cond_wait(&server->idle, &server->lock);
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	pthread_cond_destroy(&server->idle);
+	pthread_mutex_destroy(&server->lock);
+}
+
+void latency_server_get_counts(struct latency_server *server, struct latency_server_counts *counts)
+{
+	pthread_mutex_lock(&server->lock);
+	*counts = server->counts;
+	pthread_mutex_unlock(&server->lock);
+}
+
+void latency_server_reset_counts(struct latency_server *server)
+{
+	pthread_mutex_lock(&server->lock);
+	memset(&server->counts, 0, sizeof(server->counts));
+	server->counts.max_connections = server->connections;
+	server->counts.max_active = server->active;
+	pthread_mutex_unlock(&server->lock);
+}
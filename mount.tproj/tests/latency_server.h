@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _LATENCY_SERVER_H_INCLUDE
+#define _LATENCY_SERVER_H_INCLUDE
+
+/*
+ * The latency server is a small WebDAV class 2 server on 127.0.0.1 for the
+ * benchmarks that mount a volume. It serves a local directory, waits
+ * latency_ms before answering each request, can hold each connection to a
+ * bandwidth, and counts what it was asked for. It understands OPTIONS,
+ * PROPFIND (Depth 0 and 1), PROPPATCH, GET and HEAD (with a single Range),
+ * PUT (with Content-Range, chunked or not), DELETE, MKCOL, MOVE, LOCK and
+ * UNLOCK -- enough for mount_webdav. Each connection gets its own thread.
+ */
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/* what the server has been asked for since it started or was last reset */
+struct latency_server_counts
+{
+	uint64_t requests;			/* all requests */
+	uint64_t propfinds;			/* PROPFIND requests */
+	uint64_t gets;				/* GET requests, including range_gets */
+	uint64_t range_gets;		/* GET requests with a Range header */
+	uint64_t puts;				/* PUT requests */
+	uint64_t bytes_sent;		/* GET body bytes sent */
+	uint64_t bytes_received;	/* PUT body bytes received */
+	int max_connections;		/* most connections open at once */
+	int max_active;				/* most requests being answered at once */
+};
+
+struct latency_server
+{
+	/* set before latency_server_start */
+	const char *root;			/* the directory served as "/" */
+	int latency_ms;				/* delay before each response */
+	uint64_t bandwidth;			/* bytes per second per connection for GET bodies, or 0 for no limit */
+
+	/* set by latency_server_start */
+	int port;					/* the port it listens on */
+
+	/* private */
+	int listen_fd;
+	pthread_t accept_thread;
+	pthread_mutex_t lock;
+	pthread_cond_t idle;		/* signalled when the last connection closes */
+	int stopping;
+	int connections;
+	int active;
+	int connection_fds[1024];
+	uint64_t next_lock_token;
+	struct latency_server_counts counts;
+};
+
+/*
+ * latency_server_start starts serving on an unused 127.0.0.1 port. Returns
+ * an errno.
+ */
+int latency_server_start(struct latency_server *server);
+
+/*
+ * latency_server_stop closes the listening socket and every connection, and
+ * waits for the connection threads to finish.
+ */
+void latency_server_stop(struct latency_server *server);
+
+/* copies the counts to counts */
+void latency_server_get_counts(struct latency_server *server, struct latency_server_counts *counts);
+
+/* zeroes the counts */
+void latency_server_reset_counts(struct latency_server *server);
+
+#endif
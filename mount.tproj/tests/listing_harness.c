@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "webdavd.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "webdav_parse.h"
+#include "webdav_network.h"
+#include "listing_harness.h"
+
+/*****************************************************************************/
+
+/* agent globals the parser reads */
+int gMultistatusScanner = TRUE;
+
+/* the directory being listed, its parent, and the node every child gets */
+static struct node_entry gRootNode;
+static struct node_entry gParentNode;
+static struct node_entry gListedNode;
+static char gListedName[MAXNAMLEN + 1];
+static webdav_ino_t gNextFileid = 100;
+static size_t gListedNodes = 0;
+
+/*****************************************************************************/
+
+/*
+ * The node cache, as far as the parser uses it.
+ */
+
+int nodecache_get_node(
+	struct node_entry *parent,
+	size_t name_length,
+	const char *name,
+	int make_entry,
+	int client_created,
+	webdav_filetype_t node_type,
+	struct node_entry **node)
+{
+	#pragma unused(name_length, name, make_entry, client_created, node_type)
+	/* the parser only asks for the directory itself */
+	*node = parent;
+	return ( 0 );
+}
+
+int nodecache_get_listed_node(
+	struct node_entry *parent,
+	size_t name_length,
+	const char *name,
+	webdav_filetype_t node_type,
+	struct node_entry **node)
+{
+	#pragma unused(parent)
+	if ( name_length > MAXNAMLEN )
+	{
+		return ( ENAMETOOLONG );
+	}
+	memcpy(gListedName, name, name_length);
+	gListedName[name_length] = '\0';
+	gListedNode.name = gListedName;
+	gListedNode.name_length = name_length;
+	gListedNode.node_type = node_type;
+	gListedNode.fileid = gNextFileid++;
+	++gListedNodes;
+	*node = &gListedNode;
+	return ( 0 );
+}
+
+int nodecache_add_attributes(
+	struct node_entry *node,
+	uid_t uid,
+	struct webdav_stat_attr *statp,
+	char *appledoubleheader)
+{
+	#pragma unused(node, uid, statp, appledoubleheader)
+	return ( 0 );
+}
+
+int nodecache_begin_listing(struct node_entry *dir_node)
+{
+	#pragma unused(dir_node)
+	return ( 0 );
+}
+
+void nodecache_end_listing(struct node_entry *dir_node)
+{
+	#pragma unused(dir_node)
+}
+
+int nodecache_delete_invalid_directory_nodes(struct node_entry *dir_node)
+{
+	#pragma unused(dir_node)
+	return ( 0 );
+}
+
+void lock_node_cache(void)
+{
+}
+
+void unlock_node_cache(void)
+{
+}
+
+int filesystem_writeback_pending(struct node_entry *node)
+{
+	#pragma unused(node)
+	return ( FALSE );
+}
+
+/* creation dates aren't looked at by the drivers */
+time_t ISO8601ToTime(const UInt8 *bytes, CFIndex length)
+{
+	#pragma unused(bytes, length)
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+/* appends to a growing document; exits if memory runs out */
+static void document_append(char **document, size_t *length, size_t *size, const char *format, ...)
+{
+	va_list ap;
+	int count;
+
+	while ( 1 )
+	{
+		va_start(ap, format);
+		count = vsnprintf(*document + *length, *size - *length, format, ap);
+		va_end(ap);
+		if ( (count >= 0) && ((size_t)count < (*size - *length)) )
+		{
+			*length += (size_t)count;
+			return;
+		}
+		*size *= 2;
+		*document = realloc(*document, *size);
+		if ( *document == NULL )
+		{
+			fprintf(stderr, "listing_document: out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+char *listing_document(size_t count, size_t *length)
+{
+	char *document;
+	size_t size;
+	size_t index;
+
+	size = 0x10000;
+	document = malloc(size);
+	if ( document == NULL )
+	{
+		fprintf(stderr, "listing_document: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	*length = 0;
+
+	document_append(&document, length, &size,
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<D:multistatus xmlns:D=\"DAV:\" xmlns:ns0=\"DAV:\">\n"
+		"<D:response xmlns:lp1=\"DAV:\" xmlns:lp2=\"http://apache.org/dav/props/\">\n"
+		"<D:href>" LISTING_PARENT_PATH "</D:href>\n"
+		"<D:propstat>\n<D:prop>\n"
+		"<lp1:resourcetype><D:collection/></lp1:resourcetype>\n"
+		"<lp1:getlastmodified>Sat, 17 Oct 2026 10:00:00 GMT</lp1:getlastmodified>\n"
+		"</D:prop>\n<D:status>HTTP/1.1 200 OK</D:status>\n</D:propstat>\n"
+		"</D:response>\n");
+
+	for ( index = 1; index <= count; ++index )
+	{
+		if ( (index % 16) == 0 )
+		{
+			document_append(&document, length, &size,
+				"<D:response xmlns:lp1=\"DAV:\" xmlns:lp2=\"http://apache.org/dav/props/\">\n"
+				"<D:href>" LISTING_PARENT_PATH "folder%%20%06zu/</D:href>\n"
+				"<D:propstat>\n<D:prop>\n"
+				"<lp1:resourcetype><D:collection/></lp1:resourcetype>\n"
+				"<lp1:getlastmodified>Sat, 17 Oct 2026 10:00:00 GMT</lp1:getlastmodified>\n"
+				"</D:prop>\n<D:status>HTTP/1.1 200 OK</D:status>\n</D:propstat>\n"
+				"</D:response>\n", index);
+		}
+		else
+		{
+			document_append(&document, length, &size,
+				"<D:response xmlns:lp1=\"DAV:\" xmlns:lp2=\"http://apache.org/dav/props/\">\n"
+				"<D:href>" LISTING_PARENT_PATH "file%%20%06zu.txt</D:href>\n"
+				"<D:propstat>\n<D:prop>\n"
+				"<lp1:resourcetype/>\n"
+				"<lp1:getcontentlength>%zu</lp1:getcontentlength>\n"
+				"<lp1:getlastmodified>Sat, 17 Oct 2026 10:00:00 GMT</lp1:getlastmodified>\n"
+				"</D:prop>\n<D:status>HTTP/1.1 200 OK</D:status>\n</D:propstat>\n"
+				"</D:response>\n", index, index * 512);
+		}
+	}
+
+	document_append(&document, length, &size, "</D:multistatus>\n");
+
+	return ( document );
+}
+
+/*****************************************************************************/
+
+int listing_run(const char *document, size_t length, size_t piece_size, struct listing_result *result)
+{
+	int error;
+	char path[] = "/tmp/listing_harness.XXXXXX";
+	CFURLRef urlRef;
+	webdav_parse_opendir_stream_t *stream;
+	size_t offset;
+	size_t piece;
+	off_t size;
+	double start;
+
+	memset(result, 0, sizeof(*result));
+
+	/* every run uses the same cache file (parse_opendir_begin truncates it) */
+	if ( gParentNode.file_fd <= 0 )
+	{
+		gParentNode.file_fd = mkstemp(path);
+		if ( gParentNode.file_fd < 0 )
+		{
+			return ( errno );
+		}
+		unlink(path);
+	}
+
+	gRootNode.fileid = WEBDAV_ROOTFILEID;
+	gParentNode.parent = &gRootNode;
+	gParentNode.fileid = WEBDAV_ROOTFILEID + 1;
+	gParentNode.node_type = WEBDAV_DIR_TYPE;
+	LIST_INIT(&gParentNode.children);
+	gListedNodes = 0;
+
+	urlRef = CFURLCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)LISTING_PARENT_URL, (CFIndex)strlen(LISTING_PARENT_URL),
+		kCFStringEncodingUTF8, NULL);
+	if ( urlRef == NULL )
+	{
+		return ( ENOMEM );
+	}
+
+	start = listing_now();
+
+	error = parse_opendir_begin(urlRef, getuid(), &gParentNode, &stream);
+	if ( error == 0 )
+	{
+		for ( offset = 0; (error == 0) && (offset < length); offset += piece )
+		{
+			piece = ((length - offset) < piece_size) ? (length - offset) : piece_size;
+			error = parse_opendir_continue(stream, (const UInt8 *)document + offset, (CFIndex)piece);
+		}
+		if ( error == 0 )
+		{
+			error = parse_opendir_finish(stream, FALSE);
+		}
+		else
+		{
+			(void) parse_opendir_finish(stream, TRUE);
+		}
+	}
+
+	result->seconds = listing_now() - start;
+	result->listed_nodes = gListedNodes;
+	size = lseek(gParentNode.file_fd, 0, SEEK_END);
+	if ( size >= (off_t)(2 * sizeof(struct webdav_dirent)) )
+	{
+		result->entries = ((size_t)size / sizeof(struct webdav_dirent)) - 2;
+	}
+
+	CFRelease(urlRef);
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+const char *listing_name(size_t index, char *buffer, size_t size)
+{
+	struct webdav_dirent dirent;
+	off_t offset;
+
+	offset = (off_t)((index + 2) * sizeof(struct webdav_dirent));
+	if ( pread(gParentNode.file_fd, &dirent, sizeof(dirent), offset) != (ssize_t)sizeof(dirent) )
+	{
+		return ( NULL );
+	}
+	snprintf(buffer, size, "%.*s", (int)dirent.d_namlen, dirent.d_name);
+	return ( buffer );
+}
+
+/*****************************************************************************/
+
+double listing_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ( (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0) );
+}
+
+/*****************************************************************************/
+
+size_t listing_max_rss(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+	/* bytes on Darwin */
+	return ( (size_t)usage.ru_maxrss );
+#else
+	return ( (size_t)usage.ru_maxrss * 1024 );
+#endif
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _LISTING_HARNESS_H_INCLUDE
+#define _LISTING_HARNESS_H_INCLUDE
+
+/*
+ * The listing harness runs directory listings through parse_opendir_begin,
+ * parse_opendir_continue and parse_opendir_finish without a mount. It fakes
+ * the parts of the node cache the parser calls: every listed child gets the
+ * same scratch node (with a new fileid), so the harness itself allocates
+ * nothing per entry, and the dirents land in a temporary cache file.
+ */
+
+#include <sys/types.h>
+#include <CoreFoundation/CoreFoundation.h>
+
+/* the URL of the directory every listing is for */
+#define LISTING_PARENT_URL "http://localhost/listing/"
+#define LISTING_PARENT_PATH "/listing/"
+
+/* the results of listing_run */
+struct listing_result
+{
+	size_t entries;				/* child dirents in the cache file (not counting "." and "..") */
+	size_t listed_nodes;		/* calls to nodecache_get_listed_node */
+	double seconds;				/* wall time from parse_opendir_begin through parse_opendir_finish */
+};
+
+/*
+ * listing_document returns a malloc'd multistatus document listing count
+ * children of LISTING_PARENT_PATH (and the directory itself) the way Apache
+ * mod_dav does, and its length in *length. Every 16th child is a directory.
+ */
+char *listing_document(
+	size_t count,				/* -> number of children */
+	size_t *length);			/* <- length of the document */
+
+/*
+ * listing_run parses document as a response to a Depth 1 PROPFIND of
+ * LISTING_PARENT_URL, handing it to parse_opendir_continue piece_size bytes at
+ * a time. Returns the error parse_opendir_* returned.
+ */
+int listing_run(
+	const char *document,		/* -> the multistatus document */
+	size_t length,				/* -> its length */
+	size_t piece_size,			/* -> bytes per parse_opendir_continue */
+	struct listing_result *result);	/* <- what the listing produced */
+
+/*
+ * listing_name returns the name of dirent index (counting from 0 after "."
+ * and "..") of the last listing_run in buffer, or NULL if there isn't one.
+ */
+const char *listing_name(
+	size_t index,				/* -> the dirent */
+	char *buffer,				/* <- the name */
+	size_t size);				/* -> size of buffer */
+
+/* returns the current time in seconds */
+double listing_now(void);
+
+/* returns the peak resident size of the process in bytes */
+size_t listing_max_rss(void);
+
+#endif
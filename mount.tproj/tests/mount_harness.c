@@ -0,0 +1,533 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <libkern/OSByteOrder.h>
+#include <libproc.h>
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+#define MOUNT_WEBDAV_COMMAND	"/sbin/mount_webdav"
+#define AGENT_NAME				"webdavfs_agent"	/* argv[0] of the agent mount_webdav runs */
+#define FILL_BUFFER_SIZE		0x100000
+#define STORM_STACK_SIZE		0x10000
+
+/* every 8-byte aligned word of a file is its offset times this */
+#define FILL_MULTIPLIER			0x9e3779b97f4a7c15ULL
+
+extern char **environ;
+
+/* the threads of a mount_harness_storm */
+struct storm
+{
+	pthread_mutex_t lock;
+	pthread_cond_t condition;
+	size_t ready;				/* threads waiting to go */
+	int go;						/* set when they all are */
+	void (*function)(void *context, size_t index);
+	void *context;
+};
+
+struct storm_thread
+{
+	struct storm *storm;
+	size_t index;
+};
+
+/*****************************************************************************/
+
+/* returns the pid of the webdavfs_agent whose last argument is mount_point, or 0 */
+static pid_t find_agent(const char *mount_point)
+{
+	int mib[3];
+	int argmax;
+	size_t size;
+	char *args;
+	pid_t *pids;
+	int count;
+	int index;
+	int argc;
+	char *arg;
+	char *end;
+	const char *first;
+	const char *last;
+	pid_t agent;
+
+	agent = 0;
+	mib[0] = CTL_KERN;
+	mib[1] = KERN_ARGMAX;
+	size = sizeof(argmax);
+	if ( sysctl(mib, 2, &argmax, &size, NULL, 0) != 0 )
+	{
+		return ( 0 );
+	}
+
+	count = proc_listallpids(NULL, 0);
+	pids = malloc(sizeof(pid_t) * (size_t)(count + 64));
+	args = malloc((size_t)argmax);
+	if ( (pids == NULL) || (args == NULL) )
+	{
+		free(pids);
+		free(args);
+		return ( 0 );
+	}
+	count = proc_listallpids(pids, (int)sizeof(pid_t) * (count + 64));
+
+	for ( index = 0; (index < count) && (agent == 0); ++index )
+	{
+		/* KERN_PROCARGS2 is argc, the executable path, padding, and then the arguments */
+		mib[1] = KERN_PROCARGS2;
+		mib[2] = pids[index];
+		size = (size_t)argmax;
+		if ( (sysctl(mib, 3, args, &size, NULL, 0) != 0) || (size <= sizeof(int)) )
+		{
+			continue;
+		}
+		memcpy(&argc, args, sizeof(int));
+		end = args + size;
+		arg = args + sizeof(int);
+		arg += strnlen(arg, (size_t)(end - arg));
+		while ( (arg < end) && (*arg == '\0') )
+		{
+			++arg;
+		}
+
+		first = last = NULL;
+		for ( ; (argc > 0) && (arg < end); --argc )
+		{
+			if ( first == NULL )
+			{
+				first = arg;
+			}
+			last = arg;
+			arg += strnlen(arg, (size_t)(end - arg)) + 1;
+		}
+		if ( (first != NULL) && (strcmp(first, AGENT_NAME) == 0) && (strcmp(last, mount_point) == 0) )
+		{
+			agent = pids[index];
+		}
+	}
+
+	free(pids);
+	free(args);
+	return ( agent );
+}
+
+static int remove_entry(const char *path, const struct stat *statbuf, int type, struct FTW *ftw)
+{
+	#pragma unused(statbuf, type, ftw)
+	return ( remove(path) );
+}
+
+/*****************************************************************************/
+
+int mount_harness_init(struct mount_harness *harness)
+{
+	const char *tmpdir;
+	char directory[MAXPATHLEN];
+	int error;
+
+	harness->agent = 0;
+	harness->directory[0] = '\0';
+	harness->mount_point[0] = '\0';
+	harness->server.root = NULL;
+
+	tmpdir = getenv("TMPDIR");
+	snprintf(directory, sizeof(directory), "%s/webdavfs_bench.XXXXXX", (tmpdir != NULL) ? tmpdir : "/tmp");
+	if ( (mkdtemp(directory) == NULL) || (realpath(directory, harness->directory) == NULL) )
+	{
+		return ( errno );
+	}
+	snprintf(harness->root, sizeof(harness->root), "%s/root", harness->directory);
+	snprintf(harness->mount_point, sizeof(harness->mount_point), "%s/mnt", harness->directory);
+	if ( (mkdir(harness->root, 0755) != 0) || (mkdir(harness->mount_point, 0755) != 0) )
+	{
+		error = errno;
+		mount_harness_cleanup(harness);
+		return ( error );
+	}
+
+	harness->server.root = harness->root;
+	error = latency_server_start(&harness->server);
+	if ( error != 0 )
+	{
+		harness->server.root = NULL;
+		mount_harness_cleanup(harness);
+	}
+	return ( error );
+}
+
+int mount_harness_mount(struct mount_harness *harness, const char *options)
+{
+	const char *command;
+	char url[64];
+	char *argv[8];
+	int argc;
+	pid_t pid;
+	int status;
+	int error;
+
+	command = getenv("MOUNT_WEBDAV");
+	if ( command == NULL )
+	{
+		command = MOUNT_WEBDAV_COMMAND;
+	}
+	snprintf(url, sizeof(url), "http://127.0.0.1:%d/", harness->server.port);
+
+	argc = 0;
+	argv[argc++] = (char *)"mount_webdav";
+	argv[argc++] = (char *)"-S";
+	if ( options != NULL )
+	{
+		argv[argc++] = (char *)"-o";
+		argv[argc++] = (char *)options;
+	}
+	argv[argc++] = url;
+	argv[argc++] = harness->mount_point;
+	argv[argc] = NULL;
+
+	error = posix_spawn(&pid, command, NULL, NULL, argv, environ);
+	if ( error != 0 )
+	{
+		fprintf(stderr, "%s: %s\n", command, strerror(error));
+		return ( error );
+	}
+	while ( waitpid(pid, &status, 0) < 0 )
+	{
+		if ( errno != EINTR )
+		{
+			return ( errno );
+		}
+	}
+	if ( !WIFEXITED(status) || (WEXITSTATUS(status) != 0) )
+	{
+		fprintf(stderr, "mount_webdav %s failed\n", url);
+		return ( (WIFEXITED(status) && (WEXITSTATUS(status) != 0)) ? WEXITSTATUS(status) : EIO );
+	}
+
+	harness->agent = find_agent(harness->mount_point);
+	return ( 0 );
+}
+
+void mount_harness_unmount(struct mount_harness *harness)
+{
+	int tries;
+
+	/* the agent may still be uploading; give it a while before forcing */
+	for ( tries = 0; unmount(harness->mount_point, 0) != 0; ++tries )
+	{
+		if ( (errno == EINVAL) || (errno == ENOENT) )
+		{
+			/* not mounted */
+			break;
+		}
+		if ( tries == 60 )
+		{
+			(void) unmount(harness->mount_point, MNT_FORCE);
+			break;
+		}
+		sleep(1);
+	}
+
+	for ( tries = 0; (harness->agent != 0) && (kill(harness->agent, 0) == 0) && (tries < 300); ++tries )
+	{
+		usleep(100000);
+	}
+	harness->agent = 0;
+}
+
+void mount_harness_cleanup(struct mount_harness *harness)
+{
+	if ( harness->mount_point[0] != '\0' )
+	{
+		mount_harness_unmount(harness);
+	}
+	if ( harness->server.root != NULL )
+	{
+		latency_server_stop(&harness->server);
+		harness->server.root = NULL;
+	}
+	if ( harness->directory[0] != '\0' )
+	{
+		(void) nftw(harness->directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+	}
+}
+
+/*****************************************************************************/
+
+int mount_harness_make_file(struct mount_harness *harness, const char *name, off_t size)
+{
+	char path[MAXPATHLEN];
+	char *buffer;
+	off_t offset;
+	size_t length;
+	int fd;
+	int error;
+
+	snprintf(path, sizeof(path), "%s/%s", harness->root, name);
+	buffer = malloc(FILL_BUFFER_SIZE);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if ( (buffer == NULL) || (fd < 0) )
+	{
+		error = (buffer == NULL) ? ENOMEM : errno;
+		free(buffer);
+		if ( fd >= 0 )
+		{
+			close(fd);
+		}
+		return ( error );
+	}
+
+	error = 0;
+	for ( offset = 0; offset < size; offset += (off_t)length )
+	{
+		length = (size_t)MIN((off_t)FILL_BUFFER_SIZE, size - offset);
+		mount_harness_fill(buffer, offset, length);
+		if ( write(fd, buffer, length) != (ssize_t)length )
+		{
+			error = errno;
+			break;
+		}
+	}
+
+	close(fd);
+	free(buffer);
+	return ( error );
+}
+
+int mount_harness_check_file(struct mount_harness *harness, const char *name, off_t size)
+{
+	char path[MAXPATHLEN];
+	struct stat statbuf;
+	char *buffer;
+	off_t offset;
+	ssize_t count;
+	int fd;
+	int error;
+
+	snprintf(path, sizeof(path), "%s/%s", harness->root, name);
+	buffer = malloc(FILL_BUFFER_SIZE);
+	fd = open(path, O_RDONLY);
+	if ( (buffer == NULL) || (fd < 0) )
+	{
+		error = (buffer == NULL) ? ENOMEM : errno;
+		free(buffer);
+		if ( fd >= 0 )
+		{
+			close(fd);
+		}
+		return ( error );
+	}
+
+	error = (fstat(fd, &statbuf) == 0) ? 0 : errno;
+	if ( (error == 0) && (statbuf.st_size != size) )
+	{
+		fprintf(stderr, "%s has %lld bytes, not %lld\n", path, (long long)statbuf.st_size, (long long)size);
+		error = EIO;
+	}
+	for ( offset = 0; (error == 0) && (offset < size); offset += count )
+	{
+		count = read(fd, buffer, FILL_BUFFER_SIZE);
+		if ( count <= 0 )
+		{
+			error = (count < 0) ? errno : EIO;
+		}
+		else if ( !mount_harness_check(buffer, offset, (size_t)count) )
+		{
+			fprintf(stderr, "%s has the wrong data at offset %lld\n", path, (long long)offset);
+			error = EIO;
+		}
+	}
+
+	close(fd);
+	free(buffer);
+	return ( error );
+}
+
+void mount_harness_fill(char *bytes, off_t offset, size_t length)
+{
+	uint64_t word;
+
+	/* the words are stored little endian */
+	for ( ; (length != 0) && (((offset & 7) != 0) || (length < 8)); ++offset, --length )
+	{
+		word = (uint64_t)(offset & ~(off_t)7) * FILL_MULTIPLIER;
+		*bytes++ = (char)(word >> ((offset & 7) * 8));
+	}
+	for ( ; length >= 8; length -= 8, offset += 8 )
+	{
+		word = OSSwapHostToLittleInt64((uint64_t)offset * FILL_MULTIPLIER);
+		memcpy(bytes, &word, 8);
+		bytes += 8;
+	}
+	for ( ; length != 0; ++offset, --length )
+	{
+		word = (uint64_t)(offset & ~(off_t)7) * FILL_MULTIPLIER;
+		*bytes++ = (char)(word >> ((offset & 7) * 8));
+	}
+}
+
+int mount_harness_check(const char *bytes, off_t offset, size_t length)
+{
+	char expected[0x10000];
+	size_t piece;
+
+	for ( ; length != 0; length -= piece )
+	{
+		piece = MIN(length, sizeof(expected));
+		mount_harness_fill(expected, offset, piece);
+		if ( memcmp(bytes, expected, piece) != 0 )
+		{
+			return ( 0 );
+		}
+		bytes += piece;
+		offset += (off_t)piece;
+	}
+	return ( 1 );
+}
+
+/*****************************************************************************/
+
+int mount_harness_agent_usage(struct mount_harness *harness, int *threads, double *cpu_seconds)
+{
+	struct proc_taskinfo info;
+	mach_timebase_info_data_t timebase;
+
+	if ( (harness->agent == 0) ||
+		 (proc_pidinfo(harness->agent, PROC_PIDTASKINFO, 0, &info, sizeof(info)) != (int)sizeof(info)) )
+	{
+		return ( ESRCH );
+	}
+	(void) mach_timebase_info(&timebase);
+	*threads = info.pti_threadnum;
+	*cpu_seconds = (double)(info.pti_total_user + info.pti_total_system) * timebase.numer / timebase.denom / 1000000000.0;
+	return ( 0 );
+}
+
+static void *storm_thread(void *arg)
+{
+	struct storm_thread *thread;
+	struct storm *storm;
+
+	thread = (struct storm_thread *)arg;
+	storm = thread->storm;
+
+	pthread_mutex_lock(&storm->lock);
+	++storm->ready;
+	pthread_cond_broadcast(&storm->condition);
+	while ( !storm->go )
+	{
+		pthread_cond_wait(&storm->condition, &storm->lock);
+	}
+	pthread_mutex_unlock(&storm->lock);
+
+	storm->function(storm->context, thread->index);
+	return ( NULL );
+}
+
+int mount_harness_storm(size_t count, void (*function)(void *context, size_t index), void *context)
+{
+	struct storm storm;
+	struct storm_thread *threads;
+	pthread_t *ids;
+	pthread_attr_t attr;
+	size_t started;
+	int error;
+
+	threads = malloc(count * sizeof(struct storm_thread));
+	ids = malloc(count * sizeof(pthread_t));
+	if ( (threads == NULL) || (ids == NULL) )
+	{
+		free(threads);
+		free(ids);
+		return ( ENOMEM );
+	}
+
+	pthread_mutex_init(&storm.lock, NULL);
+	pthread_cond_init(&storm.condition, NULL);
+	storm.ready = 0;
+	storm.go = 0;
+	storm.function = function;
+	storm.context = context;
+
+	/* small stacks, so there can be a lot of them */
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, STORM_STACK_SIZE);
+
+	error = 0;
+	for ( started = 0; started < count; ++started )
+	{
+		threads[started].storm = &storm;
+		threads[started].index = started;
+		error = pthread_create(&ids[started], &attr, storm_thread, &threads[started]);
+		if ( error != 0 )
+		{
+			break;
+		}
+	}
+
+	/* release them once they are all waiting (or, if some didn't start, release the rest to clean up) */
+	pthread_mutex_lock(&storm.lock);
+	while ( storm.ready < started )
+	{
+		pthread_cond_wait(&storm.condition, &storm.lock);
+	}
+	storm.go = 1;
+	pthread_cond_broadcast(&storm.condition);
+	pthread_mutex_unlock(&storm.lock);
+
+	while ( started != 0 )
+	{
+		pthread_join(ids[--started], NULL);
+	}
+
+	pthread_attr_destroy(&attr);
+	pthread_cond_destroy(&storm.condition);
+	pthread_mutex_destroy(&storm.lock);
+	free(threads);
+	free(ids);
+	return ( error );
+}
+
+double mount_harness_now(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return ( (double)now.tv_sec + (double)now.tv_usec / 1000000.0 );
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _MOUNT_HARNESS_H_INCLUDE
+#define _MOUNT_HARNESS_H_INCLUDE
+
+/*
+ * The mount harness runs a latency server on a temporary directory and
+ * mounts it with the installed mount_webdav (or the one named by the
+ * MOUNT_WEBDAV environment variable), so a benchmark can work on the mount
+ * point and look at what the server and the agent did. Test a built agent by
+ * installing it first.
+ */
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include "latency_server.h"
+
+struct mount_harness
+{
+	struct latency_server server;	/* set latency_ms and bandwidth before mount_harness_init */
+	char directory[MAXPATHLEN];		/* temporary directory holding root and mount_point */
+	char root[MAXPATHLEN];			/* the server's directory */
+	char mount_point[MAXPATHLEN];	/* where it is mounted */
+	pid_t agent;					/* the webdavfs_agent of the mount, or 0 */
+};
+
+/* creates the directories and starts the server; returns an errno */
+int mount_harness_init(struct mount_harness *harness);
+
+/* mounts the server with -S and, if options isn't NULL, -o options; returns an errno */
+int mount_harness_mount(struct mount_harness *harness, const char *options);
+
+/* unmounts and waits for the agent to exit */
+void mount_harness_unmount(struct mount_harness *harness);
+
+/* unmounts if needed, stops the server and removes the directories */
+void mount_harness_cleanup(struct mount_harness *harness);
+
+/* makes a file of size bytes of mount_harness_fill data in the server's directory; returns an errno */
+int mount_harness_make_file(struct mount_harness *harness, const char *name, off_t size);
+
+/* checks that a file in the server's directory is size bytes of mount_harness_fill data; returns an errno */
+int mount_harness_check_file(struct mount_harness *harness, const char *name, off_t size);
+
+/* fills bytes with the data a mount_harness_make_file file has at offset */
+void mount_harness_fill(char *bytes, off_t offset, size_t length);
+
+/* returns TRUE if bytes is the data a mount_harness_make_file file has at offset */
+int mount_harness_check(const char *bytes, off_t offset, size_t length);
+
+/* gets the agent's current thread count and the CPU time it has used; returns an errno */
+int mount_harness_agent_usage(struct mount_harness *harness, int *threads, double *cpu_seconds);
+
+/*
+ * mount_harness_storm calls function(context, index) on count threads at
+ * once: each thread waits until all of them have started. Returns when every
+ * call has returned, or an errno if the threads couldn't be started.
+ */
+int mount_harness_storm(
+	size_t count,				/* -> number of threads */
+	void (*function)(void *context, size_t index),	/* -> called on each thread */
+	void *context);				/* -> passed to function */
+
+/* returns the current time in seconds */
+double mount_harness_now(void);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include "webdavd.h"
+
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "webdav_parse.h"
+#include "webdav_requestqueue.h"
+#include "webdav_authcache.h"
+#include "webdav_cookie.h"
+#include "network_harness.h"
+
+/*****************************************************************************/
+
+/* agent globals webdav_network.c reads */
+char *gtimeout_string = "Second-600";
+int gEventEngine = TRUE;
+int gAcceptEncoding = TRUE;
+int gMmapUpload = TRUE;
+uint32_t gSeqWriteWindow = WEBDAV_DEFAULT_WRITESEQ_WINDOW;
+off_t gUploadSegmentSize = WEBDAV_DEFAULT_UPLOAD_SEGMENT_SIZE;
+int gDownloadConnections = WEBDAV_DEFAULT_DOWNLOAD_CONNECTIONS;
+size_t gDownloadSegmentSize = WEBDAV_DEFAULT_DOWNLOAD_SEGMENT_SIZE;
+off_t gDownloadThreshold = WEBDAV_DEFAULT_DOWNLOAD_THRESHOLD;
+size_t gFirstReadSize = 0;
+size_t gFirstReadMax = WEBDAV_DEFAULT_FIRST_READ_MAX;
+uid_t gProcessUID = -1;
+int gSuppressAllUI = TRUE;
+CFURLRef gBaseURL = NULL;
+CFStringRef gBasePath = NULL;
+char gBasePathStr[MAXPATHLEN];
+uint32_t gServerIdent = 0;
+uint64_t webdavCacheMaximumSize = WEBDAV_DEFAULT_CACHE_MAX_SIZE;
+
+/* the agent would shut down; a driver can't go on */
+void webdav_kill(int message)
+{
+	fprintf(stderr, "webdav_kill(%d)\n", message);
+	exit(EXIT_FAILURE);
+}
+
+/*****************************************************************************/
+
+/*
+ * Credentials and cookies: requests go out as they are.
+ */
+
+int authcache_apply(
+	uid_t uid,
+	CFHTTPMessageRef request,
+	UInt32 statusCode,
+	CFHTTPMessageRef response,
+	UInt32 *generation)
+{
+	#pragma unused(uid, request, statusCode, response)
+	*generation = 0;
+	return ( 0 );
+}
+
+int authcache_valid(
+	uid_t uid,
+	CFHTTPMessageRef request,
+	UInt32 generation)
+{
+	#pragma unused(uid, request, generation)
+	return ( 0 );
+}
+
+int authcache_proxy_invalidate(void)
+{
+	return ( 0 );
+}
+
+void add_cookie_headers(CFHTTPMessageRef message, CFURLRef url)
+{
+	#pragma unused(message, url)
+}
+
+void handle_cookies(CFStringRef str, CFHTTPMessageRef message)
+{
+	#pragma unused(str, message)
+}
+
+/*****************************************************************************/
+
+/*
+ * The node cache and the file system, as far as webdav_network.c uses them.
+ */
+
+void lock_node_cache(void)
+{
+}
+
+void unlock_node_cache(void)
+{
+}
+
+int node_appledoubleheader_valid(
+	struct node_entry *node,
+	uid_t uid)
+{
+	#pragma unused(node, uid)
+	return ( FALSE );
+}
+
+CFURLRef nodecache_get_baseURL(void)
+{
+	return ( (gBaseURL != NULL) ? (CFURLRef)CFRetain(gBaseURL) : NULL );
+}
+
+CFArrayRef nodecache_get_locktokens(
+	struct node_entry *a_node)
+{
+	#pragma unused(a_node)
+	return ( NULL );
+}
+
+int nodecache_get_path_from_node(
+	struct node_entry *node,
+	bool *pathHasRedirection,
+	char **path)
+{
+	#pragma unused(node, pathHasRedirection, path)
+	return ( EIO );
+}
+
+void nodecache_preallocate_file_cache(
+	struct node_entry *node,
+	off_t file_length)
+{
+	#pragma unused(node, file_length)
+}
+
+int nodecache_redirect_node(
+	CFURLRef url,
+	struct node_entry *redirected_node,
+	CFHTTPMessageRef responseRef,
+	CFIndex statusCode)
+{
+	#pragma unused(url, redirected_node, responseRef, statusCode)
+	return ( EIO );
+}
+
+int filesystem_get_scratch_file(int *fd)
+{
+	char path[MAXPATHLEN];
+
+	snprintf(path, sizeof(path), "%s/network_harness.XXXXXX", (getenv("TMPDIR") != NULL) ? getenv("TMPDIR") : "/tmp");
+	*fd = mkstemp(path);
+	if ( *fd < 0 )
+	{
+		return ( errno );
+	}
+	(void) unlink(path);
+	return ( 0 );
+}
+
+int filesystem_writeback_pending(struct node_entry *node)
+{
+	#pragma unused(node)
+	return ( FALSE );
+}
+
+/*****************************************************************************/
+
+/*
+ * The request queue: nothing is handed off to other threads.
+ */
+
+int requestqueue_enqueue_download(
+	uid_t uid,
+	struct node_entry *node,
+	struct ReadStreamRec *readStreamRecPtr)
+{
+	#pragma unused(uid, node, readStreamRecPtr)
+	return ( EIO );
+}
+
+int requestqueue_enqueue_readdir(
+	struct node_entry *node,
+	struct ReadStreamRec *readStreamRecPtr,
+	webdav_parse_opendir_stream_t *opendir_stream,
+	struct ContentDecoder *decoder)
+{
+	#pragma unused(node, readStreamRecPtr, opendir_stream, decoder)
+	return ( EIO );
+}
+
+int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *ctx)
+{
+	#pragma unused(ctx)
+	return ( EIO );
+}
+
+int requestqueue_enqueue_server_ping(u_int32_t delay)
+{
+	#pragma unused(delay)
+	return ( 0 );
+}
+
+int get_connectionstate(void)
+{
+	return ( WEBDAV_CONNECTION_UP );
+}
+
+void set_connectionstate(int bad)
+{
+	#pragma unused(bad)
+}
+
+/*****************************************************************************/
+
+/*
+ * The parser: no response is understood.
+ */
+
+int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modified, char **entity_tag)
+{
+	#pragma unused(xmlp, xmlp_len, last_modified, entity_tag)
+	return ( EIO );
+}
+
+int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count)
+{
+	#pragma unused(xmlp, xmlp_len, file_count)
+	return ( EIO );
+}
+
+int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken)
+{
+	#pragma unused(xmlp, xmlp_len, locktoken)
+	return ( EIO );
+}
+
+webdav_parse_multistatus_list_t *parse_multi_status(UInt8 *xmlp, CFIndex xmlp_len)
+{
+	#pragma unused(xmlp, xmlp_len)
+	return ( NULL );
+}
+
+int parse_opendir_begin(
+	CFURLRef urlRef,
+	uid_t uid,
+	struct node_entry *parent_node,
+	webdav_parse_opendir_stream_t **stream)
+{
+	#pragma unused(urlRef, uid, parent_node, stream)
+	return ( EIO );
+}
+
+int parse_opendir_continue(
+	webdav_parse_opendir_stream_t *stream,
+	const UInt8 *xmlp,
+	CFIndex xmlp_len)
+{
+	#pragma unused(stream, xmlp, xmlp_len)
+	return ( EIO );
+}
+
+int parse_opendir_finish(
+	webdav_parse_opendir_stream_t *stream,
+	int abort)
+{
+	#pragma unused(stream, abort)
+	return ( EIO );
+}
+
+int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *statbuf)
+{
+	#pragma unused(xmlp, xmlp_len, statbuf)
+	return ( EIO );
+}
+
+int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf)
+{
+	#pragma unused(xmlp, xmlp_len, statfsbuf)
+	return ( EIO );
+}
+
+/*****************************************************************************/
+
+double network_harness_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ( (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0) );
+}
+
+/*****************************************************************************/
+
+double network_harness_cpu(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return ( (double)usage.ru_utime.tv_sec + ((double)usage.ru_utime.tv_usec / 1000000.0) +
+		(double)usage.ru_stime.tv_sec + ((double)usage.ru_stime.tv_usec / 1000000.0) );
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef _NETWORK_HARNESS_H_INCLUDE
+#define _NETWORK_HARNESS_H_INCLUDE
+
+/*
+ * The network harness lets a driver include ../webdav_network.c and call its
+ * static functions without a mount or a server. It defines the agent globals
+ * webdav_network.c reads (with webdav_agent.c's defaults) and fakes the rest
+ * of the agent it calls: the node cache, the request queue, the
+ * authentication cache, cookies and the parser. The fakes do nothing, or
+ * fail with EIO where a caller needs a result.
+ */
+
+/* returns the current time in seconds */
+double network_harness_now(void);
+
+/* returns the user and system CPU time the process has used, in seconds */
+double network_harness_cpu(void);
+
+#endif
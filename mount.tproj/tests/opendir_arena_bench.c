@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * opendir_arena_bench measures the memory a large directory listing takes.
+ *
+ *	usage: opendir_arena_bench [entries]
+ *
+ * A synthetic multistatus document with entries children (100,000 by default)
+ * is parsed twice: first 64K at a time, the way responses arrive, and then in
+ * one piece, which keeps every element record and href alive until the end of
+ * the parse. The growth of the peak resident size is reported for each, next
+ * to what a WEBDAV_MAX_URI_LEN href buffer per element would have taken.
+ */
+
+#include "webdavd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "webdav_parse.h"
+#include "listing_harness.h"
+
+static int run(const char *label, const char *document, size_t length, size_t piece_size, size_t entries)
+{
+	struct listing_result result;
+	size_t rss;
+	int error;
+
+	rss = listing_max_rss();
+	error = listing_run(document, length, piece_size, &result);
+	if ( error != 0 )
+	{
+		fprintf(stderr, "%s: listing failed (error %d)\n", label, error);
+		return ( error );
+	}
+	if ( result.entries != entries )
+	{
+		fprintf(stderr, "%s: %zu dirents, expected %zu\n", label, result.entries, entries);
+		return ( EIO );
+	}
+	printf("%-12s %8zu entries  %8.3f s  peak RSS +%8.1f MB\n", label, result.entries, result.seconds,
+		(double)(listing_max_rss() - rss) / (1024.0 * 1024.0));
+	return ( 0 );
+}
+
+int main(int argc, char *argv[])
+{
+	char *document;
+	size_t length;
+	size_t entries;
+
+	entries = (argc > 1) ? strtoul(argv[1], NULL, 10) : 100000;
+
+	document = listing_document(entries, &length);
+	printf("document     %8zu entries  %8.1f MB\n", entries, (double)length / (1024.0 * 1024.0));
+	printf("href buffers %8zu entries  %8.1f MB at WEBDAV_MAX_URI_LEN each\n", entries,
+		(double)entries * WEBDAV_MAX_URI_LEN / (1024.0 * 1024.0));
+
+	if ( (run("streamed", document, length, 0x10000, entries) != 0) ||
+		 (run("one piece", document, length, length, entries) != 0) )
+	{
+		return ( EXIT_FAILURE );
+	}
+
+	free(document);
+	return ( EXIT_SUCCESS );
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * readahead_bench measures reads that land past the download of a file, which
+ * the kernel sends to the agent as WEBDAV_READs.
+ *
+ *	usage: readahead_bench [megabytes [latency_ms]]
+ *
+ * A 512M file is opened, and megabytes (8 by default) are read 64K at a time
+ * from its middle, long before the download (held to 10M/s) gets there. The
+ * reads are made in order, which the agent reads ahead of, and then on a
+ * fresh mount in a shuffled order, which it doesn't, so each one is a Range
+ * GET of its own. The latency server waits latency_ms (50 by default) before
+ * each response. The time of the reads and the Range GETs the server answered
+ * are reported for each. The data read is checked.
+ */
+
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+#define FILE_SIZE	((off_t)512 * 1024 * 1024)
+#define READ_SIZE	0x10000
+
+/* reads count READ_SIZE pieces from the middle of the file in the order of pieces; returns an errno */
+static int run(struct mount_harness *harness, const char *label, const size_t *pieces, size_t count)
+{
+	struct latency_server_counts counts;
+	char path[MAXPATHLEN];
+	char buffer[READ_SIZE];
+	off_t offset;
+	size_t index;
+	ssize_t got;
+	double start;
+	double seconds;
+	int fd;
+	int error;
+
+	error = mount_harness_mount(harness, NULL);
+	if ( error != 0 )
+	{
+		return ( error );
+	}
+	snprintf(path, sizeof(path), "%s/file", harness->mount_point);
+
+	fd = open(path, O_RDONLY);
+	error = (fd < 0) ? errno : 0;
+	latency_server_reset_counts(&harness->server);
+	start = mount_harness_now();
+	for ( index = 0; (error == 0) && (index < count); ++index )
+	{
+		offset = FILE_SIZE / 2 + (off_t)pieces[index] * READ_SIZE;
+		got = pread(fd, buffer, READ_SIZE, offset);
+		if ( got != READ_SIZE )
+		{
+			error = (got < 0) ? errno : EIO;
+		}
+		else if ( !mount_harness_check(buffer, offset, READ_SIZE) )
+		{
+			fprintf(stderr, "%s: wrong data at offset %lld\n", label, (long long)offset);
+			error = EIO;
+		}
+	}
+	seconds = mount_harness_now() - start;
+	if ( fd >= 0 )
+	{
+		close(fd);
+	}
+
+	if ( error == 0 )
+	{
+		latency_server_get_counts(&harness->server, &counts);
+		printf("%-10s %6zu reads %8.2f s %8.2f ms/read %6llu Range GETs\n", label, count, seconds,
+			seconds * 1000.0 / (double)count, (unsigned long long)counts.range_gets);
+	}
+	mount_harness_unmount(harness);
+	return ( error );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	size_t *pieces;
+	size_t count;
+	size_t index;
+	size_t other;
+	size_t piece;
+	int error;
+
+	count = (size_t)((argc > 1) ? atoi(argv[1]) : 8) * 1024 * 1024 / READ_SIZE;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 2) ? atoi(argv[2]) : 50;
+	harness.server.bandwidth = 10 * 1024 * 1024;
+	if ( (count == 0) || ((off_t)count * READ_SIZE > FILE_SIZE / 2) )
+	{
+		fprintf(stderr, "usage: %s [megabytes [latency_ms]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	pieces = malloc(count * sizeof(size_t));
+	if ( pieces == NULL )
+	{
+		return ( EXIT_FAILURE );
+	}
+	for ( index = 0; index < count; ++index )
+	{
+		pieces[index] = index;
+	}
+
+	error = mount_harness_init(&harness);
+	if ( error == 0 )
+	{
+		error = mount_harness_make_file(&harness, "file", FILE_SIZE);
+	}
+	if ( error == 0 )
+	{
+		error = run(&harness, "in order", pieces, count);
+	}
+	if ( error == 0 )
+	{
+		srandom(1);
+		for ( index = count - 1; index > 0; --index )
+		{
+			other = (size_t)random() % (index + 1);
+			piece = pieces[index];
+			pieces[index] = pieces[other];
+			pieces[other] = piece;
+		}
+		error = run(&harness, "shuffled", pieces, count);
+	}
+	mount_harness_cleanup(&harness);
+	free(pieces);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "readahead_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * sax_dispatch_bench measures PROPFIND parse throughput over the documents in
+ * corpus/, which are shaped like the multistatus responses of Apache mod_dav,
+ * IIS, nginx and SabreDAV.
+ *
+ *	usage: sax_dispatch_bench [corpus directory [seconds]]
+ *
+ * Each document is parsed for about seconds (0.5 by default) per parser: as a
+ * Depth 1 listing with the multistatus scanner, as a listing with the scanner
+ * off (every element goes through the libxml2 SAX callbacks), and by
+ * parse_stat. The listings are checked for the children each document has.
+ */
+
+#include "webdavd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "webdav_parse.h"
+#include "listing_harness.h"
+
+struct corpus_document
+{
+	const char *name;		/* file in the corpus directory */
+	size_t children;		/* children of LISTING_PARENT_PATH it lists */
+};
+
+static const struct corpus_document gCorpus[] =
+{
+	{ "apache.xml", 4 },
+	{ "iis.xml", 3 },
+	{ "nginx.xml", 3 },
+	{ "sabredav.xml", 4 }
+};
+
+#define CORPUS_COUNT (sizeof(gCorpus) / sizeof(gCorpus[0]))
+
+/* reads a corpus file into a malloc'd buffer */
+static char *read_document(const char *directory, const char *name, size_t *length)
+{
+	char path[MAXPATHLEN];
+	FILE *file;
+	char *document;
+	long size;
+
+	snprintf(path, sizeof(path), "%s/%s", directory, name);
+	file = fopen(path, "r");
+	if ( file == NULL )
+	{
+		perror(path);
+		return ( NULL );
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	document = malloc((size_t)size);
+	if ( (document != NULL) && (fread(document, 1, (size_t)size, file) != (size_t)size) )
+	{
+		free(document);
+		document = NULL;
+	}
+	fclose(file);
+	*length = (size_t)size;
+	return ( document );
+}
+
+/* parses document as a listing until seconds have gone by; returns MB/s or -1.0 */
+static double listing_throughput(const char *document, size_t length, size_t children, double seconds)
+{
+	struct listing_result result;
+	double start;
+	double elapsed;
+	size_t bytes;
+
+	bytes = 0;
+	elapsed = 0.0;
+	start = listing_now();
+	while ( elapsed < seconds )
+	{
+		if ( (listing_run(document, length, length, &result) != 0) || (result.entries != children) )
+		{
+			return ( -1.0 );
+		}
+		bytes += length;
+		elapsed = listing_now() - start;
+	}
+	return ( (double)bytes / elapsed / (1024.0 * 1024.0) );
+}
+
+/* parses document with parse_stat until seconds have gone by; returns MB/s */
+static double stat_throughput(const char *document, size_t length, double seconds)
+{
+	struct webdav_stat_attr statbuf;
+	double start;
+	double elapsed;
+	size_t bytes;
+
+	bytes = 0;
+	elapsed = 0.0;
+	start = listing_now();
+	while ( elapsed < seconds )
+	{
+		(void) parse_stat((const UInt8 *)document, (CFIndex)length, &statbuf);
+		bytes += length;
+		elapsed = listing_now() - start;
+	}
+	return ( (double)bytes / elapsed / (1024.0 * 1024.0) );
+}
+
+int main(int argc, char *argv[])
+{
+	const char *directory;
+	double seconds;
+	char *document;
+	size_t length;
+	size_t index;
+	double scanner;
+	double libxml2;
+	double stat;
+
+	directory = (argc > 1) ? argv[1] : "corpus";
+	seconds = (argc > 2) ? atof(argv[2]) : 0.5;
+
+	printf("%-14s %8s %14s %14s %14s\n", "document", "bytes", "scanner MB/s", "libxml2 MB/s", "stat MB/s");
+	for ( index = 0; index < CORPUS_COUNT; ++index )
+	{
+		document = read_document(directory, gCorpus[index].name, &length);
+		if ( document == NULL )
+		{
+			return ( EXIT_FAILURE );
+		}
+
+		gMultistatusScanner = TRUE;
+		scanner = listing_throughput(document, length, gCorpus[index].children, seconds);
+		gMultistatusScanner = FALSE;
+		libxml2 = listing_throughput(document, length, gCorpus[index].children, seconds);
+		stat = stat_throughput(document, length, seconds);
+		if ( (scanner < 0.0) || (libxml2 < 0.0) )
+		{
+			fprintf(stderr, "%s: listing did not have %zu children\n", gCorpus[index].name, gCorpus[index].children);
+			return ( EXIT_FAILURE );
+		}
+
+		printf("%-14s %8zu %14.1f %14.1f %14.1f\n", gCorpus[index].name, length, scanner, libxml2, stat);
+		free(document);
+	}
+
+	return ( EXIT_SUCCESS );
+}
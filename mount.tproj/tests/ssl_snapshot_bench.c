@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * ssl_snapshot_bench measures the per-request path that checks out a
+ * ReadStreamRec and reads the SSL properties, with threads contending for it.
+ *
+ *	usage: ssl_snapshot_bench [iterations]
+ *
+ * Each of 1, 2, 4, 8 and WEBDAV_READ_STREAMS threads runs iterations
+ * (1,000,000 by default) of get_ReadStreamRec, a read of the SSL properties,
+ * and release_ReadStreamRec. The properties are read from the gSSLProperties
+ * snapshot the way ApplySSLProperties does, and then under
+ * gNetworkGlobals_lock the way it used to. Meanwhile another thread publishes
+ * a new snapshot every millisecond the way HandleSSLErrors does, and every
+ * snapshot read must hold the SSL level it was published with. The time per
+ * iteration and the requests per second are reported.
+ */
+
+#include "../webdav_network.c"
+#include "network_harness.h"
+
+#define PUBLISH_INTERVAL_USEC	1000
+
+struct run
+{
+	int locked;					/* TRUE to read the properties under gNetworkGlobals_lock */
+	long iterations;			/* iterations per thread */
+	volatile int starting;		/* cleared to start the threads */
+	volatile int publishing;	/* cleared to stop publish_thread */
+	long publishes;				/* snapshots published */
+	volatile int32_t failures;	/* reads that didn't find the SSL level */
+};
+
+/*****************************************************************************/
+
+/* publishes a new snapshot every PUBLISH_INTERVAL_USEC until run->publishing is cleared */
+static void *publish_thread(void *arg)
+{
+	struct run *run;
+	CFMutableDictionaryRef newProperties;
+
+	run = (struct run *)arg;
+	while ( run->publishing )
+	{
+		pthread_mutex_lock(&gNetworkGlobals_lock);
+		newProperties = create_mutable_ssl_properties();
+		if ( newProperties != NULL )
+		{
+			CFDictionarySetValue(newProperties, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
+			publish_ssl_properties(newProperties);
+			CFRelease(newProperties);
+			++run->publishes;
+		}
+		pthread_mutex_unlock(&gNetworkGlobals_lock);
+		usleep(PUBLISH_INTERVAL_USEC);
+	}
+	return ( NULL );
+}
+
+static void *request_thread(void *arg)
+{
+	struct run *run;
+	struct ReadStreamRec *readStreamRecPtr;
+	CFDictionaryRef sslProperties;
+	long index;
+
+	run = (struct run *)arg;
+	while ( run->starting )
+	{
+		sched_yield();
+	}
+	for ( index = 0; index < run->iterations; ++index )
+	{
+		readStreamRecPtr = get_ReadStreamRec();
+		if ( run->locked )
+		{
+			pthread_mutex_lock(&gNetworkGlobals_lock);
+			sslProperties = gSSLProperties;
+			if ( (sslProperties == NULL) || (CFDictionaryGetValue(sslProperties, kCFStreamSSLLevel) == NULL) )
+			{
+				OSAtomicIncrement32(&run->failures);
+			}
+			pthread_mutex_unlock(&gNetworkGlobals_lock);
+		}
+		else
+		{
+			sslProperties = gSSLProperties;
+			if ( (sslProperties == NULL) || (CFDictionaryGetValue(sslProperties, kCFStreamSSLLevel) == NULL) )
+			{
+				OSAtomicIncrement32(&run->failures);
+			}
+		}
+		if ( readStreamRecPtr != NULL )
+		{
+			release_ReadStreamRec(readStreamRecPtr);
+		}
+		else
+		{
+			OSAtomicIncrement32(&run->failures);
+		}
+	}
+	return ( NULL );
+}
+
+/* runs count request threads; returns an errno */
+static int run_threads(int locked, int count, long iterations)
+{
+	struct run run;
+	pthread_t publisher;
+	pthread_t threads[WEBDAV_READ_STREAMS];
+	double start;
+	double seconds;
+	int started;
+	int error;
+
+	memset(&run, 0, sizeof(run));
+	run.locked = locked;
+	run.iterations = iterations;
+	run.starting = TRUE;
+	run.publishing = TRUE;
+	error = pthread_create(&publisher, NULL, publish_thread, &run);
+	if ( error != 0 )
+	{
+		return ( error );
+	}
+	for ( started = 0; (error == 0) && (started < count); ++started )
+	{
+		error = pthread_create(&threads[started], NULL, request_thread, &run);
+	}
+	if ( error != 0 )
+	{
+		--started;
+	}
+
+	start = network_harness_now();
+	run.starting = FALSE;
+	while ( started > 0 )
+	{
+		pthread_join(threads[--started], NULL);
+	}
+	seconds = network_harness_now() - start;
+	run.publishing = FALSE;
+	pthread_join(publisher, NULL);
+
+	if ( error == 0 )
+	{
+		printf("%-8s %2d threads %8.1f ns/request %8.2f M requests/s  %ld snapshots published\n",
+			locked ? "locked" : "snapshot", count, seconds * 1e9 / (double)iterations,
+			(double)iterations * count / seconds / 1e6, run.publishes);
+		if ( run.failures != 0 )
+		{
+			fprintf(stderr, "%s: %d reads failed\n", locked ? "locked" : "snapshot", (int)run.failures);
+			error = EIO;
+		}
+	}
+	return ( error );
+}
+
+/*****************************************************************************/
+
+int main(int argc, char *argv[])
+{
+	static const int threadCounts[] = { 1, 2, 4, 8, WEBDAV_READ_STREAMS };
+	CFMutableDictionaryRef sslProperties;
+	long iterations;
+	size_t index;
+	int locked;
+	int error;
+
+	iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+	if ( iterations <= 0 )
+	{
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	/* what network_init sets up for these */
+	pthread_mutex_init(&gNetworkGlobals_lock, NULL);
+	pthread_mutex_init(&gReadStreams_lock, NULL);
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
+	{
+		gReadStreams[index].inUse = FALSE;
+		gReadStreams[index].readStreamRef = NULL;
+	}
+
+	/* the first snapshot, as the TLS to SSL fallback leaves it */
+	sslProperties = create_mutable_ssl_properties();
+	if ( sslProperties == NULL )
+	{
+		return ( EXIT_FAILURE );
+	}
+	CFDictionarySetValue(sslProperties, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
+	publish_ssl_properties(sslProperties);
+	CFRelease(sslProperties);
+
+	error = 0;
+	for ( locked = FALSE; (error == 0) && (locked <= TRUE); ++locked )
+	{
+		for ( index = 0; (error == 0) && (index < sizeof(threadCounts) / sizeof(threadCounts[0])); ++index )
+		{
+			error = run_threads(locked, threadCounts[index], iterations);
+		}
+	}
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "ssl_snapshot_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * stat_storm_bench measures many processes stat'ing the same path at once,
+ * the way a parallel build does.
+ *
+ *	usage: stat_storm_bench [threads [rounds [latency_ms]]]
+ *
+ * Each round, a new file is made in the server's directory and threads (32 by
+ * default) stat it at the same moment through the mount, so every stat is a
+ * lookup the agent has to ask the server about. There are rounds rounds (20 by
+ * default), and the latency server waits latency_ms (100 by default) before
+ * each response. The PROPFINDs the server answered per round are reported with
+ * the stat latencies; without coalescing there would be one per thread.
+ */
+
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+struct round
+{
+	char path[MAXPATHLEN];		/* the file every thread stats */
+	double *latencies;			/* seconds each thread's stat took */
+	int failures;				/* stats that failed */
+};
+
+static void stat_path(void *context, size_t index)
+{
+	struct round *round;
+	struct stat statbuf;
+	double start;
+
+	round = (struct round *)context;
+	start = mount_harness_now();
+	if ( stat(round->path, &statbuf) != 0 )
+	{
+		__sync_fetch_and_add(&round->failures, 1);
+	}
+	round->latencies[index] = mount_harness_now() - start;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double difference;
+
+	difference = *(const double *)a - *(const double *)b;
+	return ( (difference < 0.0) ? -1 : (difference > 0.0) );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	struct latency_server_counts counts;
+	struct round round;
+	char name[32];
+	double *latencies;
+	size_t threads;
+	int rounds;
+	int index;
+	int fd;
+	int error;
+
+	threads = (argc > 1) ? strtoul(argv[1], NULL, 10) : 32;
+	rounds = (argc > 2) ? atoi(argv[2]) : 20;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 3) ? atoi(argv[3]) : 100;
+	if ( (threads == 0) || (rounds <= 0) )
+	{
+		fprintf(stderr, "usage: %s [threads [rounds [latency_ms]]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	latencies = malloc(threads * (size_t)rounds * sizeof(double));
+	if ( latencies == NULL )
+	{
+		return ( EXIT_FAILURE );
+	}
+	memset(&round, 0, sizeof(round));
+
+	error = mount_harness_init(&harness);
+	if ( error == 0 )
+	{
+		error = mount_harness_mount(&harness, NULL);
+	}
+	if ( error == 0 )
+	{
+		latency_server_reset_counts(&harness.server);
+		for ( index = 0; (error == 0) && (index < rounds); ++index )
+		{
+			snprintf(name, sizeof(name), "storm%d", index);
+			snprintf(round.path, sizeof(round.path), "%s/%s", harness.root, name);
+			fd = open(round.path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if ( fd < 0 )
+			{
+				error = errno;
+				break;
+			}
+			close(fd);
+
+			snprintf(round.path, sizeof(round.path), "%s/%s", harness.mount_point, name);
+			round.latencies = latencies + (size_t)index * threads;
+			error = mount_harness_storm(threads, stat_path, &round);
+		}
+		latency_server_get_counts(&harness.server, &counts);
+	}
+	mount_harness_cleanup(&harness);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "stat_storm_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+
+	qsort(latencies, threads * (size_t)rounds, sizeof(double), compare_doubles);
+	printf("%zu threads x %d rounds: %.1f PROPFINDs per round (%zu stats), %d failed\n", threads, rounds,
+		(double)counts.propfinds / rounds, threads, round.failures);
+	printf("stat latency: median %.1f ms  p99 %.1f ms  max %.1f ms\n",
+		latencies[threads * (size_t)rounds / 2] * 1000.0,
+		latencies[threads * (size_t)rounds * 99 / 100] * 1000.0,
+		latencies[threads * (size_t)rounds - 1] * 1000.0);
+
+	free(latencies);
+	return ( (round.failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE );
+}
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * upload_bench measures how fast a large file written through the mount is
+ * uploaded when it is closed.
+ *
+ *	usage: upload_bench [megabytes [latency_ms]]
+ *
+ * A file of megabytes (1,024 by default; the uploads this was written for
+ * are 1 to 10G) is written 1M at a time on a fresh mount, first with the
+ * default mapped cache file upload and then with nommapupload. The writes
+ * only fill the agent's cache file; the PUT is sent when the file is closed.
+ * The latency server waits latency_ms (10 by default) before each response.
+ * The time of the writes and of the close, the upload throughput, the
+ * agent's CPU time, and the bytes the server received are reported for
+ * each. The file the server stored is checked.
+ */
+
+#include <sys/param.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "mount_harness.h"
+
+#define WRITE_SIZE	0x100000
+
+/* writes and closes the file on a fresh mount with options; returns an errno */
+static int run(struct mount_harness *harness, const char *options, off_t size)
+{
+	struct latency_server_counts counts;
+	const char *label;
+	char path[MAXPATHLEN];
+	char *buffer;
+	off_t offset;
+	ssize_t count;
+	double start;
+	double closing;
+	double end;
+	double cpuStart;
+	double cpuEnd;
+	int threads;
+	int fd;
+	int error;
+
+	label = (options != NULL) ? options : "mapped";
+	error = mount_harness_mount(harness, options);
+	if ( error != 0 )
+	{
+		return ( error );
+	}
+	buffer = malloc(WRITE_SIZE);
+	snprintf(path, sizeof(path), "%s/file", harness->mount_point);
+	latency_server_reset_counts(&harness->server);
+	if ( (buffer == NULL) || (mount_harness_agent_usage(harness, &threads, &cpuStart) != 0) )
+	{
+		cpuStart = 0.0;
+	}
+
+	start = mount_harness_now();
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	error = ((buffer == NULL) || (fd < 0)) ? errno : 0;
+	for ( offset = 0; (error == 0) && (offset < size); offset += count )
+	{
+		count = (ssize_t)MIN((off_t)WRITE_SIZE, size - offset);
+		mount_harness_fill(buffer, offset, (size_t)count);
+		if ( write(fd, buffer, (size_t)count) != count )
+		{
+			error = errno;
+		}
+	}
+	closing = mount_harness_now();
+	if ( (fd >= 0) && (close(fd) != 0) && (error == 0) )
+	{
+		error = errno;
+	}
+	end = mount_harness_now();
+	if ( mount_harness_agent_usage(harness, &threads, &cpuEnd) != 0 )
+	{
+		cpuEnd = cpuStart;
+	}
+
+	if ( error == 0 )
+	{
+		latency_server_get_counts(&harness->server, &counts);
+		printf("%-13s write %7.2f s  close %7.2f s %8.1f MB/s  agent CPU %6.2f s  %llu PUTs, %llu bytes received\n",
+			label, closing - start, end - closing, (double)size / (end - closing) / (1024.0 * 1024.0),
+			cpuEnd - cpuStart, (unsigned long long)counts.puts, (unsigned long long)counts.bytes_received);
+		if ( counts.bytes_received < (uint64_t)size )
+		{
+			fprintf(stderr, "%s: the server received %llu of %lld bytes\n", label,
+				(unsigned long long)counts.bytes_received, (long long)size);
+			error = EIO;
+		}
+	}
+	mount_harness_unmount(harness);
+	if ( error == 0 )
+	{
+		error = mount_harness_check_file(harness, "file", size);
+	}
+	free(buffer);
+	return ( error );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	off_t size;
+	int error;
+
+	size = (off_t)((argc > 1) ? atoll(argv[1]) : 1024) * 1024 * 1024;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 2) ? atoi(argv[2]) : 10;
+	if ( size <= 0 )
+	{
+		fprintf(stderr, "usage: %s [megabytes [latency_ms]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	error = mount_harness_init(&harness);
+	if ( error == 0 )
+	{
+		error = run(&harness, NULL, size);
+	}
+	if ( error == 0 )
+	{
+		error = run(&harness, "nommapupload", size);
+	}
+	mount_harness_cleanup(&harness);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "upload_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
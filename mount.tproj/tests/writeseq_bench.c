@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2026 Apple Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * writeseq_bench measures a large file written in Write Sequential mode, where
+ * each write is sent on to the server as it is made instead of at close.
+ *
+ *	usage: writeseq_bench [megabytes [latency_ms]]
+ *
+ * A file is opened for writing on a fresh mount, put in Write Sequential mode
+ * with fsctl(WEBDAVIOC_WRITE_SEQUENTIAL), and megabytes (5,120 by default)
+ * are written 64K at a time before it is closed. This is done with
+ * writeseqwindow=1, where every chunk waits for the one before it to be
+ * written to the PUT stream, and then with the default window. The latency
+ * server waits latency_ms (10 by default) before each response. The time of
+ * the writes and of the close, the throughput from open to close, and the
+ * bytes the server received are reported for each. The file the server stored
+ * is checked.
+ */
+
+#include <sys/param.h>
+#include <sys/fsctl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../webdav_fs.kextproj/webdav_fs.kmodproj/webdav.h"
+#include "mount_harness.h"
+
+#define WRITE_SIZE	0x10000
+
+/* writes and closes the file in Write Sequential mode on a fresh mount with options; returns an errno */
+static int run(struct mount_harness *harness, const char *options, off_t size)
+{
+	struct latency_server_counts counts;
+	struct WebdavWriteSequential writeSequential;
+	const char *label;
+	char path[MAXPATHLEN];
+	char buffer[WRITE_SIZE];
+	off_t offset;
+	ssize_t count;
+	double start;
+	double closing;
+	double end;
+	int fd;
+	int error;
+
+	label = (options != NULL) ? options : "default window";
+	error = mount_harness_mount(harness, options);
+	if ( error != 0 )
+	{
+		return ( error );
+	}
+	snprintf(path, sizeof(path), "%s/file", harness->mount_point);
+	latency_server_reset_counts(&harness->server);
+
+	start = mount_harness_now();
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	error = (fd < 0) ? errno : 0;
+	if ( error == 0 )
+	{
+		writeSequential.file_len = (uint64_t)size;
+		if ( fsctl(path, WEBDAVIOC_WRITE_SEQUENTIAL, &writeSequential, 0) != 0 )
+		{
+			error = errno;
+			fprintf(stderr, "%s: fsctl(WEBDAVIOC_WRITE_SEQUENTIAL): %s\n", label, strerror(error));
+		}
+	}
+	for ( offset = 0; (error == 0) && (offset < size); offset += count )
+	{
+		count = (ssize_t)MIN((off_t)WRITE_SIZE, size - offset);
+		mount_harness_fill(buffer, offset, (size_t)count);
+		if ( write(fd, buffer, (size_t)count) != count )
+		{
+			error = errno;
+		}
+	}
+	closing = mount_harness_now();
+	if ( (fd >= 0) && (close(fd) != 0) && (error == 0) )
+	{
+		error = errno;
+	}
+	end = mount_harness_now();
+
+	if ( error == 0 )
+	{
+		latency_server_get_counts(&harness->server, &counts);
+		printf("%-16s write %7.2f s  close %6.2f s %8.1f MB/s  %llu PUTs, %llu bytes received\n",
+			label, closing - start, end - closing, (double)size / (end - start) / (1024.0 * 1024.0),
+			(unsigned long long)counts.puts, (unsigned long long)counts.bytes_received);
+	}
+	mount_harness_unmount(harness);
+	if ( error == 0 )
+	{
+		error = mount_harness_check_file(harness, "file", size);
+	}
+	return ( error );
+}
+
+int main(int argc, char *argv[])
+{
+	struct mount_harness harness;
+	off_t size;
+	int error;
+
+	size = (off_t)((argc > 1) ? atoll(argv[1]) : 5120) * 1024 * 1024;
+	memset(&harness, 0, sizeof(harness));
+	harness.server.latency_ms = (argc > 2) ? atoi(argv[2]) : 10;
+	if ( size <= 0 )
+	{
+		fprintf(stderr, "usage: %s [megabytes [latency_ms]]\n", argv[0]);
+		return ( EXIT_FAILURE );
+	}
+
+	error = mount_harness_init(&harness);
+	if ( error == 0 )
+	{
+		error = run(&harness, "writeseqwindow=1", size);
+	}
+	if ( error == 0 )
+	{
+		error = run(&harness, NULL, size);
+	}
+	mount_harness_cleanup(&harness);
+
+	if ( error != 0 )
+	{
+		fprintf(stderr, "writeseq_bench: %s\n", strerror(error));
+		return ( EXIT_FAILURE );
+	}
+	return ( EXIT_SUCCESS );
+}
@@ -33,6 +33,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
 #include <err.h>
 #include <fcntl.h>
@@ -64,6 +65,20 @@
 unsigned int gtimeout_val;		/* the pulse_thread runs at double this rate */
 char *gtimeout_string;			/* the length of time LOCKs are held on on the server */
 int gWebdavfsDebug = FALSE;		/* TRUE if the WEBDAVFS_DEBUG environment variable is set */
+int gMultistatusScanner = TRUE;	/* FALSE if the noscanner mount option is set */
+int gEventEngine = TRUE;		/* FALSE if the noeventengine mount option is set */
+int gAcceptEncoding = TRUE;		/* FALSE if the nocompression mount option is set */
+int gMmapUpload = TRUE;			/* FALSE if the nommapupload mount option is set */
+int gLazyCreate = FALSE;		/* TRUE if the lazycreate mount option is set */
+int gWriteBack = FALSE;			/* TRUE if the writeback mount option is set */
+time_t gWriteBackDelay = WEBDAV_DEFAULT_WRITEBACK_DELAY;	/* seconds a file is closed before write-back uploads it */
+uint32_t gSeqWriteWindow = WEBDAV_DEFAULT_WRITESEQ_WINDOW;	/* Write Sequential chunks queued on the PUT stream at once */
+off_t gUploadSegmentSize = WEBDAV_DEFAULT_UPLOAD_SEGMENT_SIZE;	/* size of each PUT of a resumable upload, or 0 to send files in one PUT */
+int gDownloadConnections = WEBDAV_DEFAULT_DOWNLOAD_CONNECTIONS;	/* connections used to download a large file */
+size_t gDownloadSegmentSize = WEBDAV_DEFAULT_DOWNLOAD_SEGMENT_SIZE;	/* size of each Range GET of a parallel download */
+off_t gDownloadThreshold = WEBDAV_DEFAULT_DOWNLOAD_THRESHOLD;	/* smallest file downloaded with parallel Range GETs */
+size_t gFirstReadSize = 0;			/* bytes downloaded at open, or 0 for the page size */
+size_t gFirstReadMax = WEBDAV_DEFAULT_FIRST_READ_MAX;	/* most bytes downloaded at open after learning from closes */
 uid_t gProcessUID = -1;			/* the daemon's UID */
 int gSuppressAllUI = FALSE;		/* if TRUE, the mount requested that all UI be supressed */
 int gSecureServerAuth = FALSE;		/* if TRUE, the authentication for server challenges must be sent securely (not clear-text) */
@@ -97,6 +112,10 @@ uint64_t webdavCacheMaximumSize = WEBDAV_DEFAULT_CACHE_MAX_SIZE;
 // the system.
 static void setCacheMaximumSize(void);
 
+// Sets the agent's own tunables from a -o option string. getmntopts()
+// silently ignores these options.
+static void getAgentOptions(const char *options);
+
 #define CFENVFORMATSTRING "__CF_USER_TEXT_ENCODING=0x%X:0:0"
 
 /*****************************************************************************/
@@ -520,6 +539,139 @@ static void setCacheMaximumSize(void)
 
 /*****************************************************************************/
 
+/*
+ * getNumericOption returns TRUE if option is "name=value". If value is between
+ * min and max (inclusive) it is returned in number; otherwise the option is
+ * logged and number is left alone.
+ */
+static int getNumericOption(const char *option, const char *name, long long min, long long max, long long *number)
+{
+	size_t		nameLength;
+	long long	value;
+	char		*end;
+	
+	nameLength = strlen(name);
+	if ( (strncmp(option, name, nameLength) != 0) || (option[nameLength] != '=') )
+	{
+		return ( FALSE );
+	}
+	
+	value = strtoll(&option[nameLength + 1], &end, 0);
+	if ( (end != &option[nameLength + 1]) && (*end == '\0') && (value >= min) && (value <= max) )
+	{
+		*number = value;
+	}
+	else
+	{
+		syslog(LOG_ERR, "ignoring mount option %s: value must be between %lld and %lld", option, min, max);
+	}
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+static void getAgentOptions(const char *options)
+{
+	char		*optionsCopy;
+	char		*remaining;
+	char		*option;
+	long long	number;
+	
+	optionsCopy = strdup(options);
+	if ( optionsCopy == NULL )
+	{
+		return;
+	}
+	
+	remaining = optionsCopy;
+	while ( (option = strsep(&remaining, ",")) != NULL )
+	{
+		number = -1;
+		
+		/* the download's own thread plus at most all of the helper threads */
+		if ( getNumericOption(option, "downloadconnections", 1, WEBDAV_DOWNLOAD_HELPER_THREADS + 1, &number) )
+		{
+			if ( number >= 0 )
+				gDownloadConnections = (int)number;
+		}
+		else if ( getNumericOption(option, "downloadsegmentsize", 0x10000, 0x04000000, &number) )
+		{
+			if ( number >= 0 )
+				gDownloadSegmentSize = (size_t)number;
+		}
+		else if ( getNumericOption(option, "downloadthreshold", 0, LLONG_MAX, &number) )
+		{
+			if ( number >= 0 )
+				gDownloadThreshold = (off_t)number;
+		}
+		else if ( getNumericOption(option, "firstreadsize", 0, 0x01000000, &number) )
+		{
+			if ( number >= 0 )
+				gFirstReadSize = (size_t)number;
+		}
+		/* setting firstreadmax to firstreadsize (or less) turns learning off */
+		else if ( getNumericOption(option, "firstreadmax", 0, 0x01000000, &number) )
+		{
+			if ( number >= 0 )
+				gFirstReadMax = (size_t)number;
+		}
+		/* changes sit in the cache file until they're uploaded, so don't wait too long */
+		else if ( getNumericOption(option, "writebackdelay", 1, 60, &number) )
+		{
+			if ( number >= 0 )
+				gWriteBackDelay = (time_t)number;
+		}
+		/* each chunk in the window is a BODY_BUFFER_SIZE slot in the PUT's ring */
+		else if ( getNumericOption(option, "writeseqwindow", 1, WEBDAV_WRITESEQ_RING_SLOTS, &number) )
+		{
+			if ( number >= 0 )
+				gSeqWriteWindow = (uint32_t)number;
+		}
+		/* a segment is sent from memory when the file can't be mapped, so keep it reasonable */
+		else if ( getNumericOption(option, "uploadsegmentsize", 0, 0x10000000, &number) )
+		{
+			if ( (number == 0) || (number >= BODY_BUFFER_SIZE) )
+				gUploadSegmentSize = (off_t)number;
+			else if ( number > 0 )
+				syslog(LOG_ERR, "ignoring mount option %s: nonzero segments must be at least %d bytes", option, BODY_BUFFER_SIZE);
+		}
+		else if ( strcmp(option, "noscanner") == 0 )
+		{
+			/* parse directory listings with libxml2 only */
+			gMultistatusScanner = FALSE;
+		}
+		else if ( strcmp(option, "noeventengine") == 0 )
+		{
+			/* request threads do their own network I/O */
+			gEventEngine = FALSE;
+		}
+		else if ( strcmp(option, "nocompression") == 0 )
+		{
+			/* don't ask for encoded PROPFIND responses */
+			gAcceptEncoding = FALSE;
+		}
+		else if ( strcmp(option, "nommapupload") == 0 )
+		{
+			/* uploads read the cache file through its fd */
+			gMmapUpload = FALSE;
+		}
+		else if ( strcmp(option, "lazycreate") == 0 )
+		{
+			/* new files aren't created on the server until their first fsync or close */
+			gLazyCreate = TRUE;
+		}
+		else if ( strcmp(option, "writeback") == 0 )
+		{
+			/* closes don't wait for uploads */
+			gWriteBack = TRUE;
+		}
+	}
+	
+	free(optionsCopy);
+}
+
+/*****************************************************************************/
+
 #define TMP_WEBDAV_UDS _PATH_TMP ".webdavUDS.XXXXXX"	/* Scratch socket name */
 
 /* maximum length of username and password */
@@ -811,6 +963,9 @@ int main(int argc, char *argv[])
 						{ NULL, 0, 0, 0 }
 					};
 					
+					/* pick out webdavfs_agent's own options; getmntopts() ignores them */
+					getAgentOptions(optarg);
+					
 					mp = getmntopts(optarg, mopts, &mntflags, 0);
 					if (mp == NULL)
 						error = 1;
@@ -1024,6 +1179,12 @@ int main(int argc, char *argv[])
 	uri = NULL;
 	require_noerr_action_quiet(error, error_exit, error = EINVAL);
 	
+	if ( gEventEngine )
+	{
+		/* if the event threads can't be started, fall back to blocking transactions */
+		gEventEngine = (network_event_engine_init() == 0);
+	}
+	
 	error = filesystem_init(vfc.vfc_typenum);
 	require_noerr_action_quiet(error, error_exit, error = EINVAL);
 
@@ -1031,9 +1192,10 @@ int main(int argc, char *argv[])
 	require_noerr_action_quiet(error, error_exit, error = EINVAL);
 
 	/*
-	 * Check out the server and get the mount flags
+	 * Check out the server and get the mount flags (network_mount must not
+	 * write to the server if the user asked for a read-only mount)
 	 */
-	servermntflags = 0;
+	servermntflags = mntflags & MNT_RDONLY;
 	error = filesystem_mount(&servermntflags);
 	require_noerr_quiet(error, error_exit);
 	
@@ -1343,6 +1505,10 @@ int main(int argc, char *argv[])
 		}
 	}
 	
+	network_log_coalesced_requests();
+	network_log_content_decoding();
+	filesystem_log_writeback();
+	network_save_server_profile();
 	syslog(LOG_DEBUG, "%s unmounted\n", g_mountPoint);
 
 	/* attempt to delete the cache directory (if any) and the bound socket name */
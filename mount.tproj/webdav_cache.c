@@ -30,7 +30,9 @@
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/stat.h>
 
 #include "webdav_cache.h"
 #include "webdav_parse.h"
@@ -261,7 +263,9 @@ int node_attributes_valid(
 
 	result = ( (node->attr_time != 0) && /* 0 attr_time is invalid */
 			 ((uid == node->attr_uid) || (0 == node->attr_uid)) && /* does this user or root have access to the cached attributes */
-			 (time(NULL) < (node->attr_time + ATTRIBUTES_TIMEOUT_MAX)) ); /* don't cache them too long */
+			 ((time(NULL) < (node->attr_time + ATTRIBUTES_TIMEOUT_MAX)) || /* don't cache them too long */
+			  NODE_FILE_CREATE_PENDING(node) || /* unless the server doesn't have the file yet */
+			  NODE_FILE_WRITEBACK_PENDING(node)) ); /* or doesn't have its latest changes yet */
 
 	unlock_node_cache();
 
@@ -468,7 +472,9 @@ static int internal_add_file_cache(
 		victim_node = NULL;
 		LIST_FOREACH(file_node, &g_file_list, file_list)
 		{
-			if ( !NODE_FILE_IS_OPEN(file_node) )
+			/* a cache file with changes write-back hasn't uploaded can't be a victim */
+			if ( !NODE_FILE_IS_OPEN(file_node) &&
+				 (!NODE_FILE_WRITEBACK_PENDING(file_node) || NODE_IS_DELETED(file_node)) )
 			{
 				victim_node = file_node;
 			}
@@ -526,6 +532,68 @@ int nodecache_add_file_cache(
 
 /*****************************************************************************/
 
+static void internal_free_read_ahead(struct node_entry *node)
+{
+	if ( node->read_ahead_buffer != NULL )
+	{
+		free(node->read_ahead_buffer);
+		node->read_ahead_buffer = NULL;
+	}
+	node->read_ahead_offset = 0;
+	node->read_ahead_count = 0;
+	node->read_ahead_size = 0;
+	node->read_next_offset = 0;
+}
+
+/*****************************************************************************/
+
+/*
+ * Reserves the blocks a cache file will need to grow to file_length so the
+ * file isn't extended one write at a time. F_PREALLOCATE allocates past the
+ * end of the file without changing its size, so the size the kernel uses to
+ * follow a download's progress is still only what has been written. This is
+ * only a hint: errors are ignored and the blocks are released if the file is
+ * truncated or closed.
+ */
+void nodecache_preallocate_file_cache(struct node_entry *node, off_t file_length)
+{
+	struct stat statbuf;
+	fstore_t fstore;
+	
+	if ( NODE_FILE_IS_CACHED(node) && (fstat(node->file_fd, &statbuf) == 0) &&
+		((file_length - statbuf.st_size) > BODY_BUFFER_SIZE) )
+	{
+		fstore.fst_posmode = F_PEOFPOSMODE;
+		fstore.fst_offset = 0;
+		fstore.fst_length = file_length - statbuf.st_size;
+		fstore.fst_bytesalloc = 0;
+		
+		/* try for one contiguous extent, then settle for any extents */
+		fstore.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+		if ( fcntl(node->file_fd, F_PREALLOCATE, &fstore) == -1 )
+		{
+			fstore.fst_flags = F_ALLOCATEALL;
+			if ( fcntl(node->file_fd, F_PREALLOCATE, &fstore) == -1 )
+			{
+				syslog(LOG_DEBUG, "nodecache_preallocate_file_cache: F_PREALLOCATE of %qd bytes failed, errno %d", fstore.fst_length, errno);
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+
+void nodecache_free_read_ahead(struct node_entry *node)
+{
+	lock_node_cache();
+	
+	internal_free_read_ahead(node);
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
 static void internal_remove_file_cache(struct node_entry *node)
 {
 	if ( NODE_FILE_IS_CACHED(node) )
@@ -564,6 +632,7 @@ static void internal_remove_file_cache(struct node_entry *node)
 			free(node->file_locktoken);
 			node->file_locktoken = NULL;
 		}
+		internal_free_read_ahead(node);
 	}
 }
 
@@ -573,7 +642,11 @@ void nodecache_remove_file_cache(struct node_entry *node)
 {
 	lock_node_cache();
 	
-	internal_remove_file_cache(node);
+	/* the cache file holds the only copy of changes write-back hasn't uploaded */
+	if ( !NODE_FILE_WRITEBACK_PENDING(node) || NODE_IS_DELETED(node) )
+	{
+		internal_remove_file_cache(node);
+	}
 	
 	unlock_node_cache();
 }
@@ -810,8 +883,8 @@ static void internal_free_nodes(void)
 		struct node_entry *next_node;
 
 		next_node = node->entries.le_next;
-		/* free this node ONLY if it's  NOT on the file list */
-		if ( !NODE_FILE_IS_CACHED(node) )
+		/* free this node ONLY if it's  NOT on the file list (or waiting for a write-back upload) */
+		if ( !NODE_FILE_IS_CACHED(node) && !NODE_FILE_WRITEBACK_PENDING(node) )
 		{
 			/* remove the node_entry from the list it is in */
 			LIST_REMOVE(node, entries);
@@ -831,12 +904,15 @@ static void internal_free_nodes(void)
 				free(node->file_locktoken);
 				node->file_locktoken = NULL;
 			}
+			internal_free_read_ahead(node);
 
 			/* free memory used by the node */
 			free(node->name);
 			CFRelease(node->name_ref);
 			if (node->redir_name != NULL) 
 				free (node->redir_name);
+			if ( node->listing_removed != NULL )
+				CFRelease(node->listing_removed);
 
 			(void) internal_remove_attributes(node, TRUE);
 
@@ -866,9 +942,30 @@ static int internal_move_node(
 	char *new_name)					/* the utf8 new name of the node or NULL */
 {
 	int error;
+	CFStringRef removed_name;
 	
 	error = 0;
 	
+	/*
+	 * A listing of the old parent that is still arriving must not bring the
+	 * old name back, so remember it until the listing is done.
+	 */
+	if ( (node->parent != NULL) && (node->parent->listing_removed != NULL) )
+	{
+		removed_name = CFStringCreateCopy(kCFAllocatorDefault, node->name_ref);
+		if ( removed_name != NULL )
+		{
+			CFArrayAppendValue(node->parent->listing_removed, removed_name);
+			CFRelease(removed_name);
+		}
+	}
+	
+	/* the node is where it was moved to (and keeps its name if it wasn't renamed) even if a listing arriving there doesn't have it yet */
+	if ( new_parent != g_deleted_root_node )
+	{
+		node->node_time = time(NULL);
+	}
+	
 	/* new name? */
 	if ( (new_name_length != 0) && (new_name != NULL) )
 	{
@@ -1044,6 +1141,9 @@ static int internal_delete_invalid_directory_nodes(struct node_entry *dir_node)
 	error = 0;
 	
 	require_action(dir_node->node_type == WEBDAV_DIR_TYPE, not_directory, error = ENOTDIR);
+	
+	/* if the directory was deleted while its listing arrived, its children were deleted with it */
+	require_quiet(!NODE_IS_DELETED(dir_node), deleted_directory);
 
 	node = (&(dir_node->children))->lh_first;
 	while ( node != NULL )
@@ -1051,7 +1151,8 @@ static int internal_delete_invalid_directory_nodes(struct node_entry *dir_node)
 		struct node_entry *next_node;
 		
 		next_node = node->entries.le_next;
-		if ( node->node_time == 0 )
+		/* files waiting for deferred creation are never in the server's listing */
+		if ( (node->node_time == 0) && !NODE_FILE_CREATE_PENDING(node) )
 		{
 			//syslog(LOG_ERR,"NODE NAME IS %s",node->name);
 			error = delete_node_tree(node, TRUE);
@@ -1061,6 +1162,7 @@ static int internal_delete_invalid_directory_nodes(struct node_entry *dir_node)
 	}
 
 delete_node_tree:
+deleted_directory:
 not_directory:
 
 	return ( error );
@@ -1084,6 +1186,241 @@ int nodecache_delete_invalid_directory_nodes(
 
 /*****************************************************************************/
 
+/*
+ * nodecache_begin_listing invalidates dir_node's children's node_times (the
+ * listing validates the ones it has) and starts remembering the names removed
+ * from dir_node until nodecache_end_listing. The kernel's lock on the
+ * directory is dropped while a listing arrives in the background, so a remove
+ * or rename can finish before the listing gets to the name it changed.
+ */
+int nodecache_begin_listing(
+	struct node_entry *dir_node)		/* parent directory node */
+{
+	int error;
+
+	lock_node_cache();
+
+	error = internal_invalidate_directory_node_time(dir_node);
+	if ( error == 0 )
+	{
+		if ( dir_node->listing_removed != NULL )
+		{
+			CFArrayRemoveAllValues(dir_node->listing_removed);
+		}
+		else
+		{
+			dir_node->listing_removed = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+			require_action(dir_node->listing_removed != NULL, CFArrayCreateMutable, error = ENOMEM);
+		}
+	}
+
+CFArrayCreateMutable:
+
+	unlock_node_cache();
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+void nodecache_end_listing(
+	struct node_entry *dir_node)		/* parent directory node */
+{
+	lock_node_cache();
+
+	if ( dir_node->listing_removed != NULL )
+	{
+		CFRelease(dir_node->listing_removed);
+		dir_node->listing_removed = NULL;
+	}
+
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
+/*
+ * nodecache_get_listed_node gets (or creates) the node for a child named in a
+ * listing of parent. It returns ENOENT without creating it if the name was
+ * removed or renamed away since the listing started.
+ */
+int nodecache_get_listed_node(
+	struct node_entry *parent,		/* the parent node_entry */
+	size_t name_length,				/* length of name */
+	const char *name,				/* the utf8 name of the node */
+	webdav_filetype_t node_type,	/* the type of node to create */
+	struct node_entry **node)		/* the found (or new) node */
+{
+	int error;
+	CFStringRef name_string;
+	CFIndex index;
+	CFIndex count;
+
+	*node = NULL;
+	
+	lock_node_cache();
+
+	count = (parent->listing_removed != NULL) ? CFArrayGetCount(parent->listing_removed) : 0;
+	if ( count != 0 )
+	{
+		name_string = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *)name, name_length, kCFStringEncodingUTF8, false);
+		require_action(name_string != NULL, CFStringCreateWithBytes, error = EINVAL);
+		
+		for ( index = 0; index < count; ++index )
+		{
+			if ( CFStringCompare(name_string, CFArrayGetValueAtIndex(parent->listing_removed, index), kCFCompareNonliteral) == kCFCompareEqualTo )
+			{
+				break;
+			}
+		}
+		CFRelease(name_string);
+		require_action_quiet(index == count, removed, error = ENOENT);
+	}
+	
+	error = internal_get_node(parent, name_length, name, TRUE, FALSE, node_type, node);
+
+removed:
+CFStringCreateWithBytes:
+
+	unlock_node_cache();
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+void nodecache_set_create_pending(
+	struct node_entry *node,		/* the file node_entry */
+	int pending)					/* TRUE if the file isn't on the server yet */
+{
+	lock_node_cache();
+	
+	if ( pending )
+	{
+		node->flags |= nodeCreatePendingMask;
+	}
+	else
+	{
+		node->flags &= ~nodeCreatePendingMask;
+	}
+	
+	unlock_node_cache();
+}
+
+/*****************************************************************************/
+
+/* returns TRUE if any of dir_node's children are waiting for deferred creation */
+int nodecache_has_pending_children(
+	struct node_entry *dir_node)		/* parent directory node */
+{
+	int result;
+	struct node_entry *node;
+	
+	result = FALSE;
+	
+	lock_node_cache();
+	
+	LIST_FOREACH(node, &(dir_node->children), entries)
+	{
+		if ( NODE_FILE_CREATE_PENDING(node) )
+		{
+			result = TRUE;
+			break;
+		}
+	}
+	
+	unlock_node_cache();
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/* asks the listings of node and its descendants to stop -- call with the node cache locked */
+static int internal_terminate_listings(struct node_entry *node)
+{
+	int in_progress;
+	struct node_entry *child_node;
+	
+	in_progress = FALSE;
+	
+	if ( (node->node_type == WEBDAV_DIR_TYPE) &&
+		 ((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS) )
+	{
+		node->file_status |= WEBDAV_DOWNLOAD_TERMINATED;
+		in_progress = TRUE;
+	}
+	
+	LIST_FOREACH(child_node, &(node->children), entries)
+	{
+		if ( internal_terminate_listings(child_node) )
+		{
+			in_progress = TRUE;
+		}
+	}
+	
+	return ( in_progress );
+}
+
+/*
+ * nodecache_terminate_listings asks any listing still arriving for node or
+ * one of its descendants to stop. It returns TRUE if one hasn't stopped yet.
+ */
+int nodecache_terminate_listings(
+	struct node_entry *node)			/* directory node */
+{
+	int result;
+	
+	lock_node_cache();
+	
+	result = internal_terminate_listings(node);
+	
+	unlock_node_cache();
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/* returns TRUE if any of dir_node's descendants has changes the server may not have -- call with the node cache locked */
+static int internal_has_unsynced_descendants(struct node_entry *dir_node)
+{
+	struct node_entry *node;
+	
+	LIST_FOREACH(node, &(dir_node->children), entries)
+	{
+		if ( NODE_FILE_CREATE_PENDING(node) || NODE_FILE_WRITEBACK_PENDING(node) ||
+			 (NODE_FILE_IS_CACHED(node) && NODE_FILE_IS_OPEN(node) && (node->node_type == WEBDAV_FILE_TYPE)) ||
+			 internal_has_unsynced_descendants(node) )
+		{
+			return ( TRUE );
+		}
+	}
+	
+	return ( FALSE );
+}
+
+/*
+ * nodecache_has_unsynced_descendants returns TRUE if any file under dir_node
+ * is waiting for deferred creation or a write-back upload, or is open (and so
+ * may have changes that haven't been synced yet).
+ */
+int nodecache_has_unsynced_descendants(
+	struct node_entry *dir_node)		/* directory node */
+{
+	int result;
+	
+	lock_node_cache();
+	
+	result = internal_has_unsynced_descendants(dir_node);
+	
+	unlock_node_cache();
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
 /*
  * nodecache_get_path_from_node
  *
@@ -57,6 +57,7 @@ struct node_entry
 	u_int32_t				flags;
 	opaque_id				nodeid;					/* opaque_id assigned to this node */
 	time_t					node_time;				/* local time - when node was validated on server */
+	CFMutableArrayRef		listing_removed;		/* while a listing of this directory is arriving, the names removed or renamed away since it started, or NULL */
 	
 	/*
 	 * Attribute fields
@@ -106,6 +107,25 @@ struct node_entry
 	/* Context for sequential writes */
 	struct stream_put_ctx* put_ctx;
 	
+	/*
+	 * Write-back of closed files (see filesystem_fsync). Protected by the
+	 * write-back lock in webdav_file.c.
+	 */
+	u_int32_t				writeback_status;	/* WEBDAV_WRITEBACK_DIRTY, WEBDAV_WRITEBACK_BUSY and WEBDAV_WRITEBACK_QUEUED */
+	time_t					writeback_time;		/* when the cache file was last closed with changes */
+	uid_t					writeback_uid;		/* the uid of the user who closed it */
+	int						writeback_error;	/* the error of an upload the server refused, for the next open or fsync */
+	
+	/*
+	 * Read-ahead for WEBDAV_READ (reads the kernel sends to the server because
+	 * the download hasn't gotten that far yet). Protected by the node cache lock.
+	 */
+	off_t					read_next_offset;		/* offset just past the last WEBDAV_READ, to spot sequential reads */
+	size_t					read_ahead_size;		/* bytes to read past the next sequential WEBDAV_READ, or 0 */
+	off_t					read_ahead_offset;		/* file offset of read_ahead_buffer */
+	size_t					read_ahead_count;		/* number of bytes in read_ahead_buffer */
+	char					*read_ahead_buffer;		/* data already read from the server, or NULL */
+	
 	/* Fields used for HTTP 3xx Redirects */
 	boolean_t				isRedirected;		/* TRUE if this node has been redirected */
 	size_t					redir_name_length;	/* length of redirected name */
@@ -119,6 +139,10 @@ struct node_entry
 #define WEBDAV_DOWNLOAD_STATUS_MASK	0x7fffffff
 #define WEBDAV_DOWNLOAD_TERMINATED	0x80000000
 
+#define WEBDAV_WRITEBACK_DIRTY		0x00000001	/* the cache file has changes the server doesn't have */
+#define WEBDAV_WRITEBACK_BUSY		0x00000002	/* an upload of the cache file is in progress */
+#define WEBDAV_WRITEBACK_QUEUED		0x00000004	/* a request to upload the cache file is in the request queue */
+
 /* node_entry flags */
 enum
 {
@@ -127,7 +151,9 @@ enum
 	nodeInFileListBit		= 1,			/* the node is cached and is on the file list */
 	nodeInFileListMask		= 0x00000002,
 	nodeRecentBit			= 2,			/* the file node was recently created by this client or the directory was recently read */
-	nodeRecentMask			= 0x00000004
+	nodeRecentMask			= 0x00000004,
+	nodeCreatePendingBit	= 3,			/* the file node was created by this client but isn't on the server yet (deferred creation) */
+	nodeCreatePendingMask	= 0x00000008
 };
 
 /*****************************************************************************/
@@ -156,6 +182,8 @@ int node_attributes_valid(
 #define NODE_FILE_RECENTLY_CREATED(node) ( ((node)->node_time != 0) && \
 									  (((node)->flags & nodeRecentMask) != 0) && \
 									  (time(NULL) <= ((node)->node_time + FILE_RECENTLY_CREATED_TIMEOUT)) )
+#define NODE_FILE_CREATE_PENDING(node) ( ((node)->flags & nodeCreatePendingMask) != 0 )
+#define NODE_FILE_WRITEBACK_PENDING(node) filesystem_writeback_pending(node)
 
 /*****************************************************************************/
 
@@ -203,6 +231,13 @@ int nodecache_add_file_cache(
 void nodecache_remove_file_cache(
 	struct node_entry *node);		/* the node_entry to remove file_cache_entry from */
 
+void nodecache_preallocate_file_cache(
+	struct node_entry *node,		/* the node_entry whose cache file will grow */
+	off_t file_length);				/* the length the cache file is expected to reach */
+
+void nodecache_free_read_ahead(
+	struct node_entry *node);		/* the node_entry to free the read-ahead data of */
+
 struct node_entry *nodecache_get_next_file_cache_node(
 	int get_first);					/* if true, return first file cache node; otherwise, the next one */
 
@@ -223,6 +258,32 @@ int nodecache_invalidate_directory_node_time(
 int nodecache_delete_invalid_directory_nodes(
 	struct node_entry *dir_node);	/* parent directory node */
 
+int nodecache_begin_listing(
+	struct node_entry *dir_node);	/* parent directory node */
+
+void nodecache_end_listing(
+	struct node_entry *dir_node);	/* parent directory node */
+
+int nodecache_get_listed_node(
+	struct node_entry *parent,		/* the parent node_entry */
+	size_t name_length,				/* length of name */
+	const char *name,				/* the utf8 name of the node */
+	webdav_filetype_t node_type,	/* the type of node to create */
+	struct node_entry **node);		/* the found (or new) node */
+
+void nodecache_set_create_pending(
+	struct node_entry *node,		/* the file node_entry */
+	int pending);					/* TRUE if the file isn't on the server yet */
+
+int nodecache_has_pending_children(
+	struct node_entry *dir_node);	/* parent directory node */
+
+int nodecache_has_unsynced_descendants(
+	struct node_entry *dir_node);	/* directory node */
+
+int nodecache_terminate_listings(
+	struct node_entry *node);		/* directory node */
+
 CFURLRef nodecache_get_baseURL(void);
 
 CFArrayRef nodecache_get_locktokens(
@@ -35,9 +35,11 @@
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/sysctl.h>
+#include <libkern/OSAtomic.h>
 
 #include "webdav_cache.h"
 #include "webdav_network.h"
+#include "webdav_requestqueue.h"
 #include "OpaqueIDs.h"
 #include "LogMessage.h"
 
@@ -49,6 +51,15 @@ extern uint64_t webdavCacheMaximumSize;
 /*****************************************************************************/
 
 #define WEBDAV_STATFS_TIMEOUT 60	/* Number of seconds statfs_cache_buffer is valid */
+
+/*
+ * When WEBDAV_READs are sequential, filesystem_read reads past each one and
+ * keeps the extra data for the next. The read-ahead starts at the size of the
+ * read (but at least WEBDAV_READ_AHEAD_MIN) and doubles with every sequential
+ * read up to WEBDAV_READ_AHEAD_MAX.
+ */
+#define WEBDAV_READ_AHEAD_MIN 0x00020000	/* 128K */
+#define WEBDAV_READ_AHEAD_MAX 0x00400000	/* 4M */
 static time_t statfs_cache_time;
 static struct statfs statfs_cache_buffer;
 
@@ -57,11 +68,44 @@ int g_vfc_typenum;
 static pthread_mutex_t webdav_cachefile_lock;	/* this mutex protects webdav_cachefile */
 static int webdav_cachefile;	/* file descriptor for an empty, unlinked cache file or -1 */
 
+/*
+ * Write-back of closed files. When gWriteBack is set, the fsync the kernel
+ * sends when it closes a changed file (WEBDAV_FSYNC_WRITEBACK) only marks the
+ * node WEBDAV_WRITEBACK_DIRTY and the cache file stays in the file cache. Once
+ * the file has been closed for gWriteBackDelay seconds, filesystem_writeback_scan
+ * queues its upload on a request thread, so a file that is written and closed
+ * several times in a row is uploaded once. An fsync(2), or any operation that
+ * needs the server to have the file, uploads it right away. A failed upload
+ * never discards the changes: the node stays dirty, and if the server refused
+ * the upload the error is reported by the next open or fsync.
+ *
+ * The changes are only in the cache file, which is unlinked, so they are lost
+ * if the agent crashes before uploading them. A forced unmount that leaves
+ * changes behind copies them to a WRITEBACK_SAVE_TEMPLATE directory instead.
+ */
+#define WEBDAV_WRITEBACK_DRAIN_TIME 30	/* seconds unmount spends starting uploads */
+#define WRITEBACK_SAVE_TEMPLATE _PATH_VARTMP "webdav.unuploaded.XXXXXX"	/* where a forced unmount saves changes */
+
+static pthread_mutex_t writeback_lock;	/* this mutex protects the nodes' writeback fields */
+static pthread_cond_t writeback_condvar;	/* signaled when an upload finishes */
+
+/* statistics for filesystem_log_writeback */
+static int64_t gWriteBackCloses = 0;		/* closes that left the upload to write-back */
+static int64_t gWriteBackCoalesced = 0;		/* closes of a file that was already waiting for its upload */
+static int64_t gWriteBackUploads = 0;		/* uploads done by write-back */
+static int64_t gWriteBackEarlyUploads = 0;	/* waiting uploads done early by fsync or an operation that needed them */
+static int64_t gWriteBackFailures = 0;		/* uploads the server refused (the changes stay in the cache file) */
+
 /*****************************************************************************/
 
 static int get_cachefile(int *fd);
 static void save_cachefile(int fd);
 static int associate_cachefile(int ref, int fd);
+static int writeback_defer(uid_t uid, struct node_entry *node);
+static void writeback_wait(struct node_entry *node);
+static void writeback_cancel(struct node_entry *node);
+static int flush_node(uid_t uid, struct node_entry *node);
+static void terminate_listing(struct node_entry *node);
 
 /*****************************************************************************/
 
@@ -150,6 +194,14 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
+/* filesystem_get_scratch_file returns the fd for an empty, unlinked file in the cache directory */
+int filesystem_get_scratch_file(int *fd)
+{
+	return ( get_cachefile(fd) );
+}
+
+/*****************************************************************************/
+
 /* save_cachefile saves a cache file fd that wasn't needed. If there is already
  * stored a cache file fd, then the input fd is closed (closing will only
  * happen when there there is a race between multiple open requests so it
@@ -206,6 +258,54 @@ sysctl:
 
 /*****************************************************************************/
 
+/*
+ * deferred_create_finished is called after a PUT of a file whose creation
+ * was deferred. The file is on the server now if error is 0. If error is
+ * EEXIST, someone else created a file with the name first and the node
+ * refers to their file now. Otherwise the file still isn't on the server.
+ */
+static void deferred_create_finished(struct node_entry *node, int error)
+{
+	if ( (error == 0) || (error == EEXIST) )
+	{
+		nodecache_set_create_pending(node, FALSE);
+		
+		/* the parent directory changed on the server */
+		(void)nodecache_remove_attributes(node->parent);
+		
+		statfs_cache_time = 0;
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * finish_deferred_create PUTs the cache file of a file whose creation was
+ * deferred so that an operation on the server can find it. It does nothing
+ * if the file is already on the server.
+ */
+static int finish_deferred_create(uid_t uid, struct node_entry *node)
+{
+	int error;
+	off_t file_length;
+	time_t file_last_modified;
+	
+	error = 0;
+	
+	if ( NODE_FILE_CREATE_PENDING(node) )
+	{
+		error = network_fsync(uid, node, &file_length, &file_last_modified);
+		deferred_create_finished(node, error);
+		
+		/* the attributes synthesized by filesystem_create are out of date */
+		(void)nodecache_remove_attributes(node);
+	}
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
 int filesystem_init(int typenum)
 {
 	pthread_mutexattr_t mutexattr;
@@ -225,7 +325,14 @@ int filesystem_init(int typenum)
 	
 	error = pthread_mutex_init(&webdav_cachefile_lock, &mutexattr);
 	require_noerr(error, pthread_mutex_init);
+	
+	error = pthread_mutex_init(&writeback_lock, &mutexattr);
+	require_noerr(error, pthread_mutex_init);
+	
+	error = pthread_cond_init(&writeback_condvar, NULL);
+	require_noerr(error, pthread_cond_init);
 
+pthread_cond_init:
 pthread_mutex_init:
 pthread_mutexattr_init:
 
@@ -251,6 +358,16 @@ int filesystem_open(struct webdav_request_open *request_open,
 	
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 	
+	if ( node->node_type == WEBDAV_FILE_TYPE )
+	{
+		/* report an upload the server refused -- the changes are still waiting in the cache file */
+		pthread_mutex_lock(&writeback_lock);
+		error = node->writeback_error;
+		node->writeback_error = 0;
+		pthread_mutex_unlock(&writeback_lock);
+		require_noerr_quiet(error, writeback_refused);
+	}
+	
 	/* get a cache file */
 	theCacheFile = -1;
 	error = get_cachefile(&theCacheFile);
@@ -260,6 +377,18 @@ int filesystem_open(struct webdav_request_open *request_open,
 	{
 		int write_mode;
 		
+		/*
+		 * The kernel can't change the cache file while write-back is uploading
+		 * it. Marking it active here keeps a queued upload from starting.
+		 */
+		pthread_mutex_lock(&writeback_lock);
+		writeback_wait(node);
+		if ( NODE_FILE_IS_CACHED(node) )
+		{
+			node->file_inactive_time = 0;
+		}
+		pthread_mutex_unlock(&writeback_lock);
+		
 		if ( NODE_FILE_IS_CACHED(node) )
 		{
 			/* save the cache file we didn't need */
@@ -288,7 +417,15 @@ int filesystem_open(struct webdav_request_open *request_open,
 			else if (request_open->flags & O_EXLOCK)
 				lockType = 0;
 
-			error = network_lock(request_open->pcr.pcr_uid, lockType, FALSE, node);
+			/*
+			 * A LOCK of a file that isn't on the server yet would create it
+			 * (RFC 4918, section 7.3) and defeat deferred creation. The
+			 * If-None-Match on the PUT that creates it guards it instead.
+			 */
+			if ( !NODE_FILE_CREATE_PENDING(node) )
+			{
+				error = network_lock(request_open->pcr.pcr_uid, lockType, FALSE, node);
+			}
 			if ( error == ENOENT )
 			{
 				/* the server says it's gone so delete it and its descendants */
@@ -361,10 +498,17 @@ ftruncate:
 
 		/* remove it from the file cache */
 		nodecache_remove_file_cache(node);
+		
+		/* a cache file write-back hasn't uploaded stays in the file cache, closed */
+		if ( NODE_FILE_IS_CACHED(node) )
+		{
+			node->file_inactive_time = time(NULL);
+		}
 	}
 
 nodecache_add_file_cache:
 get_cachefile:
+writeback_refused:
 deleted_node:
 bad_obj_id:
 	
@@ -385,6 +529,12 @@ int filesystem_close(struct webdav_request_close *request_close)
 	/* Trying to close something we did not open? */
 	require_action(NODE_FILE_IS_CACHED(node), not_open, error = EBADF);
 	
+	/* learn how much of files like this one are read */
+	if ( node->node_type == WEBDAV_FILE_TYPE )
+	{
+		network_learn_first_read_len(node, request_close->read_frontier);
+	}
+	
 	/* Kill any threads that may be downloading data for this file */
 	if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS )
 	{
@@ -397,6 +547,9 @@ int filesystem_close(struct webdav_request_close *request_close)
 		usleep(10000);	/* 10 milliseconds */
 	}
 
+	/* the read-ahead data (if any) is only kept while the file is open */
+	nodecache_free_read_ahead(node);
+	
 	/* set the file_inactive_time  */
 	time(&node->file_inactive_time);
 
@@ -407,6 +560,29 @@ int filesystem_close(struct webdav_request_close *request_close)
 		node->put_ctx = NULL;
 	}
 	
+	/* a file that was created and closed without an fsync appears on the server now (or with write-back, soon) */
+	if ( (error == 0) && NODE_FILE_CREATE_PENDING(node) && !NODE_IS_DELETED(node) && gWriteBack )
+	{
+		int dirty;
+		
+		pthread_mutex_lock(&writeback_lock);
+		dirty = ((node->writeback_status & WEBDAV_WRITEBACK_DIRTY) != 0);
+		pthread_mutex_unlock(&writeback_lock);
+		if ( !dirty )
+		{
+			error = writeback_defer(request_close->pcr.pcr_uid, node);
+		}
+	}
+	else if ( (error == 0) && NODE_FILE_CREATE_PENDING(node) && !NODE_IS_DELETED(node) )
+	{
+		error = finish_deferred_create(request_close->pcr.pcr_uid, node);
+		if ( (error != 0) && (error != EEXIST) )
+		{
+			/* the file never made it to the server, so there's nothing left to refer to */
+			(void) nodecache_delete_node(node, FALSE);
+		}
+	}
+	
 	
 	lock_node_cache();
 	locked = true;
@@ -552,12 +728,47 @@ out:
 
 /*****************************************************************************/
 
+/* fills in reply_getattr from the node's cached attributes */
+static void fill_getattr_reply(struct node_entry *node, struct webdav_reply_getattr *reply_getattr)
+{
+	struct webdav_stat *wstat;
+	
+	wstat = &reply_getattr->obj_attr;
+	
+	wstat->st_dev = node->attr_stat_info.attr_stat.st_dev;
+	wstat->st_ino = (webdav_ino_t) node->attr_stat_info.attr_stat.st_ino;
+	wstat->st_mode = node->attr_stat_info.attr_stat.st_mode;
+	wstat->st_nlink = node->attr_stat_info.attr_stat.st_nlink;
+	wstat->st_uid = node->attr_stat_info.attr_stat.st_uid;
+	wstat->st_gid = node->attr_stat_info.attr_stat.st_gid;
+	wstat->st_rdev = node->attr_stat_info.attr_stat.st_rdev;
+	
+	wstat->st_atimespec.tv_sec = node->attr_stat_info.attr_stat.st_atimespec.tv_sec;
+	wstat->st_atimespec.tv_nsec = node->attr_stat_info.attr_stat.st_atimespec.tv_nsec;
+	
+	wstat->st_mtimespec.tv_sec = node->attr_stat_info.attr_stat.st_mtimespec.tv_sec;
+	wstat->st_mtimespec.tv_nsec = node->attr_stat_info.attr_stat.st_mtimespec.tv_nsec;
+	
+	wstat->st_ctimespec.tv_sec = node->attr_stat_info.attr_stat.st_ctimespec.tv_sec;
+	wstat->st_ctimespec.tv_nsec = node->attr_stat_info.attr_stat.st_ctimespec.tv_nsec;
+	
+	wstat->st_createtimespec.tv_sec = node->attr_stat_info.attr_create_time.tv_sec;
+	wstat->st_createtimespec.tv_nsec = node->attr_stat_info.attr_create_time.tv_nsec;		
+	
+	wstat->st_size = node->attr_stat_info.attr_stat.st_size;
+	wstat->st_blocks = node->attr_stat_info.attr_stat.st_blocks;
+	wstat->st_blksize = node->attr_stat_info.attr_stat.st_blksize;
+	wstat->st_flags = node->attr_stat_info.attr_stat.st_flags;
+	wstat->st_gen = node->attr_stat_info.attr_stat.st_gen;
+}
+
+/*****************************************************************************/
+
 int filesystem_getattr(struct webdav_request_getattr *request_getattr, struct webdav_reply_getattr *reply_getattr)
 {
 	int error;
 	struct node_entry *node;
 	struct webdav_stat_attr statbuf;
-	struct webdav_stat *wstat;
 	
 	error = RetrieveDataFromOpaqueID(request_getattr->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
@@ -583,33 +794,7 @@ int filesystem_getattr(struct webdav_request_getattr *request_getattr, struct we
 	if ( !error )
 	{
 		/* we have the attributes cached */
-		wstat = &reply_getattr->obj_attr;
-		
-		wstat->st_dev = node->attr_stat_info.attr_stat.st_dev;
-		wstat->st_ino = (webdav_ino_t) node->attr_stat_info.attr_stat.st_ino;
-		wstat->st_mode = node->attr_stat_info.attr_stat.st_mode;
-		wstat->st_nlink = node->attr_stat_info.attr_stat.st_nlink;
-		wstat->st_uid = node->attr_stat_info.attr_stat.st_uid;
-		wstat->st_gid = node->attr_stat_info.attr_stat.st_gid;
-		wstat->st_rdev = node->attr_stat_info.attr_stat.st_rdev;
-		
-		wstat->st_atimespec.tv_sec = node->attr_stat_info.attr_stat.st_atimespec.tv_sec;
-		wstat->st_atimespec.tv_nsec = node->attr_stat_info.attr_stat.st_atimespec.tv_nsec;
-		
-		wstat->st_mtimespec.tv_sec = node->attr_stat_info.attr_stat.st_mtimespec.tv_sec;
-		wstat->st_mtimespec.tv_nsec = node->attr_stat_info.attr_stat.st_mtimespec.tv_nsec;
-		
-		wstat->st_ctimespec.tv_sec = node->attr_stat_info.attr_stat.st_ctimespec.tv_sec;
-		wstat->st_ctimespec.tv_nsec = node->attr_stat_info.attr_stat.st_ctimespec.tv_nsec;
-		
-		wstat->st_createtimespec.tv_sec = node->attr_stat_info.attr_create_time.tv_sec;
-		wstat->st_createtimespec.tv_nsec = node->attr_stat_info.attr_create_time.tv_nsec;		
-		
-		wstat->st_size = node->attr_stat_info.attr_stat.st_size;
-		wstat->st_blocks = node->attr_stat_info.attr_stat.st_blocks;
-		wstat->st_blksize = node->attr_stat_info.attr_stat.st_blksize;
-		wstat->st_flags = node->attr_stat_info.attr_stat.st_flags;
-		wstat->st_gen = node->attr_stat_info.attr_stat.st_gen;
+		fill_getattr_reply(node, reply_getattr);
 	}
 	
 deleted_node:
@@ -620,6 +805,96 @@ bad_obj_id:
 
 /*****************************************************************************/
 
+/* the state of a getattr request started by filesystem_getattr_async */
+struct getattr_async
+{
+	opaque_id obj_id;						/* the node's opaque ID */
+	uid_t uid;								/* the uid of the user making the request */
+	filesystem_getattr_complete complete;	/* the caller's completion function */
+	void *context;							/* passed to complete */
+};
+
+static void getattr_async_done(void *context, int error, struct webdav_stat_attr *statbuf)
+{
+	struct getattr_async *getattr;
+	struct node_entry *node;
+	struct webdav_reply_getattr reply_getattr;
+	
+	getattr = (struct getattr_async *)context;
+	bzero(&reply_getattr, sizeof(reply_getattr));
+	
+	if ( error == 0 )
+	{
+		/* the node may have gone away while the PROPFIND was in flight */
+		error = RetrieveDataFromOpaqueID(getattr->obj_id, (void **)&node);
+		if ( (error != 0) || NODE_IS_DELETED(node) )
+		{
+			error = ESTALE;
+		}
+		else
+		{
+			/* cache the attributes */
+			error = nodecache_add_attributes(node, getattr->uid, statbuf, NULL);
+			if ( error == 0 )
+			{
+				fill_getattr_reply(node, &reply_getattr);
+			}
+		}
+	}
+	
+	getattr->complete(getattr->context, error, &reply_getattr);
+	free(getattr);
+}
+
+/*
+ * filesystem_getattr_async starts a getattr request that needs a round trip to
+ * the server without blocking the calling thread. It returns FALSE if the
+ * request should be handled by filesystem_getattr instead (the cached attributes
+ * are valid, or the request can't be sent asynchronously). If TRUE is returned,
+ * complete is called with the reply once it arrives; an EAGAIN error means
+ * the request must be finished by filesystem_getattr.
+ */
+int filesystem_getattr_async(struct webdav_request_getattr *request_getattr,
+		filesystem_getattr_complete complete, void *context)
+{
+	int error;
+	struct node_entry *node;
+	struct getattr_async *getattr;
+	
+	error = RetrieveDataFromOpaqueID(request_getattr->obj_id, (void **)&node);
+	require_noerr_quiet(error, bad_obj_id);
+	
+	require_quiet(!NODE_IS_DELETED(node), deleted_node);
+	
+	require_quiet(!node_attributes_valid(node, request_getattr->pcr.pcr_uid), attributes_valid);
+	
+	getattr = malloc(sizeof(struct getattr_async));
+	require(getattr != NULL, malloc_getattr);
+	
+	getattr->obj_id = request_getattr->obj_id;
+	getattr->uid = request_getattr->pcr.pcr_uid;
+	getattr->complete = complete;
+	getattr->context = context;
+	
+	error = network_getattr_async(request_getattr->pcr.pcr_uid, node, getattr_async_done, getattr);
+	require_noerr_quiet(error, network_getattr_async);
+	
+	return ( TRUE );
+
+network_getattr_async:
+
+	free(getattr);
+
+malloc_getattr:
+attributes_valid:
+deleted_node:
+bad_obj_id:
+	
+	return ( FALSE );
+}
+
+/*****************************************************************************/
+
 int filesystem_statfs(struct webdav_request_statfs *request_statfs,
 		struct webdav_reply_statfs *reply_statfs)
 {
@@ -714,7 +989,20 @@ int filesystem_create(struct webdav_request_create *request_create, struct webda
 	
 	require_action_quiet(!NODE_IS_DELETED(parent_node), deleted_node, error = ESTALE);
 	
-	error = network_create(request_create->pcr.pcr_uid, parent_node, request_create->name, request_create->name_length, &creation_date);
+	if ( gLazyCreate )
+	{
+		/*
+		 * Deferred creation: the file is created on the server by the PUT
+		 * at its first fsync or close, so skip the empty PUT. The server
+		 * hasn't changed yet, so the parent_node's attributes are still good.
+		 */
+		creation_date = time(NULL);
+		error = 0;
+	}
+	else
+	{
+		error = network_create(request_create->pcr.pcr_uid, parent_node, request_create->name, request_create->name_length, &creation_date);
+	}
 	
 	// Translate ENOENT to workaround VFS bug:
 	// <rdar://problem/6965993> 10A383: WebDAV FS hangs on open with Microsoft servers (unsupported characters)
@@ -726,8 +1014,13 @@ int filesystem_create(struct webdav_request_create *request_create, struct webda
 	{
 		/*
 		 * we just changed the parent_node so update or remove its attributes
+		 * (with deferred creation, the parent_node is unchanged until the file is on the server)
 		 */
-		if ( (creation_date != -1) &&	/* if we know when the creation occurred */
+		if ( gLazyCreate )
+		{
+			/* nothing to do */
+		}
+		else if ( (creation_date != -1) &&	/* if we know when the creation occurred */
 			 (parent_node->attr_stat_info.attr_stat.st_mtimespec.tv_sec <= creation_date) &&	/* and that time is later than what's cached */
 			 node_attributes_valid(parent_node, request_create->pcr.pcr_uid) )	/* and the cache is valid */
 		{
@@ -797,6 +1090,20 @@ int filesystem_create(struct webdav_request_create *request_create, struct webda
 				time(&node->file_inactive_time);
 			}
 			
+			if ( gLazyCreate )
+			{
+				if ( error == 0 )
+				{
+					/* the cache file is the file until its first fsync or close */
+					nodecache_set_create_pending(node, TRUE);
+				}
+				else
+				{
+					/* the file isn't on the server, so don't leave a node for it */
+					(void) nodecache_delete_node(node, FALSE);
+				}
+			}
+			
 			reply_create->obj_id = node->nodeid;
 			reply_create->obj_fileid = node->fileid;
 		}
@@ -898,6 +1205,17 @@ int filesystem_read(struct webdav_request_read *request_read, char **a_byte_addr
 {
 	int error;
 	struct node_entry *node;
+	off_t offset;
+	size_t count;
+	size_t buffered;
+	size_t read_ahead;
+	char *bytes;
+	char *network_bytes;
+	size_t network_count;
+	
+	*a_byte_addr = NULL;
+	*a_size = 0;
+	bytes = NULL;
 	
 	error = RetrieveDataFromOpaqueID(request_read->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
@@ -905,9 +1223,103 @@ int filesystem_read(struct webdav_request_read *request_read, char **a_byte_addr
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
 
 	// Note: request_read->count has already been checked for overflow
-	error = network_read(request_read->pcr.pcr_uid, node,
-		request_read->offset, (size_t)request_read->count, a_byte_addr, a_size);
+	offset = request_read->offset;
+	count = (size_t)request_read->count;
+	
+	lock_node_cache();
+	
+	/* copy whatever the read-ahead buffer has from the start of the range */
+	buffered = 0;
+	if ( (node->read_ahead_buffer != NULL) && (offset >= node->read_ahead_offset) &&
+		(offset < (node->read_ahead_offset + (off_t)node->read_ahead_count)) )
+	{
+		bytes = malloc(count);
+		if ( bytes != NULL )
+		{
+			buffered = MIN(count, (size_t)(node->read_ahead_offset + (off_t)node->read_ahead_count - offset));
+			memcpy(bytes, node->read_ahead_buffer + (offset - node->read_ahead_offset), buffered);
+		}
+	}
+	
+	/* grow the read-ahead while the reads are sequential; stop it when they aren't */
+	if ( offset == node->read_next_offset )
+	{
+		if ( node->read_ahead_size == 0 )
+		{
+			node->read_ahead_size = MIN(MAX(count, WEBDAV_READ_AHEAD_MIN), WEBDAV_READ_AHEAD_MAX);
+		}
+		else
+		{
+			node->read_ahead_size = MIN(node->read_ahead_size * 2, WEBDAV_READ_AHEAD_MAX);
+		}
+	}
+	else
+	{
+		node->read_ahead_size = 0;
+	}
+	read_ahead = node->read_ahead_size;
+	node->read_next_offset = offset + (off_t)count;
+	
+	unlock_node_cache();
+	
+	if ( buffered < count )
+	{
+		/* get the rest of the range, and the read-ahead, from the server */
+		error = network_read(request_read->pcr.pcr_uid, node,
+			offset + (off_t)buffered, count - buffered + read_ahead, &network_bytes, &network_count);
+		require_noerr_quiet(error, network_read);
+		
+		if ( (bytes == NULL) && (network_count <= count) )
+		{
+			/* nothing came from the read-ahead buffer and nothing was read past the range */
+			*a_byte_addr = network_bytes;
+			*a_size = network_count;
+			goto done;
+		}
+		
+		if ( bytes == NULL )
+		{
+			bytes = malloc(count);
+			require_action(bytes != NULL, malloc_bytes, free(network_bytes); error = ENOMEM);
+		}
+		memcpy(bytes + buffered, network_bytes, MIN(network_count, count - buffered));
+		*a_size = buffered + MIN(network_count, count - buffered);
+		
+		if ( network_count > (count - buffered) )
+		{
+			/* keep what was read past the range for the next WEBDAV_READ */
+			lock_node_cache();
+			if ( node->read_ahead_buffer != NULL )
+			{
+				free(node->read_ahead_buffer);
+			}
+			node->read_ahead_buffer = network_bytes;
+			node->read_ahead_offset = offset + (off_t)buffered;
+			node->read_ahead_count = network_count;
+			unlock_node_cache();
+		}
+		else
+		{
+			free(network_bytes);
+		}
+	}
+	else
+	{
+		*a_size = count;
+	}
+	
+	*a_byte_addr = bytes;
+	bytes = NULL;
+
+malloc_bytes:
+network_read:
 
+	if ( bytes != NULL )
+	{
+		free(bytes);
+	}
+
+done:
 deleted_node:
 bad_obj_id:
 
@@ -959,6 +1371,12 @@ int filesystem_rename(struct webdav_request_rename *request_rename)
 		error = 0;
 	}
 	
+	if ( !error )
+	{
+		/* the server can't MOVE a file it doesn't have (or doesn't have all of) yet */
+		error = flush_node(request_rename->pcr.pcr_uid, f_node);
+	}
+	
 	if ( !error )
 	{
 		error = network_rename(request_rename->pcr.pcr_uid, f_node, t_node,
@@ -1028,38 +1446,158 @@ bad_from_obj_id:
 
 /*****************************************************************************/
 
-int filesystem_remove(struct webdav_request_remove *request_remove)
+int filesystem_copyfile(struct webdav_request_copyfile *request_copyfile)
 {
-	int error;
-	struct node_entry *node;
-	time_t remove_date;
-	
-	error = RetrieveDataFromOpaqueID(request_remove->obj_id, (void **)&node);
-	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+	int error = 0;
+	struct node_entry *f_node;
+	struct node_entry *t_node;
+	struct node_entry *parent_node;
+	time_t copy_date;
 
-	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
-	
-	error = network_remove(request_remove->pcr.pcr_uid, node, &remove_date);
+	error = RetrieveDataFromOpaqueID(request_copyfile->from_obj_id, (void **)&f_node);
+	require_noerr_action_quiet(error, bad_from_obj_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(f_node), deleted_node, error = ESTALE);
 	
-	/*
-	 *  When connected to an Mac OS X Server, I can delete the main file (ie blah.dmg), but when I try
-	 *  to delete the ._ file (ie ._blah.dmg), I get a file not found error since the vfs layer on the
-	 *  server already deleted the ._ file.  Since I am deleting the ._ anyways, the ENOENT is ok and I
-	 *  should still clean up. 
-	 */
-	if ( (!error) || (error == ENOENT) )
+	error = RetrieveDataFromOpaqueID(request_copyfile->to_dir_id, (void **)&parent_node);
+	require_noerr_action_quiet(error, bad_to_dir_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(parent_node), deleted_node, error = ESTALE);
+
+	if ( request_copyfile->to_obj_id != kInvalidOpaqueID )
 	{
-		/*
-		 * we just changed the parent_node so update or remove its attributes
-		 */
-		if ( (remove_date != -1) &&	/* if we know when the creation occurred */
-			 (node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec <= remove_date) &&	/* and that time is later than what's cached */
-			 node_attributes_valid(node->parent, request_remove->pcr.pcr_uid) )	/* and the cache is valid */
+		/* "to" exists */
+		error = RetrieveDataFromOpaqueID(request_copyfile->to_obj_id, (void **)&t_node);
+		require_noerr_action_quiet(error, bad_to_obj_id, error = ESTALE);
+		
+		require_action_quiet(!NODE_IS_DELETED(t_node), deleted_node, error = ESTALE);
+		
+		if ( !request_copyfile->overwrite )
 		{
-			/* update the times of the cached attributes */
-			node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec = remove_date;
-			node->parent->attr_stat_info.attr_stat.st_atimespec = node->parent->attr_stat_info.attr_stat.st_ctimespec = node->parent->attr_stat_info.attr_stat.st_mtimespec;
-			node->parent->attr_time = time(NULL);
+			error = EEXIST;
+		}
+		else if ( f_node->node_type != t_node->node_type )
+		{
+			/* "from" and "to" must be the same file_type */
+			error = (f_node->node_type == WEBDAV_FILE_TYPE) ? EISDIR : ENOTDIR;
+		}
+		else
+		{
+			error = 0;
+		}
+	}
+	else
+	{
+		t_node = NULL;
+		error = 0;
+	}
+	
+	if ( !error )
+	{
+		/* the server can't COPY a file it doesn't have (or doesn't have all of) yet */
+		error = flush_node(request_copyfile->pcr.pcr_uid, f_node);
+	}
+	
+	if ( !error && (f_node->node_type == WEBDAV_DIR_TYPE) && nodecache_has_unsynced_descendants(f_node) )
+	{
+		/* the server's copy of the tree would be stale or missing files, so have copyfile copy it here */
+		error = ENOTSUP;
+	}
+	
+	if ( !error )
+	{
+		error = network_copy(request_copyfile->pcr.pcr_uid, f_node, t_node, parent_node,
+			request_copyfile->to_name, request_copyfile->to_name_length, request_copyfile->overwrite, &copy_date);
+		if ( !error )
+		{
+			/*
+			 * we just changed the destination directory so update or remove its attributes
+			 */
+			if ( (copy_date != -1) &&	/* if we know when the copy occurred */
+				 (parent_node->attr_stat_info.attr_stat.st_mtimespec.tv_sec <= copy_date) &&	/* and that time is later than what's cached */
+				 node_attributes_valid(parent_node, request_copyfile->pcr.pcr_uid) )	/* and the cache is valid */
+			{
+				/* update the times of the cached attributes */
+				parent_node->attr_stat_info.attr_stat.st_mtimespec.tv_sec = copy_date;
+				parent_node->attr_stat_info.attr_stat.st_atimespec = parent_node->attr_stat_info.attr_stat.st_ctimespec = parent_node->attr_stat_info.attr_stat.st_mtimespec;
+				parent_node->attr_time = time(NULL);
+			}
+			else
+			{
+				/* remove the attributes */
+				(void)nodecache_remove_attributes(parent_node);
+			}
+			
+			/*
+			 * The node (and any cached data) for the object that was replaced is
+			 * stale. The copy gets a node of its own when it's looked up.
+			 */
+			if ( t_node != NULL )
+			{
+				if ( nodecache_delete_node(t_node, FALSE) != 0 )
+				{
+					debug_string("nodecache_delete_node failed");
+				}
+			}
+			
+			statfs_cache_time = 0;
+		}
+	}
+
+deleted_node:
+bad_to_obj_id:
+bad_to_dir_id:
+bad_from_obj_id:
+	
+	return (error);
+}
+
+/*****************************************************************************/
+
+int filesystem_remove(struct webdav_request_remove *request_remove)
+{
+	int error;
+	struct node_entry *node;
+	time_t remove_date;
+	
+	error = RetrieveDataFromOpaqueID(request_remove->obj_id, (void **)&node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	/* there's no point uploading changes to a file that's being removed */
+	writeback_cancel(node);
+	
+	if ( NODE_FILE_CREATE_PENDING(node) )
+	{
+		/* the file never made it to the server, so there's nothing to DELETE */
+		remove_date = -1;
+		error = 0;
+	}
+	else
+	{
+		error = network_remove(request_remove->pcr.pcr_uid, node, &remove_date);
+	}
+	
+	/*
+	 *  When connected to an Mac OS X Server, I can delete the main file (ie blah.dmg), but when I try
+	 *  to delete the ._ file (ie ._blah.dmg), I get a file not found error since the vfs layer on the
+	 *  server already deleted the ._ file.  Since I am deleting the ._ anyways, the ENOENT is ok and I
+	 *  should still clean up. 
+	 */
+	if ( (!error) || (error == ENOENT) )
+	{
+		/*
+		 * we just changed the parent_node so update or remove its attributes
+		 */
+		if ( (remove_date != -1) &&	/* if we know when the creation occurred */
+			 (node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec <= remove_date) &&	/* and that time is later than what's cached */
+			 node_attributes_valid(node->parent, request_remove->pcr.pcr_uid) )	/* and the cache is valid */
+		{
+			/* update the times of the cached attributes */
+			node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec = remove_date;
+			node->parent->attr_stat_info.attr_stat.st_atimespec = node->parent->attr_stat_info.attr_stat.st_ctimespec = node->parent->attr_stat_info.attr_stat.st_mtimespec;
+			node->parent->attr_time = time(NULL);
 		}
 		else
 		{
@@ -1093,6 +1631,12 @@ int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir)
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	/* the server doesn't know about files waiting for deferred creation, but they're in the directory */
+	require_action_quiet(!nodecache_has_pending_children(node), not_empty, error = ENOTEMPTY);
+	
+	/* a listing still arriving in the background must not add children to (or delete them from) a deleted node */
+	terminate_listing(node);
 		
 	/*
 	 * network_rmdir ensures the directory on the server is empty (which is what really matters)
@@ -1129,6 +1673,7 @@ int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir)
 		statfs_cache_time = 0;
 	}
 	
+not_empty:
 deleted_node:
 bad_obj_id:
 
@@ -1137,25 +1682,97 @@ bad_obj_id:
 
 /*****************************************************************************/
 
-int filesystem_fsync(struct webdav_request_fsync *request_fsync)
+int filesystem_rmtree(struct webdav_request_rmtree *request_rmtree)
 {
 	int error;
 	struct node_entry *node;
-	off_t file_length;
-	time_t file_last_modified;
-	
-	error = RetrieveDataFromOpaqueID(request_fsync->obj_id, (void **)&node);
+	time_t remove_date;
+
+	error = RetrieveDataFromOpaqueID(request_rmtree->obj_id, (void **)&node);
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	require_action_quiet(node->node_type == WEBDAV_DIR_TYPE, not_dir, error = ENOTDIR);
+	
+	/* listings still arriving in the background must not add children to (or delete them from) deleted nodes */
+	while ( nodecache_terminate_listings(node) )
+	{
+		/* wait for the listing threads to acknowledge that we stopped */
+		usleep(10000);	/* 10 milliseconds */
+	}
+	
+	/* the server removes the directory and everything in it with one DELETE request */
+	error = network_rmtree(request_rmtree->pcr.pcr_uid, node, &remove_date);
+	if ( !error )
+	{
+		/*
+		 * we just changed the parent_node so update or remove its attributes
+		 */
+		if ( (remove_date != -1) &&	/* if we know when the creation occurred */
+			 (node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec <= remove_date) &&	/* and that time is later than what's cached */
+			 node_attributes_valid(node->parent, request_rmtree->pcr.pcr_uid) )	/* and the cache is valid */
+		{
+			/* update the times of the cached attributes */
+			node->parent->attr_stat_info.attr_stat.st_mtimespec.tv_sec = remove_date;
+			node->parent->attr_stat_info.attr_stat.st_atimespec = node->parent->attr_stat_info.attr_stat.st_ctimespec = node->parent->attr_stat_info.attr_stat.st_mtimespec;
+			node->parent->attr_time = time(NULL);
+		}
+		else
+		{
+			/* remove the attributes */
+			(void)nodecache_remove_attributes(node->parent);
+		}
 		
-	/* Trying to fsync something that's not open? */
-	require_action(NODE_FILE_IS_CACHED(node), not_open, error = EBADF);
+		/* the whole subtree is gone on the server, so prune it from the cache */
+		if ( nodecache_delete_node(node, TRUE) != 0 )
+		{
+			debug_string("nodecache_delete_node failed");
+		}
+		
+		statfs_cache_time = 0;
+	}
+	else if ( error == EBUSY )
+	{
+		/*
+		 * The server returned a multistatus reply: some of the tree was
+		 * removed and some wasn't. We don't know which children are left, so
+		 * forget the cached attributes and make the next readdir of the
+		 * directory prune the children that no longer exist.
+		 */
+		(void)nodecache_remove_attributes(node->parent);
+		(void)nodecache_remove_attributes(node);
+		(void)nodecache_invalidate_directory_node_time(node);
+		
+		statfs_cache_time = 0;
+	}
 	
-	/* The kernel should not send us an fsync until the file is downloaded */
-	require_action((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED, still_downloading, error = EIO);
+not_dir:
+deleted_node:
+bad_obj_id:
+
+	return (error);
+}
+
+/*****************************************************************************/
 
-	error = network_fsync(request_fsync->pcr.pcr_uid, node, &file_length, &file_last_modified);
+/*
+ * fsync_node PUTs the cache file of node to the server and caches the
+ * attributes the server reported for it.
+ */
+static int fsync_node(uid_t uid, struct node_entry *node)
+{
+	int error;
+	off_t file_length;
+	time_t file_last_modified;
+	
+	error = network_fsync(uid, node, &file_length, &file_last_modified);
+	
+	if ( NODE_FILE_CREATE_PENDING(node) )
+	{
+		/* this PUT was the deferred creation of the file */
+		deferred_create_finished(node, error);
+	}
 	
 	if ( (file_length == -1) || (file_last_modified == -1) )
 	{
@@ -1191,11 +1808,228 @@ int filesystem_fsync(struct webdav_request_fsync *request_fsync)
 		statbuf.attr_stat.st_gen = 0;
 
 		/* cache the attributes */
-		error = nodecache_add_attributes(node, request_fsync->pcr.pcr_uid, &statbuf, NULL);
+		error = nodecache_add_attributes(node, uid, &statbuf, NULL);
 	}
 	
 	/* and we changed the volume so invalidate the statfs cache */
 	statfs_cache_time = 0;
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * writeback_defer marks the cache file of node as changed and leaves its
+ * upload to write-back. Until the upload is done, the attributes of node come
+ * from the cache file.
+ */
+static int writeback_defer(uid_t uid, struct node_entry *node)
+{
+	int error;
+	struct stat cachestat;
+	struct webdav_stat_attr statbuf;
+	
+	require_action(fstat(node->file_fd, &cachestat) == 0, fstat, error = errno);
+	
+	bzero((void *)&statbuf, sizeof(struct webdav_stat_attr));
+	
+	statbuf.attr_stat.st_dev = 0;
+	statbuf.attr_stat.st_ino = node->fileid;
+	statbuf.attr_stat.st_mode = S_IFREG | S_IRWXU;
+	statbuf.attr_stat.st_nlink = 1;
+	statbuf.attr_stat.st_uid = UNKNOWNUID;
+	statbuf.attr_stat.st_gid = UNKNOWNUID;
+	statbuf.attr_stat.st_rdev = 0;
+	statbuf.attr_create_time = node->attr_stat_info.attr_create_time;
+	statbuf.attr_stat.st_mtimespec = cachestat.st_mtimespec;
+	statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_ctimespec = statbuf.attr_stat.st_mtimespec;
+	statbuf.attr_stat.st_size = cachestat.st_size;
+	statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
+	statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
+	statbuf.attr_stat.st_flags = 0;
+	statbuf.attr_stat.st_gen = 0;
+	
+	pthread_mutex_lock(&writeback_lock);
+	
+	if ( node->writeback_status & WEBDAV_WRITEBACK_DIRTY )
+	{
+		++gWriteBackCoalesced;
+	}
+	++gWriteBackCloses;
+	node->writeback_status |= WEBDAV_WRITEBACK_DIRTY;
+	node->writeback_time = time(NULL);
+	node->writeback_uid = uid;
+	
+	pthread_mutex_unlock(&writeback_lock);
+	
+	/* the attributes are valid until the upload is done (see node_attributes_valid) */
+	error = nodecache_add_attributes(node, uid, &statbuf, NULL);
+	
+	statfs_cache_time = 0;
+
+fstat:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* waits for an upload of node's cache file that is in progress -- call with writeback_lock held */
+static void writeback_wait(struct node_entry *node)
+{
+	while ( node->writeback_status & WEBDAV_WRITEBACK_BUSY )
+	{
+		pthread_cond_wait(&writeback_condvar, &writeback_lock);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * writeback_flush uploads the cache file of node right away if write-back is
+ * waiting to upload it. Operations that need the server to have the latest
+ * contents of the file call it first.
+ */
+static int writeback_flush(struct node_entry *node)
+{
+	int error;
+	int dirty;
+	uid_t uid;
+	
+	error = 0;
+	
+	/* an upload that's queued but not started finds nothing to do */
+	pthread_mutex_lock(&writeback_lock);
+	writeback_wait(node);
+	dirty = ((node->writeback_status & WEBDAV_WRITEBACK_DIRTY) != 0);
+	uid = node->writeback_uid;
+	if ( dirty )
+	{
+		node->writeback_status &= ~WEBDAV_WRITEBACK_DIRTY;
+		node->writeback_status |= WEBDAV_WRITEBACK_BUSY;
+		++gWriteBackEarlyUploads;
+	}
+	pthread_mutex_unlock(&writeback_lock);
+	
+	if ( dirty )
+	{
+		error = fsync_node(uid, node);
+		
+		pthread_mutex_lock(&writeback_lock);
+		node->writeback_status &= ~WEBDAV_WRITEBACK_BUSY;
+		if ( error != 0 )
+		{
+			/* still not on the server */
+			node->writeback_status |= WEBDAV_WRITEBACK_DIRTY;
+		}
+		else
+		{
+			node->writeback_error = 0;
+		}
+		pthread_cond_broadcast(&writeback_condvar);
+		pthread_mutex_unlock(&writeback_lock);
+	}
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* forgets about any changes write-back hasn't uploaded yet (the file is going away) */
+static void writeback_cancel(struct node_entry *node)
+{
+	pthread_mutex_lock(&writeback_lock);
+	/* an upload that's queued but not started finds nothing to do */
+	node->writeback_status &= ~WEBDAV_WRITEBACK_DIRTY;
+	writeback_wait(node);
+	node->writeback_error = 0;
+	pthread_mutex_unlock(&writeback_lock);
+}
+
+/*****************************************************************************/
+
+/*
+ * flush_node makes sure the server has the file of node with its latest
+ * contents before an operation on the server uses it.
+ */
+static int flush_node(uid_t uid, struct node_entry *node)
+{
+	int error;
+	
+	error = writeback_flush(node);
+	if ( error == 0 )
+	{
+		error = finish_deferred_create(uid, node);
+	}
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+int filesystem_fsync(struct webdav_request_fsync *request_fsync)
+{
+	int error;
+	int was_dirty;
+	struct node_entry *node;
+	
+	error = RetrieveDataFromOpaqueID(request_fsync->obj_id, (void **)&node);
+	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
+
+	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+		
+	/* Trying to fsync something that's not open? */
+	require_action(NODE_FILE_IS_CACHED(node), not_open, error = EBADF);
+	
+	/* The kernel should not send us an fsync until the file is downloaded */
+	require_action((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED, still_downloading, error = EIO);
+
+	if ( gWriteBack && (request_fsync->flags & WEBDAV_FSYNC_WRITEBACK) )
+	{
+		/* the file is being closed and its changes are safe in the cache file -- upload them later */
+		error = writeback_defer(request_fsync->pcr.pcr_uid, node);
+		if ( error == 0 )
+		{
+			/* report an earlier upload the server refused (these changes include it) */
+			pthread_mutex_lock(&writeback_lock);
+			error = node->writeback_error;
+			node->writeback_error = 0;
+			pthread_mutex_unlock(&writeback_lock);
+		}
+	}
+	else
+	{
+		/* this upload includes any changes write-back was waiting to upload */
+		pthread_mutex_lock(&writeback_lock);
+		writeback_wait(node);
+		was_dirty = ((node->writeback_status & WEBDAV_WRITEBACK_DIRTY) != 0);
+		if ( was_dirty )
+		{
+			node->writeback_status &= ~WEBDAV_WRITEBACK_DIRTY;
+			node->writeback_status |= WEBDAV_WRITEBACK_BUSY;
+			++gWriteBackEarlyUploads;
+		}
+		pthread_mutex_unlock(&writeback_lock);
+		
+		error = fsync_node(request_fsync->pcr.pcr_uid, node);
+		
+		if ( was_dirty )
+		{
+			pthread_mutex_lock(&writeback_lock);
+			node->writeback_status &= ~WEBDAV_WRITEBACK_BUSY;
+			if ( error != 0 )
+			{
+				node->writeback_status |= WEBDAV_WRITEBACK_DIRTY;
+			}
+			else
+			{
+				node->writeback_error = 0;
+			}
+			pthread_cond_broadcast(&writeback_condvar);
+			pthread_mutex_unlock(&writeback_lock);
+		}
+	}
 
 still_downloading:
 not_open:
@@ -1207,23 +2041,269 @@ bad_obj_id:
 
 /*****************************************************************************/
 
+/*
+ * filesystem_writeback uploads the cache file of a node queued by
+ * filesystem_writeback_scan. It runs on a request thread.
+ */
+void filesystem_writeback(struct node_entry *node)
+{
+	int error;
+	uid_t uid;
+	
+	pthread_mutex_lock(&writeback_lock);
+	
+	node->writeback_status &= ~WEBDAV_WRITEBACK_QUEUED;
+	
+	/*
+	 * Nothing to do if the changes were uploaded early or cancelled, or if
+	 * the file is gone. If it was opened again, the kernel may be changing the
+	 * cache file, so leave the upload for after the next close.
+	 */
+	if ( !(node->writeback_status & WEBDAV_WRITEBACK_DIRTY) ||
+		 (node->writeback_status & WEBDAV_WRITEBACK_BUSY) ||
+		 NODE_IS_DELETED(node) || NODE_FILE_IS_OPEN(node) )
+	{
+		pthread_mutex_unlock(&writeback_lock);
+		return;
+	}
+	
+	/* a close while the upload is in progress sets WEBDAV_WRITEBACK_DIRTY again */
+	node->writeback_status &= ~WEBDAV_WRITEBACK_DIRTY;
+	node->writeback_status |= WEBDAV_WRITEBACK_BUSY;
+	uid = node->writeback_uid;
+	
+	pthread_mutex_unlock(&writeback_lock);
+	
+	error = fsync_node(uid, node);
+	
+	pthread_mutex_lock(&writeback_lock);
+	
+	if ( error == 0 )
+	{
+		++gWriteBackUploads;
+	}
+	else
+	{
+		/* the changes are only in the cache file, so it stays dirty whatever went wrong */
+		node->writeback_status |= WEBDAV_WRITEBACK_DIRTY;
+		node->writeback_time = time(NULL);
+		if ( (error != EIO) && (error != ETIMEDOUT) && (error != ENXIO) )
+		{
+			/*
+			 * The server refused the upload (EPERM, EBUSY, ENOSPC...), so trying
+			 * again won't help until someone does something about it. Hold the
+			 * upload and report the error on the next open or fsync.
+			 */
+			syslog(LOG_ERR, "write-back upload of %s refused: %d", node->name, error);
+			node->writeback_error = error;
+			++gWriteBackFailures;
+		}
+		/* else the server or the connection failed -- try again after another delay */
+	}
+	node->writeback_status &= ~WEBDAV_WRITEBACK_BUSY;
+	pthread_cond_broadcast(&writeback_condvar);
+	
+	pthread_mutex_unlock(&writeback_lock);
+}
+
+/*****************************************************************************/
+
+/* returns TRUE if write-back has anything to do with node (NODE_FILE_WRITEBACK_PENDING) */
+int filesystem_writeback_pending(struct node_entry *node)
+{
+	int pending;
+	
+	pthread_mutex_lock(&writeback_lock);
+	pending = (node->writeback_status != 0);
+	pthread_mutex_unlock(&writeback_lock);
+	
+	return ( pending );
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_writeback_scan queues the uploads of closed files whose delay
+ * has passed. The caller must be the only thread walking the file cache list.
+ */
+void filesystem_writeback_scan(void)
+{
+	struct node_entry *node;
+	int queue_it;
+	time_t now;
+	
+	now = time(NULL);
+	node = nodecache_get_next_file_cache_node(TRUE);
+	while ( node != NULL )
+	{
+		pthread_mutex_lock(&writeback_lock);
+		queue_it = ( (node->writeback_status == WEBDAV_WRITEBACK_DIRTY) &&
+					 (node->writeback_error == 0) &&
+					 !NODE_FILE_IS_OPEN(node) &&
+					 (now >= (node->writeback_time + gWriteBackDelay)) );
+		if ( queue_it )
+		{
+			/* the queued request refers to node, so it can't be freed until the request is done */
+			node->writeback_status |= WEBDAV_WRITEBACK_QUEUED;
+		}
+		pthread_mutex_unlock(&writeback_lock);
+		
+		if ( queue_it && (requestqueue_enqueue_writeback(node) != 0) )
+		{
+			/* try again next time */
+			pthread_mutex_lock(&writeback_lock);
+			node->writeback_status &= ~WEBDAV_WRITEBACK_QUEUED;
+			pthread_mutex_unlock(&writeback_lock);
+		}
+		
+		node = nodecache_get_next_file_cache_node(FALSE);
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * writeback_save copies the cache file of node, whose changes a forced
+ * unmount is leaving behind, to a new file in dir.
+ */
+static int writeback_save(struct node_entry *node, const char *dir)
+{
+	int error;
+	int fd;
+	char path[MAXPATHLEN];
+	char buffer[8192];
+	ssize_t count;
+	off_t offset;
+	
+	error = 0;
+	
+	snprintf(path, MAXPATHLEN, "%s/%llu.%s", dir, (unsigned long long)node->fileid, node->name);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+	require_action(fd != -1, open, error = errno);
+	
+	offset = 0;
+	do
+	{
+		count = pread(node->file_fd, buffer, sizeof(buffer), offset);
+		require_action(count >= 0, pread, error = errno);
+		require_action(write(fd, buffer, (size_t)count) == count, write, error = (errno != 0) ? errno : EIO);
+		offset += count;
+	} while ( count != 0 );
+
+write:
+pread:
+
+	(void) close(fd);
+	
+open:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * filesystem_writeback_drain uploads everything write-back is waiting to
+ * upload and waits for the uploads to finish. It's called at unmount, which
+ * the kernel waits for without a timeout, so no new upload is started after
+ * WEBDAV_WRITEBACK_DRAIN_TIME seconds. If changes are left that weren't
+ * uploaded, an unforced unmount fails with EBUSY so they aren't lost, and a
+ * forced unmount saves copies of them (see writeback_save). The caller must be
+ * the only thread walking the file cache list.
+ */
+int filesystem_writeback_drain(int force)
+{
+	struct node_entry *node;
+	time_t deadline;
+	int pending;
+	char savedir[MAXPATHLEN];
+	
+	deadline = time(NULL) + WEBDAV_WRITEBACK_DRAIN_TIME;
+	pending = 0;
+	*savedir = '\0';
+	node = nodecache_get_next_file_cache_node(TRUE);
+	while ( node != NULL )
+	{
+		if ( NODE_IS_DELETED(node) )
+		{
+			writeback_cancel(node);
+		}
+		else if ( time(NULL) < deadline )
+		{
+			(void) writeback_flush(node);
+		}
+		
+		pthread_mutex_lock(&writeback_lock);
+		if ( node->writeback_status & WEBDAV_WRITEBACK_DIRTY )
+		{
+			++pending;
+			if ( force )
+			{
+				if ( *savedir == '\0' )
+				{
+					strlcpy(savedir, WRITEBACK_SAVE_TEMPLATE, sizeof(savedir));
+					if ( mkdtemp(savedir) == NULL )
+					{
+						*savedir = '\0';
+					}
+				}
+				if ( (*savedir != '\0') && (writeback_save(node, savedir) == 0) )
+				{
+					syslog(LOG_ERR, "forced unmount: the changes to %s were not uploaded and were saved in %s", node->name, savedir);
+				}
+				else
+				{
+					syslog(LOG_ERR, "forced unmount: the changes to %s were not uploaded and are lost", node->name);
+				}
+			}
+		}
+		pthread_mutex_unlock(&writeback_lock);
+		
+		node = nodecache_get_next_file_cache_node(FALSE);
+	}
+	
+	if ( (pending != 0) && !force )
+	{
+		syslog(LOG_ERR, "unmount: the changes to %d files could not be uploaded", pending);
+		return ( EBUSY );
+	}
+	
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+void filesystem_log_writeback(void)
+{
+	if ( gWriteBackCloses != 0 )
+	{
+		syslog(LOG_DEBUG, "write-back: %lld closes (%lld coalesced), %lld uploads, %lld uploaded early, %lld refused",
+			(long long)gWriteBackCloses, (long long)gWriteBackCoalesced, (long long)gWriteBackUploads,
+			(long long)gWriteBackEarlyUploads, (long long)gWriteBackFailures);
+	}
+}
+
+/*****************************************************************************/
+
 // This function sends a write request to the write manager.  
 // When the request offset is zero, this function also intializes the sequential write engine.
 //
+// The cache file is read in BODY_BUFFER_SIZE chunks straight into the slots of the manager's
+// ring, and up to gSeqWriteWindow chunks are in the ring at once, so reading the cache file
+// and writes to the stream overlap. The request is answered once its last chunk is in the
+// ring, so the kernel can write the next chunk to the cache file while this one is still
+// going out. A chunk that fails makes the next request (or the close) fail.
+//
 int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 {
 	int error;
 	ssize_t bytesRead; 
-	// size_t totalBytesRead;
 	off_t totalBytesRead;
 	off_t nbytes;
 	struct node_entry *node;
 	struct stream_put_ctx *ctx = NULL;
-	struct seqwrite_mgr_req *mgr_req;
-	struct timespec timeout;
-	pthread_mutexattr_t mutexattr;
+	uint32_t slot;
 	
-	mgr_req = NULL;
 	error = 0;
 	
 	error = RetrieveDataFromOpaqueID(request_sq_wr->obj_id, (void **)&node);
@@ -1237,11 +2317,25 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 	require_action(NODE_FILE_IS_CACHED(node), out1, error = EBADF);
 	
 	if ( request_sq_wr->offset == 0 ) {
-		error = setup_seq_write(request_sq_wr->pcr.pcr_uid, node, request_sq_wr->file_len);
+		// A retry starts over with a new PUT, so shut down the one that failed
+		if ( node->put_ctx != NULL ) {
+			(void) cleanup_seq_write(node->put_ctx);
+			free(node->put_ctx);
+			node->put_ctx = NULL;
+		}
+		
+		// The sequential PUT replaces the file, so a deferred creation or upload has to happen first
+		error = flush_node(request_sq_wr->pcr.pcr_uid, node);
+		if ( error == 0 )
+			error = setup_seq_write(request_sq_wr->pcr.pcr_uid, node, request_sq_wr->file_len);
 		
 		// If file is large, turn off data caching during the upload
 		if( request_sq_wr->file_len > webdavCacheMaximumSize)
 			fcntl(node->file_fd, F_NOCACHE, 1);
+		
+		// The kernel grows the cache file as it writes, so reserve its blocks up front
+		if ( error == 0 )
+			nodecache_preallocate_file_cache(node, (off_t)request_sq_wr->file_len);
 	}
 	
 	if (error) {
@@ -1250,103 +2344,34 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 	}
 	
 	ctx = node->put_ctx;
+	// (a PUT that failed to set up has no ring)
+	require_action((ctx != NULL) && (ctx->ringBuffer != NULL), out1, error = EIO);
 	if (request_sq_wr->is_retry)
 		ctx->is_retry = 1;
 	
 	// syslog(LOG_DEBUG, "%s: entered. offset %llu, count %lu\n", __FUNCTION__, request_sq_wr->offset, request_sq_wr->count);
 	
-	pthread_mutex_lock(&ctx->ctx_lock);
-	/* Set request data which is common across all requests for this call */
-	
-	mgr_req = (struct seqwrite_mgr_req *) malloc (sizeof(struct seqwrite_mgr_req));	
-	if (mgr_req == NULL) {
-		syslog(LOG_ERR, "%s: malloc of seqwrite_mgr_req failed", __FUNCTION__);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	bzero(mgr_req, sizeof(struct seqwrite_mgr_req));
-	mgr_req->refCount = 1;	// hold a reference until were done
-	mgr_req->req = request_sq_wr;
-	mgr_req->is_retry = request_sq_wr->is_retry;	
-	mgr_req->data = (unsigned char *)malloc(BODY_BUFFER_SIZE); /* 64K */
-	if ( mgr_req->data == NULL ) {
-		syslog(LOG_ERR, "%s: malloc of data buffer failed", __FUNCTION__);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	error = pthread_mutexattr_init(&mutexattr);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx mutexattr failed, error %d", __FUNCTION__, error);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	error = pthread_mutex_init(&mgr_req->req_lock, &mutexattr);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx_lock failed, error %d", __FUNCTION__, error);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	error = pthread_cond_init(&mgr_req->req_condvar, NULL);
-	if (error) {
-		syslog(LOG_ERR, "%s: init ctx_condvar failed, error %d", __FUNCTION__, error);
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
-		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
 	if (node->file_fd == -1) 
 	{
 		/* cache file's no good, today just isn't our day */
 		syslog(LOG_ERR, "%s: cache file descriptor is -1, failed.", __FUNCTION__ );
-		ctx->finalStatus = EIO;
-		ctx->finalStatusValid = true;
 		error = EIO;
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
+		goto fail;
 	}
 	
-	// Seek to the start of this offset
-	if ( lseek(node->file_fd, request_sq_wr->offset, SEEK_SET) < 0) {
-			/* seek failed, dammit */
-			syslog(LOG_ERR, "%s: lseek errno %d, failed.", __FUNCTION__, errno);
-			ctx->finalStatus = EIO;
-			ctx->finalStatusValid = true;
-			error = EIO;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
-		}
-
-	pthread_mutex_unlock(&ctx->ctx_lock);
-	
 	totalBytesRead = 0;
 	bytesRead = 0;
-	/* Loop until everything's written or an error occurs */
+	/* Loop until everything's in the ring or an error occurs */
 	while( 1 ) {
-		pthread_mutex_lock(&ctx->ctx_lock);
+		// wait for the manager to make room in the ring
+		wait_writemgr_ring(ctx, ctx->ringSlots);
 		
 		// if the sequential write was cancelled, get outta dodge
 		if ( ctx->mgr_status == WR_MGR_DONE || ctx->finalStatusValid == true ) {
 			// sequential write was cancelled
 			// syslog(LOG_DEBUG, "%s: WRITESEQ: cancelled at top of loop mgr_status %d, finalStatusValid %d",
 			//	__FUNCTION__, ctx->mgr_status == WR_MGR_DONE, ctx->finalStatusValid);
+			pthread_mutex_lock(&ctx->ctx_lock);
 			error = ctx->finalStatus;
 			pthread_mutex_unlock(&ctx->ctx_lock);
 			goto out1;
@@ -1354,84 +2379,69 @@ int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr)
 		
 		// If we're done reading, break
 		if ( totalBytesRead >= request_sq_wr->count ) {
-			pthread_mutex_unlock(&ctx->ctx_lock);
 			break;
 		}
 		
 		nbytes = MIN( request_sq_wr->count - totalBytesRead, BODY_BUFFER_SIZE );
 
-		bytesRead = read( node->file_fd, mgr_req->data, (size_t)nbytes );
+		// The request's own offset is used so a chunk never depends on the file offset
+		slot = ctx->ringHead % ctx->ringSlots;
+		bytesRead = pread( node->file_fd, ctx->ringBuffer + ((size_t)slot * BODY_BUFFER_SIZE), (size_t)nbytes,
+			request_sq_wr->offset + totalBytesRead );
 		
 		/* bytesRead < 0 we got an error */
 		if ( bytesRead < 0 ) {
 			syslog(LOG_ERR, "%s: read() cache file returned error %d, failed.", __FUNCTION__, errno);
 			error = errno;
-			ctx->finalStatus = error;
-			ctx->finalStatusValid = true;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
+			goto fail;
 		}
 		
-		mgr_req->type = SEQWRITE_CHUNK;
-		mgr_req->request_done = false;
-		mgr_req->chunkLen = bytesRead;
-		mgr_req->chunkWritten = false;
-		mgr_req->error = 0;
-		
-		// queue request
-		if (queue_writemgr_request_locked(ctx, mgr_req) < 0) {
-			syslog(LOG_ERR, "%s: queue_writemgr_request_locked failed.", __FUNCTION__);
+		/* the kernel wrote these bytes to the cache file before sending the request */
+		if ( bytesRead == 0 ) {
+			syslog(LOG_ERR, "%s: cache file is shorter than offset %lld, failed.", __FUNCTION__,
+				(long long)(request_sq_wr->offset + totalBytesRead));
 			error = EIO;
-			ctx->finalStatus = error;
-			ctx->finalStatusValid = true;
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			goto out1;
+			goto fail;
 		}
 		
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		
-		timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
-		timeout.tv_nsec = 0;
+		// publish the chunk -- its contents must be visible before the manager sees ringHead move
+		ctx->ringLen[slot] = bytesRead;
+		OSMemoryBarrier();
+		ctx->ringHead++;
+		wake_writemgr(ctx);
 		
-		// now wait on condition var until mgr is done with this request
-		pthread_mutex_lock(&mgr_req->req_lock);
-		/* wait for request to finish */
-		while (mgr_req->request_done == false && ctx->finalStatusValid == false) {
-			error = pthread_cond_timedwait(&mgr_req->req_condvar, &mgr_req->req_lock, &timeout);	
-			if ( error != 0 ) {
-				syslog(LOG_ERR, "%s: pthread_cond_timedwait returned error %d, failed.", __FUNCTION__, error);
-				pthread_mutex_lock(&ctx->ctx_lock);
-				if ( error == ETIMEDOUT ) {
-					ctx->finalStatus = ETIMEDOUT;
-					ctx->finalStatusValid = true;
-				} else {
-					ctx->finalStatus = EIO;
-					ctx->finalStatusValid = true;
-					error = EIO;
-				}
-				pthread_mutex_unlock(&ctx->ctx_lock);
-				pthread_mutex_unlock(&mgr_req->req_lock);
-				goto out1;
-			}
-		}
-		pthread_mutex_unlock(&mgr_req->req_lock);
 		totalBytesRead += bytesRead;
-	}	
+	}
 	
-	if (mgr_req->request_done == true) {
-		error = mgr_req->error;
-	} else {
-		error = ctx->finalStatus;
+	// with a window of one chunk, wait until it's written, as before pipelining
+	if ( ctx->ringSlots == 1 ) {
+		wait_writemgr_ring(ctx, 1);
 	}
-		
-	// syslog(LOG_ERR, "%s: WRITE_SEQ: Write at offset %llu done, mgr_req.request_done: %d, error %d",
-	//	__FUNCTION__, request_sq_wr->offset, mgr_req.request_done, error);
+	
+	pthread_mutex_lock(&ctx->ctx_lock);
+	
+	// report any failure that's already known; a later one fails the next request or the close
+	error = (ctx->finalStatusValid == true) ? ctx->finalStatus : 0;
+	pthread_mutex_unlock(&ctx->ctx_lock);
+	
+	// syslog(LOG_ERR, "%s: WRITE_SEQ: Write at offset %llu done, error %d",
+	//	__FUNCTION__, request_sq_wr->offset, error);
+	
+	goto out1;
+	
+fail:
+	pthread_mutex_lock(&ctx->ctx_lock);
+	if ( ctx->finalStatusValid == false ) {
+		ctx->finalStatus = error;
+		ctx->finalStatusValid = true;
+	}
+	pthread_mutex_unlock(&ctx->ctx_lock);
+	
+	// let the manager see it's over
+	wake_writemgr(ctx);
 		
 out1:
-	if (mgr_req != NULL)
-		release_writemgr_request(ctx, mgr_req);
-	
-	if (!error) {
+	if (!error && ctx != NULL) {
 		// write succeeded, so turn off retry state
 		ctx->is_retry = 0;
 	}
@@ -1441,6 +2451,29 @@ out1:
 
 /*****************************************************************************/
 
+/*
+ * terminate_listing
+ *
+ * Stops any thread that is still reading a listing into the directory's cache
+ * file and waits until it has finished with the directory node (including the
+ * pass that deletes the children missing from the listing).
+ */
+static void terminate_listing(struct node_entry *node)
+{
+	if ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS )
+	{
+		node->file_status |= WEBDAV_DOWNLOAD_TERMINATED;
+	}
+
+	while ( (node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_IN_PROGRESS )
+	{
+		/* wait for the listing thread to acknowledge that we stopped.*/
+		usleep(10000);	/* 10 milliseconds */
+	}
+}
+
+/*****************************************************************************/
+
 int filesystem_readdir(struct webdav_request_readdir *request_readdir)
 {
 	int error;
@@ -1450,6 +2483,9 @@ int filesystem_readdir(struct webdav_request_readdir *request_readdir)
 	require_noerr_action_quiet(error, bad_obj_id, error = ESTALE);
 
 	require_action_quiet(!NODE_IS_DELETED(node), deleted_node, error = ESTALE);
+	
+	/* Kill any thread that may still be reading the previous listing into the directory's cache file */
+	terminate_listing(node);
 		
 	error = network_readdir(request_readdir->pcr.pcr_uid, request_readdir->cache, node);
 
@@ -34,6 +34,14 @@
 #include <Security/Security.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <libkern/OSAtomic.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <zlib.h>
 
 #include "webdav_parse.h"
 #include "webdav_requestqueue.h"
@@ -58,6 +66,9 @@ struct HeaderFieldValue
 	CFStringRef	value;
 };
 
+/* the number of ReadStreamRecs: one for every request thread, one for the pulse thread, and one for every download helper thread */
+#define WEBDAV_READ_STREAMS (WEBDAV_REQUEST_THREADS + 1 + WEBDAV_DOWNLOAD_HELPER_THREADS)
+
 // Specifies how to handle http 3xx redirection
 enum RedirectAction {
 	REDIRECT_DISABLE = 0,	// Do not allow redirection
@@ -76,8 +87,60 @@ static CFIndex first_read_len = 4096;	/* bytes.  Amount to download at open so f
 static CFStringRef X_Source_Id_HeaderValue = NULL;	/* the X-Source-Id header value, or NULL if not iDisk */
 static CFStringRef X_Apple_Realm_Support_HeaderValue = NULL;	/* the X-Apple-Realm-Support header value, or NULL if not iDisk */
 
+/*
+ * The header template holds the headers every request to this mount gets, so
+ * they don't have to be worked out again for each message. It is built by
+ * network_init and rebuilt when the server is identified by network_mount
+ * (before any requests from the kernel are handled), so it needs no lock.
+ * Cookies depend on the URL, so add_cookie_headers still adds them per message.
+ */
+#define HEADER_TEMPLATE_SOURCE_ID	0x01	/* apply the X-Source-Id header (if any) */
+#define HEADER_TEMPLATE_REALM		0x02	/* apply the X-Apple-Realm-Support header (if any) */
+#define HEADER_TEMPLATE_NO_CACHE	0x04	/* apply the translate and Pragma headers (if Microsoft IIS Server) */
+#define HEADER_TEMPLATE_ACCEPT_ENCODING	0x08	/* apply the Accept-Encoding header (if gAcceptEncoding) */
+
+#define HEADER_TEMPLATE_MAX 6
+
+/* how much of a mapped cache file to start reading before its upload begins */
+#define UPLOAD_READ_AHEAD_SIZE	(8 * 1024 * 1024)
+
+/* how many times in a row a segmented upload continues after losing the connection */
+#define WEBDAV_UPLOAD_RESUMES 5
+
+struct HeaderTemplateEntry
+{
+	CFStringRef	headerField;
+	CFStringRef	value;
+	int flag;		/* the HEADER_TEMPLATE_* flag that selects the header, or 0 if always applied */
+};
+
+static struct HeaderTemplateEntry gHeaderTemplate[HEADER_TEMPLATE_MAX];
+static CFIndex gHeaderTemplateCount = 0;
+
 static SCDynamicStoreRef gProxyStore;
 
+/*
+ * First read hints
+ *
+ * Programs that only look at the start of a file (file(1), Spotlight importers,
+ * media probes) usually read 16K-256K and close it. Anything past the first
+ * read at open makes them wait in the kernel for the background download. So
+ * when a file that was read is closed, the highest offset the kernel read is
+ * remembered for the file's extension and becomes the first read length for
+ * files with that extension, up to gFirstReadMax. A hint that isn't renewed
+ * halves every WEBDAV_FIRST_READ_HINT_HALF_LIFE seconds until it's dropped.
+ */
+#define WEBDAV_FIRST_READ_HINTS 32
+#define WEBDAV_FIRST_READ_EXTENSION_MAX 16
+#define WEBDAV_FIRST_READ_HINT_HALF_LIFE 600	/* 10 minutes */
+
+struct FirstReadHint
+{
+	char extension[WEBDAV_FIRST_READ_EXTENSION_MAX];	/* the lowercase filename extension, or "" for none */
+	CFIndex length;										/* first read length for the extension, or 0 if the hint is unused */
+	time_t learned;										/* when length was last learned or decayed */
+};
+
 /******************************************************************************/
 
 static pthread_mutex_t gNetworkGlobals_lock;
@@ -89,8 +152,54 @@ static int gHttpProxyPort;
 static int gHttpsProxyEnabled;
 static char gHttpsProxyServer[MAXHOSTNAMELEN];
 static int gHttpsProxyPort;
-static CFMutableDictionaryRef gSSLPropertiesDict = NULL;
-static struct ReadStreamRec gReadStreams[WEBDAV_REQUEST_THREADS + 1];	/* one for every request thread plus one for the pulse thread */
+static CFMutableArrayRef gRetiredSSLProperties = NULL;	/* SSL properties snapshots replaced by publish_ssl_properties */
+
+/*
+ * gSSLProperties is an immutable snapshot of the SSL properties applied to every
+ * stream. It is read without a lock; changes are made to a copy which is then
+ * published by publish_ssl_properties. Replaced snapshots are kept in
+ * gRetiredSSLProperties instead of being released, so a reader never sees a
+ * freed dictionary. The snapshot only changes when certificates are added at
+ * startup or when falling back from TLS to SSL, so only a few are ever retired.
+ */
+static CFDictionaryRef volatile gSSLProperties = NULL;
+
+static pthread_mutex_t gReadStreams_lock;
+/* these variables are protected by gReadStreams_lock */
+static struct ReadStreamRec gReadStreams[WEBDAV_READ_STREAMS];	/* one for every request thread, one for the pulse thread, and one for every download helper thread */
+static int gDownloadHelperThreads = 0;	/* number of WEBDAV_DOWNLOAD_HELPER_THREADS reserved by parallel downloads */
+
+/* a network_getattr_async caller waiting for a PROPFIND in flight */
+struct StatFlightCallback
+{
+	struct StatFlightCallback *next;	/* the next caller waiting */
+	network_getattr_done done;			/* the caller's completion function */
+	void *context;						/* passed to done */
+};
+
+/* network_stat and network_getattr_async PROPFINDs in flight; protected by gStatFlights_lock */
+struct StatFlight
+{
+	struct StatFlight *next;			/* the next PROPFIND in flight */
+	CFStringRef urlString;				/* the url */
+	struct node_entry *node;			/* the node passed to network_stat */
+	enum RedirectAction redirectAction;	/* how 3xx redirection is handled */
+	uid_t uid;							/* uid of the user making the request */
+	int waiters;						/* number of threads waiting for the result */
+	struct StatFlightCallback *callbacks;	/* network_getattr_async callers waiting for the result */
+	int done;							/* TRUE when error and statbuf are set */
+	int error;							/* the result */
+	struct webdav_stat_attr statbuf;	/* the result */
+};
+
+static pthread_mutex_t gStatFlights_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gStatFlights_condvar = PTHREAD_COND_INITIALIZER;	/* signaled when a PROPFIND in flight completes */
+static struct StatFlight *gStatFlights = NULL;	/* the PROPFINDs in flight */
+static u_int64_t gStatFlightsSent = 0;			/* number of stat PROPFINDs sent */
+static u_int64_t gStatFlightsCoalesced = 0;	/* number of stat requests that waited for a PROPFIND already in flight */
+
+static struct FirstReadHint gFirstReadHints[WEBDAV_FIRST_READ_HINTS];	/* first read lengths learned per extension */
+static u_int32_t gNextFirstReadHint = 0;	/* the hint to replace when gFirstReadHints is full */
 
 /******************************************************************************/
 
@@ -393,18 +502,13 @@ static const char * SkipLWS(const char *bytes)
 
 static int set_global_stream_properties(CFReadStreamRef readStreamRef)
 {
-	int error, mutexerror;
-		
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_lock, error = mutexerror; webdav_kill(-1));
+	int error;
 	
+	/*
+	 * CFNetwork gets the current system proxies itself, so no proxy globals
+	 * (or gNetworkGlobals_lock) are needed here.
+	 */
 	error = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertyHTTPUseSystemProxySettings, kCFBooleanTrue) == TRUE) ? 0 : 1;
-
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
-	require_noerr_action(mutexerror, pthread_mutex_unlock, error = mutexerror; webdav_kill(-1));
-	
-pthread_mutex_unlock:
-pthread_mutex_lock:
 	
 	return ( error );
 }
@@ -699,6 +803,61 @@ CFStringCreateWithCString:
 
 /*****************************************************************************/
 
+static void add_header_template_entry(CFStringRef headerField, CFStringRef value, int flag)
+{
+	gHeaderTemplate[gHeaderTemplateCount].headerField = headerField;
+	gHeaderTemplate[gHeaderTemplateCount].value = value;
+	gHeaderTemplate[gHeaderTemplateCount].flag = flag;
+	++gHeaderTemplateCount;
+}
+
+/* builds the header template from the mount's header values and server identity */
+static void build_header_template(void)
+{
+	gHeaderTemplateCount = 0;
+	
+	add_header_template_entry(CFSTR("User-Agent"), userAgentHeaderValue, 0);
+	
+	if ( X_Source_Id_HeaderValue != NULL )
+	{
+		add_header_template_entry(CFSTR("X-Source-Id"), X_Source_Id_HeaderValue, HEADER_TEMPLATE_SOURCE_ID);
+	}
+	
+	if ( X_Apple_Realm_Support_HeaderValue != NULL )
+	{
+		add_header_template_entry(CFSTR("X-Apple-Realm-Support"), X_Apple_Realm_Support_HeaderValue, HEADER_TEMPLATE_REALM);
+	}
+	
+	if ( gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER )
+	{
+		/* translate flag and no-cache only for Microsoft IIS Server */
+		add_header_template_entry(CFSTR("translate"), CFSTR("f"), HEADER_TEMPLATE_NO_CACHE);
+		add_header_template_entry(CFSTR("Pragma"), CFSTR("no-cache"), HEADER_TEMPLATE_NO_CACHE);
+	}
+	
+	if ( gAcceptEncoding )
+	{
+		/* only PROPFIND and REPORT responses are decoded (see content_decoder_create) */
+		add_header_template_entry(CFSTR("Accept-Encoding"), CFSTR("gzip, deflate"), HEADER_TEMPLATE_ACCEPT_ENCODING);
+	}
+}
+
+/* applies the header template's headers selected by flags to message */
+static void apply_header_template(CFHTTPMessageRef message, int flags)
+{
+	CFIndex i;
+	
+	for ( i = 0; i < gHeaderTemplateCount; ++i )
+	{
+		if ( (gHeaderTemplate[i].flag == 0) || (flags & gHeaderTemplate[i].flag) )
+		{
+			CFHTTPMessageSetHeaderFieldValue(message, gHeaderTemplate[i].headerField, gHeaderTemplate[i].value);
+		}
+	}
+}
+
+/*****************************************************************************/
+
 /*
  * The get_first_read_len function sets the global
  * first_read_len. It is set to the system's page size so that if the
@@ -726,6 +885,194 @@ static void get_first_read_len(void)
 	{
 		first_read_len = pagesize;
 	}
+	
+	/* the mount can ask for a different length */
+	if ( gFirstReadSize != 0 )
+	{
+		first_read_len = (CFIndex)gFirstReadSize;
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * get_first_read_extension
+ *
+ * Copies node's lowercase filename extension ("" if none) to extension.
+ * Returns FALSE if the extension is too long to have a first read hint.
+ */
+static int get_first_read_extension(struct node_entry *node, char *extension)
+{
+	const char *dot;
+	size_t index;
+	
+	dot = strrchr(node->name, '.');
+	if ( (dot == NULL) || (dot == node->name) )
+	{
+		/* no extension (a leading dot is part of the name) */
+		extension[0] = '\0';
+		return ( TRUE );
+	}
+	
+	++dot;
+	for ( index = 0; dot[index] != '\0'; ++index )
+	{
+		if ( index == (WEBDAV_FIRST_READ_EXTENSION_MAX - 1) )
+		{
+			return ( FALSE );
+		}
+		extension[index] = (char)tolower((unsigned char)dot[index]);
+	}
+	extension[index] = '\0';
+	
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * decay_first_read_hint
+ *
+ * Halves hint's length once for every WEBDAV_FIRST_READ_HINT_HALF_LIFE seconds
+ * since it was learned, and drops the hint once it is no longer than
+ * first_read_len. gNetworkGlobals_lock must be held.
+ */
+static void decay_first_read_hint(struct FirstReadHint *hint, time_t now)
+{
+	while ( (hint->length != 0) && ((now - hint->learned) >= WEBDAV_FIRST_READ_HINT_HALF_LIFE) )
+	{
+		hint->length /= 2;
+		hint->learned += WEBDAV_FIRST_READ_HINT_HALF_LIFE;
+		if ( hint->length <= first_read_len )
+		{
+			hint->length = 0;
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * get_first_read_length
+ *
+ * Returns the number of bytes to download synchronously when node is opened.
+ */
+static CFIndex get_first_read_length(struct node_entry *node)
+{
+	char extension[WEBDAV_FIRST_READ_EXTENSION_MAX];
+	CFIndex result;
+	int index;
+	int mutexerror;
+	
+	result = first_read_len;
+	
+	require_quiet(get_first_read_extension(node, extension), no_hint);
+	
+	/* grab gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	for ( index = 0; index < WEBDAV_FIRST_READ_HINTS; ++index )
+	{
+		if ( (gFirstReadHints[index].length != 0) && (strcmp(gFirstReadHints[index].extension, extension) == 0) )
+		{
+			decay_first_read_hint(&gFirstReadHints[index], time(NULL));
+			result = MAX(gFirstReadHints[index].length, first_read_len);
+			break;
+		}
+	}
+	
+	/* release gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+no_hint:
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
+void network_learn_first_read_len(struct node_entry *node, off_t read_frontier)
+{
+	char extension[WEBDAV_FIRST_READ_EXTENSION_MAX];
+	CFIndex length;
+	struct FirstReadHint *hint;
+	time_t now;
+	int index;
+	int mutexerror;
+	
+	/* is learning turned off? */
+	require_quiet((CFIndex)gFirstReadMax > first_read_len, no_hint);
+	
+	/* opens that never read (Finder, stat-like probes) say nothing about readers */
+	require_quiet(read_frontier > 0, no_hint);
+	
+	require_quiet(get_first_read_extension(node, extension), no_hint);
+	
+	/* round the read frontier up by doubling first_read_len so hints stay a multiple of the page size */
+	length = first_read_len;
+	while ( (length < (CFIndex)gFirstReadMax) && ((off_t)length < read_frontier) )
+	{
+		length *= 2;
+	}
+	length = MIN(length, (CFIndex)gFirstReadMax);
+	
+	now = time(NULL);
+	
+	/* grab gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	hint = NULL;
+	for ( index = 0; index < WEBDAV_FIRST_READ_HINTS; ++index )
+	{
+		decay_first_read_hint(&gFirstReadHints[index], now);
+		if ( (gFirstReadHints[index].length != 0) && (strcmp(gFirstReadHints[index].extension, extension) == 0) )
+		{
+			hint = &gFirstReadHints[index];
+			break;
+		}
+		else if ( (hint == NULL) && (gFirstReadHints[index].length == 0) )
+		{
+			/* remember the first unused hint in case the extension isn't found */
+			hint = &gFirstReadHints[index];
+		}
+	}
+	
+	if ( hint == NULL )
+	{
+		/* the table is full, so replace the hints in turn */
+		hint = &gFirstReadHints[gNextFirstReadHint];
+		gNextFirstReadHint = (gNextFirstReadHint + 1) % WEBDAV_FIRST_READ_HINTS;
+		hint->length = 0;
+	}
+	
+	if ( (hint->length == 0) || (length >= hint->length) )
+	{
+		/* a new extension, or readers of this one want more */
+		strlcpy(hint->extension, extension, sizeof(hint->extension));
+		hint->length = length;
+	}
+	else
+	{
+		/* readers of this extension wanted less this time, so shrink halfway to it */
+		hint->length = (hint->length + length) / 2;
+		hint->length = ((hint->length + first_read_len - 1) / first_read_len) * first_read_len;
+	}
+	hint->learned = now;
+	
+	/* release gNetworkGlobals_lock */
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+no_hint:
+
+	return;
 }
 
 /******************************************************************************/
@@ -749,6 +1096,9 @@ int network_init(const UInt8 *uri, CFIndex uriLength, int *store_notify_fd, int
 	error = pthread_mutex_init(&gNetworkGlobals_lock, &mutexattr);
 	require_noerr(error, pthread_mutex_init);
 	
+	error = pthread_mutex_init(&gReadStreams_lock, &mutexattr);
+	require_noerr(error, pthread_mutex_init);
+	
 	/* create a dynnamic store */
 	gProxyStore = SCDynamicStoreCreate(kCFAllocatorDefault, CFSTR("WebDAVFS"), NULL, NULL);
 	require_action(gProxyStore != NULL, SCDynamicStoreCreate, error = ENOMEM);
@@ -803,8 +1153,11 @@ int network_init(const UInt8 *uri, CFIndex uriLength, int *store_notify_fd, int
 		exit(error);
 	}
 	
+	/* build the header template */
+	build_header_template();
+	
 	/* initialize the gReadStreams array */
-	for ( index = 0; index < (WEBDAV_REQUEST_THREADS + 1); ++index )
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
 	{
 		gReadStreams[index].inUse = 0; /* not in use */
 		gReadStreams[index].readStreamRef = NULL; /* no stream */
@@ -1064,12 +1417,73 @@ CFArrayCreateMutable:
 	return (NULL);
 }
 
+/******************************************************************************/
+
+/* returns a mutable copy of the current SSL properties, or NULL if out of memory */
+static CFMutableDictionaryRef create_mutable_ssl_properties(void)
+{
+	CFDictionaryRef current;
+	
+	current = gSSLProperties;
+	if ( current != NULL )
+	{
+		return ( CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, current) );
+	}
+	else
+	{
+		return ( CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks) );
+	}
+}
+
+/*
+ * publish_ssl_properties makes an immutable copy of sslProperties the current
+ * SSL properties snapshot. The caller must hold gNetworkGlobals_lock (or be the
+ * only thread).
+ */
+static void publish_ssl_properties(CFDictionaryRef sslProperties)
+{
+	CFDictionaryRef snapshot;
+	CFDictionaryRef retired;
+	
+	snapshot = CFDictionaryCreateCopy(kCFAllocatorDefault, sslProperties);
+	require(snapshot != NULL, CFDictionaryCreateCopy);
+	
+	retired = gSSLProperties;
+	if ( retired != NULL )
+	{
+		if ( gRetiredSSLProperties == NULL )
+		{
+			gRetiredSSLProperties = CFArrayCreateMutable(kCFAllocatorDefault, 0, &kCFTypeArrayCallBacks);
+			require_action(gRetiredSSLProperties != NULL, CFArrayCreateMutable, CFRelease(snapshot));
+		}
+		CFArrayAppendValue(gRetiredSSLProperties, retired);
+	}
+	
+	/* make sure the snapshot is complete before readers can see it */
+	OSMemoryBarrier();
+	gSSLProperties = snapshot;
+	
+	if ( retired != NULL )
+	{
+		/* gRetiredSSLProperties keeps it alive */
+		CFRelease(retired);
+	}
+
+CFArrayCreateMutable:
+CFDictionaryCreateCopy:
+
+	return;
+}
+
+/******************************************************************************/
+
 int certs_init(CFDataRef certs)
 {
 	int result = -1;
 	CFErrorRef error;
 	CFPropertyListRef certs_cfpropertylistref = NULL;
 	CFArrayRef certs_secref = NULL;
+	CFMutableDictionaryRef sslProperties;
 
 	syslog(LOG_DEBUG, "%s:", __FUNCTION__);
 
@@ -1083,12 +1497,12 @@ int certs_init(CFDataRef certs)
 	// TODO: export and link against SecAddTrustedCerts from webdavlib.c
 	certs_secref = CFDataArrayCreateSecCertificateArray(certs_cfpropertylistref);
 	if (certs_secref) {
-		if ( gSSLPropertiesDict == NULL )
-		{
-			gSSLPropertiesDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-			require(gSSLPropertiesDict != NULL, CFDictionaryCreateMutable);
-		}
-		CFDictionarySetValue(gSSLPropertiesDict, _kCFStreamSSLTrustedLeafCertificates, certs_secref);
+		/* certs_init is called before network_init, so there's no other thread to lock out */
+		sslProperties = create_mutable_ssl_properties();
+		require(sslProperties != NULL, CFDictionaryCreateMutable);
+		CFDictionarySetValue(sslProperties, _kCFStreamSSLTrustedLeafCertificates, certs_secref);
+		publish_ssl_properties(sslProperties);
+		CFRelease(sslProperties);
 		result = 0;
 	} else {
 		syslog(LOG_ERR, "%s: CFDataArrayCreateSecCertificateArray failed", __FUNCTION__);
@@ -1107,10 +1521,13 @@ CFDictionaryCreateMutable:
 static int ApplySSLProperties(CFReadStreamRef readStreamRef)
 {
 	int result = TRUE;
+	CFDictionaryRef sslProperties;
 	
-	if ( gSSLPropertiesDict != NULL ) 
+	/* no lock needed -- the snapshot is immutable and never released */
+	sslProperties = gSSLProperties;
+	if ( sslProperties != NULL ) 
 	{
-		result = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertySSLSettings, gSSLPropertiesDict) == TRUE);
+		result = (CFReadStreamSetProperty(readStreamRef, kCFStreamPropertySSLSettings, sslProperties) == TRUE);
 	}
 	
 	return ( result );
@@ -1132,11 +1549,11 @@ static struct ReadStreamRec *get_ReadStreamRec(void)
 	
 	result = NULL;
 	
-	/* grab gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	/* grab gReadStreams_lock */
+	mutexerror = pthread_mutex_lock(&gReadStreams_lock);
 	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
 	
-	for ( index = 0; index < (WEBDAV_REQUEST_THREADS + 1); ++index )
+	for ( index = 0; index < WEBDAV_READ_STREAMS; ++index )
 	{
 		if ( !gReadStreams[index].inUse )
 		{
@@ -1163,8 +1580,8 @@ static struct ReadStreamRec *get_ReadStreamRec(void)
 		result->inUse = TRUE;	/* mark it in use */
 	}
 
-	/* release gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	/* release gReadStreams_lock */
+	mutexerror = pthread_mutex_unlock(&gReadStreams_lock);
 	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
 
 pthread_mutex_unlock:
@@ -1184,15 +1601,15 @@ static void release_ReadStreamRec(struct ReadStreamRec *theReadStreamRec)
 {
 	int mutexerror;
 	
-	/* grab gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	/* grab gReadStreams_lock */
+	mutexerror = pthread_mutex_lock(&gReadStreams_lock);
 	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
 	
 	/* release theReadStreamRec */
 	theReadStreamRec->inUse = FALSE;
 	
-	/* release gNetworkGlobals_lock */
-	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	/* release gReadStreams_lock */
+	mutexerror = pthread_mutex_unlock(&gReadStreams_lock);
 	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
 
 pthread_mutex_unlock:
@@ -1253,6 +1670,9 @@ static int HandleSSLErrors(CFReadStreamRef readStreamRef)
 	CFStreamError streamError;
 	SInt32 error;
 	int result;
+	int mutexerror;
+	CFDictionaryRef sslProperties;
+	CFMutableDictionaryRef newProperties;
 	
 	result = EIO;
 
@@ -1261,14 +1681,15 @@ static int HandleSSLErrors(CFReadStreamRef readStreamRef)
 	{
 		error = streamError.error;
 		log_ssl_error(error);
-		if ( gSSLPropertiesDict == NULL )
-		{
-			gSSLPropertiesDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
-			require(gSSLPropertiesDict != NULL, CFDictionaryCreateMutable);
-		}
+		
+		/* grab gNetworkGlobals_lock so only one thread changes the SSL properties */
+		mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+		require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+		
+		sslProperties = gSSLProperties;
 		
 		/* if we haven't tried falling back from TLS to SSL and the errror indicates that might work... */
-		if ( (CFDictionaryGetValue(gSSLPropertiesDict, kCFStreamSSLLevel) == NULL) &&
+		if ( ((sslProperties == NULL) || (CFDictionaryGetValue(sslProperties, kCFStreamSSLLevel) == NULL)) &&
 				(((error <= errSSLProtocol) && (error > errSSLXCertChainInvalid)) ||
 				 ((error <= errSSLCrypto) && (error > errSSLUnknownRootCert)) ||
 				 ((error <= errSSLClosedNoNotify) && (error > errSSLPeerBadCert)) ||
@@ -1278,8 +1699,14 @@ static int HandleSSLErrors(CFReadStreamRef readStreamRef)
 			/* retry with fall back from TLS to SSL */
 			syslog(LOG_DEBUG, "%s: retry with fall back from TLS to SSL -  error (%d)", __FUNCTION__, (int)error);
 
-			CFDictionarySetValue(gSSLPropertiesDict, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
-			result = EAGAIN;
+			newProperties = create_mutable_ssl_properties();
+			if ( newProperties != NULL )
+			{
+				CFDictionarySetValue(newProperties, kCFStreamSSLLevel, kCFStreamSocketSecurityLevelSSLv3);
+				publish_ssl_properties(newProperties);
+				CFRelease(newProperties);
+				result = EAGAIN;
+			}
 		}
 		else
 		{
@@ -1307,9 +1734,14 @@ static int HandleSSLErrors(CFReadStreamRef readStreamRef)
 					break;
 			}
 		}
+		
+		/* release gNetworkGlobals_lock */
+		mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+		require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
 	}
 
-CFDictionaryCreateMutable:
+pthread_mutex_unlock:
+pthread_mutex_lock:
 	
 	return ( result );
 }
@@ -1528,25 +1960,62 @@ CFReadStreamCreateForStreamedHTTPRequest:
 /******************************************************************************/
 
 /*
- * stream_get_transaction
+ * get_content_length
  *
- * Creates an HTTP stream, sends the request and returns the response and response body.
+ * Returns TRUE and the response's Content-Length in length if it has a valid one.
  */
-static int stream_get_transaction(
-	CFHTTPMessageRef request,	/* -> the request to send */
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	struct node_entry *node,	/* -> node to get into */
-	CFHTTPMessageRef *response)
+static int get_content_length(
+	CFHTTPMessageRef responseMessage,	/* -> the response message */
+	off_t *length)						/* <- the Content-Length */
 {
-	struct ReadStreamRec *readStreamRecPtr;
-	UInt8 *buffer;
-	CFIndex totalRead;
-	CFIndex bytesRead;
-	CFTypeRef theResponsePropertyRef;
-	int background_load;
-	CFStringRef connectionHeaderRef;
-	CFStringRef setCookieHeaderRef;
+	CFStringRef headerRef;
+	char lengthString[32];
+	char *end;
+	int result;
+	
+	result = FALSE;
+	
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Content-Length"));
+	require_quiet(headerRef != NULL, no_content_length);
+	
+	if ( CFStringGetCString(headerRef, lengthString, sizeof(lengthString), kCFStringEncodingASCII) )
+	{
+		*length = strtoll(lengthString, &end, 10);
+		result = (end != lengthString) && (*end == '\0') && (*length >= 0);
+	}
+	CFRelease(headerRef);
+
+no_content_length:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * stream_get_transaction
+ *
+ * Creates an HTTP stream, sends the request and returns the response and response body.
+ */
+static int stream_get_transaction(
+	uid_t uid,					/* -> uid of the user making the request */
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	struct node_entry *node,	/* -> node to get into */
+	CFHTTPMessageRef *response)
+{
+	struct ReadStreamRec *readStreamRecPtr;
+	UInt8 *buffer;
+	CFIndex readLength;
+	CFIndex totalRead;
+	CFIndex bytesRead;
+	CFTypeRef theResponsePropertyRef;
+	int background_load;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
 	CFHTTPMessageRef responseMessage;
+	off_t contentLength;
+	off_t offset;
 	int result;
 	
 	result = 0;
@@ -1561,19 +2030,20 @@ static int stream_get_transaction(
 	require_noerr_quiet(result, open_stream_for_transaction);
 	
 	/* malloc a buffer big enough for first read */
-	buffer = malloc(first_read_len);
+	readLength = get_first_read_length(node);
+	buffer = malloc(readLength);
 	require(buffer != NULL, malloc_buffer);
 
-	/* Send the message and get up to first_read_len bytes of response */
+	/* Send the message and get up to readLength bytes of response */
 	totalRead = 0;
 	background_load = FALSE;
 	while ( 1 )
 	{
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, first_read_len - totalRead);
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, readLength - totalRead);
 		if ( bytesRead > 0 )
 		{
 			totalRead += bytesRead;
-			if ( totalRead >= first_read_len )
+			if ( totalRead >= readLength )
 			{
 				/* is there more data to read? */
 				if ( CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) == kCFStreamStatusAtEnd )
@@ -1656,6 +2126,11 @@ static int stream_get_transaction(
 			require_action(ftruncate(node->file_fd, 0LL) != -1, ftruncate, syslog(LOG_ERR,"errno %d", errno));
 			/* reset the position to 0 */
 			require(lseek(node->file_fd, 0LL, SEEK_SET) >= 0, lseek);
+			/* reserve space for the whole file if the rest will be downloaded in the background */
+			if ( background_load && get_content_length(responseMessage, &contentLength) )
+			{
+				nodecache_preallocate_file_cache(node, contentLength);
+			}
 			/* write the bytes in buffer to the cache file*/
 			require(write(node->file_fd, buffer, (size_t)totalRead) == (ssize_t)totalRead, write);
 			
@@ -1669,7 +2144,13 @@ static int stream_get_transaction(
 			/* clear the flags */
 			require(fchflags(node->file_fd, 0) == 0, fchflags);
 			/* seek to EOF */
-			require(lseek(node->file_fd, 0LL, SEEK_END) >= 0, lseek);
+			offset = lseek(node->file_fd, 0LL, SEEK_END);
+			require(offset >= 0, lseek);
+			/* reserve space for the rest of the file if it will be downloaded in the background */
+			if ( background_load && get_content_length(responseMessage, &contentLength) )
+			{
+				nodecache_preallocate_file_cache(node, offset + contentLength);
+			}
 			/* write the bytes in buffer to the cache file*/
 			require(write(node->file_fd, buffer, (size_t)totalRead) >= 0, write);
 			break;
@@ -1722,7 +2203,7 @@ static int stream_get_transaction(
 		node->file_status = WEBDAV_DOWNLOAD_IN_PROGRESS;
 		
 		/* pass the node and readStreamRef off to another thread to finish */
-		error = requestqueue_enqueue_download(node, readStreamRecPtr);
+		error = requestqueue_enqueue_download(uid, node, readStreamRecPtr);
 		require_noerr_quiet(error, webdav_requestqueue_enqueue_new_download);
 	}
 	else
@@ -1786,281 +2267,505 @@ connection_down:
 /******************************************************************************/
 
 /*
- * stream_transaction_from_file
+ * Content decoding
  *
- * Creates an HTTP stream with the read stream coming from file_fd,
- * sends the request and returns the response. The response body (if any) is
- * read and disposed.
+ * When gAcceptEncoding is TRUE, PROPFIND requests are sent with
+ * "Accept-Encoding: gzip, deflate" and a ContentDecoder inflates the response
+ * body as it arrives. Some servers send deflate data without the zlib wrapper,
+ * and some send a Content-Encoding header with a body that isn't encoded at all,
+ * so the first bytes of the body decide how it's decoded. A body that starts
+ * like XML (with '<' or whitespace) is passed through unchanged whatever the
+ * header says; that also covers a body CFNetwork has already decoded.
  */
-static int stream_transaction_from_file(
-	CFHTTPMessageRef request,
-	int file_fd,
-	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	CFHTTPMessageRef *response)
+#define CONTENT_ENCODING_GZIP		1
+#define CONTENT_ENCODING_DEFLATE	2
+
+struct ContentDecoder
 {
-	CFReadStreamRef fdStream;
-	struct ReadStreamRec *readStreamRecPtr;
-	void *buffer;
-	CFIndex bytesRead;
-	CFTypeRef theResponsePropertyRef;
-	off_t contentLength;
-	CFStringRef contentLengthString;
-	CFStringRef connectionHeaderRef;
-	CFStringRef setCookieHeaderRef;
-	CFHTTPMessageRef responseMessage;
+	z_stream zstream;		/* the zlib stream */
+	int encoding;			/* CONTENT_ENCODING_GZIP or CONTENT_ENCODING_DEFLATE */
+	int started;			/* TRUE once the first bytes have been seen */
+	int passthrough;		/* TRUE if the body turned out not to be encoded */
+	int finished;			/* TRUE once the end of the encoded data was reached */
+	int haveFirstByte;		/* TRUE if firstByte holds a deflate body's first byte, which came alone */
+	UInt8 firstByte;		/* (a zlib header is told from raw deflate by its first two bytes) */
+	UInt8 *outBuffer;		/* BODY_BUFFER_SIZE bytes for decoded data */
+};
+
+/* called with each piece of decoded data */
+typedef int (*ContentDecoderOutput)(void *context, const UInt8 *bytes, CFIndex length);
+
+/* statistics for network_log_content_decoding */
+static volatile int64_t gDecodedBytesIn = 0;		/* encoded bytes received */
+static volatile int64_t gDecodedBytesOut = 0;		/* decoded bytes produced from them */
+static volatile int64_t gDecodeMicroseconds = 0;	/* time spent decoding */
+static volatile int32_t gPassthroughBodies = 0;		/* encoded responses whose body wasn't encoded */
+
+/******************************************************************************/
+
+/*
+ * content_decoder_create
+ *
+ * Returns a ContentDecoder in decoder for a response with a gzip or deflate
+ * Content-Encoding, or NULL if the response isn't encoded. Returns EIO if the
+ * response has an encoding that wasn't asked for, or ENOMEM.
+ */
+static int content_decoder_create(
+	CFHTTPMessageRef response,			/* -> the response message */
+	struct ContentDecoder **decoder)	/* <- the decoder, or NULL if no decoding is needed */
+{
+	CFStringRef encodingRef;
+	int encoding;
 	int result;
 	
 	result = 0;
-		
-	/*
-	 * If we're down and the mount is supposed to fail on disconnects
-	 * instead of retrying, just return an error.
-	 */
-	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	*decoder = NULL;
 	
-	/* get the file length */
-	contentLength = lseek(file_fd, 0LL, SEEK_END);
-	require(contentLength != -1, lseek);
+	encodingRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Content-Encoding"));
+	require_quiet(encodingRef != NULL, not_encoded);
 	
-	/* create a string with the file length for the Content-Length header */
-	contentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%qd"), contentLength);
-	/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
-	if ( contentLengthString != NULL )
+	if ( (CFStringCompare(encodingRef, CFSTR("gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo) ||
+		(CFStringCompare(encodingRef, CFSTR("x-gzip"), kCFCompareCaseInsensitive) == kCFCompareEqualTo) )
 	{
-		CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Length"), contentLengthString);
-		CFRelease(contentLengthString);
+		encoding = CONTENT_ENCODING_GZIP;
+	}
+	else if ( CFStringCompare(encodingRef, CFSTR("deflate"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+	{
+		encoding = CONTENT_ENCODING_DEFLATE;
 	}
+	else if ( CFStringCompare(encodingRef, CFSTR("identity"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+	{
+		encoding = 0;
+	}
+	else
+	{
+		logDebugCFString("content_decoder_create: unsupported Content-Encoding:", encodingRef);
+		encoding = -1;
+	}
+	CFRelease(encodingRef);
 	
-	/* set the file position to 0 */
-	verify(lseek(file_fd, 0LL, SEEK_SET) != -1);
+	require_action_quiet(encoding >= 0, unsupported_encoding, result = EIO);
+	require_quiet(encoding != 0, not_encoded);
 	
-	/* create a stream from the file */
-	CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
-	require(fdStream != NULL, CFReadStreamCreateWithFile);
+	network_learn_server_capability(WEBDAV_CAPABILITY_COMPRESSION, TRUE);
 	
-	result = open_stream_for_transaction(request, fdStream, FALSE, retryTransaction, &readStreamRecPtr);
-	require_noerr_quiet(result, open_stream_for_transaction);
-		
-	/* malloc a buffer big enough for most responses */
-	buffer = malloc(BODY_BUFFER_SIZE);
-	require(buffer != NULL, malloc_currentbuffer);
+	*decoder = calloc(1, sizeof(struct ContentDecoder));
+	require_action(*decoder != NULL, calloc, result = ENOMEM);
+	
+	(*decoder)->outBuffer = malloc(BODY_BUFFER_SIZE);
+	require_action((*decoder)->outBuffer != NULL, malloc_outBuffer, result = ENOMEM);
+	
+	(*decoder)->encoding = encoding;
+	
+	return ( 0 );
 
-	/* Send the message and eat the response */
-	while ( 1 )
+malloc_outBuffer:
+
+	free(*decoder);
+	*decoder = NULL;
+
+calloc:
+unsupported_encoding:
+not_encoded:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+static void content_decoder_free(struct ContentDecoder *decoder)
+{
+	if ( decoder != NULL )
 	{
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
-		if ( bytesRead > 0 )
+		if ( decoder->started && !decoder->passthrough )
 		{
-			continue;
+			(void) inflateEnd(&decoder->zstream);
 		}
-		else if ( bytesRead == 0 )
+		free(decoder->outBuffer);
+		free(decoder);
+	}
+}
+
+/******************************************************************************/
+
+/*
+ * content_decoder_inflate inflates the next piece of an encoded body and
+ * passes the decoded data to output. Returns EIO if the data is corrupt, or
+ * any error returned by output.
+ */
+static int content_decoder_inflate(
+	struct ContentDecoder *decoder,	/* -> the decoder */
+	const UInt8 *bytes,				/* -> the next piece of the response body */
+	CFIndex length,					/* -> its length */
+	ContentDecoderOutput output,	/* -> called with the decoded data */
+	void *context)					/* -> passed to output */
+{
+	int zresult;
+	int result;
+	struct timeval start, end;
+	int64_t decoded;
+	
+	result = 0;
+	
+	/* anything after the end of the encoded data is ignored */
+	require_quiet(!decoder->finished, done);
+	
+	gettimeofday(&start, NULL);
+	decoded = 0;
+	
+	decoder->zstream.next_in = (Bytef *)bytes;
+	decoder->zstream.avail_in = (uInt)length;
+	do
+	{
+		decoder->zstream.next_out = decoder->outBuffer;
+		decoder->zstream.avail_out = BODY_BUFFER_SIZE;
+		zresult = inflate(&decoder->zstream, Z_NO_FLUSH);
+		if ( (zresult != Z_OK) && (zresult != Z_STREAM_END) && (zresult != Z_BUF_ERROR) )
 		{
-			/* there are no more bytes to read */
+			syslog(LOG_ERR, "content_decoder_inflate: inflate error %d", zresult);
+			result = EIO;
 			break;
 		}
-		else
+		
+		if ( decoder->zstream.avail_out != BODY_BUFFER_SIZE )
 		{
-			CFStreamError streamError;
-						
-			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-			if ( *retryTransaction && ((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-									  (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
-			{
-				/* if we get a POSIX errror back from the stream, retry the transaction once */
-				syslog(LOG_INFO,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-				*retryTransaction = FALSE;
-				result = EAGAIN;
-			}
-			else
+			decoded += BODY_BUFFER_SIZE - decoder->zstream.avail_out;
+			result = output(context, decoder->outBuffer, BODY_BUFFER_SIZE - decoder->zstream.avail_out);
+			if ( result != 0 )
 			{
-				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-				{
-					syslog(LOG_ERR,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
-				}
-				set_connectionstate(WEBDAV_CONNECTION_DOWN);
-				result = stream_error_to_errno(&streamError);
+				break;
 			}
-			goto CFReadStreamRead;
 		}
-	};
+		
+		if ( zresult == Z_STREAM_END )
+		{
+			decoder->finished = TRUE;
+			break;
+		}
+	} while ( (decoder->zstream.avail_in != 0) || (decoder->zstream.avail_out == 0) );
 	
-	free(buffer);
+	gettimeofday(&end, NULL);
+	
+	OSAtomicAdd64(length - decoder->zstream.avail_in, &gDecodedBytesIn);
+	OSAtomicAdd64(decoded, &gDecodedBytesOut);
+	OSAtomicAdd64(((int64_t)(end.tv_sec - start.tv_sec) * 1000000) + (end.tv_usec - start.tv_usec), &gDecodeMicroseconds);
 
-	/* get the response header */
-	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
-	require(theResponsePropertyRef != NULL, GetResponseHeader);
+done:
+
+	return ( result );
+}
+
+/*
+ * content_decoder_decode
+ *
+ * Decodes the next piece of the response body and passes the decoded data to
+ * output. Returns EIO if the data is corrupt, or any error returned by output.
+ */
+static int content_decoder_decode(
+	struct ContentDecoder *decoder,	/* -> the decoder */
+	const UInt8 *bytes,				/* -> the next piece of the response body */
+	CFIndex length,					/* -> its length */
+	ContentDecoderOutput output,	/* -> called with the decoded data */
+	void *context)					/* -> passed to output */
+{
+	int windowBits;
+	int result;
+	UInt8 first;
 	
-	/* fun with casting a "const void *" CFTypeRef away */
-	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	result = 0;
 	
-	set_connectionstate(WEBDAV_CONNECTION_UP);
+	require_quiet(length > 0, done);
 	
-	/* Get the Connection header (if any) */
-	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
-	/* is the connection-token is "close"? */
-	if ( connectionHeaderRef != NULL )
+	if ( !decoder->started )
 	{
-		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		/* what do the first bytes look like? */
+		first = decoder->haveFirstByte ? decoder->firstByte : bytes[0];
+		if ( (first == '<') || isspace(first) )
 		{
-			/* yes -- then the server closed this connection, so close and release the read stream now */
-			CFReadStreamClose(readStreamRecPtr->readStreamRef);
-			CFRelease(readStreamRecPtr->readStreamRef);
-			readStreamRecPtr->readStreamRef = NULL;
+			/* XML -- it isn't encoded */
+			decoder->passthrough = TRUE;
+			windowBits = 0;
+		}
+		else if ( decoder->encoding == CONTENT_ENCODING_GZIP )
+		{
+			/* the gzip magic number is 0x1f 0x8b */
+			decoder->passthrough = !((first == 0x1f) && ((length < 2) || (bytes[1] == 0x8b)));
+			windowBits = 15 + 16;
+		}
+		else if ( (length == 1) && !decoder->haveFirstByte )
+		{
+			/* wait for the second byte */
+			decoder->firstByte = bytes[0];
+			decoder->haveFirstByte = TRUE;
+			goto done;
+		}
+		else
+		{
+			/* a zlib header's first two bytes, read as a big endian number, are a multiple of 31 */
+			windowBits = (((first & 0x0f) == Z_DEFLATED) &&
+				((((first << 8) | (decoder->haveFirstByte ? bytes[0] : bytes[1])) % 31) == 0)) ? 15 : -15;
+			decoder->passthrough = FALSE;
+		}
+		
+		decoder->started = TRUE;
+		if ( decoder->passthrough )
+		{
+			OSAtomicIncrement32(&gPassthroughBodies);
+		}
+		else
+		{
+			require_action(inflateInit2(&decoder->zstream, windowBits) == Z_OK, inflateInit2, decoder->passthrough = TRUE; result = ENOMEM);
+			if ( decoder->haveFirstByte )
+			{
+				result = content_decoder_inflate(decoder, &decoder->firstByte, 1, output, context);
+				require_noerr_quiet(result, done);
+			}
 		}
-		CFRelease(connectionHeaderRef);
 	}
 	
-	// Handle cookies
-	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
-	if (setCookieHeaderRef != NULL) {
-		handle_cookies(setCookieHeaderRef, request);
-		CFRelease(setCookieHeaderRef);
+	if ( decoder->passthrough )
+	{
+		result = output(context, bytes, length);
+	}
+	else
+	{
+		result = content_decoder_inflate(decoder, bytes, length, output, context);
 	}
 
-	CFRelease(fdStream);
+inflateInit2:
+done:
 
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-	
-	/* fun with casting a "const void *" CFTypeRef away */
-	*response = responseMessage;
-	
-	return ( 0 );
+	return ( result );
+}
 
-	/**********************/
+/******************************************************************************/
 
-CFReadStreamRead:
+/* returns TRUE if responses to requestMethod are decoded */
+static int method_accepts_encoding(CFStringRef requestMethod)
+{
+	return ( gAcceptEncoding &&
+		(CFEqual(requestMethod, CFSTR("PROPFIND")) || CFEqual(requestMethod, CFSTR("REPORT"))) );
+}
 
-	free(buffer);
+/******************************************************************************/
 
-GetResponseHeader:
-malloc_currentbuffer:
+/* ContentDecoderOutput that appends the decoded data to a malloc'd buffer */
+struct DecodedBuffer
+{
+	UInt8 *buffer;
+	CFIndex count;
+	CFIndex bufferSize;
+};
 
-	CFReadStreamClose(readStreamRecPtr->readStreamRef);
-	CFRelease(readStreamRecPtr->readStreamRef);
-	readStreamRecPtr->readStreamRef = NULL;
+static int append_decoded_bytes(void *context, const UInt8 *bytes, CFIndex length)
+{
+	struct DecodedBuffer *decoded;
+	UInt8 *newBuffer;
+	CFIndex newSize;
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
-
-	CFRelease(fdStream);
-
-CFReadStreamCreateWithFile:
-
-lseek:
-open_stream_for_transaction:
-connection_down:
-
-	*response = NULL;
-
-	if ( result == 0 )
+	decoded = (struct DecodedBuffer *)context;
+	
+	if ( (decoded->bufferSize - decoded->count) < length )
 	{
-		result = EIO;
+		newSize = MAX(decoded->bufferSize * 2, decoded->count + length);
+		newBuffer = realloc(decoded->buffer, newSize);
+		if ( newBuffer == NULL )
+		{
+			return ( ENOMEM );
+		}
+		decoded->buffer = newBuffer;
+		decoded->bufferSize = newSize;
 	}
+	
+	memcpy(decoded->buffer + decoded->count, bytes, length);
+	decoded->count += length;
+	
+	return ( 0 );
+}
+
+/*
+ * decode_response_buffer
+ *
+ * If the response body in buffer is encoded, replaces it with the decoded body.
+ */
+static int decode_response_buffer(
+	CFHTTPMessageRef response,	/* -> the response message */
+	UInt8 **buffer,				/* <-> the response body (freed and replaced if it was encoded) */
+	CFIndex *count)				/* <-> the response body length */
+{
+	struct ContentDecoder *decoder;
+	struct DecodedBuffer decoded;
+	int result;
+	
+	result = content_decoder_create(response, &decoder);
+	require_noerr_quiet(result, content_decoder_create);
+	require_quiet(decoder != NULL, not_encoded);
+	
+	/* XML compresses well, so start with room for several times the encoded length */
+	decoded.count = 0;
+	decoded.bufferSize = MAX(*count * 4, BODY_BUFFER_SIZE);
+	decoded.buffer = malloc(decoded.bufferSize);
+	require_action(decoded.buffer != NULL, malloc_buffer, result = ENOMEM);
+	
+	result = content_decoder_decode(decoder, *buffer, *count, append_decoded_bytes, &decoded);
+	if ( result == 0 )
+	{
+		free(*buffer);
+		*buffer = decoded.buffer;
+		*count = decoded.count;
+	}
+	else
+	{
+		free(decoded.buffer);
+	}
+
+malloc_buffer:
+
+	content_decoder_free(decoder);
+
+not_encoded:
+content_decoder_create:
 
 	return ( result );
 }
 
 /******************************************************************************/
 
+void network_log_content_decoding(void)
+{
+	if ( gDecodedBytesIn != 0 )
+	{
+		syslog(LOG_DEBUG, "%lld encoded bytes were decoded to %lld bytes (%.1f:1) in %lld microseconds",
+			(long long)gDecodedBytesIn, (long long)gDecodedBytesOut,
+			(double)gDecodedBytesOut / (double)gDecodedBytesIn, (long long)gDecodeMicroseconds);
+	}
+	if ( gPassthroughBodies != 0 )
+	{
+		syslog(LOG_DEBUG, "%d responses with a Content-Encoding had a body that wasn't encoded", (int)gPassthroughBodies);
+	}
+}
+
+/******************************************************************************/
+
+/* ContentDecoderOutput for directory listings */
+static int parse_decoded_opendir(void *context, const UInt8 *bytes, CFIndex length)
+{
+	return ( parse_opendir_continue((webdav_parse_opendir_stream_t *)context, bytes, length) );
+}
+
+/* parses the next piece of a directory listing, decoding it first if needed */
+static int parse_opendir_piece(
+	webdav_parse_opendir_stream_t *opendir_stream,	/* -> the opendir stream */
+	struct ContentDecoder *decoder,					/* -> the decoder, or NULL */
+	const UInt8 *bytes,								/* -> the next piece of the response body */
+	CFIndex length)									/* -> its length */
+{
+	if ( decoder == NULL )
+	{
+		return ( parse_opendir_continue(opendir_stream, bytes, length) );
+	}
+	else
+	{
+		return ( content_decoder_decode(decoder, bytes, length, parse_decoded_opendir, opendir_stream) );
+	}
+}
+
+/******************************************************************************/
+
 /*
- * stream_transaction
+ * stream_readdir_transaction
  *
- * Creates an HTTP stream, sends the request and returns the response and response body.
+ * Creates an HTTP stream, sends a PROPFIND request for a directory listing and
+ * returns the response. If the response is successful, the listing is parsed
+ * into the directory's cache file as it arrives. The first piece is parsed here;
+ * if there is more, the rest is handed off to another thread the same way a
+ * file download is, with UF_NODUMP set on the cache file until it is complete.
  */
-static int stream_transaction(
+static int stream_readdir_transaction(
 	CFHTTPMessageRef request,	/* -> the request to send */
-	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
 	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
-	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
-	CFIndex *count,				/* <- response data buffer length */
-	CFHTTPMessageRef *response)	/* <- the response message */
+	uid_t uid,					/* -> uid of the user making the request */
+	CFURLRef urlRef,			/* -> the CFURL to the directory */
+	struct node_entry *node,	/* -> directory node to read */
+	CFHTTPMessageRef *response)	/* <- the response */
 {
 	struct ReadStreamRec *readStreamRecPtr;
-	CFIndex	totalRead;
-	UInt8 *currentbuffer;
-	UInt8 *newBuffer;
+	UInt8 *buffer;
+	CFIndex totalRead;
 	CFIndex bytesRead;
-	CFIndex bytesToRead;
-	CFIndex bufferSize;
 	CFTypeRef theResponsePropertyRef;
+	int background_load;
 	CFStringRef connectionHeaderRef;
 	CFStringRef setCookieHeaderRef;
 	CFHTTPMessageRef responseMessage;
+	webdav_parse_opendir_stream_t *opendir_stream;
+	struct ContentDecoder *decoder;
 	int result;
 	
 	result = 0;
-	
+	responseMessage = NULL;
+	decoder = NULL;
+		
 	/*
 	 * If we're down and the mount is supposed to fail on disconnects
 	 * instead of retrying, just return an error.
 	 */
 	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
 	
-	/* get an open ReadStreamRec */
-	result = open_stream_for_transaction(request, NULL, auto_redirect, retryTransaction, &readStreamRecPtr);
+	result = open_stream_for_transaction(request, NULL, FALSE, retryTransaction, &readStreamRecPtr);
 	require_noerr_quiet(result, open_stream_for_transaction);
 	
-	/* malloc a buffer big enough for most responses */
-	bufferSize = BODY_BUFFER_SIZE;
-	currentbuffer = malloc(bufferSize);
-	require(currentbuffer != NULL, malloc_currentbuffer);
+	/* malloc a buffer for the first piece of the listing */
+	buffer = malloc(BODY_BUFFER_SIZE);
+	require(buffer != NULL, malloc_buffer);
 
-	/* Send the message and get the response */
+	/*
+	 * Send the message and get up to BODY_BUFFER_SIZE bytes of response. Small
+	 * listings are completed here; larger ones are finished in the background.
+	 */
 	totalRead = 0;
+	background_load = FALSE;
 	while ( 1 )
 	{
-		bytesToRead = bufferSize - totalRead;
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, currentbuffer + totalRead, bytesToRead);
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer + totalRead, BODY_BUFFER_SIZE - totalRead);
 		if ( bytesRead > 0 )
 		{
 			totalRead += bytesRead;
-			
-			/* is currentbuffer getting close to full? */
-			if ( (bytesToRead - bytesRead) < (BODY_BUFFER_SIZE / 2) )
+			if ( totalRead >= BODY_BUFFER_SIZE )
 			{
-				/* yes, so get larger currentbuffer for next read */
-				bufferSize += BODY_BUFFER_SIZE;
-				newBuffer = realloc(currentbuffer, bufferSize);
-				require(newBuffer != NULL, realloc);
-				
-				currentbuffer = newBuffer;
+				/* is there more data to read? */
+				background_load = (CFReadStreamGetStatus(readStreamRecPtr->readStreamRef) != kCFStreamStatusAtEnd);
+				break;
 			}
 		}
 		else if ( bytesRead == 0 )
 		{
 			/* there are no more bytes to read */
+			background_load = FALSE;
 			break;
 		}
 		else
 		{
-			result = HandleSSLErrors(readStreamRecPtr->readStreamRef);
-			if ( result != EAGAIN )
+			CFStreamError streamError;
+			
+			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+			if ( *retryTransaction &&
+				((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+				 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
 			{
-				if ( result != ECANCELED )
+				/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+				syslog(LOG_INFO,"stream_readdir_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+				*retryTransaction = FALSE;
+				result = EAGAIN;
+			}
+			else
+			{
+				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
 				{
-					CFStreamError streamError;
-								
-					streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
-					if ( *retryTransaction &&
-						((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-						 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
-					{
-						/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
-						syslog(LOG_INFO,"stream_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
-						*retryTransaction = FALSE;
-						result = EAGAIN;
-					}
-					else
-					{
-						if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-						{
-							syslog(LOG_ERR,"stream_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
-						}
-						set_connectionstate(WEBDAV_CONNECTION_DOWN);
-						result = stream_error_to_errno(&streamError);
-					}
+					syslog(LOG_ERR,"stream_readdir_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
 				}
+				set_connectionstate(WEBDAV_CONNECTION_DOWN);
+				result = stream_error_to_errno(&streamError);
 			}
 			goto CFReadStreamRead;
 		}
@@ -2076,16 +2781,15 @@ static int stream_transaction(
 	set_connectionstate(WEBDAV_CONNECTION_UP);
 	
 	/* Get the Connection header (if any) */
+	readStreamRecPtr->connectionClose = FALSE;
 	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
-	/* is the connection-token is "close"? */
 	if ( connectionHeaderRef != NULL )
 	{
+		/* is the connection-token is "close"? */
 		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
 		{
 			/* yes -- then the server closed this connection, so close and release the read stream now */
-			CFReadStreamClose(readStreamRecPtr->readStreamRef);
-			CFRelease(readStreamRecPtr->readStreamRef);
-			readStreamRecPtr->readStreamRef = NULL;
+			readStreamRecPtr->connectionClose = TRUE;
 		}
 		CFRelease(connectionHeaderRef);
 	}
@@ -2097,24 +2801,98 @@ static int stream_transaction(
 		CFRelease(setCookieHeaderRef);
 	}
 	
-	/* make this ReadStreamRec is available again */
-	release_ReadStreamRec(readStreamRecPtr);
+	if ( (CFHTTPMessageGetResponseStatusCode(responseMessage) / 100) == 2 )
+	{
+		/* the listing may be gzip or deflate encoded */
+		result = content_decoder_create(responseMessage, &decoder);
+		require_noerr_quiet(result, content_decoder_create);
+		
+		/* parse what we have so far into the directory's cache file */
+		result = parse_opendir_begin(urlRef, uid, node, &opendir_stream);
+		require_noerr_quiet(result, parse_opendir_begin);
+		
+		result = parse_opendir_piece(opendir_stream, decoder, buffer, totalRead);
+		if ( (result == 0) && background_load )
+		{
+			/*
+			 * As with file downloads, set the NODUMP bit so that the kernel
+			 * knows that we are in the process of filling up the file
+			 */
+			result = fchflags(node->file_fd, UF_NODUMP);
+			if ( result == 0 )
+			{
+				node->file_status = WEBDAV_DOWNLOAD_IN_PROGRESS;
+				
+				/* pass the node, readStreamRef, opendir stream and decoder off to another thread to finish */
+				result = requestqueue_enqueue_readdir(node, readStreamRecPtr, opendir_stream, decoder);
+				if ( result != 0 )
+				{
+					(void) fchflags(node->file_fd, 0);
+					node->file_status = WEBDAV_DOWNLOAD_ABORTED;
+				}
+			}
+			else
+			{
+				result = errno;
+			}
+			require_noerr_action_quiet(result, requestqueue_enqueue_readdir, (void) parse_opendir_finish(opendir_stream, TRUE));
+		}
+		else
+		{
+			/* the listing is complete (or failed) */
+			result = parse_opendir_finish(opendir_stream, (result != 0));
+			require_noerr_quiet(result, parse_opendir_finish);
+			background_load = FALSE;
+			content_decoder_free(decoder);
+		}
+	}
+	else
+	{
+		background_load = FALSE;
+	}
+	
+	free(buffer);
+	buffer = NULL;
+	
+	if ( !background_load )
+	{
+		if ( readStreamRecPtr->connectionClose )
+		{
+			/* close and release the stream */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
+		}
 		
+		/* make this ReadStreamRec is available again */
+		release_ReadStreamRec(readStreamRecPtr);
+	}
+	
 	*response = responseMessage;
-	*count = totalRead;
-	*buffer = currentbuffer;
 	
 	return ( 0 );
 
 	/**********************/
 
+requestqueue_enqueue_readdir:
+parse_opendir_finish:
+parse_opendir_begin:
+
+	content_decoder_free(decoder);
+
+content_decoder_create:
+	
+	CFRelease(responseMessage);
+	
 GetResponseHeader:
 CFReadStreamRead:
-realloc:
 
-	free(currentbuffer);
+	if ( buffer != NULL )
+	{
+		free(buffer);
+	}
 
-malloc_currentbuffer:
+malloc_buffer:
 
 	/* close and release the read stream on errors */
 	CFReadStreamClose(readStreamRecPtr->readStreamRef);
@@ -2128,792 +2906,4057 @@ open_stream_for_transaction:
 connection_down:
 
 	*response = NULL;
-	*count = 0;
-	*buffer = NULL;
+
 	if ( result == 0 )
 	{
 		result = EIO;
 	}
-	
+
 	return ( result );
 }
 
 /******************************************************************************/
 
 /*
- * send_transaction
- *
- * Creates a request, adds the message body, headers and authentication if needed,
- * and then calls stream_transaction() to send the request to the server and get
- * the server's response. If the caller requests the response body and/or the
- * response message, they are returned. Otherwise, they are freed/released.
+ * stream_transaction_from_file
  *
- * The 'node' parameter is needed for handling http redirects:
- * auto_redirect true  - node involved in the transaction, NULL if root node.
- * auto_redirect false - node is not used.
+ * Creates an HTTP stream with the read stream coming from length bytes of
+ * file_fd starting at offset, sends the request and returns the response.
+ * The response body (if any) is read and disposed.
  */
-static int send_transaction(
-	uid_t uid,							/* -> uid of the user making the request */
-	CFURLRef url,						/* -> url to the resource */
-	struct node_entry *node,			/* <- the node involved in the transaction (needed to handle http redirects if auto_redirect if false) */
-	CFStringRef requestMethod,			/* -> the request method */
-	CFDataRef bodyData,					/* -> message body data, or NULL if no body */
-	CFIndex headerCount,				/* -> number of headers */
-	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
-	enum RedirectAction redirectAction,		/* -> specifies how to handle http 3xx redirection */
-	UInt8 **buffer,						/* <- if not NULL, response data buffer is returned here (caller responsible for freeing) */
-	CFIndex *count,						/* <- if not NULL, response data buffer length is returned here*/
-	CFHTTPMessageRef *response)			/* <- if not NULL, response is returned here */
+static int stream_transaction_from_file(
+	CFHTTPMessageRef request,
+	int file_fd,
+	off_t offset,				/* -> the first byte of the file to send */
+	off_t length,				/* -> the number of bytes to send, or -1 for the rest of the file */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	CFHTTPMessageRef *response)
 {
-	int error;
-	CFIndex i;
-	struct HeaderFieldValue *headerPtr;
-	CFHTTPMessageRef message;
-	CFHTTPMessageRef responseRef;
-	CFIndex statusCode;
-	UInt32 auth_generation;
-	UInt8 *responseBuffer;
-	CFIndex responseBufferLength;
-	int retryTransaction;
-	int auto_redirect;
+	CFReadStreamRef fdStream;
+	struct ReadStreamRec *readStreamRecPtr;
+	void *buffer;
+	CFIndex bytesRead;
+	CFTypeRef theResponsePropertyRef;
+	off_t contentLength;
+	CFStringRef contentLengthString;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	CFHTTPMessageRef responseMessage;
+	off_t fileLength;
+	off_t mapOffset;
+	size_t mapLength;
+	void *mapping;
+	void *segment;
+	struct timeval start, end;
+	double seconds;
+	int result;
 	
-	error = 0;
-	responseBuffer = NULL;
-	responseBufferLength = 0;
-	message = NULL;
-	responseRef = NULL;
-	statusCode = 0;
-	auth_generation = 0;
-	retryTransaction = TRUE;
+	result = 0;
+	mapLength = 0;
+	mapping = MAP_FAILED;
+	segment = NULL;
+	fdStream = NULL;
+		
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
 	
-	if (redirectAction == REDIRECT_AUTO)
-		auto_redirect = TRUE;
-	else
-		auto_redirect = FALSE;
-
-	/* the transaction/authentication loop */
-	do
+	/* get the file length */
+	fileLength = lseek(file_fd, 0LL, SEEK_END);
+	require(fileLength != -1, lseek);
+	require_action(offset <= fileLength, lseek, result = EINVAL);
+	
+	/* the body is the rest of the file or the requested part of it, whichever is shorter */
+	contentLength = fileLength - offset;
+	if ( (length >= 0) && (length < contentLength) )
 	{
-		/* release message if left from previous loop */
-		if ( message != NULL )
-		{
-			CFRelease(message);
-			message = NULL;
-		}
-		/* create a CFHTTP message object */
-		message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, requestMethod, url, kCFHTTPVersion1_1);
-		require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
-		
-		/* set the message body (if any) */
-		if ( bodyData != NULL )
-		{
-			CFHTTPMessageSetBody(message, bodyData);
-		}
-		
-		/* change the User-Agent header */
-		CFHTTPMessageSetHeaderFieldValue(message, CFSTR("User-Agent"), userAgentHeaderValue);
-		
-		/* add the X-Source-Id header if needed */
-		if ( (X_Source_Id_HeaderValue != NULL) && (auto_redirect == false))
-		{
-			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
-		}
-		
-		/* add the X-Apple-Realm-Support header if needed */
-		if ( X_Apple_Realm_Support_HeaderValue != NULL )
-		{
-			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Apple-Realm-Support"), X_Apple_Realm_Support_HeaderValue);
-		}
-		
-		/* add cookies (if any) */
-		add_cookie_headers(message, url);
-		
-		/* add other HTTP headers (if any) */
-		for ( i = 0, headerPtr = headers; i < headerCount; ++i, ++headerPtr )
+		contentLength = length;
+	}
+	
+	/* create a string with the body length for the Content-Length header */
+	contentLengthString = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%qd"), contentLength);
+	/* CFReadStreamCreateForStreamedHTTPRequest will use chunked transfer-encoding if the Content-Length header cannot be provided */
+	if ( contentLengthString != NULL )
+	{
+		CFHTTPMessageSetHeaderFieldValue(request, CFSTR("Content-Length"), contentLengthString);
+		CFRelease(contentLengthString);
+	}
+	
+	/* set the file position to the first byte to send */
+	verify(lseek(file_fd, offset, SEEK_SET) != -1);
+	
+	/*
+	 * Map the file and let CFNetwork send the body straight from the mapped
+	 * pages. The kernel holds the webdavnode locked for the fsync, so the
+	 * cache file can't be truncated under the mapping. Reading ahead of the
+	 * send keeps the disk busy while the previous pages go out on the wire.
+	 */
+	if ( gMmapUpload && (contentLength > 0) )
+	{
+		/* mmap offsets must be page aligned */
+		mapOffset = offset & ~((off_t)getpagesize() - 1);
+		mapLength = (size_t)(offset - mapOffset + contentLength);
+		mapping = mmap(NULL, mapLength, PROT_READ, MAP_SHARED, file_fd, mapOffset);
+		if ( mapping != MAP_FAILED )
 		{
-			if (headerPtr->headerField && headerPtr->value) {
-				CFHTTPMessageSetHeaderFieldValue(message, headerPtr->headerField, headerPtr->value);
+			(void) madvise(mapping, mapLength, MADV_SEQUENTIAL);
+			(void) madvise(mapping, (size_t)MIN((off_t)mapLength, (off_t)UPLOAD_READ_AHEAD_SIZE), MADV_WILLNEED);
+			fdStream = CFReadStreamCreateWithBytesNoCopy(kCFAllocatorDefault, (UInt8 *)mapping + (offset - mapOffset),
+				(CFIndex)contentLength, kCFAllocatorNull);
+			if ( fdStream == NULL )
+			{
+				(void) munmap(mapping, mapLength);
+				mapping = MAP_FAILED;
 			}
 		}
-		
-		/* apply credentials (if any) */
-		/*
-		 * statusCode will be 401 or 407 and responseRef will not be NULL if we've already been through the loop;
-		 * statusCode will be 0 and responseRef will be NULL if this is the first time through.
-		 */
-		error = authcache_apply(uid, message, (UInt32)statusCode, responseRef, &auth_generation);
-		if ( error != 0 )
+		else
 		{
-			break;
+			syslog(LOG_DEBUG, "stream_transaction_from_file: mmap errno %d; reading the file instead", errno);
 		}
+	}
+	
+	if ( (fdStream == NULL) && (offset + contentLength < fileLength) )
+	{
+		/* the file stream reads to the end of the file, so a segment short of the end is sent from memory */
+		segment = malloc((size_t)contentLength);
+		require(segment != NULL, malloc_segment);
+		require(pread(file_fd, segment, (size_t)contentLength, offset) == contentLength, pread);
+		fdStream = CFReadStreamCreateWithBytesNoCopy(kCFAllocatorDefault, segment, (CFIndex)contentLength, kCFAllocatorNull);
+		require(fdStream != NULL, CFReadStreamCreateWithBytesNoCopy);
+	}
+	
+	if ( fdStream == NULL )
+	{
+		/* create a stream from the file */
+		CFStreamCreatePairWithSocket(kCFAllocatorDefault, file_fd, &fdStream, NULL);
+		require(fdStream != NULL, CFReadStreamCreateWithFile);
+	}
+	
+	gettimeofday(&start, NULL);
+	
+	result = open_stream_for_transaction(request, fdStream, FALSE, retryTransaction, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
 		
-		/* stream_transaction returns responseRef and responseBuffer so release them if left from previous loop */
-		if ( responseBuffer != NULL )
-		{
-			free(responseBuffer);
-			responseBuffer = NULL;
-			responseBufferLength = 0;
-		}
-		if ( responseRef != NULL )
+	/* malloc a buffer big enough for most responses */
+	buffer = malloc(BODY_BUFFER_SIZE);
+	require(buffer != NULL, malloc_currentbuffer);
+
+	/* Send the message and eat the response */
+	while ( 1 )
+	{
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		if ( bytesRead > 0 )
 		{
-			CFRelease(responseRef);
-			responseRef = NULL;
+			continue;
 		}
-		/* now that everything's ready to send, send it */
-		error = stream_transaction(message, auto_redirect, &retryTransaction, &responseBuffer, &responseBufferLength, &responseRef);
-		if ( error == EAGAIN )
+		else if ( bytesRead == 0 )
 		{
-			statusCode = 0;
-			/* responseRef will be left NULL on retries */
+			/* there are no more bytes to read */
+			break;
 		}
 		else
 		{
-			if ( error != 0 )
+			CFStreamError streamError;
+						
+			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+			if ( *retryTransaction && ((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+									  (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
 			{
-				break;
+				/* if we get a POSIX errror back from the stream, retry the transaction once */
+				syslog(LOG_INFO,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+				*retryTransaction = FALSE;
+				result = EAGAIN;
 			}
-			
-			/* get the status code */
-			statusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
-			
-			if ( (redirectAction == REDIRECT_MANUAL) && ((statusCode / 100) == 3)) {
-				// Handle a 3XX Redirection
-				error = nodecache_redirect_node(url, node, responseRef, statusCode);
-				if (!error) {
-					// Let the caller know the node was redirected
-					error = EDESTADDRREQ;
-					break;
+			else
+			{
+				if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+				{
+					syslog(LOG_ERR,"stream_transaction_from_file: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
 				}
-			}			
+				set_connectionstate(WEBDAV_CONNECTION_DOWN);
+				result = stream_error_to_errno(&streamError);
+			}
+			goto CFReadStreamRead;
 		}
-	} while ( error == EAGAIN || statusCode == 401 || statusCode == 407 );
+	};
+	
+	free(buffer);
 
-CFHTTPMessageCreateRequest:
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
 	
-	if ( error == 0 )
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	set_connectionstate(WEBDAV_CONNECTION_UP);
+	
+	/* Get the Connection header (if any) */
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	/* is the connection-token is "close"? */
+	if ( connectionHeaderRef != NULL )
 	{
-		error = (int)translate_status_to_error((UInt32)statusCode);
-		if ( error == 0 )
-		{
-			/*
-			 * when we get here with no errors, then we need to tell the authcache the
-			 * transaction worked so it can mark the credentials valid and, if needed
-			 * add the credentials to the keychain. If the auth_generation changed, then
-			 * another transaction updated the authcache element after we got it.
-			 */
-			(void) authcache_valid(uid, message, auth_generation);
-		}
-		else
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
 		{
-			if ( responseBuffer != NULL )
-			{
-				free(responseBuffer);
-				responseBuffer = NULL;
-			}
+			/* yes -- then the server closed this connection, so close and release the read stream now */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
 		}
+		CFRelease(connectionHeaderRef);
 	}
 	
-	if ( message != NULL )
-	{
-		CFRelease(message);
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
 	}
+
+	CFRelease(fdStream);
+
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
 	
-	/* return requested output parameters */
-	if ( buffer != NULL )
+	if ( contentLength > (off_t)webdavCacheMaximumSize )
 	{
-		*buffer = responseBuffer;
+		/* report the throughput of large uploads */
+		gettimeofday(&end, NULL);
+		seconds = MAX((double)(end.tv_sec - start.tv_sec) + ((double)(end.tv_usec - start.tv_usec) / 1000000.0), 0.001);
+		syslog(LOG_DEBUG, "stream_transaction_from_file: %qd bytes sent%s in %.3f seconds (%.1f MB/s)",
+			contentLength, (mapping != MAP_FAILED) ? " from the mapped file" : "", seconds,
+			((double)contentLength / 1048576.0) / seconds);
 	}
-	else
+	
+	/* the whole body has been sent, so the stream won't read the mapping (or segment) again */
+	if ( mapping != MAP_FAILED )
 	{
-		if ( responseBuffer != NULL )
+		if ( contentLength > (off_t)webdavCacheMaximumSize )
 		{
-			free(responseBuffer);
+			/* like F_NOCACHE for the read path: a large file's pages shouldn't crowd out everything else */
+			(void) madvise(mapping, mapLength, MADV_DONTNEED);
 		}
+		(void) munmap(mapping, mapLength);
 	}
-	
-	if ( count != NULL )
+	if ( segment != NULL )
 	{
-		*count = responseBufferLength;
+		free(segment);
 	}
 	
-	if ( response != NULL )
+	/* fun with casting a "const void *" CFTypeRef away */
+	*response = responseMessage;
+	
+	return ( 0 );
+
+	/**********************/
+
+CFReadStreamRead:
+
+	free(buffer);
+
+GetResponseHeader:
+malloc_currentbuffer:
+
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+
+open_stream_for_transaction:
+
+	CFRelease(fdStream);
+
+CFReadStreamCreateWithFile:
+CFReadStreamCreateWithBytesNoCopy:
+pread:
+
+	if ( segment != NULL )
 	{
-		/* the caller wants the response and will release it */
-		*response = responseRef;
+		free(segment);
 	}
-	else
+
+malloc_segment:
+
+	/* the body stream that used the mapping has been released */
+	if ( mapping != MAP_FAILED )
 	{
-		if ( responseRef != NULL )
-		{
-			CFRelease(responseRef);
-		}
+		(void) munmap(mapping, mapLength);
 	}
-	
-	return ( error );
+
+lseek:
+connection_down:
+
+	*response = NULL;
+
+	if ( result == 0 )
+	{
+		result = EIO;
+	}
+
+	return ( result );
 }
 
-/*****************************************************************************/
+/******************************************************************************/
 
 /*
- * ParseDAVLevel parses a DAV header's field-value (if any) to get the DAV level.
- *	Input:
- *		responsePropertyRef	the response message
- *	Outputs:
- *		dav_level			the dav_level (0 = DAV not supported)
- *
- * The rules for message headers are (rfc 2518, section 9.1):
+ * The event engine
  *
- *	DAV = "DAV" ":" "1" ["," "2"] ["," 1#extend]
- *	extend = Coded-URL | token
+ * Transactions sent through the event engine are multiplexed over
+ * WEBDAV_EVENT_THREADS threads. Each one runs a CFRunLoop that the read streams
+ * of its transactions are scheduled on, so a slow server response doesn't tie
+ * up a thread. event_transaction_start queues a transaction for an event thread
+ * and the transaction's completion function is called on that thread when the
+ * response is complete or the transaction failed. Completion functions must not
+ * block. stream_transaction, and so send_transaction, waits for its transactions
+ * to be completed by the engine.
  *
- * (Note: The rules for extend are still not in the rfc - they were taken from
- * messages in the WebDAV discussion list and are needed to interoperability
- * with Apache 2.0 servers which put Coded-URLs in DAV headers.)
+ * Each event thread owns WEBDAV_EVENT_THREAD_STREAMS ReadStreamRecs, set up the
+ * way open_stream_for_transaction sets up the request threads' streams (a
+ * WebdavConnectionNumber of their own, SO_NOADDRERR, and the last stream kept
+ * open so its persistent connection is reused). A transaction waits on its
+ * thread until one of them is free.
  */
-static void ParseDAVLevel(CFHTTPMessageRef responsePropertyRef, int *dav_level)
+#define WEBDAV_EVENT_THREADS 2
+#define WEBDAV_EVENT_THREAD_STREAMS 4
+
+struct EventThread;
+struct EventTransaction;
+typedef void (*EventTransactionCompletion)(struct EventTransaction *transaction);
+
+struct EventTransaction
 {
-	CFStringRef davHeaderRef;
-	const char *field_value;
-	char buffer[4096];
-	const char *token;
-	
-	*dav_level = 0;
+	struct EventTransaction *next;			/* the next transaction waiting to be started */
+	CFHTTPMessageRef request;				/* -> the request to send */
+	int auto_redirect;						/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
+	int retryTransaction;					/* <> if TRUE, result is EAGAIN on EPIPE/connection lost errors and retryTransaction is set to FALSE */
+	EventTransactionCompletion completion;	/* -> called on the event thread when the transaction is done */
+	void *context;							/* -> for the completion function */
+	struct EventThread *eventThread;		/* the event thread running the transaction */
+	struct ReadStreamRec *readStreamRec;	/* the event thread's ReadStreamRec while the transaction is in flight */
+	CFReadStreamRef readStreamRef;			/* the read stream while the transaction is in flight */
+	CFIndex bufferSize;						/* size of buffer */
+	UInt8 *buffer;							/* <- the response body (the completion function must free it) */
+	CFIndex count;							/* <- the response body length */
+	CFHTTPMessageRef response;				/* <- the response message (the completion function must release it) */
+	int result;								/* <- 0, EAGAIN if the transaction should be retried, or an errno */
+};
+
+struct EventThread
+{
+	pthread_mutex_t lock;					/* protects queue and runLoop */
+	pthread_cond_t started;					/* signaled when runLoop is set */
+	struct EventTransaction *queue;			/* transactions waiting to be started on this thread */
+	CFRunLoopRef runLoop;					/* the thread's run loop */
+	CFRunLoopSourceRef source;				/* signaled when there are transactions in queue */
+	/* these are only used on the event thread */
+	struct ReadStreamRec streams[WEBDAV_EVENT_THREAD_STREAMS];	/* the thread's connections to the server */
+	struct EventTransaction *waiting;		/* transactions waiting for one of streams */
+	int starting;							/* TRUE while event_thread_start_waiting is running */
+};
+
+static struct EventThread gEventThreads[WEBDAV_EVENT_THREADS];
+static volatile int32_t gNextEventThread = 0;	/* incremented to pick the event thread for the next transaction */
+
+/******************************************************************************/
+
+/*
+ * event_thread_get_stream
+ *
+ * Returns one of eventThread's ReadStreamRecs that isn't in use (preferring one
+ * whose last stream is still open), or NULL if they're all busy.
+ */
+static struct ReadStreamRec *event_thread_get_stream(struct EventThread *eventThread)
+{
+	struct ReadStreamRec *result;
+	int index;
 	
-	davHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responsePropertyRef, CFSTR("DAV"));
-	if ( davHeaderRef )
+	result = NULL;
+	for ( index = 0; index < WEBDAV_EVENT_THREAD_STREAMS; ++index )
 	{
-		field_value = CFStringGetCStringPtr(davHeaderRef, kCFStringEncodingUTF8);
-		if ( field_value == NULL )
+		if ( !eventThread->streams[index].inUse )
 		{
-			if ( CFStringGetCString(davHeaderRef, buffer, 4096, kCFStringEncodingUTF8) )
+			if ( eventThread->streams[index].readStreamRef != NULL )
 			{
-				field_value = buffer;
+				result = &eventThread->streams[index];
+				break;
 			}
-		}
-		CFRelease(davHeaderRef);
-		
-		if ( field_value != NULL )
-		{
-			while ( *field_value != '\0' )
+			else if ( result == NULL )
 			{
-				/* find first non-LWS character */
-				field_value = SkipLWS(field_value);
-				if ( *field_value == '\0' )
-				{
-					/* if we're at end of string, break out of main while loop */
-					break;
-				}
-				
-				/* is value a token or a Coded-URL? */
-				if ( *field_value == '<' )
-				{
-					/* it's a Coded-URL, so eat it */
-					
-					/* skip over '<' */
-					++field_value;
-					
-					/* find '>"' marking the end of the quoted-string */
-					field_value = SkipCodedURL(field_value);
-					
-					if ( *field_value != '\0' )
-					{
-						/* skip over '>' */
-						++field_value;
-					}
-				}
-				else
-				{
-					/* it's a token */
-					
-					/* mark start of the value token */
-					token = field_value;
-					
-					/* find the end of the value token */
-					field_value = SkipToken(field_value);
-					
-					/* could this token be '1' or '2'? */
-					if ( (field_value - token) == 1 )
-					{
-						if ( (*token == '1') && (*dav_level < 1) )
-						{
-							*dav_level = 1;
-						}
-						else if ( *token == '2' && (*dav_level < 2) )
-						{
-							*dav_level = 2;
-						}
-					}
-				}
-				
-				/* skip over LWS (if any) */
-				field_value = SkipLWS(field_value);
-				
-				/* if there's any string left after the LWS... */
-				if ( *field_value != '\0' )
-				{
-					/* we should have found a comma */
-					if ( *field_value != ',' )
-					{
-						/* if not, break out of main while loop */
-						break;
-					}
-					
-					/* skip over one or more commas */
-					while ( *field_value == ',' )
-					{
-						++field_value;
-					}
-				}
-				
-				/*
-				 * field_value is now pointing at first character after comma
-				 * delimiter, or at end of string
-				 */
+				result = &eventThread->streams[index];
 			}
 		}
 	}
-}
-
-/*****************************************************************************/
-static void identifyServerType(CFHTTPMessageRef responsePropertyRef)
-{	
-	CFStringRef serverHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responsePropertyRef, CFSTR("Server"));
-	if ( serverHeaderRef != NULL ) {
-		if (CFStringHasPrefix(serverHeaderRef, CFSTR("Microsoft-IIS/")) == TRUE)
-			gServerIdent = WEBDAV_MICROSOFT_IIS_SERVER;
-
-		CFRelease(serverHeaderRef);
+	
+	if ( result != NULL )
+	{
+		result->inUse = TRUE;
 	}
+	
+	return ( result );
 }
 
 /******************************************************************************/
-static int network_getDAVLevel(
-	uid_t uid,					/* -> uid of the user making the request */
-	CFURLRef urlRef,			/* -> url */
-	int *dav_level)				/* <- DAV level */
-{
-	int error;
-	CFHTTPMessageRef response;
-	/* the 3 headers */
-	CFIndex headerCount = 1;
-	struct HeaderFieldValue headers[] = {
-		{ CFSTR("Accept"), CFSTR("*/*") },
-	};
-		
-	*dav_level = 0;
-	syslog(LOG_ERR, "%s: ", __FUNCTION__);
 
-	/* send request to the server and get the response */
-	error = send_transaction(uid, urlRef, NULL, CFSTR("OPTIONS"), NULL,
-		headerCount, headers, REDIRECT_MANUAL, NULL, NULL, &response);
-	if ( !error ) {
-		/* get the DAV level */
-		ParseDAVLevel(response, dav_level);
-		
-		/* identify the type of server */
-		identifyServerType(response);
+static void event_transaction_open(struct EventTransaction *transaction);
 
-		/* release the response buffer */
-		CFRelease(response);
+/*
+ * event_thread_start_waiting
+ *
+ * Opens the transactions waiting for a ReadStreamRec while there are free ones.
+ */
+static void event_thread_start_waiting(struct EventThread *eventThread)
+{
+	struct EventTransaction *transaction;
+	int index;
+	
+	/* a transaction that fails to open finishes (and gets here) from the loop below */
+	if ( eventThread->starting )
+	{
+		return;
 	}
-
-	return ( error );
+	eventThread->starting = TRUE;
+	
+	while ( eventThread->waiting != NULL )
+	{
+		for ( index = 0; index < WEBDAV_EVENT_THREAD_STREAMS; ++index )
+		{
+			if ( !eventThread->streams[index].inUse )
+			{
+				break;
+			}
+		}
+		if ( index == WEBDAV_EVENT_THREAD_STREAMS )
+		{
+			/* all busy -- the next transaction to finish will call us again */
+			break;
+		}
+		
+		transaction = eventThread->waiting;
+		eventThread->waiting = transaction->next;
+		transaction->next = NULL;
+		event_transaction_open(transaction);
+	}
+	
+	eventThread->starting = FALSE;
 }
 
-/*****************************************************************************/
+/******************************************************************************/
 
-static
-int get_from_attributes_cache(struct node_entry *node, uid_t uid)
+/*
+ * event_transaction_finish
+ *
+ * Gets the response message (if there were no errors), gives the read stream
+ * back to its ReadStreamRec and calls the transaction's completion function.
+ */
+static void event_transaction_finish(struct EventTransaction *transaction, int result)
 {
-	ssize_t size;
-	int result;
+	CFTypeRef theResponsePropertyRef;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	struct EventThread *eventThread;
+	struct ReadStreamRec *readStreamRecPtr;
 	
-	result = FALSE;	/* default to FALSE */
+	eventThread = transaction->eventThread;
+	readStreamRecPtr = transaction->readStreamRec;
 	
-	if ( node_appledoubleheader_valid(node, uid) )
+	if ( result == 0 )
 	{
-		require(fchflags(node->file_fd, 0) == 0, fchflags);
-		require(lseek(node->file_fd, (off_t)0, SEEK_SET) != -1, lseek);
-		require(ftruncate(node->file_fd, 0LL) != -1, ftruncate);
-		/* we found the AppleDouble header in memcache */
-		size = write(node->file_fd, (void *)node->attr_appledoubleheader, APPLEDOUBLEHEADER_LENGTH);
-		if ( size != APPLEDOUBLEHEADER_LENGTH )
+		/* get the response header */
+		theResponsePropertyRef = CFReadStreamCopyProperty(transaction->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+		if ( theResponsePropertyRef != NULL )
 		{
-			debug_string("write failed");
-			/* attempt to seek back to start of file, make sure it's empty, and then reset its status */
-			(void) lseek(node->file_fd, (off_t)0, SEEK_SET);
-			(void) ftruncate(node->file_fd, 0LL);
-			node->file_status = WEBDAV_DOWNLOAD_NEVER;
-			node->file_validated_time = 0;
-			node->file_last_modified = -1;
-			if ( node->file_entity_tag != NULL )
+			/* fun with casting a "const void *" CFTypeRef away */
+			transaction->response = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+			
+			set_connectionstate(WEBDAV_CONNECTION_UP);
+			
+			/* Get the Connection header (if any) */
+			readStreamRecPtr->connectionClose = FALSE;
+			connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(transaction->response, CFSTR("Connection"));
+			if ( connectionHeaderRef != NULL )
 			{
-				free(node->file_entity_tag);
-				node->file_entity_tag = NULL;
+				/* is the connection-token is "close"? */
+				if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+				{
+					/* yes -- then the server closed this connection, so close and release the read stream now */
+					readStreamRecPtr->connectionClose = TRUE;
+				}
+				CFRelease(connectionHeaderRef);
+			}
+			
+			// Handle cookies
+			setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(transaction->response, CFSTR("Set-Cookie"));
+			if (setCookieHeaderRef != NULL) {
+				handle_cookies(setCookieHeaderRef, transaction->request);
+				CFRelease(setCookieHeaderRef);
 			}
 		}
 		else
 		{
-			node->file_status = WEBDAV_DOWNLOAD_FINISHED;
-			node->file_validated_time = node->attr_appledoubleheader_time;
-			node->file_last_modified = (node->attr_stat_info.attr_stat.st_mtimespec.tv_sec != 0) ? node->attr_stat_info.attr_stat.st_mtimespec.tv_sec : -1;
-			/* ••••• should I get the etag when I get attr_appledoubleheader? probably */ 
-			if ( node->file_entity_tag != NULL )
-			{
-				free(node->file_entity_tag);
-				node->file_entity_tag = NULL;
-			}
-			result = TRUE;
+			result = EIO;
 		}
 	}
-
-ftruncate:
-lseek:
-fchflags:
 	
-	return ( result );
-}	
+	if ( (result != 0) && (transaction->buffer != NULL) )
+	{
+		free(transaction->buffer);
+		transaction->buffer = NULL;
+		transaction->count = 0;
+	}
+	
+	if ( transaction->readStreamRef != NULL )
+	{
+		CFReadStreamSetClient(transaction->readStreamRef, kCFStreamEventNone, NULL, NULL);
+		CFReadStreamUnscheduleFromRunLoop(transaction->readStreamRef, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+		
+		if ( (result == 0) && !readStreamRecPtr->connectionClose )
+		{
+			/*
+			 * Leave the stream open in the ReadStreamRec, like the request threads
+			 * do, so the next stream with its WebdavConnectionNumber reuses the
+			 * persistent connection.
+			 */
+			readStreamRecPtr->readStreamRef = transaction->readStreamRef;
+		}
+		else
+		{
+			CFReadStreamClose(transaction->readStreamRef);
+			CFRelease(transaction->readStreamRef);
+		}
+		transaction->readStreamRef = NULL;
+	}
+	
+	if ( readStreamRecPtr != NULL )
+	{
+		readStreamRecPtr->inUse = FALSE;
+		transaction->readStreamRec = NULL;
+	}
+	
+	transaction->result = result;
+	transaction->completion(transaction);
+	
+	/* the completion function may have freed transaction, so only eventThread is used from here on */
+	event_thread_start_waiting(eventThread);
+}
 
 /******************************************************************************/
 
 /*
- * network_stat handles requests from network_lookup, network_getattr
- * and network_mount.
+ * event_transaction_error
+ *
+ * Returns the result for a transaction whose read stream failed, the same way
+ * stream_transaction does.
  */
-static int network_stat(
-	uid_t uid,					/* -> uid of the user making the request */
-	struct node_entry *node,	/* <- the node involved in the request */
-	CFURLRef urlRef,			/* -> url to the resource */
-	enum RedirectAction redirectAction, /*  how to handle http 3xx redirection */
-	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer */
+static int event_transaction_error(struct EventTransaction *transaction)
 {
-	int error;
-	UInt8 *responseBuffer;
-	CFIndex count;
-	CFDataRef bodyData;
-	/* the xml for the message body */
-	const UInt8 xmlString[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
-		"<D:propfind xmlns:D=\"DAV:\">\n"
-			"<D:prop>\n"
-				"<D:getlastmodified/>\n"
-				"<D:getcontentlength/>\n"
-				"<D:creationdate/>\n"
-				"<D:resourcetype/>\n"
-			"</D:prop>\n"
-		"</D:propfind>\n";
-	/* the 3 headers */
-	CFIndex headerCount = 3;
-	struct HeaderFieldValue headers[] = {
-		{ CFSTR("Accept"), CFSTR("*/*") },
-		{ CFSTR("Content-Type"), CFSTR("text/xml") },
-		{ CFSTR("Depth"), CFSTR("0") },
-		{ CFSTR("translate"), CFSTR("f") }
-	};
+	CFStreamError streamError;
+	int result;
 	
-	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
-		/* translate flag only for Microsoft IIS Server */
-		headerCount += 1;
+	result = HandleSSLErrors(transaction->readStreamRef);
+	if ( (result != EAGAIN) && (result != ECANCELED) )
+	{
+		streamError = CFReadStreamGetError(transaction->readStreamRef);
+		if ( transaction->retryTransaction &&
+			((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+			 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+		{
+			/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+			syslog(LOG_INFO,"event_transaction_error: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+			transaction->retryTransaction = FALSE;
+			result = EAGAIN;
+		}
+		else
+		{
+			if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+			{
+				syslog(LOG_ERR,"event_transaction_error: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+			}
+			set_connectionstate(WEBDAV_CONNECTION_DOWN);
+			result = stream_error_to_errno(&streamError);
+		}
 	}
+	
+	return ( result );
+}
 
-	/* create the message body with the xml */
-	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, xmlString, strlen((const char *)xmlString), kCFAllocatorNull);
-	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+/******************************************************************************/
+
+static void event_transaction_set_noaddrerr(struct EventTransaction *transaction)
+{
+	CFDataRef sockWrapper;
+	CFSocketNativeHandle sock;
+	int flag;
 	
-	/* send request to the server and get the response */
-	error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
-								headerCount, headers, redirectAction, &responseBuffer, &count, NULL);
-	if ( !error )
+	sockWrapper = (CFDataRef)CFReadStreamCopyProperty(transaction->readStreamRef, kCFStreamPropertySocketNativeHandle);
+	if ( sockWrapper != NULL )
 	{
-		/* parse the statbuf from the response buffer */
-		error = parse_stat(responseBuffer, count, statbuf);
-				
-		/* free the response buffer */
-		free(responseBuffer);
+		CFRange r = {0, sizeof(CFSocketNativeHandle)};
+		CFDataGetBytes(sockWrapper, r, (UInt8 *)&sock);
+		CFRelease(sockWrapper);
+		flag = 1;
+		setsockopt(sock, SOL_SOCKET, SO_NOADDRERR, &flag, (socklen_t)sizeof(flag));
 	}
+}
 
-	/* release the message body */
-	CFRelease(bodyData);
+/******************************************************************************/
 
-CFDataCreateWithBytesNoCopy:
+static void event_transaction_callback(CFReadStreamRef readStreamRef, CFStreamEventType type, void *info)
+{
+	#pragma unused(readStreamRef)
+	struct EventTransaction *transaction;
+	CFIndex bytesRead;
+	UInt8 *newBuffer;
+	
+	transaction = (struct EventTransaction *)info;
+	
+	switch ( type )
+	{
+		case kCFStreamEventHasBytesAvailable:
+			/* is buffer getting close to full? */
+			if ( (transaction->bufferSize - transaction->count) < (BODY_BUFFER_SIZE / 2) )
+			{
+				/* yes, so get a larger buffer for this read */
+				newBuffer = realloc(transaction->buffer, transaction->bufferSize + BODY_BUFFER_SIZE);
+				if ( newBuffer == NULL )
+				{
+					event_transaction_finish(transaction, ENOMEM);
+					break;
+				}
+				transaction->buffer = newBuffer;
+				transaction->bufferSize += BODY_BUFFER_SIZE;
+			}
+			
+			bytesRead = CFReadStreamRead(transaction->readStreamRef, transaction->buffer + transaction->count,
+				transaction->bufferSize - transaction->count);
+			if ( bytesRead > 0 )
+			{
+				transaction->count += bytesRead;
+			}
+			else if ( bytesRead == 0 )
+			{
+				/* there are no more bytes to read */
+				event_transaction_finish(transaction, 0);
+			}
+			else
+			{
+				event_transaction_finish(transaction, event_transaction_error(transaction));
+			}
+			break;
+			
+		case kCFStreamEventOpenCompleted:
+			/* Set SO_NOADDRERR on the socket so we will know about EADDRNOTAVAIL errors ASAP */
+			event_transaction_set_noaddrerr(transaction);
+			break;
+			
+		case kCFStreamEventEndEncountered:
+			event_transaction_finish(transaction, 0);
+			break;
+			
+		case kCFStreamEventErrorOccurred:
+			event_transaction_finish(transaction, event_transaction_error(transaction));
+			break;
+			
+		default:
+			break;
+	}
+}
+
+/******************************************************************************/
+
+/*
+ * event_transaction_open
+ *
+ * Creates the transaction's read stream on one of this event thread's
+ * ReadStreamRecs, schedules it on the thread's run loop, and opens it. If all
+ * of the thread's ReadStreamRecs are busy, the transaction waits for one.
+ */
+static void event_transaction_open(struct EventTransaction *transaction)
+{
+	CFStreamClientContext clientContext = { 0, NULL, NULL, NULL, NULL };
+	struct EventTransaction **waitingPtr;
+	struct ReadStreamRec *readStreamRecPtr;
+	int result;
+	
+	result = 0;
+	
+	readStreamRecPtr = event_thread_get_stream(transaction->eventThread);
+	if ( readStreamRecPtr == NULL )
+	{
+		/* wait at the end of the line */
+		for ( waitingPtr = &transaction->eventThread->waiting; *waitingPtr != NULL; waitingPtr = &(*waitingPtr)->next )
+		{
+			continue;
+		}
+		*waitingPtr = transaction;
+		return;
+	}
+	transaction->readStreamRec = readStreamRecPtr;
+	
+	/* malloc a buffer big enough for most responses */
+	transaction->bufferSize = BODY_BUFFER_SIZE;
+	transaction->buffer = malloc(BODY_BUFFER_SIZE);
+	require_action(transaction->buffer != NULL, malloc_buffer, result = ENOMEM);
+	
+	/* create the HTTP read stream */
+	transaction->readStreamRef = CFReadStreamCreateForHTTPRequest(kCFAllocatorDefault, transaction->request);
+	require_action(transaction->readStreamRef != NULL, CFReadStreamCreateForHTTPRequest, result = EIO);
+	
+	/* add persistent property */
+	CFReadStreamSetProperty(transaction->readStreamRef, kCFStreamPropertyHTTPAttemptPersistentConnection, kCFBooleanTrue);
+	
+	/* turn on automatic redirection */
+	if ( transaction->auto_redirect )
+	{
+		require_action(CFReadStreamSetProperty(transaction->readStreamRef, kCFStreamPropertyHTTPShouldAutoredirect, kCFBooleanTrue) != FALSE,
+			SetAutoredirectProperty, result = EIO);
+	}
+	
+	/* add proxies (if any) */
+	require_action_quiet(set_global_stream_properties(transaction->readStreamRef) == 0, set_global_stream_properties, result = EIO);
+	
+	/* apply any SSL properties we've already negotiated with the server */
+	ApplySSLProperties(transaction->readStreamRef);
+	
+	/* add the unique property from the ReadStreamRec to the stream */
+	require_action(CFReadStreamSetProperty(transaction->readStreamRef, CFSTR("WebdavConnectionNumber"), readStreamRecPtr->uniqueValue) != FALSE,
+		SetWebdavConnectionNumberProperty, result = EIO);
+	
+	/* have the stream events delivered to this thread */
+	clientContext.info = transaction;
+	require_action(CFReadStreamSetClient(transaction->readStreamRef,
+		kCFStreamEventOpenCompleted | kCFStreamEventHasBytesAvailable | kCFStreamEventErrorOccurred | kCFStreamEventEndEncountered,
+		event_transaction_callback, &clientContext) != FALSE, CFReadStreamSetClient, result = EIO);
+	CFReadStreamScheduleWithRunLoop(transaction->readStreamRef, CFRunLoopGetCurrent(), kCFRunLoopCommonModes);
+	
+	/* open the read stream -- the callback does the rest */
+	if ( CFReadStreamOpen(transaction->readStreamRef) == FALSE )
+	{
+		event_transaction_finish(transaction, event_transaction_error(transaction));
+		return;
+	}
+	
+	/* close and release old read stream now that the new one has its connection */
+	if ( readStreamRecPtr->readStreamRef != NULL )
+	{
+		CFReadStreamClose(readStreamRecPtr->readStreamRef);
+		CFRelease(readStreamRecPtr->readStreamRef);
+		readStreamRecPtr->readStreamRef = NULL;
+	}
+	
+	return;
+
+	/**********************/
+
+CFReadStreamSetClient:
+SetWebdavConnectionNumberProperty:
+set_global_stream_properties:
+SetAutoredirectProperty:
+
+	CFRelease(transaction->readStreamRef);
+	transaction->readStreamRef = NULL;
+
+CFReadStreamCreateForHTTPRequest:
+malloc_buffer:
+
+	event_transaction_finish(transaction, result);
+}
+
+/******************************************************************************/
+
+/* the run loop source's perform function: start the transactions queued for this thread */
+static void event_thread_perform(void *info)
+{
+	struct EventThread *eventThread;
+	struct EventTransaction *transaction;
+	struct EventTransaction *next;
+	int mutexerror;
+	
+	eventThread = (struct EventThread *)info;
+	
+	mutexerror = pthread_mutex_lock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	transaction = eventThread->queue;
+	eventThread->queue = NULL;
+	
+	mutexerror = pthread_mutex_unlock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	while ( transaction != NULL )
+	{
+		next = transaction->next;
+		transaction->next = NULL;
+		event_transaction_open(transaction);
+		transaction = next;
+	}
+	
+	/* transactions that waited for a stream go first, so start them if any streams are free */
+	event_thread_start_waiting(eventThread);
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+static void *event_thread(void *arg)
+{
+	struct EventThread *eventThread;
+	int mutexerror;
+	
+	eventThread = (struct EventThread *)arg;
+	
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), eventThread->source, kCFRunLoopCommonModes);
+	
+	/* let network_event_engine_init know this thread is ready */
+	mutexerror = pthread_mutex_lock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	eventThread->runLoop = CFRunLoopGetCurrent();
+	
+	mutexerror = pthread_cond_signal(&eventThread->started);
+	require_noerr_action(mutexerror, pthread_cond_signal, webdav_kill(-1));
+	
+	mutexerror = pthread_mutex_unlock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	/* the source keeps the run loop running forever */
+	CFRunLoopRun();
+
+pthread_mutex_unlock:
+pthread_cond_signal:
+pthread_mutex_lock:
+
+	return ( NULL );
+}
+
+/******************************************************************************/
+
+/*
+ * network_event_engine_init
+ *
+ * Starts the event threads. Returns 0 on success.
+ */
+int network_event_engine_init(void)
+{
+	int error;
+	int index;
+	int streamIndex;
+	pthread_attr_t event_thread_attr;
+	pthread_t event_thread_id;
+	CFRunLoopSourceContext sourceContext;
+	
+	error = pthread_attr_init(&event_thread_attr);
+	require_noerr(error, pthread_attr_init);
+	
+	error = pthread_attr_setdetachstate(&event_thread_attr, PTHREAD_CREATE_DETACHED);
+	require_noerr(error, pthread_attr_setdetachstate);
+	
+	for ( index = 0; index < WEBDAV_EVENT_THREADS; ++index )
+	{
+		error = pthread_mutex_init(&gEventThreads[index].lock, NULL);
+		require_noerr(error, pthread_mutex_init);
+		
+		error = pthread_cond_init(&gEventThreads[index].started, NULL);
+		require_noerr(error, pthread_cond_init);
+		
+		gEventThreads[index].queue = NULL;
+		gEventThreads[index].runLoop = NULL;
+		gEventThreads[index].waiting = NULL;
+		gEventThreads[index].starting = FALSE;
+		for ( streamIndex = 0; streamIndex < WEBDAV_EVENT_THREAD_STREAMS; ++streamIndex )
+		{
+			gEventThreads[index].streams[streamIndex].inUse = FALSE;
+			gEventThreads[index].streams[streamIndex].readStreamRef = NULL;
+			gEventThreads[index].streams[streamIndex].connectionClose = FALSE;
+			/* number them after the request threads' ReadStreamRecs so every connection is distinct */
+			gEventThreads[index].streams[streamIndex].uniqueValue = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("%d"),
+				WEBDAV_READ_STREAMS + (index * WEBDAV_EVENT_THREAD_STREAMS) + streamIndex);
+			require_action(gEventThreads[index].streams[streamIndex].uniqueValue != NULL, CFStringCreateWithFormat, error = ENOMEM);
+		}
+		
+		memset(&sourceContext, 0, sizeof(sourceContext));
+		sourceContext.info = &gEventThreads[index];
+		sourceContext.perform = event_thread_perform;
+		gEventThreads[index].source = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &sourceContext);
+		require_action(gEventThreads[index].source != NULL, CFRunLoopSourceCreate, error = ENOMEM);
+		
+		error = pthread_create(&event_thread_id, &event_thread_attr, event_thread, &gEventThreads[index]);
+		require_noerr(error, pthread_create);
+		
+		/* wait for the thread's run loop */
+		error = pthread_mutex_lock(&gEventThreads[index].lock);
+		require_noerr(error, pthread_mutex_lock);
+		while ( gEventThreads[index].runLoop == NULL )
+		{
+			error = pthread_cond_wait(&gEventThreads[index].started, &gEventThreads[index].lock);
+			require_noerr(error, pthread_cond_wait);
+		}
+		error = pthread_mutex_unlock(&gEventThreads[index].lock);
+		require_noerr(error, pthread_mutex_unlock);
+	}
+
+pthread_mutex_unlock:
+pthread_cond_wait:
+pthread_mutex_lock:
+pthread_create:
+CFRunLoopSourceCreate:
+CFStringCreateWithFormat:
+pthread_cond_init:
+pthread_mutex_init:
 	
+	pthread_attr_destroy(&event_thread_attr);
+
+pthread_attr_setdetachstate:
+pthread_attr_init:
+
 	return ( error );
 }
 
 /******************************************************************************/
 
-static int network_dir_is_empty(
-	uid_t uid,					/* -> uid of the user making the request */
-	CFURLRef urlRef)			/* -> url to check */
+/*
+ * event_transaction_start
+ *
+ * Gives a transaction to an event thread. The transaction's completion function
+ * will be called on that thread (even if the transaction couldn't be started).
+ */
+static void event_transaction_start(struct EventTransaction *transaction)
+{
+	struct EventThread *eventThread;
+	struct EventTransaction **queuePtr;
+	int mutexerror;
+	
+	transaction->next = NULL;
+	transaction->readStreamRec = NULL;
+	transaction->readStreamRef = NULL;
+	transaction->buffer = NULL;
+	transaction->bufferSize = 0;
+	transaction->count = 0;
+	transaction->response = NULL;
+	transaction->result = 0;
+	
+	/* pick the event thread round robin */
+	eventThread = &gEventThreads[(u_int32_t)OSAtomicIncrement32(&gNextEventThread) % WEBDAV_EVENT_THREADS];
+	transaction->eventThread = eventThread;
+	
+	/* add the transaction to the end of the thread's queue */
+	mutexerror = pthread_mutex_lock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	for ( queuePtr = &eventThread->queue; *queuePtr != NULL; queuePtr = &(*queuePtr)->next )
+	{
+		continue;
+	}
+	*queuePtr = transaction;
+	
+	mutexerror = pthread_mutex_unlock(&eventThread->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	/* and wake the thread up */
+	CFRunLoopSourceSignal(eventThread->source);
+	CFRunLoopWakeUp(eventThread->runLoop);
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/*
+ * event_thread_is_current
+ *
+ * Returns TRUE if the calling thread is one of the event threads.
+ */
+static int event_thread_is_current(void)
+{
+	CFRunLoopRef runLoop;
+	int index;
+	
+	runLoop = CFRunLoopGetCurrent();
+	for ( index = 0; index < WEBDAV_EVENT_THREADS; ++index )
+	{
+		if ( gEventThreads[index].runLoop == runLoop )
+		{
+			return ( TRUE );
+		}
+	}
+	return ( FALSE );
+}
+
+/******************************************************************************/
+
+/*
+ * stream_transaction_on_thread
+ *
+ * Creates an HTTP stream, sends the request and returns the response and response body.
+ * The calling thread does the I/O.
+ */
+static int stream_transaction_on_thread(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
+	CFIndex *count,				/* <- response data buffer length */
+	CFHTTPMessageRef *response)	/* <- the response message */
+{
+	struct ReadStreamRec *readStreamRecPtr;
+	CFIndex	totalRead;
+	UInt8 *currentbuffer;
+	UInt8 *newBuffer;
+	CFIndex bytesRead;
+	CFIndex bytesToRead;
+	CFIndex bufferSize;
+	CFTypeRef theResponsePropertyRef;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	CFHTTPMessageRef responseMessage;
+	int result;
+	
+	result = 0;
+	
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	
+	/* get an open ReadStreamRec */
+	result = open_stream_for_transaction(request, NULL, auto_redirect, retryTransaction, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
+	
+	/* malloc a buffer big enough for most responses */
+	bufferSize = BODY_BUFFER_SIZE;
+	currentbuffer = malloc(bufferSize);
+	require(currentbuffer != NULL, malloc_currentbuffer);
+
+	/* Send the message and get the response */
+	totalRead = 0;
+	while ( 1 )
+	{
+		bytesToRead = bufferSize - totalRead;
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, currentbuffer + totalRead, bytesToRead);
+		if ( bytesRead > 0 )
+		{
+			totalRead += bytesRead;
+			
+			/* is currentbuffer getting close to full? */
+			if ( (bytesToRead - bytesRead) < (BODY_BUFFER_SIZE / 2) )
+			{
+				/* yes, so get larger currentbuffer for next read */
+				bufferSize += BODY_BUFFER_SIZE;
+				newBuffer = realloc(currentbuffer, bufferSize);
+				require(newBuffer != NULL, realloc);
+				
+				currentbuffer = newBuffer;
+			}
+		}
+		else if ( bytesRead == 0 )
+		{
+			/* there are no more bytes to read */
+			break;
+		}
+		else
+		{
+			result = HandleSSLErrors(readStreamRecPtr->readStreamRef);
+			if ( result != EAGAIN )
+			{
+				if ( result != ECANCELED )
+				{
+					CFStreamError streamError;
+								
+					streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+					if ( *retryTransaction &&
+						((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+						 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+					{
+						/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+						syslog(LOG_INFO,"stream_transaction: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+						*retryTransaction = FALSE;
+						result = EAGAIN;
+					}
+					else
+					{
+						if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+						{
+							syslog(LOG_ERR,"stream_transaction: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+						}
+						set_connectionstate(WEBDAV_CONNECTION_DOWN);
+						result = stream_error_to_errno(&streamError);
+					}
+				}
+			}
+			goto CFReadStreamRead;
+		}
+	};
+	
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
+	
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	set_connectionstate(WEBDAV_CONNECTION_UP);
+	
+	/* Get the Connection header (if any) */
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	/* is the connection-token is "close"? */
+	if ( connectionHeaderRef != NULL )
+	{
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			/* yes -- then the server closed this connection, so close and release the read stream now */
+			CFReadStreamClose(readStreamRecPtr->readStreamRef);
+			CFRelease(readStreamRecPtr->readStreamRef);
+			readStreamRecPtr->readStreamRef = NULL;
+		}
+		CFRelease(connectionHeaderRef);
+	}
+	
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
+	}
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+		
+	*response = responseMessage;
+	*count = totalRead;
+	*buffer = currentbuffer;
+	
+	return ( 0 );
+
+	/**********************/
+
+GetResponseHeader:
+CFReadStreamRead:
+realloc:
+
+	free(currentbuffer);
+
+malloc_currentbuffer:
+
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+
+open_stream_for_transaction:
+connection_down:
+
+	*response = NULL;
+	*count = 0;
+	*buffer = NULL;
+	if ( result == 0 )
+	{
+		result = EIO;
+	}
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/* a transaction stream_transaction is waiting for */
+struct WaitTransaction
+{
+	struct EventTransaction transaction;	/* must be first */
+	pthread_mutex_t lock;					/* protects done */
+	pthread_cond_t condvar;					/* signaled when done is set */
+	int done;								/* TRUE when the transaction is complete */
+};
+
+static void wait_transaction_complete(struct EventTransaction *transaction)
+{
+	struct WaitTransaction *wait;
+	int mutexerror;
+	
+	wait = (struct WaitTransaction *)transaction;
+	
+	mutexerror = pthread_mutex_lock(&wait->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	wait->done = TRUE;
+	
+	mutexerror = pthread_cond_signal(&wait->condvar);
+	require_noerr_action(mutexerror, pthread_cond_signal, webdav_kill(-1));
+	
+	mutexerror = pthread_mutex_unlock(&wait->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_cond_signal:
+pthread_mutex_lock:
+
+	return;
+}
+
+/*
+ * stream_transaction
+ *
+ * Sends the request and returns the response and response body. The I/O is
+ * done by the event engine while the calling thread waits, so the transaction
+ * shares the engine's connections with the asynchronous ones. If the engine
+ * is off, or the caller is an event thread (which can't wait for itself), the
+ * calling thread does the I/O.
+ */
+static int stream_transaction(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int auto_redirect,			/* -> if TRUE, set kCFStreamPropertyHTTPShouldAutoredirect on stream */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */ 
+	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing) */
+	CFIndex *count,				/* <- response data buffer length */
+	CFHTTPMessageRef *response)	/* <- the response message */
+{
+	struct WaitTransaction wait;
+	int result;
+	int mutexerror;
+	
+	if ( !gEventEngine || event_thread_is_current() )
+	{
+		return ( stream_transaction_on_thread(request, auto_redirect, retryTransaction, buffer, count, response) );
+	}
+	
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_action_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down, result = EIO);
+	
+	result = pthread_mutex_init(&wait.lock, NULL);
+	require_noerr(result, pthread_mutex_init);
+	
+	result = pthread_cond_init(&wait.condvar, NULL);
+	require_noerr(result, pthread_cond_init);
+	
+	wait.done = FALSE;
+	wait.transaction.request = request;
+	wait.transaction.auto_redirect = auto_redirect;
+	wait.transaction.retryTransaction = *retryTransaction;
+	wait.transaction.completion = wait_transaction_complete;
+	wait.transaction.context = NULL;
+	
+	event_transaction_start(&wait.transaction);
+	
+	/* wait for wait_transaction_complete */
+	mutexerror = pthread_mutex_lock(&wait.lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	while ( !wait.done )
+	{
+		mutexerror = pthread_cond_wait(&wait.condvar, &wait.lock);
+		require_noerr_action(mutexerror, pthread_cond_wait, webdav_kill(-1));
+	}
+	mutexerror = pthread_mutex_unlock(&wait.lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	pthread_cond_destroy(&wait.condvar);
+	pthread_mutex_destroy(&wait.lock);
+	
+	/* event_transaction_finish only returns the response and buffer on success */
+	*retryTransaction = wait.transaction.retryTransaction;
+	*response = wait.transaction.response;
+	*count = wait.transaction.count;
+	*buffer = wait.transaction.buffer;
+	
+	return ( wait.transaction.result );
+
+	/**********************/
+
+pthread_mutex_unlock:
+pthread_cond_wait:
+pthread_mutex_lock:
+	
+	/* webdav_kill is already on its way -- don't free what the event thread may still use */
+	*response = NULL;
+	*count = 0;
+	*buffer = NULL;
+	
+	return ( EIO );
+
+pthread_cond_init:
+
+	pthread_mutex_destroy(&wait.lock);
+
+pthread_mutex_init:
+connection_down:
+
+	*response = NULL;
+	*count = 0;
+	*buffer = NULL;
+	
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * create_transaction_request
+ *
+ * Creates a request with the message body (if any), the User-Agent and other
+ * standard headers, cookies, and the caller's headers. Credentials are not
+ * applied. Returns NULL if the request could not be created.
+ */
+static CFHTTPMessageRef create_transaction_request(
+	CFURLRef url,						/* -> url to the resource */
+	CFStringRef requestMethod,			/* -> the request method */
+	CFDataRef bodyData,					/* -> message body data, or NULL if no body */
+	CFIndex headerCount,				/* -> number of headers */
+	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
+	int auto_redirect)					/* -> TRUE if the stream will be automatically redirected */
+{
+	CFIndex i;
+	struct HeaderFieldValue *headerPtr;
+	CFHTTPMessageRef message;
+	
+	/* create a CFHTTP message object */
+	message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, requestMethod, url, kCFHTTPVersion1_1);
+	require(message != NULL, CFHTTPMessageCreateRequest);
+	
+	/* set the message body (if any) */
+	if ( bodyData != NULL )
+	{
+		CFHTTPMessageSetBody(message, bodyData);
+	}
+	
+	/* apply the User-Agent, X-Source-Id (if not auto redirecting), X-Apple-Realm-Support and Accept-Encoding (if decoded) headers */
+	apply_header_template(message, (auto_redirect ? 0 : HEADER_TEMPLATE_SOURCE_ID) | HEADER_TEMPLATE_REALM |
+		(method_accepts_encoding(requestMethod) ? HEADER_TEMPLATE_ACCEPT_ENCODING : 0));
+	
+	/* add cookies (if any) */
+	add_cookie_headers(message, url);
+	
+	/* add other HTTP headers (if any) */
+	for ( i = 0, headerPtr = headers; i < headerCount; ++i, ++headerPtr )
+	{
+		if (headerPtr->headerField && headerPtr->value) {
+			CFHTTPMessageSetHeaderFieldValue(message, headerPtr->headerField, headerPtr->value);
+		}
+	}
+
+CFHTTPMessageCreateRequest:
+
+	return ( message );
+}
+
+/******************************************************************************/
+
+/*
+ * A TransactionStreamer sends a request and reads the response. It returns the
+ * response body in buffer unless it consumes the body itself.
+ */
+typedef int (*TransactionStreamer)(
+	CFHTTPMessageRef request,	/* -> the request to send */
+	int auto_redirect,			/* -> if TRUE, the stream is automatically redirected */
+	int *retryTransaction,		/* -> if TRUE, return EAGAIN on errors when streamError is kCFStreamErrorDomainPOSIX/EPIPE and set retryTransaction to FALSE */
+	void *context,				/* -> the streamer's context */
+	UInt8 **buffer,				/* <- response data buffer (caller responsible for freeing), or NULL */
+	CFIndex *count,				/* <- response data buffer length */
+	CFHTTPMessageRef *response);	/* <- the response message */
+
+/* TransactionStreamer that returns the response body in a buffer */
+static int buffer_streamer(
+	CFHTTPMessageRef request,
+	int auto_redirect,
+	int *retryTransaction,
+	void *context,
+	UInt8 **buffer,
+	CFIndex *count,
+	CFHTTPMessageRef *response)
+{
+	#pragma unused(context)
+	return ( stream_transaction(request, auto_redirect, retryTransaction, buffer, count, response) );
+}
+
+/* the context of readdir_streamer */
+struct ReaddirStreamerContext
+{
+	uid_t uid;					/* uid of the user making the request */
+	CFURLRef url;				/* url to the directory */
+	struct node_entry *node;	/* directory node to read */
+};
+
+/* TransactionStreamer that parses a directory listing into the directory's cache file */
+static int readdir_streamer(
+	CFHTTPMessageRef request,
+	int auto_redirect,
+	int *retryTransaction,
+	void *context,
+	UInt8 **buffer,
+	CFIndex *count,
+	CFHTTPMessageRef *response)
+{
+	#pragma unused(auto_redirect)
+	struct ReaddirStreamerContext *readdirContext = (struct ReaddirStreamerContext *)context;
+	
+	*buffer = NULL;
+	*count = 0;
+	return ( stream_readdir_transaction(request, retryTransaction, readdirContext->uid, readdirContext->url, readdirContext->node, response) );
+}
+
+/******************************************************************************/
+
+/*
+ * send_streamed_transaction
+ *
+ * Creates a request, adds the message body, headers and authentication if needed,
+ * and then calls streamer to send the request to the server and get the server's
+ * response. If the caller requests the response body and/or the response message,
+ * they are returned. Otherwise, they are freed/released.
+ *
+ * The 'node' parameter is needed for handling http redirects:
+ * auto_redirect true  - node involved in the transaction, NULL if root node.
+ * auto_redirect false - node is not used.
+ */
+static int send_streamed_transaction(
+	uid_t uid,							/* -> uid of the user making the request */
+	CFURLRef url,						/* -> url to the resource */
+	struct node_entry *node,			/* <- the node involved in the transaction (needed to handle http redirects if auto_redirect if false) */
+	CFStringRef requestMethod,			/* -> the request method */
+	CFDataRef bodyData,					/* -> message body data, or NULL if no body */
+	CFIndex headerCount,				/* -> number of headers */
+	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
+	enum RedirectAction redirectAction,		/* -> specifies how to handle http 3xx redirection */
+	TransactionStreamer streamer,		/* -> sends the request and reads the response */
+	void *streamerContext,				/* -> passed to streamer */
+	UInt8 **buffer,						/* <- if not NULL, response data buffer is returned here (caller responsible for freeing) */
+	CFIndex *count,						/* <- if not NULL, response data buffer length is returned here*/
+	CFHTTPMessageRef *response)			/* <- if not NULL, response is returned here */
+{
+	int error;
+	CFHTTPMessageRef message;
+	CFHTTPMessageRef responseRef;
+	CFIndex statusCode;
+	UInt32 auth_generation;
+	UInt8 *responseBuffer;
+	CFIndex responseBufferLength;
+	int retryTransaction;
+	int auto_redirect;
+	
+	error = 0;
+	responseBuffer = NULL;
+	responseBufferLength = 0;
+	message = NULL;
+	responseRef = NULL;
+	statusCode = 0;
+	auth_generation = 0;
+	retryTransaction = TRUE;
+	
+	if (redirectAction == REDIRECT_AUTO)
+		auto_redirect = TRUE;
+	else
+		auto_redirect = FALSE;
+
+	/* the transaction/authentication loop */
+	do
+	{
+		/* release message if left from previous loop */
+		if ( message != NULL )
+		{
+			CFRelease(message);
+			message = NULL;
+		}
+		/* create a CFHTTP message object */
+		message = create_transaction_request(url, requestMethod, bodyData, headerCount, headers, auto_redirect);
+		require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
+		
+		/* apply credentials (if any) */
+		/*
+		 * statusCode will be 401 or 407 and responseRef will not be NULL if we've already been through the loop;
+		 * statusCode will be 0 and responseRef will be NULL if this is the first time through.
+		 */
+		error = authcache_apply(uid, message, (UInt32)statusCode, responseRef, &auth_generation);
+		if ( error != 0 )
+		{
+			break;
+		}
+		
+		/* the streamer returns responseRef and responseBuffer so release them if left from previous loop */
+		if ( responseBuffer != NULL )
+		{
+			free(responseBuffer);
+			responseBuffer = NULL;
+			responseBufferLength = 0;
+		}
+		if ( responseRef != NULL )
+		{
+			CFRelease(responseRef);
+			responseRef = NULL;
+		}
+		/* now that everything's ready to send, send it */
+		error = streamer(message, auto_redirect, &retryTransaction, streamerContext, &responseBuffer, &responseBufferLength, &responseRef);
+		if ( error == EAGAIN )
+		{
+			statusCode = 0;
+			/* responseRef will be left NULL on retries */
+		}
+		else
+		{
+			if ( error != 0 )
+			{
+				break;
+			}
+			
+			/* get the status code */
+			statusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
+			
+			if ( (redirectAction == REDIRECT_MANUAL) && ((statusCode / 100) == 3)) {
+				// Handle a 3XX Redirection
+				error = nodecache_redirect_node(url, node, responseRef, statusCode);
+				if (!error) {
+					// Let the caller know the node was redirected
+					error = EDESTADDRREQ;
+					break;
+				}
+			}			
+		}
+	} while ( error == EAGAIN || statusCode == 401 || statusCode == 407 );
+
+CFHTTPMessageCreateRequest:
+	
+	if ( error == 0 )
+	{
+		error = (int)translate_status_to_error((UInt32)statusCode);
+		if ( error == 0 )
+		{
+			/*
+			 * when we get here with no errors, then we need to tell the authcache the
+			 * transaction worked so it can mark the credentials valid and, if needed
+			 * add the credentials to the keychain. If the auth_generation changed, then
+			 * another transaction updated the authcache element after we got it.
+			 */
+			(void) authcache_valid(uid, message, auth_generation);
+			
+			/* decode the response body if the server encoded it */
+			if ( (responseBuffer != NULL) && method_accepts_encoding(requestMethod) )
+			{
+				error = decode_response_buffer(responseRef, &responseBuffer, &responseBufferLength);
+			}
+		}
+		
+		if ( (error != 0) && (responseBuffer != NULL) )
+		{
+			free(responseBuffer);
+			responseBuffer = NULL;
+		}
+	}
+	
+	if ( message != NULL )
+	{
+		CFRelease(message);
+	}
+	
+	/* return requested output parameters */
+	if ( buffer != NULL )
+	{
+		*buffer = responseBuffer;
+	}
+	else
+	{
+		if ( responseBuffer != NULL )
+		{
+			free(responseBuffer);
+		}
+	}
+	
+	if ( count != NULL )
+	{
+		*count = responseBufferLength;
+	}
+	
+	if ( response != NULL )
+	{
+		/* the caller wants the response and will release it */
+		*response = responseRef;
+	}
+	else
+	{
+		if ( responseRef != NULL )
+		{
+			CFRelease(responseRef);
+		}
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * send_transaction
+ *
+ * Sends a request with send_streamed_transaction and returns the response body
+ * (if requested) in a buffer.
+ */
+static int send_transaction(
+	uid_t uid,							/* -> uid of the user making the request */
+	CFURLRef url,						/* -> url to the resource */
+	struct node_entry *node,			/* <- the node involved in the transaction (needed to handle http redirects if auto_redirect if false) */
+	CFStringRef requestMethod,			/* -> the request method */
+	CFDataRef bodyData,					/* -> message body data, or NULL if no body */
+	CFIndex headerCount,				/* -> number of headers */
+	struct HeaderFieldValue *headers,	/* -> pointer to array of struct HeaderFieldValue, or NULL if none */
+	enum RedirectAction redirectAction,		/* -> specifies how to handle http 3xx redirection */
+	UInt8 **buffer,						/* <- if not NULL, response data buffer is returned here (caller responsible for freeing) */
+	CFIndex *count,						/* <- if not NULL, response data buffer length is returned here*/
+	CFHTTPMessageRef *response)			/* <- if not NULL, response is returned here */
+{
+	return ( send_streamed_transaction(uid, url, node, requestMethod, bodyData, headerCount, headers, redirectAction,
+		buffer_streamer, NULL, buffer, count, response) );
+}
+
+/*****************************************************************************/
+
+/*
+ * send_readdir_transaction
+ *
+ * Sends a PROPFIND request for a directory listing with send_streamed_transaction,
+ * but the response body is parsed into the directory's cache file by
+ * stream_readdir_transaction as it arrives instead of being returned in a buffer.
+ * Redirection is handled manually: EDESTADDRREQ is returned if the node was
+ * redirected.
+ */
+static int send_readdir_transaction(
+	uid_t uid,							/* -> uid of the user making the request */
+	CFURLRef url,						/* -> url to the directory */
+	struct node_entry *node,			/* -> directory node to read */
+	CFDataRef bodyData,					/* -> message body data */
+	CFIndex headerCount,				/* -> number of headers */
+	struct HeaderFieldValue *headers)	/* -> pointer to array of struct HeaderFieldValue */
+{
+	struct ReaddirStreamerContext context;
+	
+	context.uid = uid;
+	context.url = url;
+	context.node = node;
+	return ( send_streamed_transaction(uid, url, node, CFSTR("PROPFIND"), bodyData, headerCount, headers, REDIRECT_MANUAL,
+		readdir_streamer, &context, NULL, NULL, NULL) );
+}
+
+/*****************************************************************************/
+
+/*
+ * ParseDAVLevel parses a DAV header's field-value (if any) to get the DAV level.
+ *	Input:
+ *		responsePropertyRef	the response message
+ *	Outputs:
+ *		dav_level			the dav_level (0 = DAV not supported)
+ *
+ * The rules for message headers are (rfc 2518, section 9.1):
+ *
+ *	DAV = "DAV" ":" "1" ["," "2"] ["," 1#extend]
+ *	extend = Coded-URL | token
+ *
+ * (Note: The rules for extend are still not in the rfc - they were taken from
+ * messages in the WebDAV discussion list and are needed to interoperability
+ * with Apache 2.0 servers which put Coded-URLs in DAV headers.)
+ */
+static void ParseDAVLevel(CFHTTPMessageRef responsePropertyRef, int *dav_level)
+{
+	CFStringRef davHeaderRef;
+	const char *field_value;
+	char buffer[4096];
+	const char *token;
+	
+	*dav_level = 0;
+	
+	davHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responsePropertyRef, CFSTR("DAV"));
+	if ( davHeaderRef )
+	{
+		field_value = CFStringGetCStringPtr(davHeaderRef, kCFStringEncodingUTF8);
+		if ( field_value == NULL )
+		{
+			if ( CFStringGetCString(davHeaderRef, buffer, 4096, kCFStringEncodingUTF8) )
+			{
+				field_value = buffer;
+			}
+		}
+		CFRelease(davHeaderRef);
+		
+		if ( field_value != NULL )
+		{
+			while ( *field_value != '\0' )
+			{
+				/* find first non-LWS character */
+				field_value = SkipLWS(field_value);
+				if ( *field_value == '\0' )
+				{
+					/* if we're at end of string, break out of main while loop */
+					break;
+				}
+				
+				/* is value a token or a Coded-URL? */
+				if ( *field_value == '<' )
+				{
+					/* it's a Coded-URL, so eat it */
+					
+					/* skip over '<' */
+					++field_value;
+					
+					/* find '>"' marking the end of the quoted-string */
+					field_value = SkipCodedURL(field_value);
+					
+					if ( *field_value != '\0' )
+					{
+						/* skip over '>' */
+						++field_value;
+					}
+				}
+				else
+				{
+					/* it's a token */
+					
+					/* mark start of the value token */
+					token = field_value;
+					
+					/* find the end of the value token */
+					field_value = SkipToken(field_value);
+					
+					/* could this token be '1' or '2'? */
+					if ( (field_value - token) == 1 )
+					{
+						if ( (*token == '1') && (*dav_level < 1) )
+						{
+							*dav_level = 1;
+						}
+						else if ( *token == '2' && (*dav_level < 2) )
+						{
+							*dav_level = 2;
+						}
+					}
+				}
+				
+				/* skip over LWS (if any) */
+				field_value = SkipLWS(field_value);
+				
+				/* if there's any string left after the LWS... */
+				if ( *field_value != '\0' )
+				{
+					/* we should have found a comma */
+					if ( *field_value != ',' )
+					{
+						/* if not, break out of main while loop */
+						break;
+					}
+					
+					/* skip over one or more commas */
+					while ( *field_value == ',' )
+					{
+						++field_value;
+					}
+				}
+				
+				/*
+				 * field_value is now pointing at first character after comma
+				 * delimiter, or at end of string
+				 */
+			}
+		}
+	}
+}
+
+/*****************************************************************************/
+static void identifyServerType(CFHTTPMessageRef responsePropertyRef)
+{	
+	CFStringRef serverHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responsePropertyRef, CFSTR("Server"));
+	if ( serverHeaderRef != NULL ) {
+		if (CFStringHasPrefix(serverHeaderRef, CFSTR("Microsoft-IIS/")) == TRUE) {
+			gServerIdent = WEBDAV_MICROSOFT_IIS_SERVER;
+			/* the server identity is part of the header template */
+			build_header_template();
+		}
+
+		CFRelease(serverHeaderRef);
+	}
+}
+
+/******************************************************************************/
+
+/*
+ * The server profile
+ *
+ * The server's capabilities are probed by network_mount and saved (per server
+ * URL) in WEBDAV_SERVER_PROFILE_FILE. That's a fixed local path rather than the
+ * user's preferences because the home directory can be networked, and going
+ * through it could recurse through automount (see mount_webdav.c). The
+ * OPTIONS request is sent at every mount
+ * (it decides the DAV level, MNT_RDONLY, redirection of the base URL and the
+ * server's identity), and what it says replaces the saved values it covers.
+ * Only the extra probes are skipped when a saved profile is found. Capabilities
+ * that can only be seen in responses to ordinary requests (byte ranges, strong
+ * entity tags, ...) are learned with network_learn_server_capability as the
+ * agent runs. A saved profile older than WEBDAV_SERVER_PROFILE_MAX_AGE is probed
+ * again in case the server changed.
+ */
+#define WEBDAV_SERVER_PROFILE_FILE _PATH_VARTMP ".webdavprofiles.%lu.plist"	/* the profiles of a uid's servers, by base URL */
+#define WEBDAV_SERVER_PROFILE_FILE_MAX 0x00100000	/* 1MB -- anything larger isn't ours */
+#define WEBDAV_SERVER_PROFILE_MAX_AGE (7.0 * 24.0 * 60.0 * 60.0)	/* in seconds */
+
+struct ServerProfile
+{
+	int dav_level;				/* the DAV level from the OPTIONS response */
+	u_int32_t server_ident;		/* gServerIdent */
+	u_int32_t known;			/* WEBDAV_CAPABILITY_* bits that have been probed or learned */
+	u_int32_t supported;		/* the known WEBDAV_CAPABILITY_* bits the server supports */
+	u_int32_t options_known;	/* the known bits this mount's OPTIONS response decided (not saved) */
+	CFAbsoluteTime probed;		/* when the extra probes were sent */
+	int changed;				/* TRUE if the profile should be saved */
+};
+
+/* gServerProfile is protected by gNetworkGlobals_lock once the mount is complete */
+static struct ServerProfile gServerProfile = { 0, 0, 0, 0, 0, 0.0, FALSE };
+
+/******************************************************************************/
+
+int network_server_capability(u_int32_t capability)
+{
+	int result;
+	int mutexerror;
+	
+	result = WEBDAV_CAPABILITY_UNKNOWN;
+	
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	if ( gServerProfile.known & capability )
+	{
+		result = (gServerProfile.supported & capability) ? WEBDAV_CAPABILITY_SUPPORTED : WEBDAV_CAPABILITY_UNSUPPORTED;
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+void network_learn_server_capability(u_int32_t capability, int supported)
+{
+	int mutexerror;
+	u_int32_t newSupported;
+	
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	newSupported = supported ? (gServerProfile.supported | capability) : (gServerProfile.supported & ~capability);
+	if ( ((gServerProfile.known & capability) != capability) || (newSupported != gServerProfile.supported) )
+	{
+		gServerProfile.known |= capability;
+		gServerProfile.supported = newSupported;
+		gServerProfile.changed = TRUE;
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/* gets a number from a saved server profile; returns FALSE if it's not there */
+static int get_server_profile_number(CFDictionaryRef profileDict, CFStringRef key, CFNumberType numberType, void *value)
+{
+	CFNumberRef numberRef;
+	
+	numberRef = CFDictionaryGetValue(profileDict, key);
+	return ( (numberRef != NULL) && (CFGetTypeID(numberRef) == CFNumberGetTypeID()) &&
+		CFNumberGetValue(numberRef, numberType, value) );
+}
+
+/*
+ * copy_server_profiles returns the dictionary of saved server profiles from
+ * WEBDAV_SERVER_PROFILE_FILE, or NULL if there isn't one. The file is in a
+ * directory anyone can write, so it's only used if it's a regular file owned
+ * by the user that no one else can write.
+ */
+static CFDictionaryRef copy_server_profiles(void)
+{
+	char path[MAXPATHLEN];
+	int fd;
+	struct stat statbuf;
+	UInt8 *buffer;
+	CFDataRef dataRef;
+	CFPropertyListRef profilesRef;
+	
+	profilesRef = NULL;
+	
+	snprintf(path, sizeof(path), WEBDAV_SERVER_PROFILE_FILE, (unsigned long)getuid());
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	require_quiet(fd != -1, open);
+	
+	require_quiet((fstat(fd, &statbuf) == 0) && S_ISREG(statbuf.st_mode) && (statbuf.st_uid == getuid()) &&
+		((statbuf.st_mode & (S_IWGRP | S_IWOTH)) == 0) && (statbuf.st_size <= WEBDAV_SERVER_PROFILE_FILE_MAX), not_ours);
+	
+	buffer = malloc((size_t)statbuf.st_size);
+	require(buffer != NULL, malloc_buffer);
+	require_quiet(read(fd, buffer, (size_t)statbuf.st_size) == statbuf.st_size, read);
+	
+	dataRef = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, buffer, (CFIndex)statbuf.st_size, kCFAllocatorNull);
+	require(dataRef != NULL, CFDataCreateWithBytesNoCopy);
+	
+	profilesRef = CFPropertyListCreateWithData(kCFAllocatorDefault, dataRef, kCFPropertyListImmutable, NULL, NULL);
+	if ( (profilesRef != NULL) && (CFGetTypeID(profilesRef) != CFDictionaryGetTypeID()) )
+	{
+		CFRelease(profilesRef);
+		profilesRef = NULL;
+	}
+	
+	CFRelease(dataRef);
+
+CFDataCreateWithBytesNoCopy:
+read:
+
+	free(buffer);
+
+malloc_buffer:
+not_ours:
+
+	close(fd);
+
+open:
+
+	return ( (CFDictionaryRef)profilesRef );
+}
+
+/*
+ * write_server_profiles replaces WEBDAV_SERVER_PROFILE_FILE with profilesDict.
+ * The new file is written beside it and renamed over it so a reader never sees
+ * it half written.
+ */
+static void write_server_profiles(CFDictionaryRef profilesDict)
+{
+	char path[MAXPATHLEN];
+	char tempPath[MAXPATHLEN];
+	int fd;
+	CFDataRef dataRef;
+	
+	dataRef = CFPropertyListCreateData(kCFAllocatorDefault, profilesDict, kCFPropertyListBinaryFormat_v1_0, 0, NULL);
+	require(dataRef != NULL, CFPropertyListCreateData);
+	
+	snprintf(path, sizeof(path), WEBDAV_SERVER_PROFILE_FILE, (unsigned long)getuid());
+	snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", path);
+	
+	/* mkstemp creates the file readable and writable by the user only */
+	fd = mkstemp(tempPath);
+	require_quiet(fd != -1, mkstemp);
+	
+	if ( (write(fd, CFDataGetBytePtr(dataRef), (size_t)CFDataGetLength(dataRef)) != CFDataGetLength(dataRef)) ||
+		 (close(fd) != 0) || (rename(tempPath, path) != 0) )
+	{
+		(void) unlink(tempPath);
+	}
+
+mkstemp:
+
+	CFRelease(dataRef);
+
+CFPropertyListCreateData:
+
+	return;
+}
+
+/*
+ * load_server_profile adds the profile saved for the server at the base URL by
+ * an earlier mount. Returns TRUE if there was one and it's not too old.
+ */
+static int load_server_profile(void)
+{
+	CFDictionaryRef profilesRef;
+	CFPropertyListRef profileRef;
+	CFDictionaryRef profileDict;
+	struct ServerProfile profile;
+	int result;
+	
+	result = FALSE;
+	
+	profilesRef = copy_server_profiles();
+	require_quiet(profilesRef != NULL, copy_server_profiles);
+	
+	profileRef = CFDictionaryGetValue(profilesRef, CFURLGetString(gBaseURL));
+	require_quiet((profileRef != NULL) && (CFGetTypeID(profileRef) == CFDictionaryGetTypeID()), not_a_profile);
+	
+	profileDict = (CFDictionaryRef)profileRef;
+	require_quiet(get_server_profile_number(profileDict, CFSTR("DAVLevel"), kCFNumberIntType, &profile.dav_level) &&
+		get_server_profile_number(profileDict, CFSTR("ServerIdent"), kCFNumberSInt32Type, &profile.server_ident) &&
+		get_server_profile_number(profileDict, CFSTR("Known"), kCFNumberSInt32Type, &profile.known) &&
+		get_server_profile_number(profileDict, CFSTR("Supported"), kCFNumberSInt32Type, &profile.supported) &&
+		get_server_profile_number(profileDict, CFSTR("Probed"), kCFNumberDoubleType, &profile.probed), not_a_profile);
+	
+	/* is it too old (or from the future)? */
+	require_quiet((profile.probed <= CFAbsoluteTimeGetCurrent()) &&
+		((CFAbsoluteTimeGetCurrent() - profile.probed) < WEBDAV_SERVER_PROFILE_MAX_AGE), not_a_profile);
+	
+	/* save it again if this mount's OPTIONS response disagrees with it */
+	gServerProfile.changed = (profile.dav_level != gServerProfile.dav_level) ||
+		(profile.server_ident != gServerProfile.server_ident) ||
+		((profile.known & gServerProfile.options_known) != gServerProfile.options_known) ||
+		((profile.supported & gServerProfile.options_known) != (gServerProfile.supported & gServerProfile.options_known));
+	
+	/* keep what OPTIONS just told us, and take the rest from the saved profile */
+	gServerProfile.known |= (profile.known & ~gServerProfile.options_known);
+	gServerProfile.supported |= (profile.supported & ~gServerProfile.options_known);
+	gServerProfile.probed = profile.probed;
+	
+	result = TRUE;
+
+not_a_profile:
+
+	CFRelease(profilesRef);
+
+copy_server_profiles:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+static void add_server_profile_number(CFMutableDictionaryRef profileDict, CFStringRef key, CFNumberType numberType, const void *value)
+{
+	CFNumberRef numberRef;
+	
+	numberRef = CFNumberCreate(kCFAllocatorDefault, numberType, value);
+	if ( numberRef != NULL )
+	{
+		CFDictionarySetValue(profileDict, key, numberRef);
+		CFRelease(numberRef);
+	}
+}
+
+void network_save_server_profile(void)
+{
+	struct ServerProfile profile;
+	CFMutableDictionaryRef profileDict;
+	CFDictionaryRef profilesRef;
+	CFMutableDictionaryRef profilesDict;
+	int mutexerror;
+	
+	mutexerror = pthread_mutex_lock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	profile = gServerProfile;
+	gServerProfile.changed = FALSE;
+	
+	mutexerror = pthread_mutex_unlock(&gNetworkGlobals_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	require_quiet(profile.changed, not_changed);
+	
+	profileDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	require(profileDict != NULL, CFDictionaryCreateMutable);
+	
+	add_server_profile_number(profileDict, CFSTR("DAVLevel"), kCFNumberIntType, &profile.dav_level);
+	add_server_profile_number(profileDict, CFSTR("ServerIdent"), kCFNumberSInt32Type, &profile.server_ident);
+	add_server_profile_number(profileDict, CFSTR("Known"), kCFNumberSInt32Type, &profile.known);
+	add_server_profile_number(profileDict, CFSTR("Supported"), kCFNumberSInt32Type, &profile.supported);
+	add_server_profile_number(profileDict, CFSTR("Probed"), kCFNumberDoubleType, &profile.probed);
+	
+	/* replace this server's profile and keep the others */
+	profilesRef = copy_server_profiles();
+	if ( profilesRef != NULL )
+	{
+		profilesDict = CFDictionaryCreateMutableCopy(kCFAllocatorDefault, 0, profilesRef);
+		CFRelease(profilesRef);
+	}
+	else
+	{
+		profilesDict = CFDictionaryCreateMutable(kCFAllocatorDefault, 0, &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+	}
+	if ( profilesDict != NULL )
+	{
+		CFDictionarySetValue(profilesDict, CFURLGetString(gBaseURL), profileDict);
+		write_server_profiles(profilesDict);
+		CFRelease(profilesDict);
+	}
+	
+	CFRelease(profileDict);
+
+CFDictionaryCreateMutable:
+not_changed:
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/* returns TRUE if a comma separated header field-value list contains token */
+static int header_list_contains(CFHTTPMessageRef responseRef, CFStringRef headerField, CFStringRef token)
+{
+	CFStringRef headerRef;
+	CFArrayRef listRef;
+	CFStringRef elementRef;
+	CFMutableStringRef trimmedRef;
+	CFIndex index;
+	int result;
+	
+	result = FALSE;
+	
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseRef, headerField);
+	require_quiet(headerRef != NULL, no_header);
+	
+	listRef = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault, headerRef, CFSTR(","));
+	require(listRef != NULL, CFStringCreateArrayBySeparatingStrings);
+	
+	for ( index = 0; (index < CFArrayGetCount(listRef)) && !result; ++index )
+	{
+		elementRef = CFArrayGetValueAtIndex(listRef, index);
+		trimmedRef = CFStringCreateMutableCopy(kCFAllocatorDefault, 0, elementRef);
+		if ( trimmedRef != NULL )
+		{
+			CFStringTrimWhitespace(trimmedRef);
+			result = (CFStringCompare(trimmedRef, token, kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+			CFRelease(trimmedRef);
+		}
+	}
+	
+	CFRelease(listRef);
+
+CFStringCreateArrayBySeparatingStrings:
+
+	CFRelease(headerRef);
+
+no_header:
+
+	return ( result );
+}
+
+/*
+ * record_options_capabilities records what the OPTIONS response sent at mount
+ * says about the server. It starts the profile over; load_server_profile or the
+ * extra probes fill in the rest.
+ */
+static void record_options_capabilities(CFHTTPMessageRef responseRef, int dav_level)
+{
+	gServerProfile.dav_level = dav_level;
+	gServerProfile.server_ident = gServerIdent;
+	gServerProfile.probed = 0.0;
+	gServerProfile.changed = FALSE;
+	
+	gServerProfile.known = WEBDAV_CAPABILITY_LOCK | WEBDAV_CAPABILITY_COPY;
+	gServerProfile.supported = 0;
+	
+	if ( dav_level >= 2 )
+	{
+		gServerProfile.supported |= WEBDAV_CAPABILITY_LOCK;
+	}
+	
+	if ( header_list_contains(responseRef, CFSTR("Allow"), CFSTR("COPY")) )
+	{
+		gServerProfile.supported |= WEBDAV_CAPABILITY_COPY;
+	}
+	
+	/* servers that answer OPTIONS with Accept-Ranges tell us about byte ranges up front */
+	if ( header_list_contains(responseRef, CFSTR("Accept-Ranges"), CFSTR("bytes")) )
+	{
+		gServerProfile.known |= WEBDAV_CAPABILITY_RANGE;
+		gServerProfile.supported |= WEBDAV_CAPABILITY_RANGE;
+	}
+	else if ( header_list_contains(responseRef, CFSTR("Accept-Ranges"), CFSTR("none")) )
+	{
+		gServerProfile.known |= WEBDAV_CAPABILITY_RANGE;
+	}
+	
+	gServerProfile.options_known = gServerProfile.known;
+}
+
+/******************************************************************************/
+
+/*
+ * probe_sync_collection asks the server for the base URL's supported-report-set
+ * to find out if it supports the sync-collection REPORT (rfc 6578). Errors are
+ * not fatal; the capability just stays unknown.
+ */
+static void probe_sync_collection(uid_t uid)
+{
+	int error;
+	CFURLRef urlRef;
+	CFDataRef bodyData;
+	UInt8 *responseBuffer;
+	CFIndex count;
+	/* the xml for the message body */
+	const UInt8 xmlString[] =
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<D:propfind xmlns:D=\"DAV:\">\n"
+			"<D:prop>\n"
+				"<D:supported-report-set/>\n"
+			"</D:prop>\n"
+		"</D:propfind>\n";
+	/* the 3 headers */
+	CFIndex headerCount = 3;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("Content-Type"), CFSTR("text/xml") },
+		{ CFSTR("Depth"), CFSTR("0") }
+	};
+	
+	urlRef = nodecache_get_baseURL();
+	require_quiet(urlRef != NULL, nodecache_get_baseURL);
+	
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, xmlString, strlen((const char *)xmlString), kCFAllocatorNull);
+	require(bodyData != NULL, CFDataCreateWithBytesNoCopy);
+	
+	error = send_transaction(uid, urlRef, NULL, CFSTR("PROPFIND"), bodyData,
+		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &count, NULL);
+	if ( !error )
+	{
+		/* the report's element name is only used in a supported-report */
+		gServerProfile.known |= WEBDAV_CAPABILITY_SYNC_COLLECTION;
+		if ( (responseBuffer != NULL) && (memmem(responseBuffer, (size_t)count, "sync-collection", strlen("sync-collection")) != NULL) )
+		{
+			gServerProfile.supported |= WEBDAV_CAPABILITY_SYNC_COLLECTION;
+		}
+		free(responseBuffer);
+	}
+	
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+
+	CFRelease(urlRef);
+
+nodecache_get_baseURL:
+
+	return;
+}
+
+/******************************************************************************/
+
+#define WEBDAV_PARTIAL_PUT_PROBE_NAME ".webdavfs_partial_put_probe"	/* scratch resource in the base collection */
+
+/*
+ * probe_partial_put finds out if the server takes PUTs with Content-Range
+ * (segmented uploads -- see put_file_segments). It writes a scratch resource
+ * in the base collection in two halves, the second with a Content-Range, and
+ * checks the length the server ends up with: a server that ignores
+ * Content-Range replaces the resource with the second half. The first PUT
+ * has If-None-Match: * so a resource that already has the scratch name is
+ * never replaced (or deleted); the probe just isn't done. The scratch
+ * resource is deleted. Errors are not fatal; the capability just stays
+ * unknown and files are uploaded in one PUT.
+ */
+static void probe_partial_put(uid_t uid)
+{
+	int error;
+	CFURLRef baseURL;
+	CFURLRef urlRef;
+	CFDataRef bodyData;
+	CFHTTPMessageRef responseRef;
+	off_t length;
+	/* the two halves of the scratch resource */
+	const UInt8 firstHalf[] = "partial ";
+	const UInt8 secondHalf[] = "put test";
+	/* the 1 header for the first half */
+	CFIndex createHeaderCount = 1;
+	struct HeaderFieldValue createHeaders[] = {
+		{ CFSTR("If-None-Match"), CFSTR("*") }
+	};
+	/* the 1 header for the second half */
+	CFIndex headerCount = 1;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Content-Range"), CFSTR("bytes 8-15/16") }
+	};
+	
+	baseURL = nodecache_get_baseURL();
+	require_quiet(baseURL != NULL, nodecache_get_baseURL);
+	
+	urlRef = CFURLCreateCopyAppendingPathComponent(kCFAllocatorDefault, baseURL, CFSTR(WEBDAV_PARTIAL_PUT_PROBE_NAME), FALSE);
+	require(urlRef != NULL, CFURLCreateCopyAppendingPathComponent);
+	
+	/* create the scratch resource with the first half (a 412 means something already has its name) */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, firstHalf, strlen((const char *)firstHalf), kCFAllocatorNull);
+	require(bodyData != NULL, CFDataCreateWithBytesNoCopy);
+	error = send_transaction(uid, urlRef, NULL, CFSTR("PUT"), bodyData, createHeaderCount, createHeaders, REDIRECT_AUTO, NULL, NULL, NULL);
+	CFRelease(bodyData);
+	require_noerr_quiet(error, put_first_half);
+	
+	/* write the second half after it */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, secondHalf, strlen((const char *)secondHalf), kCFAllocatorNull);
+	require(bodyData != NULL, delete_scratch);
+	error = send_transaction(uid, urlRef, NULL, CFSTR("PUT"), bodyData, headerCount, headers, REDIRECT_AUTO, NULL, NULL, NULL);
+	CFRelease(bodyData);
+	if ( error == 0 )
+	{
+		/* the server has both halves only if it wrote the second one where the Content-Range said */
+		error = send_transaction(uid, urlRef, NULL, CFSTR("HEAD"), NULL, 0, NULL, REDIRECT_AUTO, NULL, NULL, &responseRef);
+		if ( error == 0 )
+		{
+			gServerProfile.known |= WEBDAV_CAPABILITY_PARTIAL_PUT;
+			if ( get_content_length(responseRef, &length) && (length == 16) )
+			{
+				gServerProfile.supported |= WEBDAV_CAPABILITY_PARTIAL_PUT;
+			}
+			CFRelease(responseRef);
+		}
+	}
+	else if ( (error != EIO) && (error != ETIMEDOUT) && (error != ENXIO) )
+	{
+		/* the server took the first half but refused the Content-Range */
+		gServerProfile.known |= WEBDAV_CAPABILITY_PARTIAL_PUT;
+	}
+	
+delete_scratch:
+
+	(void) send_transaction(uid, urlRef, NULL, CFSTR("DELETE"), NULL, 0, NULL, REDIRECT_AUTO, NULL, NULL, NULL);
+
+put_first_half:
+CFDataCreateWithBytesNoCopy:
+
+	CFRelease(urlRef);
+
+CFURLCreateCopyAppendingPathComponent:
+
+	CFRelease(baseURL);
+
+nodecache_get_baseURL:
+
+	return;
+}
+
+/******************************************************************************/
+static int network_getDAVLevel(
+	uid_t uid,					/* -> uid of the user making the request */
+	CFURLRef urlRef,			/* -> url */
+	int *dav_level)				/* <- DAV level */
+{
+	int error;
+	CFHTTPMessageRef response;
+	/* the 3 headers */
+	CFIndex headerCount = 1;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+	};
+		
+	*dav_level = 0;
+	syslog(LOG_ERR, "%s: ", __FUNCTION__);
+
+	/* send request to the server and get the response */
+	error = send_transaction(uid, urlRef, NULL, CFSTR("OPTIONS"), NULL,
+		headerCount, headers, REDIRECT_MANUAL, NULL, NULL, &response);
+	if ( !error ) {
+		/* get the DAV level */
+		ParseDAVLevel(response, dav_level);
+		
+		/* identify the type of server */
+		identifyServerType(response);
+		
+		/* start the server profile with what OPTIONS tells us */
+		record_options_capabilities(response, *dav_level);
+
+		/* release the response buffer */
+		CFRelease(response);
+	}
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+static
+int get_from_attributes_cache(struct node_entry *node, uid_t uid)
+{
+	ssize_t size;
+	int result;
+	
+	result = FALSE;	/* default to FALSE */
+	
+	if ( node_appledoubleheader_valid(node, uid) )
+	{
+		require(fchflags(node->file_fd, 0) == 0, fchflags);
+		require(lseek(node->file_fd, (off_t)0, SEEK_SET) != -1, lseek);
+		require(ftruncate(node->file_fd, 0LL) != -1, ftruncate);
+		/* we found the AppleDouble header in memcache */
+		size = write(node->file_fd, (void *)node->attr_appledoubleheader, APPLEDOUBLEHEADER_LENGTH);
+		if ( size != APPLEDOUBLEHEADER_LENGTH )
+		{
+			debug_string("write failed");
+			/* attempt to seek back to start of file, make sure it's empty, and then reset its status */
+			(void) lseek(node->file_fd, (off_t)0, SEEK_SET);
+			(void) ftruncate(node->file_fd, 0LL);
+			node->file_status = WEBDAV_DOWNLOAD_NEVER;
+			node->file_validated_time = 0;
+			node->file_last_modified = -1;
+			if ( node->file_entity_tag != NULL )
+			{
+				free(node->file_entity_tag);
+				node->file_entity_tag = NULL;
+			}
+		}
+		else
+		{
+			node->file_status = WEBDAV_DOWNLOAD_FINISHED;
+			node->file_validated_time = node->attr_appledoubleheader_time;
+			node->file_last_modified = (node->attr_stat_info.attr_stat.st_mtimespec.tv_sec != 0) ? node->attr_stat_info.attr_stat.st_mtimespec.tv_sec : -1;
+			/* ••••• should I get the etag when I get attr_appledoubleheader? probably */ 
+			if ( node->file_entity_tag != NULL )
+			{
+				free(node->file_entity_tag);
+				node->file_entity_tag = NULL;
+			}
+			result = TRUE;
+		}
+	}
+
+ftruncate:
+lseek:
+fchflags:
+	
+	return ( result );
+}	
+
+/******************************************************************************/
+
+/* the xml for the message body of the Depth 0 PROPFIND sent for network_stat and network_getattr_async */
+static const UInt8 gStatPropfindXML[] =
+	"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+	"<D:propfind xmlns:D=\"DAV:\">\n"
+		"<D:prop>\n"
+			"<D:getlastmodified/>\n"
+			"<D:getcontentlength/>\n"
+			"<D:creationdate/>\n"
+			"<D:resourcetype/>\n"
+		"</D:prop>\n"
+	"</D:propfind>\n";
+
+/* and its headers (the translate flag is only sent to Microsoft IIS Servers) */
+static struct HeaderFieldValue gStatPropfindHeaders[] = {
+	{ CFSTR("Accept"), CFSTR("*/*") },
+	{ CFSTR("Content-Type"), CFSTR("text/xml") },
+	{ CFSTR("Depth"), CFSTR("0") },
+	{ CFSTR("translate"), CFSTR("f") }
+};
+
+static CFIndex stat_propfind_header_count(void)
+{
+	return ( (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) ? 4 : 3 );
+}
+
+/******************************************************************************/
+
+/*
+ * send_stat_transaction sends the Depth 0 PROPFIND for network_stat.
+ */
+static int send_stat_transaction(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* <- the node involved in the request */
+	CFURLRef urlRef,			/* -> url to the resource */
+	enum RedirectAction redirectAction, /*  how to handle http 3xx redirection */
+	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer */
+{
+	int error;
+	UInt8 *responseBuffer;
+	CFIndex count;
+	CFDataRef bodyData;
+	
+	/* create the message body with the xml */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, gStatPropfindXML, strlen((const char *)gStatPropfindXML), kCFAllocatorNull);
+	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+	
+	/* send request to the server and get the response */
+	error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
+								stat_propfind_header_count(), gStatPropfindHeaders, redirectAction, &responseBuffer, &count, NULL);
+	if ( !error )
+	{
+		/* parse the statbuf from the response buffer */
+		error = parse_stat(responseBuffer, count, statbuf);
+				
+		/* free the response buffer */
+		free(responseBuffer);
+	}
+
+	/* release the message body */
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * stat_flight_find returns the PROPFIND in flight for the url, node, redirect
+ * handling and uid, or NULL if there isn't one. gStatFlights_lock must be held.
+ */
+static struct StatFlight *stat_flight_find(
+	uid_t uid,
+	struct node_entry *node,
+	enum RedirectAction redirectAction,
+	CFStringRef urlString)
+{
+	struct StatFlight *flight;
+	
+	for ( flight = gStatFlights; flight != NULL; flight = flight->next )
+	{
+		if ( (flight->uid == uid) && (flight->node == node) && (flight->redirectAction == redirectAction) &&
+			(CFStringCompare(flight->urlString, urlString, 0) == kCFCompareEqualTo) )
+		{
+			break;
+		}
+	}
+	
+	return ( flight );
+}
+
+/*
+ * stat_flight_new puts a PROPFIND in flight. It returns NULL if there's no
+ * memory (the PROPFIND is still sent, but nobody can wait for it).
+ * gStatFlights_lock must be held.
+ */
+static struct StatFlight *stat_flight_new(
+	uid_t uid,
+	struct node_entry *node,
+	enum RedirectAction redirectAction,
+	CFStringRef urlString)
+{
+	struct StatFlight *flight;
+	
+	++gStatFlightsSent;
+	flight = calloc(1, sizeof(struct StatFlight));
+	if ( flight != NULL )
+	{
+		flight->uid = uid;
+		flight->node = node;
+		flight->redirectAction = redirectAction;
+		flight->urlString = CFRetain(urlString);
+		flight->next = gStatFlights;
+		gStatFlights = flight;
+	}
+	
+	return ( flight );
+}
+
+/*
+ * stat_flight_land takes flight out of flight so new requests send their own
+ * PROPFIND, hands its result to the threads waiting in network_stat, and then
+ * calls the network_getattr_async callers waiting for it. statbuf is only used
+ * if error is 0.
+ */
+static void stat_flight_land(
+	struct StatFlight *flight,
+	int error,
+	struct webdav_stat_attr *statbuf)
+{
+	struct StatFlight **flightPtr;
+	struct StatFlightCallback *callbacks;
+	struct StatFlightCallback *callback;
+	struct webdav_stat_attr callbackStatbuf;
+	int callbackError;
+	int mutexerror;
+	
+	mutexerror = pthread_mutex_lock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	for ( flightPtr = &gStatFlights; *flightPtr != flight; flightPtr = &(*flightPtr)->next )
+	{
+		continue;
+	}
+	*flightPtr = flight->next;
+	
+	/* network_getattr_async callers get what network_getattr would return */
+	callbacks = flight->callbacks;
+	flight->callbacks = NULL;
+	callbackError = error;
+	if ( error == 0 )
+	{
+		callbackStatbuf = *statbuf;
+		callbackStatbuf.attr_stat.st_ino = flight->node->fileid;
+	}
+	else
+	{
+		bzero(&callbackStatbuf, sizeof(callbackStatbuf));
+		if ( error == EDESTADDRREQ )
+		{
+			/* redirected -- network_getattr follows it */
+			callbackError = EAGAIN;
+		}
+	}
+	
+	/* hand the result to the waiters (if any) */
+	flight->done = TRUE;
+	flight->error = error;
+	if ( error == 0 )
+	{
+		flight->statbuf = *statbuf;
+	}
+	if ( flight->waiters == 0 )
+	{
+		CFRelease(flight->urlString);
+		free(flight);
+	}
+	else
+	{
+		mutexerror = pthread_cond_broadcast(&gStatFlights_condvar);
+		require_noerr_action(mutexerror, pthread_cond_broadcast, webdav_kill(-1));
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	while ( callbacks != NULL )
+	{
+		callback = callbacks;
+		callbacks = callback->next;
+		callback->done(callback->context, callbackError, &callbackStatbuf);
+		free(callback);
+	}
+
+pthread_cond_broadcast:
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/*
+ * network_stat handles requests from network_lookup, network_getattr
+ * and network_mount.
+ *
+ * When many processes stat the same path at once, every request thread would
+ * send the same PROPFIND. Instead, the first thread sends it and the threads
+ * that arrive with the same url, node, redirect handling and uid while it's
+ * in flight wait for its result. The uid is part of the key because
+ * credentials (and so what the server lets us see) are per uid. The same
+ * table is shared with network_getattr_async.
+ */
+static int network_stat(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* <- the node involved in the request */
+	CFURLRef urlRef,			/* -> url to the resource */
+	enum RedirectAction redirectAction, /*  how to handle http 3xx redirection */
+	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer */
+{
+	int error;
+	int mutexerror;
+	CFStringRef urlString;
+	struct StatFlight *flight;
+	
+	urlString = CFURLGetString(urlRef);
+	
+	mutexerror = pthread_mutex_lock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	/* is the same PROPFIND already in flight? */
+	flight = stat_flight_find(uid, node, redirectAction, urlString);
+	if ( flight != NULL )
+	{
+		/* yes -- wait for its result */
+		++flight->waiters;
+		++gStatFlightsCoalesced;
+		while ( !flight->done )
+		{
+			mutexerror = pthread_cond_wait(&gStatFlights_condvar, &gStatFlights_lock);
+			require_noerr_action(mutexerror, pthread_cond_wait, webdav_kill(-1));
+		}
+		error = flight->error;
+		if ( error == 0 )
+		{
+			*statbuf = flight->statbuf;
+		}
+		
+		/* the last one out frees the flight */
+		if ( --flight->waiters == 0 )
+		{
+			CFRelease(flight->urlString);
+			free(flight);
+		}
+		flight = NULL;
+		
+		if ( error != EAGAIN )
+		{
+			mutexerror = pthread_mutex_unlock(&gStatFlights_lock);
+			require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+			
+			return ( error );
+		}
+		
+		/* network_getattr_async's PROPFIND needs another round trip (authentication or a retry), so send our own */
+		++gStatFlightsSent;
+	}
+	else
+	{
+		/* no -- put this one in flight if possible, and send it */
+		flight = stat_flight_new(uid, node, redirectAction, urlString);
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	error = send_stat_transaction(uid, node, urlRef, redirectAction, statbuf);
+	
+	if ( flight != NULL )
+	{
+		stat_flight_land(flight, error, statbuf);
+	}
+	
+	return ( error );
+
+pthread_cond_wait:
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( EIO );
+}
+
+/******************************************************************************/
+
+void network_log_coalesced_requests(void)
+{
+	syslog(LOG_DEBUG, "%llu of %llu stat PROPFINDs were coalesced into requests already in flight",
+		(unsigned long long)gStatFlightsCoalesced, (unsigned long long)(gStatFlightsCoalesced + gStatFlightsSent));
+}
+
+/******************************************************************************/
+
+static int network_dir_is_empty(
+	uid_t uid,					/* -> uid of the user making the request */
+	CFURLRef urlRef)			/* -> url to check */
+{
+	int error;
+	UInt8 *responseBuffer;
+	CFIndex count;
+	CFDataRef bodyData;
+	/* the xml for the message body */
+	const UInt8 xmlString[] =
+		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+		"<D:propfind xmlns:D=\"DAV:\">\n"
+			"<D:prop>\n"
+				"<D:resourcetype/>\n"
+			"</D:prop>\n"
+		"</D:propfind>\n";
+	/* the 3 headers */
+	CFIndex headerCount = 3;
+	struct HeaderFieldValue headers[] = {
+		{ CFSTR("Accept"), CFSTR("*/*") },
+		{ CFSTR("Content-Type"), CFSTR("text/xml") },
+		{ CFSTR("Depth"), CFSTR("1") },
+		{ CFSTR("translate"), CFSTR("f") }
+	};
+	
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag only for Microsoft IIS Server */
+		headerCount += 1;
+	}
+
+	error = 0;
+	responseBuffer = NULL;
+
+	/* create the message body with the xml */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, xmlString, strlen((const char *)xmlString), kCFAllocatorNull);
+	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+	
+	/* send request to the server and get the response */
+	error = send_transaction(uid, urlRef, NULL, CFSTR("PROPFIND"), bodyData,
+		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &count, NULL);
+	if ( !error )
+	{
+		int num_entries;
+		
+		/* parse responseBuffer to get the number of entries */
+		error = parse_file_count(responseBuffer, count, &num_entries);
+		if ( !error )
+		{
+			if (num_entries > 1)
+			{
+				/*
+				 * An empty directory will have just one entry for itself as far
+				 * as the server is concerned.	If there is more than that we need
+				 * to return ENOTEMPTY since we don't allow deleting directories
+				 * which have anything in them.
+				 */
+				error = ENOTEMPTY;
+			}
+		}
+		/* free the response buffer */
+		free(responseBuffer);
+	}
+	
+	/* release the message body */
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+int network_lookup(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> parent node */
+	char *name,					/* -> filename to find */
+	size_t name_length,			/* -> length of name */
+	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer except for st_ino */
+{
+	int error, cnt;
+	CFURLRef urlRef;
+	
+	error = 0;
+	
+	cnt = 0;
+	while (cnt < WEBDAV_MAX_REDIRECTS) {
+		/* create a CFURL to the node plus name */
+		urlRef = create_cfurl_from_node(node, name, name_length);
+		require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+		/* let network_stat do the rest of the work */
+		error = network_stat(uid, node, urlRef, REDIRECT_AUTO, statbuf);
+	
+		CFRelease(urlRef);
+	
+		if (error != EDESTADDRREQ)
+			break;
+		cnt++;
+	}
+
+	if (error == EDESTADDRREQ) {
+		syslog(LOG_ERR, "%s: Too many http redirects", __FUNCTION__);
+		error = EIO;
+	}
+	
+create_cfurl_from_node:
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+int network_getattr(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node */
+	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer */
+{
+	int error, cnt;
+	CFURLRef urlRef;
+	
+	error = 0;
+	
+	cnt = 0;
+	while ( cnt < WEBDAV_MAX_REDIRECTS) {
+		/* create a CFURL to the node */
+		urlRef = create_cfurl_from_node(node, NULL, 0);
+		require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+		/* let network_stat do the rest of the work */
+		error = network_stat(uid, node, urlRef, REDIRECT_MANUAL, statbuf);
+
+		if ( error == 0 )
+		{
+			/* network_stat gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the node */
+			statbuf->attr_stat.st_ino = node->fileid;
+		}
+	
+		CFRelease(urlRef);
+		
+		if (error != EDESTADDRREQ)
+			break;
+		cnt++;
+	}
+	
+	if (error == EDESTADDRREQ)
+		error = EIO;
+	
+create_cfurl_from_node:
+
+	return ( error );
+}
+
+/******************************************************************************/
+
+/* the state of a getattr PROPFIND sent by network_getattr_async */
+struct GetattrTransaction
+{
+	struct EventTransaction transaction;	/* must be first */
+	uid_t uid;								/* the uid of the user making the request */
+	struct node_entry *node;				/* the node */
+	UInt32 auth_generation;					/* from authcache_apply */
+	network_getattr_done done;				/* the caller's completion function */
+	void *context;							/* passed to done */
+	struct StatFlight *flight;				/* the PROPFIND in the stat flight table, or NULL */
+};
+
+/*
+ * getattr_transaction_complete is called on an event thread when the
+ * PROPFIND sent by network_getattr_async is complete. Anything that would
+ * need another round trip (authentication, redirection, a retry) is left to
+ * network_getattr by returning EAGAIN.
+ */
+static void getattr_transaction_complete(struct EventTransaction *transaction)
+{
+	struct GetattrTransaction *getattr;
+	struct webdav_stat_attr statbuf;
+	CFIndex statusCode;
+	int error;
+	
+	getattr = (struct GetattrTransaction *)transaction;
+	
+	error = transaction->result;
+	if ( error == 0 )
+	{
+		statusCode = CFHTTPMessageGetResponseStatusCode(transaction->response);
+		if ( (statusCode == 401) || (statusCode == 407) || ((statusCode / 100) == 3) )
+		{
+			error = EAGAIN;
+		}
+		else
+		{
+			error = (int)translate_status_to_error((UInt32)statusCode);
+			if ( error == 0 )
+			{
+				/* tell the authcache the credentials worked */
+				(void) authcache_valid(getattr->uid, transaction->request, getattr->auth_generation);
+				
+				/* decode the response buffer if the server encoded it, then parse the statbuf from it */
+				bzero(&statbuf, sizeof(statbuf));
+				if ( gAcceptEncoding )
+				{
+					error = decode_response_buffer(transaction->response, &transaction->buffer, &transaction->count);
+				}
+				if ( error == 0 )
+				{
+					error = parse_stat(transaction->buffer, transaction->count, &statbuf);
+				}
+				if ( error == 0 )
+				{
+					/* parse_stat gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the node */
+					statbuf.attr_stat.st_ino = getattr->node->fileid;
+				}
+			}
+		}
+	}
+	
+	/* wake anything waiting for the same PROPFIND first */
+	if ( getattr->flight != NULL )
+	{
+		stat_flight_land(getattr->flight, error, &statbuf);
+	}
+	
+	getattr->done(getattr->context, error, &statbuf);
+	
+	if ( transaction->buffer != NULL )
+	{
+		free(transaction->buffer);
+	}
+	if ( transaction->response != NULL )
+	{
+		CFRelease(transaction->response);
+	}
+	CFRelease(transaction->request);
+	free(getattr);
+}
+
+/******************************************************************************/
+
+int network_getattr_async(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node */
+	network_getattr_done done,	/* -> called when the PROPFIND is complete (only if 0 is returned) */
+	void *context)				/* -> passed to done */
+{
+	int error;
+	CFURLRef urlRef;
+	CFDataRef bodyData;
+	CFHTTPMessageRef message;
+	struct GetattrTransaction *getattr;
+	struct StatFlight *flight;
+	struct StatFlightCallback *callback;
+	int mutexerror;
+	
+	/* if the event engine is off or the connection is down, network_getattr handles it */
+	require_action_quiet(gEventEngine, no_event_engine, error = EAGAIN);
+	require_action_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down, error = EAGAIN);
+	
+	getattr = calloc(1, sizeof(struct GetattrTransaction));
+	require_action(getattr != NULL, calloc, error = ENOMEM);
+	
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+	callback = malloc(sizeof(struct StatFlightCallback));
+	require_action(callback != NULL, malloc_callback, error = ENOMEM);
+	
+	mutexerror = pthread_mutex_lock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1); error = EIO);
+	
+	/* is the PROPFIND network_getattr would send already in flight? */
+	flight = stat_flight_find(uid, node, REDIRECT_MANUAL, CFURLGetString(urlRef));
+	if ( flight != NULL )
+	{
+		/* yes -- stat_flight_land will call done with its result */
+		callback->done = done;
+		callback->context = context;
+		callback->next = flight->callbacks;
+		flight->callbacks = callback;
+		++gStatFlightsCoalesced;
+	}
+	else
+	{
+		/* no -- put this one in flight */
+		free(callback);
+		getattr->flight = stat_flight_new(uid, node, REDIRECT_MANUAL, CFURLGetString(urlRef));
+	}
+	
+	mutexerror = pthread_mutex_unlock(&gStatFlights_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1); error = EIO);
+	
+	if ( flight != NULL )
+	{
+		CFRelease(urlRef);
+		free(getattr);
+		return ( 0 );
+	}
+	
+	/* create the message body with the xml */
+	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, gStatPropfindXML, strlen((const char *)gStatPropfindXML), kCFAllocatorNull);
+	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
+	
+	/* create the request -- redirection is handled manually by network_getattr */
+	message = create_transaction_request(urlRef, CFSTR("PROPFIND"), bodyData, stat_propfind_header_count(), gStatPropfindHeaders, FALSE);
+	require_action(message != NULL, create_transaction_request, error = EIO);
+	
+	/* apply credentials (if any) -- with no challenge, this never waits for the user */
+	error = authcache_apply(uid, message, 0, NULL, &getattr->auth_generation);
+	require_noerr_action_quiet(error, authcache_apply, CFRelease(message); error = EAGAIN);
+	
+	getattr->uid = uid;
+	getattr->node = node;
+	getattr->done = done;
+	getattr->context = context;
+	getattr->transaction.request = message;
+	getattr->transaction.auto_redirect = FALSE;
+	getattr->transaction.retryTransaction = TRUE;	/* a lost connection is retried by network_getattr */
+	getattr->transaction.completion = getattr_transaction_complete;
+	getattr->transaction.context = NULL;
+	
+	CFRelease(bodyData);
+	CFRelease(urlRef);
+	
+	/* getattr_transaction_complete will finish it */
+	event_transaction_start(&getattr->transaction);
+	
+	return ( 0 );
+
+authcache_apply:
+create_transaction_request:
+
+	CFRelease(bodyData);
+
+CFDataCreateWithBytesNoCopy:
+
+	/* let anything that joined the PROPFIND send its own */
+	if ( getattr->flight != NULL )
+	{
+		stat_flight_land(getattr->flight, EAGAIN, NULL);
+	}
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+malloc_callback:
+
+	CFRelease(urlRef);
+
+create_cfurl_from_node:
+
+	free(getattr);
+
+calloc:
+connection_down:
+no_event_engine:
+
+	return ( error );
+}
+
+/******************************************************************************/
+
+/* NOTE: this will do both the OPTIONS and the PROPFIND. */
+/* NOTE: if webdavfs is changed to support advlocks, then 
+ * server_mount_flags parameter is not needed.
+ */
+/*
+ * The only errors expected from network_mount are:
+ *		ECANCELED - the user could not authenticate and cancelled the mount
+ *		ENODEV - we could not connect to the server (bad URL, server down, etc.)
+ */
+int network_mount(
+	uid_t uid,					/* -> uid of the user making the request */
+	int *server_mount_flags)	/* <-> in: MNT_RDONLY if the user asked for it; out: flags to OR in with mount flags (i.e., MNT_RDONLY) */
+{
+	int error;
+	CFURLRef urlRef;
+	int dav_level, cnt;
+	struct webdav_stat_attr statbuf;
+	
+	cnt = 0;
+	while (cnt < WEBDAV_MAX_REDIRECTS) {
+		urlRef = nodecache_get_baseURL();
+		error = network_getDAVLevel(uid, urlRef, &dav_level);
+		CFRelease(urlRef);
+		if (error != EDESTADDRREQ)
+			break;
+		cnt++;
+	}
+	
+	if ( error == 0 )
+	{
+		/* if an earlier mount saved this server's profile, don't send the extra probes again */
+		if ( load_server_profile() )
+		{
+			syslog(LOG_DEBUG, "%s: using the saved server profile", __FUNCTION__);
+		}
+		else
+		{
+			probe_sync_collection(uid);
+			gServerProfile.probed = CFAbsoluteTimeGetCurrent();
+			gServerProfile.changed = TRUE;
+		}
+		
+		/* segmented uploads are only used on a server a probe showed takes partial PUTs (the probe writes, so not on a read-only mount) */
+		if ( (gUploadSegmentSize != 0) && (dav_level >= 2) && !(*server_mount_flags & MNT_RDONLY) &&
+			 !(gServerProfile.known & WEBDAV_CAPABILITY_PARTIAL_PUT) )
+		{
+			probe_partial_put(uid);
+			if ( gServerProfile.known & WEBDAV_CAPABILITY_PARTIAL_PUT )
+			{
+				gServerProfile.changed = TRUE;
+			}
+		}
+	}
+	
+	if ( error == 0 )
+	{
+		if ( dav_level > 2 )
+		{
+			/* pin it to 2 -- the highest we care about */
+			dav_level = 2;
+		} 
+		switch (dav_level)
+		{
+			case 1:
+				*server_mount_flags |= MNT_RDONLY;
+				break;
+				
+			case 2:
+				/* DAV supports LOCKs */
+				break;
+				
+			default:
+				debug_string("network_mount: WebDAV protocol not supported");
+				error = ENODEV;
+				break;
+		}
+		
+		if ( error == 0 )
+		{
+			cnt = 0;
+			while (cnt < WEBDAV_MAX_REDIRECTS) {
+				urlRef = nodecache_get_baseURL();
+				error = network_stat(uid, NULL, urlRef, REDIRECT_MANUAL, &statbuf);
+				CFRelease(urlRef);
+				if (error != EDESTADDRREQ)
+					break;
+				cnt++;
+			}
+			
+			if ( error )
+			{
+				if (error == EDESTADDRREQ) {
+					syslog(LOG_ERR, "%s: Too many redirects for network_stat: mount cancelled", __FUNCTION__);
+					error = EIO;
+				}
+				else if (error != EACCES)
+				{
+					syslog(LOG_ERR, "%s: network_stat returned error %d", __FUNCTION__, error);
+					error = ENODEV;
+				}
+				else
+				{
+					syslog(LOG_DEBUG, "%s: network_stat returned EACCES", __FUNCTION__);
+					error = EAUTH;
+				}
+			}
+			else if ( !S_ISDIR(statbuf.attr_stat.st_mode) )
+			{
+				/* the PROFIND was successful, but the URL was to a file, not a collection */
+				debug_string("network_mount: URL is not a collection resource (directory)");
+				error = ENODEV;
+			}
+		}
+	}
+	else
+	{
+		if (error == EDESTADDRREQ) {
+			syslog(LOG_ERR, "%s: Too many redirects for OPTIONS: mount cancelled", __FUNCTION__);
+			error = EIO;
+		}
+		else if ( error != EACCES )
+		{
+			syslog(LOG_ERR, "%s: network_getDAVLevel returned error %d", __FUNCTION__, error);
+			error = ENODEV;
+		}
+		else
+		{
+			syslog(LOG_DEBUG, "%s: network_getDAVLevel returned EACCES", __FUNCTION__);
+			error = EAUTH;
+		}
+	}
+	
+	if ( error == 0 )
+	{
+		/* save a newly probed profile now in case the agent doesn't exit cleanly */
+		network_save_server_profile();
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * Parallel downloads
+ *
+ * When a large file's server accepts byte ranges, the rest of the download is
+ * split into segments of gDownloadSegmentSize bytes. The GET started by
+ * network_open supplies the first segment and the others are fetched with Range
+ * GETs by the download thread and up to gDownloadConnections - 1 helper threads.
+ * The kernel takes the cache file's size as the amount of data downloaded, so
+ * segments are always written in order. The segment at the end of the cache
+ * file is streamed straight into it. A segment fetched ahead of that is streamed
+ * into its window slot of a scratch file and copied into the cache file once the
+ * segments before it are written. No thread starts a segment more than window
+ * segments past the next one to be written, so the scratch file never holds
+ * more than window segments and no segment is ever held in memory.
+ */
+struct download_segments
+{
+	pthread_mutex_t lock;		/* protects next_fetch, next_write, spilled, helpers and error */
+	pthread_cond_t condvar;		/* signaled when a segment is fetched or a helper thread exits */
+	uid_t uid;					/* uid of the user who opened the file */
+	struct node_entry *node;	/* the node being downloaded */
+	CFURLRef urlRef;			/* url to the file */
+	CFStringRef conditionField;	/* If-Match or If-Unmodified-Since */
+	CFStringRef conditionValue;	/* the entity tag or Last-Modified date every segment must match */
+	off_t start;				/* offset of the first segment */
+	off_t length;				/* length of the file */
+	u_int32_t count;			/* number of segments */
+	u_int32_t window;			/* number of segments that can be fetched ahead of the cache file */
+	u_int32_t next_fetch;		/* next segment to fetch */
+	u_int32_t next_write;		/* next segment to write to the cache file */
+	u_int8_t *spilled;			/* TRUE if the segment is waiting in spill_fd, indexed by segment % window */
+	int spill_fd;				/* scratch file for segments fetched ahead of the cache file, or -1 */
+	int helpers;				/* number of helper threads still running */
+	int error;					/* the first error */
+};
+
+/******************************************************************************/
+
+/*
+ * download_can_be_split
+ *
+ * Returns TRUE if the rest of the download on readStreamRecPtr can be fetched
+ * with parallel Range GETs. The response must be a 200 with Accept-Ranges: bytes,
+ * no Content-Encoding, and a Content-Length of at least gDownloadThreshold. It
+ * must also have a strong entity tag or a Last-Modified date so every segment
+ * can be required to come from the same version of the file; the precondition
+ * header is returned in conditionField and conditionValue (the caller must
+ * release conditionValue).
+ */
+static int download_can_be_split(
+	struct ReadStreamRec *readStreamRecPtr,	/* -> the ReadStreamRec with the response */
+	off_t *length,							/* <- the length of the file */
+	CFStringRef *conditionField,			/* <- If-Match or If-Unmodified-Since */
+	CFStringRef *conditionValue)			/* <- the value for conditionField */
+{
+	CFTypeRef theResponsePropertyRef;
+	CFHTTPMessageRef responseMessage;
+	CFStringRef headerRef;
+	int result;
+	
+	result = FALSE;
+	*conditionValue = NULL;
+	
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require_quiet(theResponsePropertyRef != NULL, GetResponseHeader);
+	
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	/* a 206 is already a resumed download */
+	require_quiet(CFHTTPMessageGetResponseStatusCode(responseMessage) == 200, not_splittable);
+	
+	/* don't bother with servers known to ignore byte ranges */
+	require_quiet(network_server_capability(WEBDAV_CAPABILITY_RANGE) != WEBDAV_CAPABILITY_UNSUPPORTED, not_splittable);
+	
+	/* the server must accept byte ranges */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Accept-Ranges"));
+	require_quiet(headerRef != NULL, not_splittable);
+	result = (CFStringCompare(headerRef, CFSTR("bytes"), kCFCompareCaseInsensitive) == kCFCompareEqualTo);
+	CFRelease(headerRef);
+	network_learn_server_capability(WEBDAV_CAPABILITY_RANGE, result);
+	require_quiet(result, not_splittable);
+	result = FALSE;
+	
+	/* byte ranges of an encoded body aren't byte ranges of the file */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Content-Encoding"));
+	if ( headerRef != NULL )
+	{
+		CFRelease(headerRef);
+		goto not_splittable;
+	}
+	
+	/* get the length of the file */
+	require_quiet(get_content_length(responseMessage, length) && (*length >= gDownloadThreshold), not_splittable);
+	
+	/* If-Match needs a strong entity tag; otherwise fall back to the Last-Modified date */
+	headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("ETag"));
+	if ( headerRef != NULL )
+	{
+		network_learn_server_capability(WEBDAV_CAPABILITY_STRONG_ETAG, !CFStringHasPrefix(headerRef, CFSTR("W/")));
+		if ( !CFStringHasPrefix(headerRef, CFSTR("W/")) )
+		{
+			*conditionField = CFSTR("If-Match");
+			*conditionValue = headerRef;
+		}
+		else
+		{
+			CFRelease(headerRef);
+		}
+	}
+	if ( *conditionValue == NULL )
+	{
+		headerRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Last-Modified"));
+		if ( headerRef != NULL )
+		{
+			*conditionField = CFSTR("If-Unmodified-Since");
+			*conditionValue = headerRef;
+		}
+	}
+	result = (*conditionValue != NULL);
+	
+not_splittable:
+
+	CFRelease(theResponsePropertyRef);
+
+GetResponseHeader:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * reserve_download_helpers
+ *
+ * Reserves up to wanted of the WEBDAV_DOWNLOAD_HELPER_THREADS shared by all
+ * parallel downloads and returns the number reserved. Each reserved helper
+ * thread must call release_download_helper when it exits.
+ */
+static int reserve_download_helpers(int wanted)
+{
+	int result;
+	int mutexerror;
+	
+	result = 0;
+	
+	/* grab gReadStreams_lock */
+	mutexerror = pthread_mutex_lock(&gReadStreams_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	result = MIN(wanted, WEBDAV_DOWNLOAD_HELPER_THREADS - gDownloadHelperThreads);
+	gDownloadHelperThreads += result;
+	
+	/* release gReadStreams_lock */
+	mutexerror = pthread_mutex_unlock(&gReadStreams_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+static void release_download_helper(void)
+{
+	int mutexerror;
+	
+	/* grab gReadStreams_lock */
+	mutexerror = pthread_mutex_lock(&gReadStreams_lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	--gDownloadHelperThreads;
+	
+	/* release gReadStreams_lock */
+	mutexerror = pthread_mutex_unlock(&gReadStreams_lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+/* the context of segment_streamer */
+struct SegmentStreamerContext
+{
+	struct node_entry *node;	/* the node being downloaded */
+	int fd;						/* the file the segment is written to */
+	off_t offset;				/* the offset in fd to write the segment at */
+	off_t length;				/* the length of the segment */
+	off_t written;				/* the number of bytes written to fd */
+};
+
+/*
+ * segment_streamer
+ *
+ * TransactionStreamer for a segment of a parallel download. The body of a 206
+ * response is written to the context's file as it arrives instead of being
+ * returned in a buffer; the body of any other response is thrown away.
+ */
+static int segment_streamer(
+	CFHTTPMessageRef request,
+	int auto_redirect,
+	int *retryTransaction,
+	void *context,
+	UInt8 **buffer,
+	CFIndex *count,
+	CFHTTPMessageRef *response)
+{
+	struct SegmentStreamerContext *segmentContext = (struct SegmentStreamerContext *)context;
+	struct ReadStreamRec *readStreamRecPtr;
+	UInt8 *readBuffer;
+	CFIndex bytesRead;
+	CFTypeRef theResponsePropertyRef;
+	CFHTTPMessageRef responseMessage;
+	CFStringRef connectionHeaderRef;
+	CFStringRef setCookieHeaderRef;
+	int result;
+	
+	*buffer = NULL;
+	*count = 0;
+	segmentContext->written = 0;
+	result = 0;
+	
+	/*
+	 * If we're down and the mount is supposed to fail on disconnects
+	 * instead of retrying, just return an error.
+	 */
+	require_quiet(!gSuppressAllUI || (get_connectionstate() == WEBDAV_CONNECTION_UP), connection_down);
+	
+	result = open_stream_for_transaction(request, NULL, auto_redirect, retryTransaction, &readStreamRecPtr);
+	require_noerr_quiet(result, open_stream_for_transaction);
+	
+	readBuffer = malloc(BODY_BUFFER_SIZE);
+	require(readBuffer != NULL, malloc_buffer);
+	
+	/* send the message and get the first piece of the response */
+	bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, readBuffer, BODY_BUFFER_SIZE);
+	if ( bytesRead < 0 )
+	{
+		CFStreamError streamError;
+		
+		streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+		if ( *retryTransaction &&
+			((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+			 (streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)) )
+		{
+			/* if we get a POSIX EPIPE or HTTP Connection Lost error back from the stream, retry the transaction once */
+			syslog(LOG_INFO,"segment_streamer: CFStreamError: domain %ld, error %lld -- retrying", streamError.domain, (SInt64)streamError.error);
+			*retryTransaction = FALSE;
+			result = EAGAIN;
+		}
+		else
+		{
+			if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
+			{
+				syslog(LOG_ERR,"segment_streamer: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+			}
+			set_connectionstate(WEBDAV_CONNECTION_DOWN);
+			result = stream_error_to_errno(&streamError);
+		}
+		goto CFReadStreamRead;
+	}
+	
+	/* get the response header */
+	theResponsePropertyRef = CFReadStreamCopyProperty(readStreamRecPtr->readStreamRef, kCFStreamPropertyHTTPResponseHeader);
+	require(theResponsePropertyRef != NULL, GetResponseHeader);
+	
+	/* fun with casting a "const void *" CFTypeRef away */
+	responseMessage = *((CFHTTPMessageRef*)((void*)&theResponsePropertyRef));
+	
+	set_connectionstate(WEBDAV_CONNECTION_UP);
+	
+	/* Get the Connection header (if any) */
+	readStreamRecPtr->connectionClose = FALSE;
+	connectionHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Connection"));
+	if ( connectionHeaderRef != NULL )
+	{
+		/* is the connection-token is "close"? */
+		if ( CFStringCompare(connectionHeaderRef, CFSTR("close"), kCFCompareCaseInsensitive) == kCFCompareEqualTo )
+		{
+			readStreamRecPtr->connectionClose = TRUE;
+		}
+		CFRelease(connectionHeaderRef);
+	}
+	
+	// Handle cookies
+	setCookieHeaderRef = CFHTTPMessageCopyHeaderFieldValue(responseMessage, CFSTR("Set-Cookie"));
+	if (setCookieHeaderRef != NULL) {
+		handle_cookies(setCookieHeaderRef, request);
+		CFRelease(setCookieHeaderRef);
+	}
+	
+	if ( CFHTTPMessageGetResponseStatusCode(responseMessage) == 206 )
+	{
+		/* write the segment to the file as it arrives */
+		while ( bytesRead > 0 )
+		{
+			/* were we asked to terminate the download? */
+			require_quiet((segmentContext->node->file_status & WEBDAV_DOWNLOAD_TERMINATED) == 0, terminated);
+			
+			/* a server that sends more than the range asked for is broken */
+			require(bytesRead <= (segmentContext->length - segmentContext->written), too_long);
+			
+			require(pwrite(segmentContext->fd, readBuffer, (size_t)bytesRead, segmentContext->offset + segmentContext->written) == (ssize_t)bytesRead, pwrite);
+			segmentContext->written += bytesRead;
+			
+			bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, readBuffer, BODY_BUFFER_SIZE);
+		}
+		require(bytesRead == 0, CFReadStreamRead_body);
+	}
+	else
+	{
+		/* the body isn't wanted, so don't read it -- this connection can't be reused */
+		readStreamRecPtr->connectionClose = TRUE;
+	}
+	
+	free(readBuffer);
+	
+	if ( readStreamRecPtr->connectionClose )
+	{
+		/* close and release the stream */
+		CFReadStreamClose(readStreamRecPtr->readStreamRef);
+		CFRelease(readStreamRecPtr->readStreamRef);
+		readStreamRecPtr->readStreamRef = NULL;
+	}
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+	
+	*response = responseMessage;
+	
+	return ( 0 );
+
+	/**********************/
+
+CFReadStreamRead_body:
+pwrite:
+too_long:
+terminated:
+
+	CFRelease(responseMessage);
+
+GetResponseHeader:
+CFReadStreamRead:
+
+	free(readBuffer);
+
+malloc_buffer:
+
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+
+open_stream_for_transaction:
+connection_down:
+
+	*response = NULL;
+
+	if ( result == 0 )
+	{
+		result = EIO;
+	}
+
+	return ( result );
+}
+
+/******************************************************************************/
+
+/*
+ * download_segment
+ *
+ * Fetches one segment of a parallel download with a Range GET and writes it to
+ * fd at fdOffset as it arrives. Anything but a 206 with exactly the requested
+ * bytes is an error -- in particular, a 412 means the file changed on the
+ * server since the download started.
+ */
+static int download_segment(
+	struct download_segments *segments,	/* -> the parallel download */
+	u_int32_t segment,					/* -> the segment to fetch */
+	int fd,								/* -> the file to write the segment to */
+	off_t fdOffset)						/* -> the offset in fd to write the segment at */
 {
 	int error;
-	UInt8 *responseBuffer;
-	CFIndex count;
-	CFDataRef bodyData;
-	/* the xml for the message body */
-	const UInt8 xmlString[] =
-		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
-		"<D:propfind xmlns:D=\"DAV:\">\n"
-			"<D:prop>\n"
-				"<D:resourcetype/>\n"
-			"</D:prop>\n"
-		"</D:propfind>\n";
-	/* the 3 headers */
+	off_t offset;
+	off_t length;
+	CFHTTPMessageRef responseRef;
+	CFStringRef byteRangesSpecifierRef;
+	struct SegmentStreamerContext context;
+	/* the 3 headers -- the range and precondition values will be set below */
 	CFIndex headerCount = 3;
 	struct HeaderFieldValue headers[] = {
 		{ CFSTR("Accept"), CFSTR("*/*") },
-		{ CFSTR("Content-Type"), CFSTR("text/xml") },
-		{ CFSTR("Depth"), CFSTR("1") },
-		{ CFSTR("translate"), CFSTR("f") }
+		{ CFSTR("Range"), NULL },
+		{ NULL, NULL },
+		{ CFSTR("translate"), CFSTR("f") },
+		{ CFSTR("Pragma"), CFSTR("no-cache") }
 	};
 	
 	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
-		/* translate flag only for Microsoft IIS Server */
-		headerCount += 1;
+		/* translate flag and no-cache only for Microsoft IIS Server */
+		headerCount += 2;
 	}
-
-	error = 0;
-	responseBuffer = NULL;
-
-	/* create the message body with the xml */
-	bodyData = CFDataCreateWithBytesNoCopy(kCFAllocatorDefault, xmlString, strlen((const char *)xmlString), kCFAllocatorNull);
-	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
 	
-	/* send request to the server and get the response */
-	error = send_transaction(uid, urlRef, NULL, CFSTR("PROPFIND"), bodyData,
-		headerCount, headers, REDIRECT_AUTO, &responseBuffer, &count, NULL);
+	offset = segments->start + ((off_t)segment * (off_t)gDownloadSegmentSize);
+	length = MIN((off_t)gDownloadSegmentSize, segments->length - offset);
+	
+	byteRangesSpecifierRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes=%qd-%qd"), offset, offset + length - 1);
+	require_action(byteRangesSpecifierRef != NULL, CFStringCreateWithFormat, error = EIO);
+	
+	headers[1].value = byteRangesSpecifierRef;
+	headers[2].headerField = segments->conditionField;
+	headers[2].value = segments->conditionValue;
+	
+	context.node = segments->node;
+	context.fd = fd;
+	context.offset = fdOffset;
+	context.length = length;
+	context.written = 0;
+	
+	/* send request to the server and write the response body to fd */
+	error = send_streamed_transaction(segments->uid, segments->urlRef, NULL, CFSTR("GET"), NULL,
+		headerCount, headers, REDIRECT_AUTO, segment_streamer, &context, NULL, NULL, &responseRef);
 	if ( !error )
 	{
-		int num_entries;
-		
-		/* parse responseBuffer to get the number of entries */
-		error = parse_file_count(responseBuffer, count, &num_entries);
-		if ( !error )
+		if ( (CFHTTPMessageGetResponseStatusCode(responseRef) != 206) || (context.written != length) )
 		{
-			if (num_entries > 1)
+			if ( CFHTTPMessageGetResponseStatusCode(responseRef) == 200 )
 			{
-				/*
-				 * An empty directory will have just one entry for itself as far
-				 * as the server is concerned.	If there is more than that we need
-				 * to return ENOTEMPTY since we don't allow deleting directories
-				 * which have anything in them.
-				 */
-				error = ENOTEMPTY;
+				/* the Range header was ignored */
+				network_learn_server_capability(WEBDAV_CAPABILITY_RANGE, FALSE);
 			}
+			syslog(LOG_ERR, "download_segment: bytes %qd-%qd: status %ld, %qd bytes",
+				offset, offset + length - 1, (long)CFHTTPMessageGetResponseStatusCode(responseRef), context.written);
+			error = EIO;
 		}
-		/* free the response buffer */
-		free(responseBuffer);
+		CFRelease(responseRef);
 	}
 	
-	/* release the message body */
-	CFRelease(bodyData);
-
-CFDataCreateWithBytesNoCopy:
+	CFRelease(byteRangesSpecifierRef);
 	
+CFStringCreateWithFormat:
+
 	return ( error );
 }
 
 /******************************************************************************/
 
-int network_lookup(
-	uid_t uid,					/* -> uid of the user making the request */
-	struct node_entry *node,	/* -> parent node */
-	char *name,					/* -> filename to find */
-	size_t name_length,			/* -> length of name */
-	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer except for st_ino */
+/*
+ * copy_spilled_segment
+ *
+ * Copies length bytes of a segment from its window slot at spillOffset in the
+ * scratch file to offset in the cache file.
+ */
+static int copy_spilled_segment(
+	int spill_fd,			/* -> the scratch file */
+	off_t spillOffset,		/* -> the offset of the segment in the scratch file */
+	int file_fd,			/* -> the cache file */
+	off_t offset,			/* -> the offset of the segment in the cache file */
+	off_t length)			/* -> the length of the segment */
 {
-	int error, cnt;
-	CFURLRef urlRef;
+	UInt8 *buffer;
+	off_t copied;
+	ssize_t count;
+	int error;
 	
 	error = 0;
 	
-	cnt = 0;
-	while (cnt < WEBDAV_MAX_REDIRECTS) {
-		/* create a CFURL to the node plus name */
-		urlRef = create_cfurl_from_node(node, name, name_length);
-		require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
-	
-		/* let network_stat do the rest of the work */
-		error = network_stat(uid, node, urlRef, REDIRECT_AUTO, statbuf);
-	
-		CFRelease(urlRef);
+	buffer = malloc(BODY_BUFFER_SIZE);
+	require_action(buffer != NULL, malloc_buffer, error = ENOMEM);
 	
-		if (error != EDESTADDRREQ)
-			break;
-		cnt++;
-	}
-
-	if (error == EDESTADDRREQ) {
-		syslog(LOG_ERR, "%s: Too many http redirects", __FUNCTION__);
-		error = EIO;
+	for ( copied = 0; copied < length; copied += count )
+	{
+		count = pread(spill_fd, buffer, (size_t)MIN((off_t)BODY_BUFFER_SIZE, length - copied), spillOffset + copied);
+		require_action(count > 0, pread, error = EIO);
+		require_action(pwrite(file_fd, buffer, (size_t)count, offset + copied) == count, pwrite, error = EIO);
 	}
-	
-create_cfurl_from_node:
-	
-	return ( error );
-}
 
-/******************************************************************************/
+pwrite:
+pread:
 
-int network_getattr(
-	uid_t uid,					/* -> uid of the user making the request */
-	struct node_entry *node,	/* -> node */
-	struct webdav_stat_attr *statbuf)	/* <- stat information is returned in this buffer */
-{
-	int error, cnt;
-	CFURLRef urlRef;
-	
-	error = 0;
-	
-	cnt = 0;
-	while ( cnt < WEBDAV_MAX_REDIRECTS) {
-		/* create a CFURL to the node */
-		urlRef = create_cfurl_from_node(node, NULL, 0);
-		require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
-	
-		/* let network_stat do the rest of the work */
-		error = network_stat(uid, node, urlRef, REDIRECT_MANUAL, statbuf);
+	free(buffer);
 
-		if ( error == 0 )
-		{
-			/* network_stat gets all of the struct stat fields except for st_ino so fill it in here with the fileid of the node */
-			statbuf->attr_stat.st_ino = node->fileid;
-		}
-	
-		CFRelease(urlRef);
-		
-		if (error != EDESTADDRREQ)
-			break;
-		cnt++;
-	}
-	
-	if (error == EDESTADDRREQ)
-		error = EIO;
-	
-create_cfurl_from_node:
+malloc_buffer:
 
 	return ( error );
 }
 
 /******************************************************************************/
 
-/* NOTE: this will do both the OPTIONS and the PROPFIND. */
-/* NOTE: if webdavfs is changed to support advlocks, then 
- * server_mount_flags parameter is not needed.
- */
 /*
- * The only errors expected from network_mount are:
- *		ECANCELED - the user could not authenticate and cancelled the mount
- *		ENODEV - we could not connect to the server (bad URL, server down, etc.)
+ * fetch_download_segments
+ *
+ * Run by the download thread and every helper thread: claims segments, fetches
+ * them, and writes the fetched segments that follow the end of the cache file.
+ * Returns when every segment has been claimed or the download failed.
  */
-int network_mount(
-	uid_t uid,					/* -> uid of the user making the request */
-	int *server_mount_flags)	/* <- flags to OR in with mount flags (i.e., MNT_RDONLY) */
+static void fetch_download_segments(struct download_segments *segments)
 {
+	u_int32_t segment;
+	u_int32_t slot;
+	off_t offset;
+	off_t length;
+	int direct;
 	int error;
-	CFURLRef urlRef;
-	int dav_level, cnt;
-	struct webdav_stat_attr statbuf;
+	int mutexerror;
 	
-	cnt = 0;
-	while (cnt < WEBDAV_MAX_REDIRECTS) {
-		urlRef = nodecache_get_baseURL();
-		error = network_getDAVLevel(uid, urlRef, &dav_level);
-		CFRelease(urlRef);
-		if (error != EDESTADDRREQ)
-			break;
-		cnt++;
-	}
+	mutexerror = pthread_mutex_lock(&segments->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
 	
-	if ( error == 0 )
+	while ( (segments->error == 0) && (segments->next_fetch < segments->count) )
 	{
-		if ( dav_level > 2 )
+		/* were we asked to terminate the download? */
+		if ( (segments->node->file_status & WEBDAV_DOWNLOAD_TERMINATED) != 0 )
 		{
-			/* pin it to 2 -- the highest we care about */
-			dav_level = 2;
-		} 
-		switch (dav_level)
+			/* the rest of the file will be downloaded if it's reopened */
+			segments->error = EIO;
+			break;
+		}
+		
+		/* don't get more than window segments ahead of the cache file */
+		if ( segments->next_fetch >= (segments->next_write + segments->window) )
 		{
-			case 1:
-				*server_mount_flags |= MNT_RDONLY;
-				break;
-				
-			case 2:
-				/* DAV supports LOCKs */
-				break;
-				
-			default:
-				debug_string("network_mount: WebDAV protocol not supported");
-				error = ENODEV;
-				break;
+			mutexerror = pthread_cond_wait(&segments->condvar, &segments->lock);
+			require_noerr_action(mutexerror, pthread_cond_wait, webdav_kill(-1));
+			continue;
 		}
 		
-		if ( error == 0 )
+		segment = segments->next_fetch++;
+		slot = segment % segments->window;
+		offset = segments->start + ((off_t)segment * (off_t)gDownloadSegmentSize);
+		
+		/* every segment before this one is written, so it can go straight to the end of the cache file */
+		direct = (segment == segments->next_write);
+		
+		mutexerror = pthread_mutex_unlock(&segments->lock);
+		require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+		
+		if ( direct )
 		{
-			cnt = 0;
-			while (cnt < WEBDAV_MAX_REDIRECTS) {
-				urlRef = nodecache_get_baseURL();
-				error = network_stat(uid, NULL, urlRef, REDIRECT_MANUAL, &statbuf);
-				CFRelease(urlRef);
-				if (error != EDESTADDRREQ)
-					break;
-				cnt++;
+			error = download_segment(segments, segment, segments->node->file_fd, offset);
+		}
+		else
+		{
+			error = download_segment(segments, segment, segments->spill_fd, (off_t)slot * (off_t)gDownloadSegmentSize);
+		}
+		
+		mutexerror = pthread_mutex_lock(&segments->lock);
+		require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+		
+		if ( error != 0 )
+		{
+			if ( segments->error == 0 )
+			{
+				segments->error = error;
+			}
+		}
+		else
+		{
+			if ( direct )
+			{
+				++segments->next_write;
+			}
+			else
+			{
+				segments->spilled[slot] = TRUE;
 			}
 			
-			if ( error )
+			/* copy every spilled segment that now follows the end of the cache file */
+			while ( (segments->error == 0) && (segments->next_write < segments->count) &&
+				segments->spilled[segments->next_write % segments->window] )
 			{
-				if (error == EDESTADDRREQ) {
-					syslog(LOG_ERR, "%s: Too many redirects for network_stat: mount cancelled", __FUNCTION__);
-					error = EIO;
-				}
-				else if (error != EACCES)
-				{
-					syslog(LOG_ERR, "%s: network_stat returned error %d", __FUNCTION__, error);
-					error = ENODEV;
-				}
-				else
+				slot = segments->next_write % segments->window;
+				segments->spilled[slot] = FALSE;
+				offset = segments->start + ((off_t)segments->next_write * (off_t)gDownloadSegmentSize);
+				length = MIN((off_t)gDownloadSegmentSize, segments->length - offset);
+				if ( copy_spilled_segment(segments->spill_fd, (off_t)slot * (off_t)gDownloadSegmentSize,
+						segments->node->file_fd, offset, length) != 0 )
 				{
-					syslog(LOG_DEBUG, "%s: network_stat returned EACCES", __FUNCTION__);
-					error = EAUTH;
+					syslog(LOG_ERR, "fetch_download_segments: copy errno %d", errno);
+					segments->error = EIO;
 				}
-			}
-			else if ( !S_ISDIR(statbuf.attr_stat.st_mode) )
-			{
-				/* the PROFIND was successful, but the URL was to a file, not a collection */
-				debug_string("network_mount: URL is not a collection resource (directory)");
-				error = ENODEV;
+				++segments->next_write;
 			}
 		}
+		
+		/* wake up any threads waiting for the window to move */
+		mutexerror = pthread_cond_broadcast(&segments->condvar);
+		require_noerr_action(mutexerror, pthread_cond_broadcast, webdav_kill(-1));
+	}
+	
+	/* wake up any threads waiting for the window to move so they see the error */
+	mutexerror = pthread_cond_broadcast(&segments->condvar);
+	require_noerr_action(mutexerror, pthread_cond_broadcast, webdav_kill(-1));
+	
+	mutexerror = pthread_mutex_unlock(&segments->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_cond_broadcast:
+pthread_cond_wait:
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return;
+}
+
+/******************************************************************************/
+
+static void *download_helper_thread(void *arg)
+{
+	struct download_segments *segments;
+	int mutexerror;
+	
+	segments = (struct download_segments *)arg;
+	
+	fetch_download_segments(segments);
+	
+	release_download_helper();
+	
+	/* let download_segments know this helper is done with segments */
+	mutexerror = pthread_mutex_lock(&segments->lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	--segments->helpers;
+	
+	mutexerror = pthread_cond_broadcast(&segments->condvar);
+	require_noerr_action(mutexerror, pthread_cond_broadcast, webdav_kill(-1));
+	
+	mutexerror = pthread_mutex_unlock(&segments->lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_cond_broadcast:
+pthread_mutex_lock:
+
+	return ( NULL );
+}
+
+/******************************************************************************/
+
+/*
+ * download_segments
+ *
+ * Downloads the rest of a file, from start to length, with parallel Range GETs
+ * and appends it to the cache file. Returns 0 on success or EIO.
+ */
+static int download_segments(
+	uid_t uid,					/* -> uid of the user who opened the file */
+	struct node_entry *node,	/* -> node to download to */
+	off_t start,				/* -> offset of the first segment (the cache file's length) */
+	off_t length,				/* -> length of the file */
+	CFStringRef conditionField,	/* -> If-Match or If-Unmodified-Since */
+	CFStringRef conditionValue)	/* -> the value for conditionField */
+{
+	struct download_segments segments;
+	pthread_attr_t helper_thread_attr;
+	pthread_t helper_thread;
+	int helpers;
+	int error;
+	int mutexerror;
+	
+	memset(&segments, 0, sizeof(segments));
+	segments.uid = uid;
+	segments.node = node;
+	segments.conditionField = conditionField;
+	segments.conditionValue = conditionValue;
+	segments.start = start;
+	segments.length = length;
+	segments.count = (u_int32_t)((length - start + (off_t)gDownloadSegmentSize - 1) / (off_t)gDownloadSegmentSize);
+	segments.window = 2 * (u_int32_t)gDownloadConnections;
+	segments.spill_fd = -1;
+	
+	error = pthread_mutex_init(&segments.lock, NULL);
+	require_noerr_action(error, pthread_mutex_init, error = EIO);
+	
+	error = pthread_cond_init(&segments.condvar, NULL);
+	require_noerr_action(error, pthread_cond_init, error = EIO);
+	
+	segments.spilled = calloc(segments.window, sizeof(u_int8_t));
+	require_action(segments.spilled != NULL, calloc_spilled, error = EIO);
+	
+	/* segments fetched ahead of the cache file wait in a scratch file */
+	if ( filesystem_get_scratch_file(&segments.spill_fd) != 0 )
+	{
+		/* without one, every segment is written straight to the end of the cache file */
+		segments.spill_fd = -1;
+		segments.window = 1;
 	}
-	else
+	
+	/* create a CFURL to the node */
+	segments.urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(segments.urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+	/* start as many helper threads as this download wants and the shared helper streams allow */
+	helpers = (segments.window > 1) ? reserve_download_helpers(MIN(gDownloadConnections - 1, (int)segments.count - 1)) : 0;
+	if ( helpers > 0 )
 	{
-		if (error == EDESTADDRREQ) {
-			syslog(LOG_ERR, "%s: Too many redirects for OPTIONS: mount cancelled", __FUNCTION__);
-			error = EIO;
-		}
-		else if ( error != EACCES )
+		if ( (pthread_attr_init(&helper_thread_attr) == 0) &&
+			(pthread_attr_setdetachstate(&helper_thread_attr, PTHREAD_CREATE_DETACHED) == 0) )
 		{
-			syslog(LOG_ERR, "%s: network_getDAVLevel returned error %d", __FUNCTION__, error);
-			error = ENODEV;
+			/* hold the lock so a helper thread that's done quickly can't decrement helpers before it's counted */
+			mutexerror = pthread_mutex_lock(&segments.lock);
+			require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+			
+			while ( (helpers > 0) && (pthread_create(&helper_thread, &helper_thread_attr, download_helper_thread, &segments) == 0) )
+			{
+				++segments.helpers;
+				--helpers;
+			}
+			
+			mutexerror = pthread_mutex_unlock(&segments.lock);
+			require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+			
+			pthread_attr_destroy(&helper_thread_attr);
 		}
-		else
+		
+		/* give back the reservations for helper threads that couldn't be started */
+		while ( helpers > 0 )
 		{
-			syslog(LOG_DEBUG, "%s: network_getDAVLevel returned EACCES", __FUNCTION__);
-			error = EAUTH;
+			release_download_helper();
+			--helpers;
 		}
 	}
 	
+	/* this thread fetches segments too */
+	fetch_download_segments(&segments);
+	
+	/* wait for the helper threads to finish with segments */
+	mutexerror = pthread_mutex_lock(&segments.lock);
+	require_noerr_action(mutexerror, pthread_mutex_lock, webdav_kill(-1));
+	
+	while ( segments.helpers != 0 )
+	{
+		mutexerror = pthread_cond_wait(&segments.condvar, &segments.lock);
+		require_noerr_action(mutexerror, pthread_cond_wait, webdav_kill(-1));
+	}
+	
+	mutexerror = pthread_mutex_unlock(&segments.lock);
+	require_noerr_action(mutexerror, pthread_mutex_unlock, webdav_kill(-1));
+	
+	error = ((segments.error != 0) || (segments.next_write != segments.count)) ? EIO : 0;
+	
+	CFRelease(segments.urlRef);
+	
+create_cfurl_from_node:
+
+	/* the scratch file was unlinked when it was created, so closing it throws away any segments never copied */
+	if ( segments.spill_fd != -1 )
+	{
+		(void) close(segments.spill_fd);
+	}
+	free(segments.spilled);
+
+calloc_spilled:
+
+	pthread_cond_destroy(&segments.condvar);
+
+pthread_cond_init:
+
+	pthread_mutex_destroy(&segments.lock);
+
+pthread_mutex_init:
+
 	return ( error );
+
+pthread_cond_wait:
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	/* webdav_kill(-1) has been called; there's no safe way out */
+	return ( EIO );
 }
 
 /******************************************************************************/
 
 int network_finish_download(
+	uid_t uid,
 	struct node_entry *node,
 	struct ReadStreamRec *readStreamRecPtr)
 {
 	UInt8 *buffer;
 	CFIndex bytesRead;
+	CFIndex readLength;
+	off_t length;
+	off_t offset;
+	off_t segmentEnd;
+	CFStringRef conditionField;
+	CFStringRef conditionValue;
+	int error;
+	
+	/*
+	 * If the rest of a large file can be fetched with parallel Range GETs, this
+	 * stream only supplies the first segment, up to segmentEnd.
+	 */
+	segmentEnd = -1;
+	offset = 0;
+	length = 0;
+	conditionField = NULL;
+	conditionValue = NULL;
+	if ( (gDownloadConnections > 1) && download_can_be_split(readStreamRecPtr, &length, &conditionField, &conditionValue) )
+	{
+		offset = lseek(node->file_fd, 0LL, SEEK_END);
+		if ( (offset >= 0) && ((length - offset) > (off_t)gDownloadSegmentSize) )
+		{
+			segmentEnd = offset + (off_t)gDownloadSegmentSize;
+		}
+		else
+		{
+			CFRelease(conditionValue);
+			conditionValue = NULL;
+		}
+	}
 	
 	/* malloc a buffer */
 	buffer = malloc(BODY_BUFFER_SIZE);
@@ -2924,6 +6967,9 @@ int network_finish_download(
 		/* were we asked to terminate the download? */
 		if ( (node->file_status & WEBDAV_DOWNLOAD_TERMINATED) != 0 )
 		{
+			/* a split download can't be finished yet -- the other segments haven't been fetched */
+			require_quiet(segmentEnd < 0, terminated);
+			
 			/*
 			 * Call CFReadStreamRead one more time. This may block but this is
 			 * the only way to know at termination if the download was
@@ -2949,14 +6995,28 @@ int network_finish_download(
 			}
 		}
 		
-		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		readLength = BODY_BUFFER_SIZE;
+		if ( segmentEnd >= 0 )
+		{
+			if ( offset == segmentEnd )
+			{
+				/* the first segment is done */
+				break;
+			}
+			readLength = (CFIndex)MIN((off_t)readLength, segmentEnd - offset);
+		}
+		
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, readLength);
 		if ( bytesRead > 0 )
 		{
+			/* appending moves the cache file's size, which is how the kernel knows how much has arrived */
 			require(write(node->file_fd, buffer, (size_t)bytesRead) == (ssize_t)bytesRead, write);
+			offset += bytesRead;
 		}
 		else if ( bytesRead == 0 )
 		{
-			/* there are no more bytes to read */
+			/* there are no more bytes to read -- which is an error if the body was shorter than its Content-Length */
+			require(segmentEnd < 0, CFReadStreamRead);
 			break;
 		}
 		else
@@ -2972,6 +7032,23 @@ int network_finish_download(
 
 	free(buffer);
 
+	if ( segmentEnd >= 0 )
+	{
+		/* the rest of the response body won't be read, so this connection can't be reused */
+		CFReadStreamClose(readStreamRecPtr->readStreamRef);
+		CFRelease(readStreamRecPtr->readStreamRef);
+		readStreamRecPtr->readStreamRef = NULL;
+		
+		/* make this ReadStreamRec is available again */
+		release_ReadStreamRec(readStreamRecPtr);
+		
+		/* fetch the rest of the file in parallel */
+		error = download_segments(uid, node, segmentEnd, length, conditionField, conditionValue);
+		CFRelease(conditionValue);
+		
+		return ( error );
+	}
+	
 	if ( readStreamRecPtr->connectionClose )
 	{
 		/* close and release the stream */
@@ -3000,6 +7077,97 @@ malloc_buffer:
 	
 	/* make this ReadStreamRec is available again */
 	release_ReadStreamRec(readStreamRecPtr);
+	
+	if ( conditionValue != NULL )
+	{
+		CFRelease(conditionValue);
+	}
+
+	return ( EIO );
+}
+
+/******************************************************************************/
+
+int network_finish_readdir(
+	struct node_entry *node,
+	struct ReadStreamRec *readStreamRecPtr,
+	webdav_parse_opendir_stream_t *opendir_stream,
+	struct ContentDecoder *decoder)
+{
+	UInt8 *buffer;
+	CFIndex bytesRead;
+	
+	/* malloc a buffer */
+	buffer = malloc(BODY_BUFFER_SIZE);
+	require(buffer != NULL, malloc_buffer);
+
+	while ( 1 )
+	{
+		/*
+		 * Were we asked to terminate the listing? Unlike a file download, an
+		 * incomplete listing is of no use later, so just throw it away.
+		 */
+		require_quiet((node->file_status & WEBDAV_DOWNLOAD_TERMINATED) == 0, terminated);
+		
+		bytesRead = CFReadStreamRead(readStreamRecPtr->readStreamRef, buffer, BODY_BUFFER_SIZE);
+		if ( bytesRead > 0 )
+		{
+			/* decode and parse this piece of the listing and append its dirents to the cache file */
+			require_noerr(parse_opendir_piece(opendir_stream, decoder, buffer, bytesRead), parse_opendir_piece);
+		}
+		else if ( bytesRead == 0 )
+		{
+			/* there are no more bytes to read */
+			break;
+		}
+		else
+		{
+			CFStreamError streamError;
+			
+			streamError = CFReadStreamGetError(readStreamRecPtr->readStreamRef);
+			syslog(LOG_ERR,"network_finish_readdir: CFStreamError: domain %ld, error %lld", streamError.domain, (SInt64)streamError.error);
+			goto CFReadStreamRead;
+		}
+	};
+
+	free(buffer);
+
+	if ( readStreamRecPtr->connectionClose )
+	{
+		/* close and release the stream */
+		CFReadStreamClose(readStreamRecPtr->readStreamRef);
+		CFRelease(readStreamRecPtr->readStreamRef);
+		readStreamRecPtr->readStreamRef = NULL;
+	}
+
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+	
+	content_decoder_free(decoder);
+	
+	/* complete the listing */
+	return ( parse_opendir_finish(opendir_stream, FALSE) );
+
+terminated:
+parse_opendir_piece:
+CFReadStreamRead:
+
+	free(buffer);
+
+malloc_buffer:
+
+	/* close and release the read stream on errors */
+	CFReadStreamClose(readStreamRecPtr->readStreamRef);
+	CFRelease(readStreamRecPtr->readStreamRef);
+	readStreamRecPtr->readStreamRef = NULL;
+	
+	/* make this ReadStreamRec is available again */
+	release_ReadStreamRec(readStreamRecPtr);
+	
+	content_decoder_free(decoder);
+	
+	/* throw away the incomplete listing */
+	(void) parse_opendir_finish(opendir_stream, TRUE);
 
 	return ( EIO );
 }
@@ -3283,13 +7451,56 @@ void writeseqWriteCallback(CFWriteStreamRef str,
 
 /******************************************************************************/
 
-CFDataRef managerMessagePortCallback(CFMessagePortRef local, SInt32 msgid, CFDataRef data, void *info)
+static void writemgrSourcePerform(void *info)
 {	
-  	#pragma unused(local,msgid,data,info)
+  	#pragma unused(info)
 		
-	// Callback does nothing. Just used to wakeup writemgr thread
+	// Perform does nothing. Signaling the source just wakes up the writemgr thread
+}
+
+/******************************************************************************/
 
-	return NULL;
+// Wakes the manager to look at the ring, the close request, or the final status.
+void wake_writemgr(struct stream_put_ctx *ctx)
+{
+	// mgrSource and mgr_rl live until cleanup_seq_write, so this is safe after the manager exits
+	if (ctx->mgrSource != NULL) {
+		CFRunLoopSourceSignal(ctx->mgrSource);
+		CFRunLoopWakeUp(ctx->mgr_rl);
+	}
+}
+
+/******************************************************************************/
+
+// Waits until fewer than limit chunks are in the ring, or the sequential write is over.
+// Only the producer calls this.
+void wait_writemgr_ring(struct stream_put_ctx *ctx, uint32_t limit)
+{
+	struct timespec timeout;
+	int error;
+	
+	// the common case doesn't need the lock
+	if ((ctx->ringHead - ctx->ringTail) < limit)
+		return;
+	
+	timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_REQUEST_TIMEOUT;
+	timeout.tv_nsec = 0;
+	
+	pthread_mutex_lock(&ctx->ctx_lock);
+	// the manager only takes ctx_lock to wake us if it sees producerWaiting
+	ctx->producerWaiting = true;
+	OSMemoryBarrier();
+	while ( ((ctx->ringHead - ctx->ringTail) >= limit) && (ctx->finalStatusValid == false) && (ctx->mgr_status != WR_MGR_DONE) ) {
+		error = pthread_cond_timedwait(&ctx->ctx_condvar, &ctx->ctx_lock, &timeout);
+		if ( error != 0 ) {
+			syslog(LOG_ERR, "%s: pthread_cond_timedwait returned error %d, failed.", __FUNCTION__, error);
+			ctx->finalStatus = (error == ETIMEDOUT) ? ETIMEDOUT : EIO;
+			ctx->finalStatusValid = true;
+			wake_writemgr(ctx);
+		}
+	}
+	ctx->producerWaiting = false;
+	pthread_mutex_unlock(&ctx->ctx_lock);
 }
 
 /******************************************************************************/
@@ -3297,7 +7508,6 @@ CFDataRef managerMessagePortCallback(CFMessagePortRef local, SInt32 msgid, CFDat
 int cleanup_seq_write(struct stream_put_ctx *ctx) 
 {
 	struct timespec timeout;
-	struct seqwrite_mgr_req *mgr_req;
 	int error;
 	
 	if ( ctx == NULL ) {
@@ -3305,25 +7515,15 @@ int cleanup_seq_write(struct stream_put_ctx *ctx)
 		return (-1);
 	}
 	
-	mgr_req = (struct seqwrite_mgr_req *) malloc(sizeof(struct seqwrite_mgr_req));
-	
-	if (mgr_req == NULL) {
-		syslog(LOG_ERR, "%s: no mem for mgr request", __FUNCTION__);
-		return (-1);
-	}
-	bzero(mgr_req, sizeof(struct seqwrite_mgr_req));
-	
-	mgr_req->refCount = 1;	// hold on to a reference until we're done
-	mgr_req->type = SEQWRITE_CLOSE;
-	
 	timeout.tv_sec = time(NULL) + WEBDAV_WRITESEQ_RSP_TIMEOUT;		/* time out in seconds */
 	timeout.tv_nsec = 0;
 
-	// If mgr is running, tell it to close down
+	// If mgr is running, tell it to close down once the ring is empty
 	pthread_mutex_lock(&ctx->ctx_lock);
 	if (ctx->mgr_status == WR_MGR_RUNNING) {
-		// queue request
-		queue_writemgr_request_locked(ctx, mgr_req);
+		OSMemoryBarrier();
+		ctx->closeRequested = true;
+		wake_writemgr(ctx);
 	}
 	
 	while (ctx->mgr_status != WR_MGR_DONE) {
@@ -3341,7 +7541,6 @@ int cleanup_seq_write(struct stream_put_ctx *ctx)
 	}
 	
 	error = ctx->finalStatus;
-	release_writemgr_request_locked(mgr_req);
 	pthread_mutex_unlock(&ctx->ctx_lock);
 
 	/* clean up the streams */
@@ -3367,10 +7566,15 @@ int cleanup_seq_write(struct stream_put_ctx *ctx)
 		ctx->rspStreamRef = NULL;
 	}
 	
-	if (ctx->mgrPort != NULL) {
-		CFMessagePortInvalidate(ctx->mgrPort);
-		CFRelease(ctx->mgrPort);
-		ctx->mgrPort = NULL;
+	if (ctx->mgrSource != NULL) {
+		CFRunLoopSourceInvalidate(ctx->mgrSource);
+		CFRelease(ctx->mgrSource);
+		ctx->mgrSource = NULL;
+	}
+	
+	if (ctx->ringBuffer != NULL) {
+		free(ctx->ringBuffer);
+		ctx->ringBuffer = NULL;
 	}
 	
 	if (ctx->mgr_rl != NULL) {
@@ -3391,7 +7595,13 @@ int network_open(
 	int error;
 	int ask_server;
 	
-	if ( !write_access )
+	if ( (NODE_FILE_CREATE_PENDING(node) || NODE_FILE_WRITEBACK_PENDING(node)) &&
+		((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED) )
+	{
+		/* the file (or its latest changes) isn't on the server yet, so the cache file is all there is */
+		ask_server = FALSE;
+	}
+	else if ( !write_access )
 	{
 		if ( ((node->file_status & WEBDAV_DOWNLOAD_STATUS_MASK) == WEBDAV_DOWNLOAD_FINISHED) && !NODE_FILE_INVALID(node) )
 		{
@@ -3462,20 +7672,8 @@ int network_open(
 			message = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("GET"), urlRef, kCFHTTPVersion1_1);
 			require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
 			
-			if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
-				/* translate flag and no-cache only for Microsoft IIS Server */
-				CFHTTPMessageSetHeaderFieldValue(message, CFSTR("translate"), CFSTR("f"));
-				CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Pragma"), CFSTR("no-cache"));
-			}
-
-			/* Change the User-Agent header */
-			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("User-Agent"), userAgentHeaderValue);
-			
-			/* add the X-Source-Id header if needed */
-			if ( X_Source_Id_HeaderValue != NULL )
-			{
-				CFHTTPMessageSetHeaderFieldValue(message, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
-			}
+			/* apply the translate and Pragma (Microsoft IIS Server only), User-Agent and X-Source-Id headers */
+			apply_header_template(message, HEADER_TEMPLATE_NO_CACHE | HEADER_TEMPLATE_SOURCE_ID);
 			
 			/* add cookies (if any) */
 			add_cookie_headers(message, urlRef);
@@ -3540,7 +7738,7 @@ int network_open(
 				responseRef = NULL;
 			}
 			/* now that everything's ready to send, send it */
-			error = stream_get_transaction(message, &retryTransaction, node, &responseRef);
+			error = stream_get_transaction(uid, message, &retryTransaction, node, &responseRef);
 			if ( error == EAGAIN )
 			{
 				statusCode = 0;
@@ -3799,20 +7997,8 @@ static void create_http_request_message(CFHTTPMessageRef *message_p, CFURLRef ur
 	*message_p = CFHTTPMessageCreateRequest(kCFAllocatorDefault, CFSTR("PUT"), urlRef, kCFHTTPVersion1_1);
 	/* require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO); */ 
 	if (*message_p != NULL) {
-		if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
-			/* translate flag and no-cache only for Microsoft IIS Server */
-			CFHTTPMessageSetHeaderFieldValue(*message_p, CFSTR("translate"), CFSTR("f"));
-			CFHTTPMessageSetHeaderFieldValue(*message_p, CFSTR("Pragma"), CFSTR("no-cache"));
-		}
-		
-		/* Change the User-Agent header */
-		CFHTTPMessageSetHeaderFieldValue(*message_p, CFSTR("User-Agent"), userAgentHeaderValue);
-		
-		/* add the X-Source-Id header if needed */
-		if ( X_Source_Id_HeaderValue != NULL )
-		{
-			CFHTTPMessageSetHeaderFieldValue(*message_p, CFSTR("X-Source-Id"), X_Source_Id_HeaderValue);
-		}
+		/* apply the translate and Pragma (Microsoft IIS Server only), User-Agent and X-Source-Id headers */
+		apply_header_template(*message_p, HEADER_TEMPLATE_NO_CACHE | HEADER_TEMPLATE_SOURCE_ID);
 		
 		/* add cookies (if any) */
 		add_cookie_headers(*message_p, urlRef);
@@ -3970,6 +8156,15 @@ int setup_seq_write(
 		return (error);
 	}
 	
+	/* all the chunk buffers are allocated up front; none are allocated per chunk */
+	node->put_ctx->ringSlots = gSeqWriteWindow;
+	node->put_ctx->ringBuffer = malloc((size_t)node->put_ctx->ringSlots * BODY_BUFFER_SIZE);
+	if (node->put_ctx->ringBuffer == NULL) {
+		syslog(LOG_ERR, "%s: failed to alloc ring buffer", __FUNCTION__);
+		error = ENOMEM;
+		return (error);
+	}
+	
 	/* create a CFURL to the node */
 	urlRef = create_cfurl_from_node(node, NULL, 0);
 	if (urlRef == NULL)
@@ -4073,74 +8268,39 @@ int setup_seq_write(
 	
 out1:
 	CFRelease(urlRef);
-	return ( error );
-}
-
-void network_seqwrite_manager(struct stream_put_ctx *ctx)
-{
-	CFMessagePortRef localPort;
-	CFRunLoopSourceRef runLoopSource;
-	CFStreamError streamError;
-	CFIndex bytesWritten, len;
-	struct seqwrite_mgr_req *curr_req = NULL;
-	CFStringRef msgPortNameString = NULL;
-	int result;
-	bool didReceiveClose;
-
-	localPort = NULL;
-	runLoopSource = NULL;
-	didReceiveClose = false;
-
-	pthread_mutex_lock(&ctx->ctx_lock);
-	ctx->mgr_rl = CFRunLoopGetCurrent();
-	CFRetain(ctx->mgr_rl);
-	pthread_mutex_unlock(&ctx->ctx_lock);
-
-	// *************************************
-	// *** Schedule CFMessagePort Source ***
-	// *************************************
-	
-	// generate a unique msg port name
-	char msgPortName[WRITE_MGR_MSG_PORT_NAME_BUFSIZE];
-	snprintf(msgPortName, WRITE_MGR_MSG_PORT_NAME_BUFSIZE, WRITE_MGR_MSG_PORT_NAME_TEMPLATE, WRITE_MGR_MSG_PORT_NAME_BASE_STRING, getpid(), (void*)ctx);
-	msgPortNameString = CFStringCreateWithBytes(kCFAllocatorDefault,
-												(uint8_t*)msgPortName,
-												strlen(msgPortName),
-												kCFStringEncodingASCII, false);
-
-	if (msgPortNameString == NULL) {
-		syslog(LOG_ERR, "%s: No mem for msgPortNameString\n", __FUNCTION__);
-		pthread_mutex_lock(&ctx->ctx_lock);
-		ctx->finalStatusValid = true;
-		ctx->finalStatus = EIO;
-		ctx->mgr_status = WR_MGR_DONE;
-		pthread_cond_signal(&ctx->ctx_condvar);  // signal setup thread
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
-	
-	localPort = CFMessagePortCreateLocal(kCFAllocatorDefault, msgPortNameString,
-										managerMessagePortCallback, NULL, NULL);
-		
-	if (localPort == NULL) {
-		syslog(LOG_ERR, "%s: CFMessagePortCreateLocal failed\n", __FUNCTION__);
-		pthread_mutex_lock(&ctx->ctx_lock);
-		ctx->finalStatusValid = true;
-		ctx->finalStatus = EIO;
-		ctx->mgr_status = WR_MGR_DONE;
-		pthread_cond_signal(&ctx->ctx_condvar);  // signal setup thread
-		pthread_mutex_unlock(&ctx->ctx_lock);
-		goto out1;
-	}
+	return ( error );
+}
+
+void network_seqwrite_manager(struct stream_put_ctx *ctx)
+{
+	CFRunLoopSourceContext sourceContext;
+	CFStreamError streamError;
+	CFIndex bytesWritten, len;
+	unsigned char *chunk;
+	uint32_t head, slot;
+	bool closeRequested;
+	int result;
+	bool didReceiveClose;
+
+	didReceiveClose = false;
+
+	pthread_mutex_lock(&ctx->ctx_lock);
+	ctx->mgr_rl = CFRunLoopGetCurrent();
+	CFRetain(ctx->mgr_rl);
+	pthread_mutex_unlock(&ctx->ctx_lock);
 
-	runLoopSource = CFMessagePortCreateRunLoopSource( kCFAllocatorDefault, localPort, 0);
-	CFRunLoopAddSource(CFRunLoopGetCurrent(), runLoopSource, kCFRunLoopCommonModes);
+	// ***********************************
+	// *** Schedule the wakeup source ***
+	// ***********************************
 	
-	// Init a remote port so other threads can send to our Message Port
-	ctx->mgrPort = CFMessagePortCreateRemote(kCFAllocatorDefault, msgPortNameString);
+	// Producers signal this source when they add a chunk to the ring or ask for the close
+	memset(&sourceContext, 0, sizeof(sourceContext));
+	sourceContext.info = ctx;
+	sourceContext.perform = writemgrSourcePerform;
+	ctx->mgrSource = CFRunLoopSourceCreate(kCFAllocatorDefault, 0, &sourceContext);
 		
-	if (ctx->mgrPort == NULL) {
-		syslog(LOG_ERR, "%s: CFMessagePortCreateRemote failed\n", __FUNCTION__);
+	if (ctx->mgrSource == NULL) {
+		syslog(LOG_ERR, "%s: CFRunLoopSourceCreate failed\n", __FUNCTION__);
 		pthread_mutex_lock(&ctx->ctx_lock);
 		ctx->finalStatusValid = true;
 		ctx->finalStatus = EIO;
@@ -4150,9 +8310,7 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 		goto out1;
 	}
 
-	// Done with msgPortNameString
-	CFRelease(msgPortNameString);
-	msgPortNameString = NULL;
+	CFRunLoopAddSource(ctx->mgr_rl, ctx->mgrSource, kCFRunLoopDefaultMode);
 
 	// Setup our client context
 	CFStreamClientContext mgrContext = {0, ctx, NULL, NULL, NULL};
@@ -4272,299 +8430,174 @@ void network_seqwrite_manager(struct stream_put_ctx *ctx)
 	while(1)
 	{
 		pthread_mutex_lock(&ctx->ctx_lock);
-
-		if (curr_req == NULL) {
-			// dequeue the next request
-			curr_req = dequeue_writemgr_request_locked(ctx);
-		}
-		
-		// Are we all done?
-		if ((curr_req != NULL) && (curr_req->type == SEQWRITE_CLOSE)) {
-			// syslog(LOG_DEBUG, "%s: SEQWRITE_CLOSE, closing write stream", __FUNCTION__);
-			release_writemgr_request_locked(curr_req);
-			curr_req = NULL;
-			didReceiveClose = true;
-			CFWriteStreamClose(ctx->wrStreamRef);
-		}
-		
 		if (ctx->finalStatusValid == true) {
 			// syslog(LOG_DEBUG, "%s: finalStatusValid is true, exiting now", __FUNCTION__);
 
-			if (curr_req == NULL) {
-				// dequeue the next request
-				curr_req = dequeue_writemgr_request_locked(ctx);
-			}
-			
-			// cleanup
-			while (curr_req) {
-				if ( curr_req->type == SEQWRITE_CHUNK ) {
-					// wake thread sleeping on this request
-					pthread_mutex_lock(&curr_req->req_lock);
-					curr_req->error = ctx->finalStatus;
-					curr_req->request_done = true;
-					pthread_cond_signal(&curr_req->req_condvar);
-					pthread_mutex_unlock(&curr_req->req_lock);
-				}
-				release_writemgr_request_locked(curr_req);
-
-				curr_req = dequeue_writemgr_request_locked(ctx);
-			}
+			// the chunks still in the ring won't be written
+			ctx->ringTail = ctx->ringHead;
 
-			// signal cleanup thread and exit
+			// signal cleanup thread (or a producer waiting for room) and exit
 			ctx->mgr_status = WR_MGR_DONE;
-			pthread_cond_signal(&ctx->ctx_condvar);
+			pthread_cond_broadcast(&ctx->ctx_condvar);
 			pthread_mutex_unlock(&ctx->ctx_lock);
 
 			break;
 		}
+		pthread_mutex_unlock(&ctx->ctx_lock);
+		
+		// The producer sets closeRequested after its last chunk, so read it before ringHead.
+		// The barrier after reading ringHead keeps the chunk's contents from being read early.
+		closeRequested = ctx->closeRequested;
+		OSMemoryBarrier();
+		head = ctx->ringHead;
+		OSMemoryBarrier();
 		
 		// Can we Write?
-		if ( (ctx->canAcceptBytesEvents !=0) && (curr_req != NULL)  && (didReceiveClose == false) ) {
-			pthread_mutex_unlock(&ctx->ctx_lock);
+		// (canAcceptBytesEvents is only changed by writeseqWriteCallback, which runs on this thread)
+		if ( (ctx->ringTail != head) && (ctx->canAcceptBytesEvents != 0) ) {
+			slot = ctx->ringTail % ctx->ringSlots;
+			chunk = ctx->ringBuffer + ((size_t)slot * BODY_BUFFER_SIZE);
+			len = ctx->ringLen[slot] - ctx->chunkWritten;
 			
-			// Now write the data
-			len = curr_req->chunkLen - curr_req->chunkWritten;
-			if (len <= 0) {
-				// syslog(LOG_DEBUG,"%s: chunk written succesfully",__FUNCTION__);
-				
-				if (len < 0)
-					 syslog(LOG_DEBUG,"%s: negative len value %ld for chunkLen %ld, chunkWritten %ld",
-							__FUNCTION__, len, curr_req->chunkLen, curr_req->chunkWritten);
-						
-				// wake thread sleeping on this request
-				pthread_mutex_lock(&curr_req->req_lock);
-				curr_req->error = 0;
-				curr_req->request_done = true;
-				pthread_cond_signal(&curr_req->req_condvar);
-				pthread_mutex_unlock(&curr_req->req_lock);
-				release_writemgr_request(ctx, curr_req);
-				curr_req = NULL;
-				continue;
-			} else {
-				// syslog(LOG_DEBUG,"%s: chunkWritten: %u len: %ld\n",
-				//	__FUNCTION__, curr_req->chunkWritten, len);
+			// syslog(LOG_DEBUG,"%s: chunkWritten: %ld len: %ld\n",
+			//	__FUNCTION__, ctx->chunkWritten, len);
 
+			ctx->canAcceptBytesEvents--;
+			bytesWritten = CFWriteStreamWrite(ctx->wrStreamRef, (UInt8*)(chunk + ctx->chunkWritten), len);
+				
+			if (bytesWritten < 0 ) {
+				// bad
+				streamError = CFWriteStreamGetError(ctx->wrStreamRef);
 				pthread_mutex_lock(&ctx->ctx_lock);
-				ctx->canAcceptBytesEvents--;
-				pthread_mutex_unlock(&ctx->ctx_lock);
-				bytesWritten = CFWriteStreamWrite(ctx->wrStreamRef, (UInt8*)(curr_req->data + curr_req->chunkWritten), len);
-					
-				if (bytesWritten < 0 ) {
-					// bad
-					streamError = CFWriteStreamGetError(ctx->wrStreamRef);
-					if (!(ctx->is_retry) &&
-						((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
-						(streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)))						
+				if (!(ctx->is_retry) &&
+					((streamError.domain == kCFStreamErrorDomainPOSIX && streamError.error == EPIPE) ||
+					(streamError.domain ==  kCFStreamErrorDomainHTTP && streamError.error ==  kCFStreamErrorHTTPConnectionLost)))						
+				{
+					/*
+					 * We got an EPIPE or HTTP Connection Lost error from the stream.  We retry the PUT request
+					 * for these errors conditions
+					 */
+					syslog(LOG_DEBUG,"%s: bytesWritten < 0, CFStreamError: domain %ld, error %lld (retrying)",
+						__FUNCTION__, streamError.domain, (SInt64)streamError.error);
+					if (ctx->finalStatusValid == false) {
+						ctx->finalStatus = EAGAIN;
+						ctx->finalStatusValid = true;
+					}
+				}
+				else
+				{						
+					if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
 					{
-						/*
-						 * We got an EPIPE or HTTP Connection Lost error from the stream.  We retry the PUT request
-						 * for these errors conditions
-						 */
-						syslog(LOG_DEBUG,"%s: bytesWritten < 0, CFStreamError: domain %ld, error %lld (retrying)",
-							__FUNCTION__, streamError.domain, (SInt64)streamError.error);
-
-						// wake thread sleeping on this request
-						pthread_mutex_lock(&curr_req->req_lock);
-						curr_req->error = EAGAIN;
-						curr_req->request_done = true;
-						pthread_cond_signal(&curr_req->req_condvar);
-						pthread_mutex_unlock(&curr_req->req_lock);
-						release_writemgr_request(ctx, curr_req);
-						curr_req = NULL;
+						syslog(LOG_DEBUG,"%s: CFStreamError: domain %ld, error %lld",
+						__FUNCTION__, streamError.domain, (SInt64)streamError.error);
 					}
-					else
-					{						
-						if ( get_connectionstate() == WEBDAV_CONNECTION_UP )
-						{
-							syslog(LOG_DEBUG,"%s: CFStreamError: domain %ld, error %lld",
-							__FUNCTION__, streamError.domain, (SInt64)streamError.error);
-						}
-						set_connectionstate(WEBDAV_CONNECTION_DOWN);							
-							
-						// wake thread sleeping on this request
-						pthread_mutex_lock(&curr_req->req_lock);
-						curr_req->error = EIO;
-						curr_req->request_done = true;
-						pthread_cond_signal(&curr_req->req_condvar);
-						pthread_mutex_unlock(&curr_req->req_lock);
-						release_writemgr_request(ctx, curr_req);
-						curr_req = NULL;
+					set_connectionstate(WEBDAV_CONNECTION_DOWN);							
+					if (ctx->finalStatusValid == false) {
+						ctx->finalStatus = EIO;
+						ctx->finalStatusValid = true;
 					}
 				}
-				else
-					curr_req->chunkWritten += bytesWritten;
+				pthread_mutex_unlock(&ctx->ctx_lock);
+				continue;
 			}
-		}		
-		else
-			pthread_mutex_unlock(&ctx->ctx_lock);
-		
-		pthread_mutex_lock(&ctx->ctx_lock);
-		if ( (ctx->canAcceptBytesEvents == 0) || (curr_req == NULL && ctx->req_head == NULL)) {
-			pthread_mutex_unlock(&ctx->ctx_lock);
-			CFRunLoopRunInMode(kCFRunLoopDefaultMode, DBL_MAX, TRUE);
-		} else {
-			pthread_mutex_unlock(&ctx->ctx_lock);
+			
+			ctx->chunkWritten += bytesWritten;
+			if (ctx->chunkWritten >= ctx->ringLen[slot]) {
+				// syslog(LOG_DEBUG,"%s: chunk written succesfully",__FUNCTION__);
+				
+				// done with the slot -- hand it back to the producer
+				ctx->chunkWritten = 0;
+				OSMemoryBarrier();
+				ctx->ringTail++;
+				OSMemoryBarrier();
+				
+				// only a producer waiting for room needs the lock and condvar
+				if (ctx->producerWaiting == true) {
+					pthread_mutex_lock(&ctx->ctx_lock);
+					pthread_cond_broadcast(&ctx->ctx_condvar);
+					pthread_mutex_unlock(&ctx->ctx_lock);
+				}
+			}
+			
+			// keep writing while the stream can take more
+			if (ctx->canAcceptBytesEvents != 0)
+				continue;
+		}
+		else if ( (ctx->ringTail == head) && (closeRequested == true) && (didReceiveClose == false) ) {
+			// syslog(LOG_DEBUG, "%s: close requested, closing write stream", __FUNCTION__);
+			didReceiveClose = true;
+			CFWriteStreamClose(ctx->wrStreamRef);
 		}
+		
+		// wait for the stream, a producer, or the response
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, DBL_MAX, TRUE);
 	}
 
 out1:
-	if (localPort != NULL) {
-		CFMessagePortInvalidate(localPort);
-		CFRelease(localPort);
-	}
-
-	if (runLoopSource != NULL)
-		CFRelease(runLoopSource);
-	if (msgPortNameString != NULL)
-		CFRelease(msgPortNameString);
 	return;
 }
 
 /******************************************************************************/
 
-// Note: ctx->lock must be held before calling this routine
-int queue_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req)
-{
-	SInt32 status;
-
-	if (ctx == NULL) {
-		syslog(LOG_ERR, "%s: NULL ctx arg", __FUNCTION__);
-		return (-1);
-	}
-	
-	if (req == NULL) {
-		syslog(LOG_ERR, "%s: NULL request arg", __FUNCTION__);
-		return (-1);
-	}
-
-	// queue request
-	if (ctx->req_head == NULL) {
-		ctx->req_head = req;
-		ctx->req_tail = req;
-		req->prev = NULL;
-		req->next = NULL;
-	} else {
-		ctx->req_tail->next = req;
-		req->prev = ctx->req_tail;
-		req->next = NULL;
-		ctx->req_tail = req;
-	}
-	
-	// Add a reference
-	req->refCount++;
-	
-	// fire manager's runloop source
-	status = CFMessagePortSendRequest(
-		ctx->mgrPort,
-		(SInt32) WRITE_MGR_NEW_REQUEST_ID,
-		NULL,
-		WRITE_MGR_MSG_PORTSEND_TIMEOUT,
-		WRITE_MGR_MSG_PORTSEND_TIMEOUT,
-		NULL, NULL);
-		
-	if (status != kCFMessagePortSuccess) {
-		syslog(LOG_ERR, "%s: CFMessagePort error %lld\n", __FUNCTION__, (SInt64)status);
-		return (-1);
-	}
-	else
-		return (0);
-}
-
-/******************************************************************************/
-// Note: ctx->lock must be held before calling this routine
-struct seqwrite_mgr_req *dequeue_writemgr_request_locked(struct stream_put_ctx *ctx)
-{
-	struct seqwrite_mgr_req *req;
-	
-	req = ctx->req_head;
-	if (req != NULL) {
-		// dequeue the request
-		if (ctx->req_head == ctx->req_tail) {
-			// only one in queue
-			ctx->req_head = NULL;
-			ctx->req_tail = NULL;
-		} else {
-			ctx->req_head = ctx->req_head->next;
-			ctx->req_head->prev = NULL;
-		}		
-	}
-	
-	return req;
-}
-
-/******************************************************************************/
-// Note: ctx->lock must be held before calling this routine
-void release_writemgr_request_locked(struct seqwrite_mgr_req *req)
-{
-	if (req->refCount)
-		req->refCount--;
-	
-	if (req->refCount == 0) {
-		// no references remain, can free now
-		if (req->data != NULL)
-			free(req->data);
-		free(req);
-	}
-}
-
-/******************************************************************************/
-void release_writemgr_request(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req)
-{
-	pthread_mutex_lock(&ctx->ctx_lock);
-	release_writemgr_request_locked(req);
-	pthread_mutex_unlock(&ctx->ctx_lock);								
-}
-
-/******************************************************************************/
-
-int network_fsync(
+/*
+ * put_file_range
+ *
+ * PUTs length bytes of node's cache file starting at offset. A PUT that
+ * starts past the beginning of the file carries a Content-Range header.
+ * statusCode is set to the response's status code, or to 0 if the transaction
+ * failed before there was a response. If no error, the response is returned in
+ * responseRef and the caller must release it.
+ */
+static int put_file_range(
 	uid_t uid,					/* -> uid of the user making the request */
-	struct node_entry *node,	/* -> node to sync with server */
-	off_t *file_length,			/* <- length of file */
-	time_t *file_last_modified)	/* <- date of last modification */
+	struct node_entry *node,	/* -> node to PUT */
+	CFURLRef urlRef,			/* -> url to the node */
+	off_t offset,				/* -> the first byte of the file to send */
+	off_t length,				/* -> the number of bytes to send */
+	off_t fileLength,			/* -> the length of the whole file */
+	int createOnly,				/* -> if TRUE, the PUT must not replace a file on the server */
+	CFIndex *statusCode,		/* <- the status code of the response */
+	CFHTTPMessageRef *responseRef)	/* <- the response (caller responsible for releasing) */
 {
 	int error;
-	CFURLRef urlRef;
 	CFHTTPMessageRef message;
-	CFHTTPMessageRef responseRef;
-	CFIndex statusCode;
 	UInt32 auth_generation;
 	CFStringRef lockTokenRef;
-	char *file_entity_tag;
+	CFStringRef contentRangeRef;
 	int retryTransaction;
 	
 	error = 0;
-	*file_last_modified = -1;
-	*file_length = -1;
-	file_entity_tag = NULL;
 	message = NULL;
-	responseRef = NULL;
-	statusCode = 0;
+	*responseRef = NULL;
+	*statusCode = 0;
 	auth_generation = 0;
 	retryTransaction = TRUE;
-	off_t contentLength;
-	
-	/* create a CFURL to the node */
-	urlRef = create_cfurl_from_node(node, NULL, 0);
-	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
-
-	/* get the file length */
-	contentLength = lseek(node->file_fd, 0LL, SEEK_END);	
 	
-	/* set the file position back to 0 */
-	lseek(node->file_fd, 0LL, SEEK_SET);
-
-	
-	// If this file is large, turn off data caching during the upload
-	if (contentLength > (off_t)webdavCacheMaximumSize)
-		fcntl(node->file_fd, F_NOCACHE, 1);
-
 	/* the transaction/authentication loop */
 	do
 	{
 		create_http_request_message(&message, urlRef, 0);
 		require_action(message != NULL, CFHTTPMessageCreateRequest, error = EIO);
 		
+		/*
+		 * If this PUT creates the file (deferred creation), it must not
+		 * replace a file someone else created since our create.
+		 */
+		if ( createOnly )
+		{
+			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("If-None-Match"), CFSTR("*"));
+		}
+		
+		/* a segment after the first writes its part of the file */
+		if ( offset != 0 )
+		{
+			contentRangeRef = CFStringCreateWithFormat(kCFAllocatorDefault, NULL, CFSTR("bytes %qd-%qd/%qd"),
+				offset, offset + length - 1, fileLength);
+			require_action(contentRangeRef != NULL, CFStringCreateWithFormat, error = EIO);
+			CFHTTPMessageSetHeaderFieldValue(message, CFSTR("Content-Range"), contentRangeRef);
+			CFRelease(contentRangeRef);
+		}
+		
 		/* is there a lock token? */
 		if ( node->file_locktoken != NULL )
 		{
@@ -4577,73 +8610,274 @@ int network_fsync(
 				lockTokenRef = NULL;
 			}
 		}
-		else
-		{
-			lockTokenRef = NULL;
-		}
 		
 		/* apply credentials (if any) */
 		/*
 		 * statusCode will be 401 or 407 and responseRef will not be NULL if we've already been through the loop;
 		 * statusCode will be 0 and responseRef will be NULL if this is the first time through.
 		 */
-		error = authcache_apply(uid, message, (UInt32)statusCode, responseRef, &auth_generation);
+		error = authcache_apply(uid, message, (UInt32)*statusCode, *responseRef, &auth_generation);
 		if ( error != 0 )
 		{
 			break;
 		}
 		
 		/* stream_transaction returns responseRef so release it if left from previous loop */
-		if ( responseRef != NULL )
+		if ( *responseRef != NULL )
 		{
-			CFRelease(responseRef);
-			responseRef = NULL;
+			CFRelease(*responseRef);
+			*responseRef = NULL;
 		}
 		/* now that everything's ready to send, send it */
 		
-		error = stream_transaction_from_file(message, node->file_fd, &retryTransaction, &responseRef);
-		if ( error == EAGAIN )
+		error = stream_transaction_from_file(message, node->file_fd, offset, length, &retryTransaction, responseRef);
+		if ( error != 0 )
 		{
-			statusCode = 0;
-			/* responseRef will be left NULL on retries */
+			/* responseRef will be left NULL on retries and errors */
+			*statusCode = 0;
+			if ( error != EAGAIN )
+			{
+				break;
+			}
 		}
-		else if ( error != 0 )
+		else
 		{
-			break;
+			/* get the status code */
+			*statusCode = CFHTTPMessageGetResponseStatusCode(*responseRef);
+		}
+
+	} while ( error == EAGAIN || *statusCode == 401 || *statusCode == 407 );
+
+CFStringCreateWithFormat:
+CFHTTPMessageCreateRequest:
+
+	if ( error == 0 )
+	{
+		if ( (*statusCode == 412) && createOnly )
+		{
+			/* Precondition Failed: the If-None-Match found a file that isn't ours */
+			error = EEXIST;
+		}
+		else
+		{
+			error = translate_status_to_error((UInt32)*statusCode);
+		}
+		if ( error == 0 )
+		{
+			/*
+			 * when we get here with no errors, then we need to tell the authcache the
+			 * transaction worked so it can mark the credentials valid and, if needed
+			 * add the credentials to the keychain. If the auth_generation changed, then
+			 * another transaction updated the authcache element after we got it.
+			 */
+			(void) authcache_valid(uid, message, auth_generation);
+		}
+	}
+	
+	if ( message != NULL )
+	{
+		CFRelease(message);
+	}
+	
+	if ( (error != 0) && (*responseRef != NULL) )
+	{
+		CFRelease(*responseRef);
+		*responseRef = NULL;
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * get_server_length
+ *
+ * Returns the length of the file at urlRef on the server (from the
+ * Content-Length of a HEAD response) in length.
+ */
+static int get_server_length(
+	uid_t uid,					/* -> uid of the user making the request */
+	CFURLRef urlRef,			/* -> url to the file */
+	off_t *length)				/* <- the length of the file on the server */
+{
+	int error;
+	CFHTTPMessageRef responseRef;
+	
+	error = send_transaction(uid, urlRef, NULL, CFSTR("HEAD"), NULL, 0, NULL, REDIRECT_AUTO, NULL, NULL, &responseRef);
+	if ( error == 0 )
+	{
+		if ( !get_content_length(responseRef, length) )
+		{
+			error = EIO;
+		}
+		CFRelease(responseRef);
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
+/*
+ * put_file_segments
+ *
+ * Uploads node's cache file with PUTs of gUploadSegmentSize bytes. The first
+ * PUT replaces the file on the server and each of the rest writes its part
+ * of the file with a Content-Range. If the connection is lost, the length of
+ * the file on the server says how much of the upload was committed, and the
+ * upload continues from there rather than from the beginning. It's only used
+ * once probe_partial_put has shown the server handles Content-Range, since
+ * the first PUT truncates the file on the server. If the server refuses a
+ * Content-Range anyway, the file is sent in a single PUT. If no error, the last response (if there was one) is returned in
+ * responseRef and the caller must release it.
+ */
+static int put_file_segments(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node to PUT */
+	CFURLRef urlRef,			/* -> url to the node */
+	off_t fileLength,			/* -> the length of the file */
+	CFHTTPMessageRef *responseRef)	/* <- the last response (caller responsible for releasing) */
+{
+	int error;
+	off_t committed;
+	off_t length;
+	off_t serverLength;
+	CFIndex statusCode;
+	int created;
+	int resumes;
+	
+	error = 0;
+	*responseRef = NULL;
+	committed = 0;
+	created = FALSE;
+	resumes = 0;
+	
+	while ( committed < fileLength )
+	{
+		if ( *responseRef != NULL )
+		{
+			CFRelease(*responseRef);
+			*responseRef = NULL;
+		}
+		
+		length = MIN(gUploadSegmentSize, fileLength - committed);
+		error = put_file_range(uid, node, urlRef, committed, length, fileLength,
+			NODE_FILE_CREATE_PENDING(node) && !created, &statusCode, responseRef);
+		if ( error == 0 )
+		{
+			created = TRUE;
+			committed += length;
+			resumes = 0;
+		}
+		else if ( (committed != 0) &&
+				  ((statusCode == 400) || (statusCode == 405) || (statusCode == 416) || (statusCode == 501)) )
+		{
+			/* the server wouldn't take the Content-Range after all, so stop using segments */
+			network_learn_server_capability(WEBDAV_CAPABILITY_PARTIAL_PUT, FALSE);
+			goto single_put;
+		}
+		else if ( (statusCode == 0) && ((error == ETIMEDOUT) || (error == ENXIO) || (error == EIO)) &&
+				  (resumes < WEBDAV_UPLOAD_RESUMES) )
+		{
+			/* the connection was lost -- continue from what the server committed */
+			++resumes;
+			if ( committed != 0 )
+			{
+				if ( get_server_length(uid, urlRef, &serverLength) != 0 )
+				{
+					/* the server is still unreachable */
+					break;
+				}
+				if ( (serverLength >= committed) && (serverLength <= committed + length) )
+				{
+					committed = serverLength;
+				}
+				else
+				{
+					/* the file isn't what this upload left on the server, so start over */
+					committed = 0;
+				}
+			}
+			syslog(LOG_INFO, "put_file_segments: connection lost; resuming the upload at %qd of %qd bytes", committed, fileLength);
+			error = 0;
 		}
 		else
 		{
-			/* get the status code */
-			statusCode = CFHTTPMessageGetResponseStatusCode(responseRef);
+			break;
 		}
+	}
+	
+	return ( error );
 
-	} while ( error == EAGAIN || statusCode == 401 || statusCode == 407 );
+	/**********************/
 
-CFHTTPMessageCreateRequest:
+single_put:
 
-	if ( error == 0 )
+	if ( *responseRef != NULL )
 	{
-		error = translate_status_to_error((UInt32)statusCode);
-		if ( error == 0 )
-		{
-			/*
-			 * when we get here with no errors, then we need to tell the authcache the
-			 * transaction worked so it can mark the credentials valid and, if needed
-			 * add the credentials to the keychain. If the auth_generation changed, then
-			 * another transaction updated the authcache element after we got it.
-			 */
-			(void) authcache_valid(uid, message, auth_generation);
-			add_last_mod_etag(responseRef, file_last_modified, &file_entity_tag);
-		}
+		CFRelease(*responseRef);
+		*responseRef = NULL;
 	}
 	
-	if ( message != NULL )
+	syslog(LOG_INFO, "put_file_segments: the server doesn't take Content-Range; sending the whole file");
+	return ( put_file_range(uid, node, urlRef, 0, fileLength, fileLength,
+		NODE_FILE_CREATE_PENDING(node) && !created, &statusCode, responseRef) );
+}
+
+/******************************************************************************/
+
+int network_fsync(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node to sync with server */
+	off_t *file_length,			/* <- length of file */
+	time_t *file_last_modified)	/* <- date of last modification */
+{
+	int error;
+	CFURLRef urlRef;
+	CFHTTPMessageRef responseRef;
+	CFIndex statusCode;
+	char *file_entity_tag;
+	
+	error = 0;
+	*file_last_modified = -1;
+	*file_length = -1;
+	file_entity_tag = NULL;
+	responseRef = NULL;
+	statusCode = 0;
+	off_t contentLength;
+	
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+
+	/* get the file length */
+	contentLength = lseek(node->file_fd, 0LL, SEEK_END);	
+	
+	/* set the file position back to 0 */
+	lseek(node->file_fd, 0LL, SEEK_SET);
+
+	
+	// If this file is large, turn off data caching during the upload
+	// (a mapped upload uses madvise hints instead -- see stream_transaction_from_file)
+	if ( !gMmapUpload && (contentLength > (off_t)webdavCacheMaximumSize) )
+		fcntl(node->file_fd, F_NOCACHE, 1);
+
+	if ( (gUploadSegmentSize == 0) || (contentLength <= gUploadSegmentSize) ||
+		 (network_server_capability(WEBDAV_CAPABILITY_PARTIAL_PUT) != WEBDAV_CAPABILITY_SUPPORTED) )
 	{
-		CFRelease(message);
+		error = put_file_range(uid, node, urlRef, 0, contentLength, contentLength,
+			NODE_FILE_CREATE_PENDING(node), &statusCode, &responseRef);
+	}
+	else
+	{
+		/* a large file goes up in segments so a lost connection doesn't start it over */
+		error = put_file_segments(uid, node, urlRef, contentLength, &responseRef);
 	}
 	
 	if ( responseRef != NULL )
 	{
+		add_last_mod_etag(responseRef, file_last_modified, &file_entity_tag);
 		CFRelease(responseRef);
 	}
 	
@@ -4783,8 +9017,8 @@ static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuff
 	
 	urlLen = strlen(urlPtr);
 	
-	elementPtr = statusList->head;
-	while (elementPtr != NULL) {
+	// Every skipped element must still advance elementPtr, or the loop never ends
+	for (elementPtr = statusList->head; elementPtr != NULL; elementPtr = elementPtr->next) {
 		if (elementPtr->seen_href == FALSE)
 			continue;  // skipit
 		
@@ -4805,8 +9039,6 @@ static int network_handle_multistatus_reply(CFURLRef urlRef, UInt8 *responseBuff
 			*statusCode = elementPtr->statusCode;
 			break;
 		}
-		
-		elementPtr = elementPtr->next;
 	}
 	
 parsed_nothing:
@@ -4995,6 +9227,38 @@ create_cfurl_from_node:
 
 /******************************************************************************/
 
+int network_rmtree(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> directory node to remove with everything in it */
+	time_t *remove_date)		/* <- date of the removal */
+{
+	int error;
+	CFURLRef urlRef;
+	
+	error = 0;
+	
+	/* create a CFURL to the node */
+	urlRef = create_cfurl_from_node(node, NULL, 0);
+	require_action_quiet(urlRef != NULL, create_cfurl_from_node, error = EIO);
+	
+	/*
+	 * Unlike network_rmdir, don't check for an empty directory. A DELETE on a
+	 * collection always acts as if "Depth: infinity" was specified (RFC 4918,
+	 * section 9.6.1), so the server removes the whole tree in one request. If
+	 * anything in the tree can't be removed, the server returns a 207 and
+	 * network_delete returns EBUSY.
+	 */
+	error = network_delete(uid, urlRef, node, remove_date);
+	
+	CFRelease(urlRef);
+
+create_cfurl_from_node:
+
+	return ( error );
+}
+
+/******************************************************************************/
+
 int network_rmdir(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> directory node to remove on the server */
@@ -5189,6 +9453,194 @@ exit:
 
 /******************************************************************************/
 
+int network_copy(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *from_node, /* node to copy */
+	struct node_entry *to_node,	/* node to copy over (ignored if NULL) */
+	struct node_entry *to_dir_node, /* directory node to copy into (ignored if to_node != NULL) */
+	char *to_name,				/* name for the copy (ignored if to_node != NULL) */
+	size_t to_name_length,		/* length of to_name (ignored if to_node != NULL) */
+	int overwrite,				/* -> if TRUE, replace the destination if it exists */
+	time_t *copy_date)			/* <- date of the copy */
+{
+	int error;
+	CFURLRef urlRef;
+	CFURLRef destinationUrlRef;
+	CFStringRef destinationRef;
+	CFHTTPMessageRef response;
+	CFArrayRef lockTokenArr;
+	CFStringRef lockTokenRef;
+	CFIndex i, lockTokenCount, headerIndex, headerCount;
+	CFIndex statusCode;
+	bool needTranslateFlag;
+	struct HeaderFieldValue *headers;
+	
+	headerCount = 4;	// the headers "Accept", "Destination", "Overwrite" and (for directories) "Depth"
+	needTranslateFlag = false;
+	lockTokenCount = 0;
+	headerIndex = 0;
+	lockTokenArr = NULL;
+	headers = NULL;
+	response = NULL;
+	*copy_date = -1;
+	urlRef = NULL;
+	destinationUrlRef = NULL;
+	destinationRef = NULL;
+	
+	/* don't bother servers that are known not to support COPY -- the caller will copy the data itself */
+	require_action_quiet(network_server_capability(WEBDAV_CAPABILITY_COPY) != WEBDAV_CAPABILITY_UNSUPPORTED, exit, error = ENOTSUP);
+	
+	if (gServerIdent & WEBDAV_MICROSOFT_IIS_SERVER) {
+		/* translate flag only for Microsoft IIS Server */
+		headerCount += 1;
+		needTranslateFlag = true;
+	}
+	
+	// A locked destination can only be replaced with its lock token(s)
+	if (to_node != NULL)
+		lockTokenArr = nodecache_get_locktokens(to_node);
+	
+	if (lockTokenArr != NULL)
+		lockTokenCount = CFArrayGetCount(lockTokenArr);
+	
+	headerCount += lockTokenCount;
+	
+	// Now allocate space for headers
+	headers = (struct HeaderFieldValue *)malloc(sizeof(struct HeaderFieldValue) * headerCount);
+	require_action_quiet(headers != NULL, exit, error = ENOMEM);
+	
+	// Setup initial headers
+	headers[headerIndex].headerField = CFSTR("Accept");
+	headers[headerIndex].value = CFSTR("*/*");
+	headerIndex++;
+	
+	headers[headerIndex].headerField = CFSTR("Destination");
+	headers[headerIndex].value = NULL;
+	headerIndex++;
+	
+	if (from_node->node_type == WEBDAV_DIR_TYPE) {
+		/* a collection is copied with all of its members */
+		headers[headerIndex].headerField = CFSTR("Depth");
+		headers[headerIndex].value = CFSTR("infinity");
+		headerIndex++;
+	}
+	
+	headers[headerIndex].headerField = CFSTR("Overwrite");
+	headers[headerIndex].value = overwrite ? CFSTR("T") : CFSTR("F");
+	headerIndex++;
+	
+	if (needTranslateFlag == true) {
+		/* translate flag only for Microsoft IIS Server */
+		headers[headerIndex].headerField = CFSTR("translate");
+		headers[headerIndex].value = CFSTR("f");
+		headerIndex++;
+	}
+	
+	// Add locktokens if any
+	if (lockTokenCount) {
+		for (i = 0; i < lockTokenCount; i++) {
+			lockTokenRef = (CFStringRef)CFArrayGetValueAtIndex(lockTokenArr, i);
+			if ( lockTokenRef != NULL )
+			{
+				headers[headerIndex].headerField = CFSTR("If");
+				headers[headerIndex].value = lockTokenRef;
+				headerIndex++;
+			}
+		}
+	}
+	
+	/* create a CFURL to the from_node */
+	urlRef = create_cfurl_from_node(from_node, NULL, 0);
+	require_action_quiet(urlRef != NULL, exit, error = EIO);
+	
+	/* create the URL for the destination */
+	if ( to_node != NULL )
+	{
+		destinationUrlRef = create_cfurl_from_node(to_node, NULL, 0);
+	}
+	else
+	{
+		destinationUrlRef = create_cfurl_from_node(to_dir_node, to_name, to_name_length);
+	}
+	require_action_quiet(destinationUrlRef != NULL, exit, error = EIO);
+	
+	/* copying something onto itself is an error */
+	require_action_quiet(!CFEqual(urlRef, destinationUrlRef), exit, error = EINVAL);
+	
+	destinationRef = CFURLGetString(destinationUrlRef);
+	require_action(destinationRef != NULL, exit, error = EIO);
+	
+	headers[1].value = destinationRef;
+	
+	/* send request to the server and get the response */
+	error = send_transaction(uid, urlRef, NULL, CFSTR("COPY"), NULL,
+		headerIndex, headers, REDIRECT_DISABLE, NULL, NULL, &response);
+	if ( response != NULL )
+	{
+		statusCode = CFHTTPMessageGetResponseStatusCode(response);
+		switch ( statusCode )
+		{
+			case 207:	/* Multi-Status: some members of the collection could not be copied */
+				syslog(LOG_ERR, "network_copy: some members of a collection could not be copied");
+				error = EIO;
+				break;
+			case 405:	/* Method Not Allowed */
+			case 501:	/* Not Implemented */
+				network_learn_server_capability(WEBDAV_CAPABILITY_COPY, FALSE);
+				error = ENOTSUP;
+				break;
+			case 412:	/* Precondition Failed: the destination exists and Overwrite is F */
+				error = EEXIST;
+				break;
+			case 502:	/* Bad Gateway: the destination is on another server */
+				error = EXDEV;
+				break;
+			default:
+				break;
+		}
+		
+		if ( !error )
+		{
+			CFStringRef dateHeaderRef;
+			
+			network_learn_server_capability(WEBDAV_CAPABILITY_COPY, TRUE);
+			
+			dateHeaderRef = CFHTTPMessageCopyHeaderFieldValue(response, CFSTR("Date"));
+			if ( dateHeaderRef != NULL )
+			{
+				*copy_date = DateStringToTime(dateHeaderRef);
+				
+				CFRelease(dateHeaderRef);
+			}
+		}
+		/* release the response buffer */
+		CFRelease(response);
+	}
+
+exit:
+	
+	if ( destinationUrlRef != NULL )
+	{
+		CFRelease(destinationUrlRef);
+	}
+	if ( urlRef != NULL )
+	{
+		CFRelease(urlRef);
+	}
+	if ( lockTokenArr != NULL)
+	{
+		CFRelease(lockTokenArr);
+	}
+	if (headers != NULL)
+	{
+		free(headers);
+	}
+	
+	return ( error );
+}
+
+/******************************************************************************/
+
 int network_lock(
 	uid_t uid,					/* -> uid of the user making the request (ignored if refreshing) */
 	int lockscope,				/* -> exclusive == 0 | shared == 1 */
@@ -5500,8 +9952,6 @@ int network_readdir(
 {
 	int error, redir_cnt;
 	CFURLRef urlRef;
-	UInt8 *responseBuffer;
-	CFIndex count;
 	CFDataRef bodyData;
 	const UInt8 xmlString[] =
 		"<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
@@ -5543,7 +9993,10 @@ int network_readdir(
 		(cache ? xmlStringCache : xmlString), strlen((const char *)(cache ? xmlStringCache : xmlString)), kCFAllocatorNull);
 	require_action(bodyData != NULL, CFDataCreateWithBytesNoCopy, error = EIO);
 
-	/* send request to the server and get the response */
+	/*
+	 * send request to the server -- the response is parsed into the directory's
+	 * cache file as it arrives and large listings are finished in the background
+	 */
 	redir_cnt = 0;
 	while (redir_cnt < WEBDAV_MAX_REDIRECTS) {
 		/* create a CFURL to the node */
@@ -5554,17 +10007,7 @@ int network_readdir(
 			break;
 		}
 		
-		error = send_transaction(uid, urlRef, node, CFSTR("PROPFIND"), bodyData,
-								 headerCount, headers, REDIRECT_MANUAL, &responseBuffer, &count, NULL);
-		if ( !error )
-		{
-			/* parse responseBuffer to create the directory file */
-			error = parse_opendir(responseBuffer, count, urlRef, uid, node);
-			/* free the response buffer */
-			free(responseBuffer);
-			CFRelease(urlRef);
-			break;
-		}
+		error = send_readdir_transaction(uid, urlRef, node, bodyData, headerCount, headers);
 		
 		CFRelease(urlRef);
 
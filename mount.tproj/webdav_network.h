@@ -28,6 +28,8 @@
 
 #include <CoreServices/CoreServices.h>
 
+#include "webdav_parse.h"
+
 #define WEBDAV_MAX_REDIRECTS 5	/* avoids infinite 3xx redirection loops */
 
 enum
@@ -44,6 +46,9 @@ struct ReadStreamRec
 	int connectionClose;			/* if TRUE, readStreamRef should be closed when transaction is complete */
 };
 
+/* decodes a gzip or deflate encoded response body (opaque outside of webdav_network.c) */
+struct ContentDecoder;
+
 int network_init(
 	const UInt8 *uri,			/* -> bytes containing base URI to server */
 	CFIndex uriLength,			/* -> length of uri string */
@@ -60,6 +65,12 @@ int network_get_proxy_settings(
 
 int network_update_proxy(void *arg);
 
+/*
+ * Starts the threads that multiplex transactions over their run loops.
+ * Returns 0 on success.
+ */
+int network_event_engine_init(void);
+
 int network_lookup(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *node,	/* -> parent node */
@@ -72,17 +83,89 @@ int network_getattr(
 	struct node_entry *node,	/* -> parent node */
 	struct webdav_stat_attr *statbuf);	/* <- stat information is returned in this buffer */
 
+/*
+ * Sends the getattr PROPFIND without blocking the calling thread, or joins the
+ * same PROPFIND if it is already in flight. done is called with the result on
+ * an event thread (or on the request thread that sent the PROPFIND). If the
+ * result is EAGAIN, the request needs authentication, redirection or a retry,
+ * so the caller must finish it with network_getattr.
+ */
+typedef void (*network_getattr_done)(void *context, int error, struct webdav_stat_attr *statbuf);
+
+int network_getattr_async(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> node */
+	network_getattr_done done,	/* -> called when the PROPFIND is complete (only if 0 is returned) */
+	void *context);				/* -> passed to done */
+
 int network_mount(
 	uid_t uid,					/* -> uid of the user making the request */
-	int *server_mount_flags);	/* <- flags to OR in with mount flags (i.e., MNT_RDONLY) */
+	int *server_mount_flags);	/* <-> in: MNT_RDONLY if the user asked for it; out: flags to OR in with mount flags (i.e., MNT_RDONLY) */
 								/* NOTE: if webdavfs is changed to support advlocks, then 
 								 * server_mount_flags parameter is not needed.
 								 */
 
+/*
+ * Server capabilities recorded in the server profile. The profile is probed by
+ * network_mount (or loaded from an earlier mount of the same server) and
+ * updated with network_learn_server_capability as responses show more.
+ */
+#define WEBDAV_CAPABILITY_LOCK				0x00000001	/* LOCK and UNLOCK (DAV level 2) */
+#define WEBDAV_CAPABILITY_COPY				0x00000002	/* the COPY method */
+#define WEBDAV_CAPABILITY_RANGE				0x00000004	/* byte range GETs */
+#define WEBDAV_CAPABILITY_STRONG_ETAG		0x00000008	/* strong entity tags */
+#define WEBDAV_CAPABILITY_PARTIAL_PUT		0x00000010	/* PUTs with Content-Range */
+#define WEBDAV_CAPABILITY_SYNC_COLLECTION	0x00000020	/* the sync-collection REPORT (rfc 6578) */
+#define WEBDAV_CAPABILITY_COMPRESSION		0x00000040	/* gzip or deflate Content-Encoding of responses */
+
+/* network_server_capability results */
+#define WEBDAV_CAPABILITY_UNKNOWN		0
+#define WEBDAV_CAPABILITY_SUPPORTED		1
+#define WEBDAV_CAPABILITY_UNSUPPORTED	2
+
+int network_server_capability(
+	u_int32_t capability);		/* -> a WEBDAV_CAPABILITY_* bit */
+
+void network_learn_server_capability(
+	u_int32_t capability,		/* -> a WEBDAV_CAPABILITY_* bit */
+	int supported);				/* -> TRUE if the server supports it */
+
+/*
+ * Saves the server profile (if it changed) so later mounts of the server
+ * don't have to probe it.
+ */
+void network_save_server_profile(void);
+
+/*
+ * Logs how many requests were coalesced into identical requests already in flight.
+ */
+void network_log_coalesced_requests(void);
+
+/*
+ * Logs how many encoded response bytes were decoded, the compression ratio,
+ * and the time spent decoding them.
+ */
+void network_log_content_decoding(void);
+
+/*
+ * Called when a file is closed; the highest offset the kernel read while it
+ * was open is used to size the first read of files with the same extension.
+ */
+void network_learn_first_read_len(
+	struct node_entry *node,	/* -> node being closed */
+	off_t read_frontier);		/* -> highest offset read since the file was opened */
+
 int network_finish_download(
+	uid_t uid,					/* -> uid of the user who opened the file */
 	struct node_entry *node,	/* -> node to download to */
 	struct ReadStreamRec *readStreamRecPtr); /* -> the ReadStreamRec */
 
+int network_finish_readdir(
+	struct node_entry *node,	/* -> directory node being read */
+	struct ReadStreamRec *readStreamRecPtr, /* -> the ReadStreamRec */
+	webdav_parse_opendir_stream_t *opendir_stream, /* -> the opendir stream (freed by network_finish_readdir) */
+	struct ContentDecoder *decoder); /* -> the listing's decoder, or NULL (freed by network_finish_readdir) */
+
 /*
  * Sends an "OPTIONS" request to the server after 'delay' seconds
  * Returns 0 on success. 
@@ -91,23 +174,9 @@ int network_server_ping(u_int32_t delay);
 
 void network_seqwrite_manager(struct stream_put_ctx *ctx);
 
-// Note: ctx->lock must be held before calling queue_writemgr_request_locked()
-enum {WRITE_MGR_NEW_REQUEST_ID = 1};
-#define WRITE_MGR_MSG_PORTSEND_TIMEOUT 10.0
-#define WRITE_MGR_MSG_PORT_NAME_BASE_STRING "com.apple.webdavfs.msgport"
-#define WRITE_MGR_MSG_PORT_NAME_TEMPLATE  ("%s-0x%016u-%p")
-//
-// WRITE_MGR_MSG_PORT_NAME_BUFSIZE must be large enough
-// to hold strings like this:
-// com.apple.webdavfs.msgport-0x0000000000000594-0x000000064e689a32
-// |<------- 26 bytes------>|<------------ 38 bytes ------------->|
-//
-#define WRITE_MGR_MSG_PORT_NAME_BUFSIZE 128
-
-int queue_writemgr_request_locked(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req);
-struct seqwrite_mgr_req *dequeue_writemgr_request_locked(struct stream_put_ctx *ctx);
-void release_writemgr_request_locked(struct seqwrite_mgr_req *req);
-void release_writemgr_request(struct stream_put_ctx *ctx, struct seqwrite_mgr_req *req);
+// Producer side of the manager's chunk ring
+void wake_writemgr(struct stream_put_ctx *ctx);
+void wait_writemgr_ring(struct stream_put_ctx *ctx, uint32_t limit);
 
 void writeseqReadResponseCallback(CFReadStreamRef str, 
 								  CFStreamEventType event, 
@@ -117,11 +186,6 @@ void writeseqWriteCallback(CFWriteStreamRef str,
 						   CFStreamEventType event, 
 						   void* arg);
 
-CFDataRef managerMessagePortCallback(CFMessagePortRef local,
-										SInt32 msgid,
-										CFDataRef data,
-										void *info);
-
 int cleanup_seq_write(struct stream_put_ctx *ctx);
 
 int network_open(
@@ -162,6 +226,11 @@ int network_rmdir(
 	struct node_entry *node,	/* -> directory node to remove on the server */
 	time_t *remove_date);		/* <- date of the removal */
 
+int network_rmtree(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *node,	/* -> directory node to remove with everything in it */
+	time_t *remove_date);		/* <- date of the removal */
+
 int network_rename(
 	uid_t uid,					/* -> uid of the user making the request */
 	struct node_entry *from_node, /* node to move */
@@ -174,6 +243,21 @@ int network_rename(
 								 * of to_dir_node and to_name.
 								 */
 
+/*
+ * Copies from_node on the server with a WebDAV COPY (Depth infinity for
+ * directories). Returns ENOTSUP if the server doesn't support COPY, and
+ * EEXIST if the destination exists and overwrite is FALSE.
+ */
+int network_copy(
+	uid_t uid,					/* -> uid of the user making the request */
+	struct node_entry *from_node, /* node to copy */
+	struct node_entry *to_node,	/* node to copy over (ignored if NULL) */
+	struct node_entry *to_dir_node, /* directory node to copy into (ignored if to_node != NULL) */
+	char *to_name,				/* name for the copy (ignored if to_node != NULL) */
+	size_t to_name_length,		/* length of to_name (ignored if to_node != NULL) */
+	int overwrite,				/* -> if TRUE, replace the destination if it exists */
+	time_t *copy_date);			/* <- date of the copy */
+
 int network_lock(
 	uid_t uid,					/* -> uid of the user making the request (ignored if refreshing) */
 	int lockType,				/* -> exclusive == 0 | shared == 1 */
@@ -120,6 +120,102 @@ void parser_multistatus_end(void *ctx,
 							const xmlChar *prefix,
 							const xmlChar *URI);
 /*****************************************************************************/
+
+/*
+ * The element names the SAX startElementNs callbacks dispatch on. Elements are
+ * matched by their local name only (case insensitive) -- the namespace is not
+ * checked because servers don't all put these properties in the "DAV:" namespace.
+ */
+enum
+{
+	WEBDAV_XML_UNKNOWN = 0,
+	WEBDAV_XML_HREF,
+	WEBDAV_XML_QUOTA,
+	WEBDAV_XML_STATUS,
+	WEBDAV_XML_GETETAG,
+	WEBDAV_XML_RESPONSE,
+	WEBDAV_XML_LOCKTOKEN,
+	WEBDAV_XML_QUOTAUSED,
+	WEBDAV_XML_COLLECTION,
+	WEBDAV_XML_CREATIONDATE,
+	WEBDAV_XML_GETLASTMODIFIED,
+	WEBDAV_XML_GETCONTENTLENGTH,
+	WEBDAV_XML_QUOTA_USED_BYTES,
+	WEBDAV_XML_APPLEDOUBLEHEADER,
+	WEBDAV_XML_QUOTA_AVAILABLE_BYTES
+};
+
+/*
+ * element_name returns the WEBDAV_XML_* constant for an element's local name.
+ * This is called for every element of every response so it switches on the
+ * length of the name and compares bytes instead of creating a CFString.
+ */
+static int element_name(const xmlChar *localname)
+{
+	const char *name = (const char *)localname;
+	
+	switch ( strlen(name) )
+	{
+		case 4:
+			if ( strncasecmp(name, "href", 4) == 0 )
+				return ( WEBDAV_XML_HREF );
+			break;
+		case 5:
+			if ( strncasecmp(name, "quota", 5) == 0 )
+				return ( WEBDAV_XML_QUOTA );
+			break;
+		case 6:
+			if ( strncasecmp(name, "status", 6) == 0 )
+				return ( WEBDAV_XML_STATUS );
+			break;
+		case 7:
+			if ( strncasecmp(name, "getetag", 7) == 0 )
+				return ( WEBDAV_XML_GETETAG );
+			break;
+		case 8:
+			if ( strncasecmp(name, "response", 8) == 0 )
+				return ( WEBDAV_XML_RESPONSE );
+			break;
+		case 9:
+			if ( strncasecmp(name, "locktoken", 9) == 0 )
+				return ( WEBDAV_XML_LOCKTOKEN );
+			if ( strncasecmp(name, "quotaused", 9) == 0 )
+				return ( WEBDAV_XML_QUOTAUSED );
+			break;
+		case 10:
+			if ( strncasecmp(name, "collection", 10) == 0 )
+				return ( WEBDAV_XML_COLLECTION );
+			break;
+		case 12:
+			if ( strncasecmp(name, "creationdate", 12) == 0 )
+				return ( WEBDAV_XML_CREATIONDATE );
+			break;
+		case 15:
+			if ( strncasecmp(name, "getlastmodified", 15) == 0 )
+				return ( WEBDAV_XML_GETLASTMODIFIED );
+			break;
+		case 16:
+			if ( strncasecmp(name, "getcontentlength", 16) == 0 )
+				return ( WEBDAV_XML_GETCONTENTLENGTH );
+			if ( strncasecmp(name, "quota-used-bytes", 16) == 0 )
+				return ( WEBDAV_XML_QUOTA_USED_BYTES );
+			break;
+		case 17:
+			if ( strncasecmp(name, "appledoubleheader", 17) == 0 )
+				return ( WEBDAV_XML_APPLEDOUBLEHEADER );
+			break;
+		case 21:
+			if ( strncasecmp(name, "quota-available-bytes", 21) == 0 )
+				return ( WEBDAV_XML_QUOTA_AVAILABLE_BYTES );
+			break;
+		default:
+			break;
+	}
+	
+	return ( WEBDAV_XML_UNKNOWN );
+}
+
+/*****************************************************************************/
 /* The from_base64 function decodes a base64 encoded c-string into outBuffer.
  * The outBuffer's size is *lengthptr. The actual number of bytes decoded into
  * outBuffer is also returned in *lengthptr. If outBuffer is large enough to
@@ -329,9 +425,70 @@ void parser_opendir_end(void *ctx,
 						const xmlChar *prefix,
 						const xmlChar *URI)
 {
-	#pragma unused(localname,prefix,URI)
+	#pragma unused(prefix,URI)
 	webdav_parse_opendir_struct_t * struct_ptr = (webdav_parse_opendir_struct_t *)ctx;
+	webdav_parse_opendir_element_t * element_ptr;
+	char *ep;
+	
+	/* if this element had text we collected, convert it now that we have all of it */
+	if ( (struct_ptr->start == true) && (struct_ptr->text_length != 0) )
+	{
+		element_ptr = (webdav_parse_opendir_element_t *)struct_ptr->data_ptr;
+		switch (struct_ptr->id)
+		{
+			case WEBDAV_OPENDIR_ELEMENT_LENGTH:
+				element_ptr->statsize = strtoq((const char *)struct_ptr->text, &ep, 10);
+				break;
+				
+			case WEBDAV_OPENDIR_ELEMENT_MODDATE:
+				element_ptr->stattime.tv_sec = DateBytesToTime(struct_ptr->text, (CFIndex)struct_ptr->text_length);
+				if (element_ptr->stattime.tv_sec == -1)
+				{
+					element_ptr->stattime.tv_sec = 0;
+				}
+				element_ptr->stattime.tv_nsec = 0;
+				break;
+				
+			case WEBDAV_OPENDIR_ELEMENT_CREATEDATE:
+				// First try ISO8601
+				element_ptr->createtime.tv_sec = ISO8601ToTime(struct_ptr->text, (CFIndex)struct_ptr->text_length);
+				
+				if (element_ptr->createtime.tv_sec == -1) {
+					// Try RFC 850, RFC 1123
+					element_ptr->createtime.tv_sec = DateBytesToTime(struct_ptr->text, (CFIndex)struct_ptr->text_length);
+				}
+				
+				if (element_ptr->createtime.tv_sec == -1)
+				{
+					element_ptr->createtime.tv_sec = 0;
+				}
+				element_ptr->createtime.tv_nsec = 0;
+				break;
+				
+			case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
+			{
+				size_t	len = APPLEDOUBLEHEADER_LENGTH;
+				
+				from_base64((const char *)struct_ptr->text, (unsigned char *)element_ptr->appledoubleheader, &len);
+				if (len == APPLEDOUBLEHEADER_LENGTH)
+				{
+					element_ptr->appledoubleheadervalid = TRUE;
+				}
+			}
+				break;
+				
+			default:
+				break;
+		}
+	}
+	struct_ptr->text_length = 0;
 	struct_ptr->start = false;
+	
+	/* the element for this response is complete at </D:response> */
+	if ( (struct_ptr->tail != NULL) && (element_name(localname) == WEBDAV_XML_RESPONSE) )
+	{
+		struct_ptr->tail->seen_response_end = TRUE;
+	}
 }
 /*****************************************************************************/
 
@@ -356,24 +513,146 @@ void parser_multistatus_end(void *ctx,
 	struct_ptr->start = false;
 }
 /*****************************************************************************/
-static webdav_parse_opendir_element_t *create_opendir_element(void)
+/*
+ * create_opendir_element hands out the next element record from the parse's
+ * element chunks, allocating a new chunk when the current one is used up.
+ */
+static webdav_parse_opendir_element_t *create_opendir_element(webdav_parse_opendir_struct_t *struct_ptr)
 {
 	webdav_parse_opendir_element_t *element_ptr;
+	webdav_parse_opendir_chunk_t *chunk_ptr;
 	
-	element_ptr = calloc(1, sizeof(webdav_parse_opendir_element_t));
-	if (!element_ptr)
-		return (NULL);
+	chunk_ptr = struct_ptr->chunks;
+	if ( (chunk_ptr == NULL) || (chunk_ptr->count == WEBDAV_OPENDIR_CHUNK_ELEMENTS) )
+	{
+		chunk_ptr = malloc(sizeof(webdav_parse_opendir_chunk_t));
+		if (!chunk_ptr)
+			return (NULL);
+		chunk_ptr->count = 0;
+		chunk_ptr->next = struct_ptr->chunks;
+		struct_ptr->chunks = chunk_ptr;
+	}
 	
-	element_ptr->dir_data.d_type = DT_REG;
+	element_ptr = &chunk_ptr->elements[chunk_ptr->count++];
+	bzero(element_ptr, sizeof(webdav_parse_opendir_element_t));
+	
+	element_ptr->d_type = DT_REG;
 	element_ptr->seen_href = FALSE;
 	element_ptr->seen_response_end = FALSE;
-	element_ptr->dir_data.d_namlen = 0;
-	element_ptr->dir_data.d_name_URI_length = 0;
-	element_ptr->dir_data.d_reclen = sizeof(struct webdav_dirent);
+	element_ptr->href_offset = struct_ptr->arena_length;
+	element_ptr->href_length = 0;
 	element_ptr->next = NULL;
 	return (element_ptr);
 }
 /*****************************************************************************/
+/*
+ * opendir_append_href appends text to an element's href in the href arena. The
+ * href is kept '\0' terminated. An element's href is normally the last thing in
+ * the arena; if it isn't, the href is moved to the end before appending.
+ */
+static int opendir_append_href(webdav_parse_opendir_struct_t *struct_ptr,
+							   webdav_parse_opendir_element_t *element_ptr,
+							   const UInt8 *text,
+							   size_t length)
+{
+	int error;
+	size_t href_end;
+	size_t needed;
+	
+	error = 0;
+	
+	/* make sure the complete name will fit */
+	require_action((element_ptr->href_length + length) <= (WEBDAV_MAX_URI_LEN - 1), name_too_long, error = ENAMETOOLONG);
+	
+	href_end = element_ptr->href_offset + element_ptr->href_length;
+	if ( (element_ptr->href_length != 0) && ((href_end + 1) == struct_ptr->arena_length) )
+	{
+		/* the href is at the end of the arena -- write over its '\0' */
+		struct_ptr->arena_length = href_end;
+	}
+	
+	/* grow the arena if needed (leave room to move the href in case it isn't at the end) */
+	needed = struct_ptr->arena_length + element_ptr->href_length + length + 1;
+	if ( needed > struct_ptr->arena_size )
+	{
+		size_t new_size;
+		char *new_arena;
+		
+		/* double the arena so a large listing isn't copied over and over */
+		new_size = MAX(struct_ptr->arena_size, WEBDAV_OPENDIR_ARENA_MIN_SIZE);
+		while ( new_size < needed )
+		{
+			new_size *= 2;
+		}
+		new_arena = realloc(struct_ptr->arena, new_size);
+		require_action(new_arena != NULL, realloc_arena, error = ENOMEM);
+		struct_ptr->arena = new_arena;
+		struct_ptr->arena_size = new_size;
+	}
+	
+	if ( href_end != struct_ptr->arena_length )
+	{
+		/* another href was added after this one -- move this one to the end */
+		memmove(&struct_ptr->arena[struct_ptr->arena_length], &struct_ptr->arena[element_ptr->href_offset], element_ptr->href_length);
+		element_ptr->href_offset = struct_ptr->arena_length;
+		struct_ptr->arena_length += element_ptr->href_length;
+	}
+	
+	memcpy(&struct_ptr->arena[struct_ptr->arena_length], text, length);
+	struct_ptr->arena_length += length;
+	struct_ptr->arena[struct_ptr->arena_length++] = '\0';
+	element_ptr->href_length += length;
+	
+realloc_arena:
+name_too_long:
+	
+	return ( error );
+}
+/*****************************************************************************/
+/* free_opendir_storage releases the element chunks and href arena of a parse */
+static void free_opendir_storage(webdav_parse_opendir_struct_t *struct_ptr)
+{
+	webdav_parse_opendir_chunk_t *chunk_ptr;
+	
+	while ( struct_ptr->chunks != NULL )
+	{
+		chunk_ptr = struct_ptr->chunks;
+		struct_ptr->chunks = chunk_ptr->next;
+		free(chunk_ptr);
+	}
+	if ( struct_ptr->arena != NULL )
+	{
+		free(struct_ptr->arena);
+		struct_ptr->arena = NULL;
+	}
+	struct_ptr->arena_length = struct_ptr->arena_size = 0;
+	struct_ptr->head = struct_ptr->tail = NULL;
+}
+/*****************************************************************************/
+/*
+ * reset_opendir_storage empties the element list of a parse so the element
+ * chunks and href arena can be reused. Only the most recent chunk is kept.
+ */
+static void reset_opendir_storage(webdav_parse_opendir_struct_t *struct_ptr)
+{
+	webdav_parse_opendir_chunk_t *chunk_ptr;
+	
+	if ( struct_ptr->chunks != NULL )
+	{
+		while ( struct_ptr->chunks->next != NULL )
+		{
+			chunk_ptr = struct_ptr->chunks->next;
+			struct_ptr->chunks->next = chunk_ptr->next;
+			free(chunk_ptr);
+		}
+		struct_ptr->chunks->count = 0;
+	}
+	struct_ptr->arena_length = 0;
+	struct_ptr->head = struct_ptr->tail = NULL;
+	struct_ptr->id = WEBDAV_OPENDIR_IGNORE;
+	struct_ptr->data_ptr = NULL;
+}
+/*****************************************************************************/
 void parser_opendir_create (void *ctx,
 							const xmlChar *localname,
 							const xmlChar *prefix,
@@ -388,19 +667,17 @@ void parser_opendir_create (void *ctx,
 	webdav_parse_opendir_element_t * element_ptr = NULL;
 	webdav_parse_opendir_element_t * list_ptr;
 	webdav_parse_opendir_struct_t * struct_ptr = (webdav_parse_opendir_struct_t *)ctx;
-	CFStringRef nodeString;
+	int element;
 	struct_ptr->start=true;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	struct_ptr->text_length = 0;
+	element = element_name(localname);
 	/* See if this is the resource type.  If it is, malloc a webdav_parse_opendir_element_t element and add it to the list.*/
 	
-	if (((CFStringCompare(nodeString, CFSTR("href"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_HREF)
 	{
 		element_ptr = struct_ptr->tail;
 		
-		if ( (element_ptr != NULL) && (element_ptr->seen_href == FALSE))
+		if ( (element_ptr != NULL) && (element_ptr->seen_href == FALSE) && (element_ptr->seen_response_end == FALSE))
 		{
 			// <rdar://problem/4173444>
 			// This is a placeholder (<D:propstat> & children came before the <D:href>)
@@ -411,7 +688,7 @@ void parser_opendir_create (void *ctx,
 		else
 		{
 			// Create the new href element
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			element_ptr->seen_href = TRUE;
@@ -431,7 +708,7 @@ void parser_opendir_create (void *ctx,
 			struct_ptr->data_ptr = (void *)element_ptr;
 		}
 	}	/* end if href */
-	else if (((CFStringCompare(nodeString, CFSTR("collection"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_COLLECTION)
 	{
 		/* If we have a collection property, we should normally have an
 		 * element ptr in the context already. But this is not always the
@@ -449,7 +726,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -464,7 +741,7 @@ void parser_opendir_create (void *ctx,
 			struct_ptr->tail = element_ptr;
 		}
 		
-		element_ptr->dir_data.d_type = DT_DIR;
+		element_ptr->d_type = DT_DIR;
 		
 		/* Not interested in child of collection element. We can
 		 * and should free the return_ptr in this case.
@@ -472,7 +749,7 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_IGNORE;
 		struct_ptr->data_ptr = NULL;
 	}	/* end if collection */
-	else if (((CFStringCompare(nodeString, CFSTR("getcontentlength"), kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_GETCONTENTLENGTH)
 	{
 		/* If we have size then mark up the element pointer so that the
 		 * child will know to parse the upcoming text size and store it.
@@ -489,7 +766,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -507,7 +784,7 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_LENGTH;
 		struct_ptr->data_ptr = (void *)element_ptr;
 	}	/* end if length */
-	else if (((CFStringCompare(nodeString, CFSTR("getlastmodified"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_GETLASTMODIFIED)
 	{
 		/* If we have size then mark up the element pointer so that the
 		 * child will know to parse the upcoming text size and store it.
@@ -524,7 +801,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -542,7 +819,7 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_MODDATE;
 		struct_ptr->data_ptr = (void *)element_ptr;
 	}	/* end if modified */
-	else if (((CFStringCompare(nodeString, CFSTR("creationdate"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_CREATIONDATE)
 	{
 		/* If we have size then mark up the element pointer so that the
 		 * child will know to parse the upcoming text size and store it.
@@ -559,7 +836,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -577,7 +854,7 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_CREATEDATE;
 		struct_ptr->data_ptr = (void *)element_ptr;
 	}	/* end if createdate */
-	else if (((CFStringCompare(nodeString, CFSTR("appledoubleheader"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_APPLEDOUBLEHEADER)
 	{
 		/* If we have size then mark up the element pointer so that the
 		 * child will know to parse the upcoming text size and store it.
@@ -595,7 +872,7 @@ void parser_opendir_create (void *ctx,
 			//
 			// The <D:href> element might appear after the <D:propstat>. To handle this
 			// case we simply create a placeholder opendir element.
-			element_ptr = create_opendir_element();
+			element_ptr = create_opendir_element(struct_ptr);
 			require_action(element_ptr != NULL, malloc_element_ptr, struct_ptr->error = ENOMEM);
 			
 			if (struct_ptr->head == NULL)
@@ -613,7 +890,7 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->id = WEBDAV_OPENDIR_APPLEDOUBLEHEADER;
 		struct_ptr->data_ptr = (void *)element_ptr;
 	}	/* end if appledoubleheader */
-	else if (((CFStringCompare(nodeString, CFSTR("response"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_RESPONSE)
 	{
 		struct_ptr->id = WEBDAV_OPENDIR_ELEMENT_RESPONSE;
 		struct_ptr->data_ptr = (void *)NULL;
@@ -623,6 +900,8 @@ void parser_opendir_create (void *ctx,
 		struct_ptr->data_ptr = (void *)NULL;
 	}
 	
+	return;
+	
 malloc_element_ptr:
 	syslog(LOG_DEBUG,"malloc failed\n");
 	
@@ -659,17 +938,12 @@ static void parser_file_count_create(void *ctx,
 									 const xmlChar **attributes)
 {
 	#pragma unused(prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted,attributes)
-	CFStringRef nodeString;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
-	if (((CFStringCompare(nodeString, CFSTR("href"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	int element;
+	element = element_name(localname);
+	if (element == WEBDAV_XML_HREF)
 	{
 		++(*((int *)ctx));
 	}
-	if(nodeString)
-		CFRelease(nodeString);
 }
 /*****************************************************************************/
 
@@ -687,39 +961,34 @@ static void parser_stat_create(void *ctx,
 	struct webdav_stat_attr* text_ptr = (struct webdav_stat_attr*)ctx;
 	text_ptr->data = (void *)WEBDAV_STATFS_IGNORE;
 	text_ptr->start = true;
-	CFStringRef nodeString;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	int element;
+	element = element_name(localname);
 	/* See if this is a type we are interested in  If it is, we'll return
 	 the appropriate constant */
 	
-	if (((CFStringCompare(nodeString, CFSTR("getcontentlength"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_GETCONTENTLENGTH)
 	{
 		text_ptr->data = (void *)WEBDAV_STAT_LENGTH;
 	}
 	else
 	{
-		if (((CFStringCompare(nodeString, CFSTR("getlastmodified"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+		if (element == WEBDAV_XML_GETLASTMODIFIED)
 		{
 			text_ptr->data = (void *)WEBDAV_STAT_MODDATE;
 		}
-		else if (((CFStringCompare(nodeString, CFSTR("creationdate"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+		else if (element == WEBDAV_XML_CREATIONDATE)
 		{
 			text_ptr->data = (void *)WEBDAV_STAT_CREATEDATE;
 		}
 		else
 		{
-			if (((CFStringCompare(nodeString, CFSTR("collection"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+			if (element == WEBDAV_XML_COLLECTION)
 			{
 				/* It's a collection so set the type as VDIR */
 				((struct stat *)ctx)->st_mode = S_IFDIR;
 			}	/* end if collection */
 		}	/* end of if-else mod date */
 	}	/* end if-else length*/
-	if(nodeString)
-		CFRelease(nodeString);
 }
 /*****************************************************************************/
 
@@ -737,35 +1006,29 @@ static void parser_statfs_create(void *ctx,
 	struct webdav_quotas* text_ptr = (struct webdav_quotas*)ctx;
 	text_ptr->data = (void *)WEBDAV_STATFS_IGNORE;
 	text_ptr->start = true;
-	CFStringRef nodeString;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	int element;
+	element = element_name(localname);
 	/* See if this is a type we are interested in  If it is, we'll return
 	 the appropriate constant */
 	
 	/* handle the "quota-available-bytes" and "quota-used-bytes" properties in the "DAV:" namespace */
-	if (((CFStringCompare(nodeString, CFSTR("quota-available-bytes"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_QUOTA_AVAILABLE_BYTES)
 	{
 		text_ptr->data = (void *)WEBDAV_STATFS_QUOTA_AVAILABLE_BYTES;
 	}
-	else if (((CFStringCompare(nodeString, CFSTR("quota-used-bytes"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_QUOTA_USED_BYTES)
 	{
 		text_ptr->data = (void *)WEBDAV_STATFS_QUOTA_USED_BYTES;
 	}
 	/* handle the deprecated "quota" and "quotaused" properties in the "DAV:" namespace */
-	else if (((CFStringCompare(nodeString, CFSTR("quota"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_QUOTA)
 	{
 		text_ptr->data = (void *)WEBDAV_STATFS_QUOTA;
 	}
-	else if (((CFStringCompare(nodeString, CFSTR("quotaused"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_QUOTAUSED)
 	{
 		text_ptr->data = (void *)WEBDAV_STATFS_QUOTAUSED;
 	}
-	
-	if(nodeString)
-		CFRelease(nodeString);
 }
 
 /*****************************************************************************/
@@ -782,20 +1045,17 @@ static void parser_lock_create(void *ctx,
 {
 	#pragma unused(prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted,attributes)
 	webdav_parse_lock_struct_t *lock_struct = (webdav_parse_lock_struct_t *)ctx;
-	CFStringRef nodeString = NULL;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	int element;
+	element = element_name(localname);
 	/* See if this is a type we are interested in  If it is, we'll return
 	 the appropriate constant */
-	if (((CFStringCompare(nodeString, CFSTR("locktoken"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_LOCKTOKEN)
 	{
 		lock_struct->context = WEBDAV_LOCK_TOKEN;
 	}
 	else
 	{
-		if (((CFStringCompare(nodeString, CFSTR("href"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+		if (element == WEBDAV_XML_HREF)
 		{
 			if (lock_struct->context == WEBDAV_LOCK_TOKEN)
 			{
@@ -807,8 +1067,6 @@ static void parser_lock_create(void *ctx,
 			}
 		}
 	}	/* end if-else locktoken*/
-	if(nodeString)
-		CFRelease(nodeString);
 }
 /*****************************************************************************/
 static void parser_cachevalidators_create(void *ctx,
@@ -823,24 +1081,19 @@ static void parser_cachevalidators_create(void *ctx,
 {
 	#pragma unused(prefix,URI,nb_namespaces,namespaces,nb_attributes,nb_defaulted,attributes)
 	struct webdav_parse_cachevalidators_struct* text_ptr = (struct webdav_parse_cachevalidators_struct*)ctx;
-	CFStringRef nodeString = NULL;
+	int element;
 	text_ptr->start = true;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	element = element_name(localname);
 	/* See if this is a type we are interested in  If it is, we'll return
 	 the appropriate constant */
-	if (((CFStringCompare(nodeString, CFSTR("getlastmodified"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_GETLASTMODIFIED)
 	{
 		text_ptr->data = (void *)WEBDAV_CACHEVALIDATORS_MODDATE;
 	}
-	else if (((CFStringCompare(nodeString, CFSTR("getetag"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_GETETAG)
 	{
 		text_ptr->data = (void *)WEBDAV_CACHEVALIDATORS_ETAG;
 	}
-	if(nodeString)
-		CFRelease(nodeString);
 }
 
 /*****************************************************************************/
@@ -859,15 +1112,12 @@ static void parser_multistatus_create(void *ctx,
 	webdav_parse_multistatus_element_t * element_ptr = NULL;
 	webdav_parse_multistatus_element_t * list_ptr = NULL;
 	webdav_parse_multistatus_list_t * struct_ptr = (webdav_parse_multistatus_list_t *)ctx;
-	CFStringRef nodeString = NULL;
+	int element;
 	struct_ptr->start = true;
-	nodeString =  CFStringCreateWithCString (kCFAllocatorDefault,
-											 (const char *)localname,
-											 kCFStringEncodingUTF8
-											 );
+	element = element_name(localname);
 	/* See if this is the resource type.  If it is, malloc a webdav_parse_opendir_element_t element and
 	 add it to the list. */
-	if (((CFStringCompare(nodeString, CFSTR("href"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	if (element == WEBDAV_XML_HREF)
 	{
 		element_ptr = struct_ptr->tail;
 		
@@ -902,7 +1152,7 @@ static void parser_multistatus_create(void *ctx,
 			struct_ptr->data_ptr = (void *)element_ptr;
 		}
 	}	/* end if href */
-	else if (((CFStringCompare(nodeString, CFSTR("status"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_STATUS)
 	{
 		/* If we have status then mark up the element pointer so that the
 		 * add callback will know to parse the upcoming text size and store it.
@@ -937,7 +1187,7 @@ static void parser_multistatus_create(void *ctx,
 		struct_ptr->id = WEBDAV_MULTISTATUS_STATUS;
 		struct_ptr->data_ptr = (void *)element_ptr;
 	}	/* end if length */
-	else if (((CFStringCompare(nodeString, CFSTR("response"),kCFCompareCaseInsensitive)) == kCFCompareEqualTo))
+	else if (element == WEBDAV_XML_RESPONSE)
 	{
 		struct_ptr->id = WEBDAV_MULTISTATUS_RESPONSE;
 		struct_ptr->data_ptr = (void *)NULL;
@@ -948,128 +1198,61 @@ static void parser_multistatus_create(void *ctx,
 		
 	}
 	
+	return;
+	
 malloc_element_ptr:
 	syslog(LOG_INFO,"malloc failed\n");
 	
-	if(nodeString)
-		CFRelease(nodeString);
 }
 /*****************************************************************************/
 void parser_opendir_add(void *ctx, const xmlChar *localname, int length)
 {
-	
 	webdav_parse_opendir_element_t * element_ptr;
-	webdav_parse_opendir_text_t * text_ptr = NULL;
 	webdav_parse_opendir_struct_t * parent_ptr = (webdav_parse_opendir_struct_t *)ctx;
-	char * ampPointer = NULL;
-	char* str_ptr = NULL;
-	char *ep;
 
-	if ((size_t)length >= sizeof(text_ptr->name)) {
-		debug_string("URI too long 1");
-		parent_ptr->error = ENAMETOOLONG;
-		return;
-	}
-	text_ptr = calloc(1, sizeof(webdav_parse_opendir_text_t));
-	text_ptr->size = (CFIndex)length;
-	memcpy(text_ptr->name,localname,length);
-	/* If the parent is one of our returned directory elements, and if this is a
-	 * text element, than copy the text into the name buffer provided we have room */
+	/*
+	 * The text of an element can be delivered in more than one piece (when it
+	 * spans two pieces of a response given to the push parser, contains an
+	 * entity reference such as &amp;, or contains non-ASCII characters), so
+	 * the href is appended piece by piece and the text of the other elements
+	 * is collected and converted by parser_opendir_end.
+	 */
 	if(parent_ptr->start == true)
 	{
 		switch (parent_ptr->id)
 		{
 			case WEBDAV_OPENDIR_ELEMENT:
 				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				/* TO Handle a special case for ampersand */
-				ampPointer = strstr((const char*) localname,"amp;");
-				if(ampPointer) {
-					char * literalPtr = strchr((const char*) localname,'<');
-					int totalLength = (int)(literalPtr - (const char*)localname);
-					if(totalLength >= (length+5)) {
-						str_ptr = (char*)calloc(1, totalLength+1);
-						memcpy(str_ptr,localname,totalLength);
-						ampPointer = strstr((const char*) str_ptr,"amp;");
-						/* To handle multiple ampersands*/
-						while(ampPointer) {
-							ampPointer+=4;
-							memcpy(&text_ptr->name[length],"&",1);
-							memcpy(&text_ptr->name[length+1],ampPointer,totalLength-length-4-1);
-							text_ptr->size = totalLength-4;
-							ampPointer = strstr((const char*)text_ptr->name,"amp;");
-							length++;
-						}
-						free(str_ptr);
-					}
-				}
-				/* make sure the complete name will fit in the structure */
-				if ((element_ptr->dir_data.d_name_URI_length + text_ptr->size) <=
-					((unsigned int)sizeof(element_ptr->dir_data.d_name) - 1))
-				{
-					bcopy(text_ptr->name,
-						  &element_ptr->dir_data.d_name[element_ptr->dir_data.d_name_URI_length],
-						  text_ptr->size);
-					element_ptr->dir_data.d_name_URI_length += (uint32_t)text_ptr->size;
-				}
-				else
+				/* append the text to the element's href */
+				if ( opendir_append_href(parent_ptr, element_ptr, localname, (size_t)length) != 0 )
 				{
-					debug_string("URI too long 2");
+					debug_string("URI too long");
 					parent_ptr->error = ENAMETOOLONG;
 				}
 				break;
 				
 			case WEBDAV_OPENDIR_ELEMENT_LENGTH:
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->statsize = strtoq((const char *)text_ptr->name, &ep, 10);
-				break;
-				
 			case WEBDAV_OPENDIR_ELEMENT_MODDATE:
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->stattime.tv_sec = DateBytesToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-				if (element_ptr->stattime.tv_sec == -1)
-				{
-					element_ptr->stattime.tv_sec = 0;
-				}
-				element_ptr->stattime.tv_nsec = 0;
-				break;
-				
 			case WEBDAV_OPENDIR_ELEMENT_CREATEDATE:
-				// First try ISO8601
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				element_ptr->createtime.tv_sec = ISO8601ToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-				
-				if (element_ptr->createtime.tv_sec == -1) {
-					// Try RFC 850, RFC 1123
-					element_ptr->createtime.tv_sec = DateBytesToTime(text_ptr->name, strlen((const char *)text_ptr->name));
-					
-				}
-				
-				if (element_ptr->createtime.tv_sec == -1)
+			case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
+				/* collect the text (keeping it '\0' terminated) */
+				if ( (parent_ptr->text_length + (size_t)length) < sizeof(parent_ptr->text) )
 				{
-					element_ptr->createtime.tv_sec = 0;
+					memcpy(&parent_ptr->text[parent_ptr->text_length], localname, (size_t)length);
+					parent_ptr->text_length += (size_t)length;
+					parent_ptr->text[parent_ptr->text_length] = '\0';
 				}
-				element_ptr->createtime.tv_nsec = 0;
-				break;
-				
-			case WEBDAV_OPENDIR_APPLEDOUBLEHEADER:
-			{
-				size_t	len = APPLEDOUBLEHEADER_LENGTH;
-				
-				element_ptr = (webdav_parse_opendir_element_t *)parent_ptr->data_ptr;
-				from_base64((const char *)text_ptr->name, (unsigned char *)element_ptr->appledoubleheader, &len);
-				if (len == APPLEDOUBLEHEADER_LENGTH)
+				else
 				{
-					element_ptr->appledoubleheadervalid = TRUE;
+					debug_string("text too long");
+					parent_ptr->error = ENAMETOOLONG;
 				}
-			}
 				break;
 				
 			default:
 				break;
 		}	/* end of switch statement */
-		parent_ptr->start = false;
 	}/* end of if it is our text element */
-	free(text_ptr);
 }
 
 /*****************************************************************************/
@@ -1452,147 +1635,1783 @@ CFURLCopyAbsoluteURL:
 /*****************************************************************************/
 
 /*
- * GetComponentName determines if the URI combined with the parent URL is a
- * child of the parent or is the parent itself, and if it is a child, extracts
- * the child's component name.
- *
- * GetComponentName returns TRUE if the URI is for a child, or returns FALSE if
- * the URI is the parent itself. The componentName buffer will contain the child's
- * component name if the result is TRUE.
- *
- * The parentPathLength parameter allows this routine to determine child/parent
- * status without comparing the path strings.
+ * CopyEscapedPath returns the escaped absolute path portion of a CFURLRef as a
+ * malloc'd c-string, or NULL.
  */
-static Boolean GetComponentName(	/* <- TRUE if http URI was not parent and component name was returned */
-								CFURLRef urlRef,				/* -> the parent directory's URL  */
-								CFIndex parentPathLength,		/* -> the parent directory's percent decoded path length */
-								char *uri,						/* -> the http URI from the WebDAV server */
-								char *componentName)			/* <-> point to buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if result it TRUE */
+static char *CopyEscapedPath(CFURLRef anURL)
 {
-	Boolean result;
-	CFStringRef uriString;				/* URI as CFString */
-	CFURLRef uriURL;					/* URI converted to full URL */
-	CFStringRef uriName;				/* URI's LastPathComponent as CFString */
+	CFURLRef absoluteURL;
+	CFStringRef escapedPath;
+	char *result;
 	
-	result = FALSE;
+	result = NULL;
+	absoluteURL = CFURLCopyAbsoluteURL(anURL);
+	require(absoluteURL != NULL, CFURLCopyAbsoluteURL);
 	
-	/* create a CFString from the c-string containing URI */
-	uriString = CFStringCreateWithCString(kCFAllocatorDefault, uri, kCFStringEncodingUTF8);
-	require(uriString != NULL, CFStringCreateWithCString);
+	escapedPath = CFURLCopyPath(absoluteURL);
+	require(escapedPath != NULL, CFURLCopyPath);
 	
-	/* create a CFURL from the URI CFString and the parent URL */
-	uriURL = CFURLCreateWithString(kCFAllocatorDefault, uriString, urlRef);
-	if (uriURL != NULL) {
-		/* CFURLCreateWithString worked fine, so release uriString and keep going */
-		CFRelease(uriString);
-	}
-	else {
-		/* Fix for Windows servers.  They tend to send over names that have a space in them instead of the correct %20.  This causes
-		 CFURLCreateWithString to fail.  Since it might be a partially escaped URL string, try to unescape the string, then re-escape it */
-		CFStringRef unEscapedString;		/* URI as CFString with un-escaped chars */
-		CFStringRef reEscapedString;		/* URI as CFString with re-escaped chars */
-		
-		unEscapedString = CFURLCreateStringByReplacingPercentEscapesUsingEncoding (kCFAllocatorDefault, uriString, NULL, kCFStringEncodingUTF8);
-		CFRelease(uriString);
-		require(unEscapedString != NULL, CFURLCreateWithString);
-		
-		reEscapedString = CFURLCreateStringByAddingPercentEscapes (kCFAllocatorDefault, unEscapedString, NULL, NULL, kCFStringEncodingUTF8);
-		CFRelease(unEscapedString);
-		require(reEscapedString != NULL, CFURLCreateWithString);
-		
-		/* try again to create a CFURL from the reEscapedString and the parent URL */
-		uriURL = CFURLCreateWithString(kCFAllocatorDefault, reEscapedString, urlRef);
-		CFRelease(reEscapedString);
-		require(uriURL != NULL, CFURLCreateWithString);
-	}
+	result = malloc(WEBDAV_MAX_URI_LEN);
+	require(result != NULL, malloc_result);
 	
-	/* see if this is the parent or a child */
-	if ( GetNormalizedPathLength(uriURL) > parentPathLength ) {
-		/* this is a child */
-		
-		/* get the child's name */
-		uriName = CFURLCopyLastPathComponent(uriURL);
-		require_string(uriName != NULL, CFURLCopyLastPathComponent, "name was not legal UTF8");
-		
-		if ( CFStringGetCString(uriName, componentName, MAXNAMLEN + 1, kCFStringEncodingUTF8) ) {
-			/* we have the child name */
-			result = TRUE;
-		}
-		else {
-			debug_string("could not get child name (too long?)");
-		}
-		CFRelease(uriName);
-	}
-	else {
-		/* this is the parent, skip it */
+	if ( !CFStringGetCString(escapedPath, result, WEBDAV_MAX_URI_LEN, kCFStringEncodingUTF8) )
+	{
+		free(result);
+		result = NULL;
 	}
 	
-CFURLCopyLastPathComponent:
+malloc_result:
 	
-	CFRelease(uriURL);
+	CFRelease(escapedPath);
 	
-CFURLCreateWithString:
-CFStringCreateWithCString:
+CFURLCopyPath:
+	
+	CFRelease(absoluteURL);
+	
+CFURLCopyAbsoluteURL:
 	
 	return ( result );
 }
 
 /*****************************************************************************/
 
-int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
-				  CFIndex xmlp_len,				/* -> length of xml data */
-				  CFURLRef urlRef,				/* -> the CFURL to the parent directory */
-				  uid_t uid,						/* -> uid of the user making the request */
-				  struct node_entry *parent_node)	/* -> pointer to the parent directory's node_entry */
-{
-	int error = 0;
-	ssize_t size = 0;
-	struct webdav_dirent dir_data[2];
-	CFIndex parentPathLength;
+/*
+ * Characters that may appear unescaped in the path of an http URI that
+ * href_path_decode handles: alphanumerics, the RFC 2396 unreserved marks, the
+ * reserved characters allowed in a path segment, '/' and '%'. Anything else
+ * (including ';', '?' and '#', which start parameters, a query or a fragment)
+ * is left to CFURL.
+ */
+#define HREF_IS_PATH_CHAR(c) \
+	((((c) >= 'a') && ((c) <= 'z')) || (((c) >= 'A') && ((c) <= 'Z')) || (((c) >= '0') && ((c) <= '9')) || \
+	 (((c) != '\0') && (strchr("-_.!~*'():@&=+$,/%", (c)) != NULL)))
+
+/*
+ * href_hex_value returns the value of a hex digit, or -1 if c isn't one.
+ */
+static int href_hex_value(char c)
+{
+	if ( (c >= '0') && (c <= '9') )
+	{
+		return ( c - '0' );
+	}
+	if ( (c >= 'a') && (c <= 'f') )
+	{
+		return ( c - 'a' + 10 );
+	}
+	if ( (c >= 'A') && (c <= 'F') )
+	{
+		return ( c - 'A' + 10 );
+	}
+	return ( -1 );
+}
+
+/*****************************************************************************/
+
+/*
+ * href_decode_segments percent decodes an escaped absolute path (or the rest of
+ * one) onto the end of buffer. It returns FALSE if the path has anything
+ * href_path_decode leaves to CFURL: characters not allowed in a path, a bad
+ * escape, an escaped '/' or NUL, or an empty, "." or ".." segment (other than
+ * the empty segment after a trailing '/').
+ */
+static Boolean href_decode_segments(const char *path,		/* -> the escaped path */
+									size_t path_length,		/* -> length of the escaped path */
+									char *buffer,			/* <-> the decoded path */
+									size_t *length,			/* <-> length of the decoded path */
+									size_t buffer_size)		/* -> size of buffer */
+{
+	const char *end;
+	size_t segment;		/* offset in buffer of the current segment */
+	int high;
+	int low;
+
+	end = path + path_length;
+	segment = *length;
+
+	while ( path < end )
+	{
+		if ( *length == buffer_size )
+		{
+			return ( FALSE );
+		}
+
+		if ( *path == '/' )
+		{
+			/* check the segment this ends (the one before the first '/' is empty) */
+			if ( (*length != 0) &&
+				 (((*length - segment) == 0) ||
+				  (((*length - segment) == 1) && (buffer[segment] == '.')) ||
+				  (((*length - segment) == 2) && (buffer[segment] == '.') && (buffer[segment + 1] == '.'))) )
+			{
+				return ( FALSE );
+			}
+			buffer[(*length)++] = '/';
+			segment = *length;
+			++path;
+		}
+		else if ( *path == '%' )
+		{
+			if ( ((end - path) < 3) ||
+				 ((high = href_hex_value(path[1])) < 0) ||
+				 ((low = href_hex_value(path[2])) < 0) ||
+				 ((high == 0) && (low == 0)) ||
+				 ((high == 2) && (low == 0xf)) )
+			{
+				return ( FALSE );
+			}
+			buffer[(*length)++] = (char)((high << 4) | low);
+			path += 3;
+		}
+		else if ( HREF_IS_PATH_CHAR(*path) )
+		{
+			buffer[(*length)++] = *path++;
+		}
+		else
+		{
+			return ( FALSE );
+		}
+	}
+
+	/* the last segment may only be empty if the path ends with '/' */
+	if ( (((*length - segment) == 1) && (buffer[segment] == '.')) ||
+		 (((*length - segment) == 2) && (buffer[segment] == '.') && (buffer[segment + 1] == '.')) )
+	{
+		return ( FALSE );
+	}
+
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * href_utf16_length returns the number of UTF-16 characters (what CFStringGetLength
+ * would return) in a UTF-8 string, or -1 if the string isn't well-formed UTF-8.
+ */
+static CFIndex href_utf16_length(const char *string, size_t length)
+{
+	const UInt8 *p;
+	const UInt8 *end;
+	CFIndex result;
+
+	p = (const UInt8 *)string;
+	end = p + length;
+	result = 0;
+
+	while ( p < end )
+	{
+		UInt32 c;
+		UInt32 minimum;
+		int extra;
+
+		c = *p++;
+		if ( c < 0x80 )
+		{
+			++result;
+			continue;
+		}
+		else if ( (c >= 0xc2) && (c <= 0xdf) )
+		{
+			extra = 1;
+			minimum = 0x80;
+			c &= 0x1f;
+		}
+		else if ( (c >= 0xe0) && (c <= 0xef) )
+		{
+			extra = 2;
+			minimum = 0x800;
+			c &= 0x0f;
+		}
+		else if ( (c >= 0xf0) && (c <= 0xf4) )
+		{
+			extra = 3;
+			minimum = 0x10000;
+			c &= 0x07;
+		}
+		else
+		{
+			return ( -1 );
+		}
+		if ( (end - p) < extra )
+		{
+			return ( -1 );
+		}
+		while ( extra-- != 0 )
+		{
+			if ( (*p & 0xc0) != 0x80 )
+			{
+				return ( -1 );
+			}
+			c = (c << 6) | (*p++ & 0x3f);
+		}
+		/* no overlong forms, surrogates, or characters past U+10FFFF */
+		if ( (c < minimum) || ((c >= 0xd800) && (c <= 0xdfff)) || (c > 0x10ffff) )
+		{
+			return ( -1 );
+		}
+		result += (c >= 0x10000) ? 2 : 1;
+	}
+
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * href_path_decode resolves an http URI from the server against the parent
+ * directory's escaped absolute path and percent decodes the resulting path into
+ * buffer without creating any CF objects. It handles absolute URLs (http and
+ * https), absolute paths, and relative paths without dot segments. It returns
+ * the length of the decoded path and its length in UTF-16 characters, or -1 if
+ * the URI is one that must go through CFURL.
+ */
+static ssize_t href_path_decode(const char *parentPath,		/* -> the parent directory's escaped absolute path */
+								const char *uri,			/* -> the http URI from the WebDAV server */
+								char *buffer,				/* <- the decoded path */
+								size_t buffer_size,			/* -> size of buffer */
+								CFIndex *utf16_length)		/* <- length of the decoded path in UTF-16 characters */
+{
+	const char *p;
+	const char *slash;
+	size_t length;
+
+	length = 0;
+
+	/* an absolute URL? */
+	for ( p = uri; ((*p >= 'a') && (*p <= 'z')) || ((*p >= 'A') && (*p <= 'Z')) ||
+				   ((p != uri) && (((*p >= '0') && (*p <= '9')) || (*p == '+') || (*p == '-') || (*p == '.'))); ++p )
+	{
+	}
+	if ( (p != uri) && (*p == ':') )
+	{
+		if ( !(((p - uri) == 4) && (strncasecmp(uri, "http", 4) == 0)) &&
+			 !(((p - uri) == 5) && (strncasecmp(uri, "https", 5) == 0)) )
+		{
+			return ( -1 );
+		}
+		if ( (p[1] != '/') || (p[2] != '/') )
+		{
+			return ( -1 );
+		}
+		/* skip the authority -- only the path is compared */
+		uri = p + 3 + strcspn(p + 3, "/?#");
+		if ( *uri != '/' )
+		{
+			return ( -1 );
+		}
+	}
+	else if ( *uri != '/' )
+	{
+		/* a relative path replaces the last segment of the parent's path */
+		slash = strrchr(parentPath, '/');
+		if ( (*uri == '\0') || (*parentPath != '/') || (slash == NULL) ||
+			 !href_decode_segments(parentPath, (size_t)(slash + 1 - parentPath), buffer, &length, buffer_size) )
+		{
+			return ( -1 );
+		}
+	}
+	else if ( uri[1] == '/' )
+	{
+		/* a network-path reference */
+		return ( -1 );
+	}
+
+	if ( !href_decode_segments(uri, strlen(uri), buffer, &length, buffer_size) )
+	{
+		return ( -1 );
+	}
+
+	*utf16_length = href_utf16_length(buffer, length);
+	if ( *utf16_length < 0 )
+	{
+		return ( -1 );
+	}
+
+	return ( (ssize_t)length );
+}
+
+/*****************************************************************************/
+
+/*
+ * GetComponentName determines if the URI combined with the parent URL is a
+ * child of the parent or is the parent itself, and if it is a child, extracts
+ * the child's component name.
+ *
+ * GetComponentName returns TRUE if the URI is for a child, or returns FALSE if
+ * the URI is the parent itself. The componentName buffer will contain the child's
+ * component name if the result is TRUE.
+ *
+ * The parentPathLength parameter allows this routine to determine child/parent
+ * status without comparing the path strings.
+ *
+ * If parentPath is not NULL, URIs that href_path_decode can handle are done
+ * without creating any CF objects; everything else goes through CFURL.
+ */
+static Boolean GetComponentName(	/* <- TRUE if http URI was not parent and component name was returned */
+								CFURLRef urlRef,				/* -> the parent directory's URL  */
+								const char *parentPath,			/* -> the parent directory's escaped absolute path, or NULL */
+								CFIndex parentPathLength,		/* -> the parent directory's percent decoded path length */
+								char *uri,						/* -> the http URI from the WebDAV server */
+								char *componentName)			/* <-> point to buffer of MAXNAMLEN + 1 bytes where URI's LastPathComponent is returned if result it TRUE */
+{
+	Boolean result;
+	CFStringRef uriString;				/* URI as CFString */
+	CFURLRef uriURL;					/* URI converted to full URL */
+	CFStringRef uriName;				/* URI's LastPathComponent as CFString */
+	char path[WEBDAV_MAX_URI_LEN];		/* URI's percent decoded path */
+	ssize_t pathLength;
+	CFIndex utf16Length;
+	
+	result = FALSE;
+	
+	if ( parentPath != NULL )
+	{
+		pathLength = href_path_decode(parentPath, uri, path, sizeof(path), &utf16Length);
+		if ( pathLength > 0 )
+		{
+			ssize_t nameEnd;
+			ssize_t nameStart;
+			
+			/* see if this is the parent or a child */
+			if ( utf16Length <= parentPathLength )
+			{
+				/* this is the parent, skip it */
+				return ( FALSE );
+			}
+			
+			/* the child's name is the last segment, ignoring a trailing '/' */
+			nameEnd = (path[pathLength - 1] == '/') ? (pathLength - 1) : pathLength;
+			for ( nameStart = nameEnd; (nameStart > 0) && (path[nameStart - 1] != '/'); --nameStart )
+			{
+			}
+			if ( nameEnd != nameStart )
+			{
+				if ( (nameEnd - nameStart) <= MAXNAMLEN )
+				{
+					memcpy(componentName, &path[nameStart], (size_t)(nameEnd - nameStart));
+					componentName[nameEnd - nameStart] = '\0';
+					/* we have the child name */
+					result = TRUE;
+				}
+				else
+				{
+					debug_string("could not get child name (too long?)");
+				}
+				return ( result );
+			}
+		}
+	}
+	
+	/* create a CFString from the c-string containing URI */
+	uriString = CFStringCreateWithCString(kCFAllocatorDefault, uri, kCFStringEncodingUTF8);
+	require(uriString != NULL, CFStringCreateWithCString);
+	
+	/* create a CFURL from the URI CFString and the parent URL */
+	uriURL = CFURLCreateWithString(kCFAllocatorDefault, uriString, urlRef);
+	if (uriURL != NULL) {
+		/* CFURLCreateWithString worked fine, so release uriString and keep going */
+		CFRelease(uriString);
+	}
+	else {
+		/* Fix for Windows servers.  They tend to send over names that have a space in them instead of the correct %20.  This causes
+		 CFURLCreateWithString to fail.  Since it might be a partially escaped URL string, try to unescape the string, then re-escape it */
+		CFStringRef unEscapedString;		/* URI as CFString with un-escaped chars */
+		CFStringRef reEscapedString;		/* URI as CFString with re-escaped chars */
+		
+		unEscapedString = CFURLCreateStringByReplacingPercentEscapesUsingEncoding (kCFAllocatorDefault, uriString, NULL, kCFStringEncodingUTF8);
+		CFRelease(uriString);
+		require(unEscapedString != NULL, CFURLCreateWithString);
+		
+		reEscapedString = CFURLCreateStringByAddingPercentEscapes (kCFAllocatorDefault, unEscapedString, NULL, NULL, kCFStringEncodingUTF8);
+		CFRelease(unEscapedString);
+		require(reEscapedString != NULL, CFURLCreateWithString);
+		
+		/* try again to create a CFURL from the reEscapedString and the parent URL */
+		uriURL = CFURLCreateWithString(kCFAllocatorDefault, reEscapedString, urlRef);
+		CFRelease(reEscapedString);
+		require(uriURL != NULL, CFURLCreateWithString);
+	}
+	
+	/* see if this is the parent or a child */
+	if ( GetNormalizedPathLength(uriURL) > parentPathLength ) {
+		/* this is a child */
+		
+		/* get the child's name */
+		uriName = CFURLCopyLastPathComponent(uriURL);
+		require_string(uriName != NULL, CFURLCopyLastPathComponent, "name was not legal UTF8");
+		
+		if ( CFStringGetCString(uriName, componentName, MAXNAMLEN + 1, kCFStringEncodingUTF8) ) {
+			/* we have the child name */
+			result = TRUE;
+		}
+		else {
+			debug_string("could not get child name (too long?)");
+		}
+		CFRelease(uriName);
+	}
+	else {
+		/* this is the parent, skip it */
+	}
+	
+CFURLCopyLastPathComponent:
+	
+	CFRelease(uriURL);
+	
+CFURLCreateWithString:
+CFStringCreateWithCString:
+	
+	return ( result );
+}
+
+/*****************************************************************************/
+
+/*
+ * write_dirents writes a batch of dirents to the directory's cache file with
+ * a single write and empties the batch.
+ */
+static int write_dirents(int fd,					/* -> the directory's cache file */
+						 struct webdav_dirent *dirents,	/* -> the batch of dirents */
+						 size_t *count)			/* <-> number of dirents in the batch; set to 0 on success */
+{
+	int error;
+	ssize_t size;
+	size_t length;
+	
+	error = 0;
+	length = *count * sizeof(struct webdav_dirent);
+	if ( length != 0 )
+	{
+		size = write(fd, dirents, length);
+		require_action(size == (ssize_t)length, write, error = EIO);
+		*count = 0;
+	}
+	
+write:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/* limits of the multistatus scanner -- anything bigger is left to libxml2 */
+#define WEBDAV_SCANNER_MAX_NAME			64		/* longest element or attribute name */
+#define WEBDAV_SCANNER_MAX_PREFIX		16		/* longest namespace prefix (including the '\0') */
+#define WEBDAV_SCANNER_MAX_NAMESPACES	16		/* namespace prefixes declared at one time */
+#define WEBDAV_SCANNER_MAX_ATTRIBUTES	16		/* attributes in one start tag */
+#define WEBDAV_SCANNER_MAX_DEPTH		32		/* element nesting */
+#define WEBDAV_SCANNER_MAX_PENDING		65536	/* bytes held waiting for the rest of a response */
+#define WEBDAV_SCANNER_MAX_TOKENS		512		/* tags and text in one child of the root element */
+
+/* multistatus scanner token types */
+enum
+{
+	WEBDAV_SCANNER_START = 0,
+	WEBDAV_SCANNER_END,
+	WEBDAV_SCANNER_TEXT
+};
+
+/* multistatus scanner states */
+enum
+{
+	WEBDAV_SCANNER_OFF = 0,		/* the response is parsed by libxml2 */
+	WEBDAV_SCANNER_PROLOG,		/* waiting for the root element's start tag */
+	WEBDAV_SCANNER_CONTENT,		/* inside the root element */
+	WEBDAV_SCANNER_EPILOG		/* after the root element's end tag */
+};
+
+/* a namespace prefix declared by an xmlns:prefix attribute */
+typedef struct
+{
+	size_t prefix_length;
+	char prefix[WEBDAV_SCANNER_MAX_PREFIX];
+	int depth;								/* depth of the element that declared it */
+} webdav_scanner_namespace_t;
+
+/* a start or end tag found by the multistatus scanner */
+typedef struct
+{
+	int is_end;								/* TRUE if this is an end tag */
+	int is_empty;							/* TRUE if this is an empty-element tag */
+	const UInt8 *name;						/* the qualified name (not '\0' terminated) */
+	size_t name_length;
+	size_t colon;							/* offset of the ':' in name, or 0 if there's no prefix */
+} webdav_scanner_tag_t;
+
+/* a start tag, end tag or text found by the multistatus scanner in a child of the root element */
+typedef struct
+{
+	int type;								/* WEBDAV_SCANNER_START, WEBDAV_SCANNER_END or WEBDAV_SCANNER_TEXT */
+	const UInt8 *data;						/* the local name or the text (not '\0' terminated) */
+	size_t length;
+} webdav_scanner_token_t;
+
+/*****************************************************************************/
+
+/*
+ * The state of a directory listing that is parsed while the PROPFIND response
+ * is still arriving from the server. Each element is turned into a dirent as
+ * soon as it is complete, and the dirents are written to the directory's cache
+ * file after every piece of the response so the kernel can return them before
+ * the whole listing has been received.
+ */
+struct webdav_parse_opendir_stream_tag
+{
+	xmlParserCtxtPtr parser;				/* the push parser, or NULL if no data has been parsed */
+	int scanner_state;						/* WEBDAV_SCANNER_* */
+	UInt8 *prolog;							/* bytes up to the end of the root element's start tag */
+	size_t prolog_length;
+	UInt8 *pending;							/* bytes the scanner has not been able to use yet */
+	size_t pending_length;
+	size_t pending_size;
+	char root_name[WEBDAV_SCANNER_MAX_NAME];	/* the root element's qualified name */
+	size_t root_name_length;
+	webdav_scanner_namespace_t namespaces[WEBDAV_SCANNER_MAX_NAMESPACES];
+	int namespace_count;
+	int root_namespace_count;				/* namespaces declared by the root element */
+	webdav_scanner_token_t tokens[WEBDAV_SCANNER_MAX_TOKENS];	/* the child of the root element being scanned */
 	webdav_parse_opendir_struct_t opendir_struct;
-	webdav_parse_opendir_element_t *element_ptr, *prev_element_ptr;
-	opendir_struct.head = opendir_struct.tail = NULL;
-	opendir_struct.error = 0;
+	webdav_parse_opendir_element_t *last_element;	/* last element turned into a dirent, or NULL */
+	CFURLRef urlRef;						/* the CFURL to the parent directory (retained) */
+	CFIndex parentPathLength;				/* normalized path length of urlRef */
+	char *parentPath;						/* escaped absolute path of urlRef, or NULL to use CFURL for every href */
+	uid_t uid;								/* uid of the user making the request */
+	struct node_entry *parent_node;			/* the parent directory's node_entry */
+	struct webdav_dirent *dirent_buffer;	/* dirents waiting to be written to the cache file */
+	size_t dirent_count;					/* number of dirents in dirent_buffer */
+};
+
+/*****************************************************************************/
+
+/*
+ * opendir_stream_add_element caches the attributes of one complete element and,
+ * if the element is a child of the directory, adds its dirent to the batch.
+ */
+static int opendir_stream_add_element(webdav_parse_opendir_stream_t *stream,
+									  webdav_parse_opendir_element_t *element_ptr)
+{
+	int error;
+	char namebuffer[MAXNAMLEN + 1];
+	struct webdav_stat_attr statbuf;
+	char *href;
+	struct node_entry *parent_node;
+	
+	error = 0;
+	parent_node = stream->parent_node;
+	
+	// Skip any placeholder that never saw a matching <D:href> element
+	if (element_ptr->seen_href == FALSE)
+		goto done;
+	
+	/* the href is a '\0' terminated cstring in the arena */
+	href = (element_ptr->href_length != 0) ? &stream->opendir_struct.arena[element_ptr->href_offset] : "";
+	/* get the component name if this element is not the parent */
+	if ( GetComponentName(stream->urlRef, stream->parentPath, stream->parentPathLength, href, namebuffer) )
+	{
+		/* this is a child */
+		struct node_entry *element_node;
+		struct webdav_dirent *dirent;
+		size_t name_len;
+		
+		name_len = strlen(namebuffer);
+		//syslog(LOG_ERR,"namebuffer is %s\n",namebuffer);
+		/* get (or create) a cache node for this element, unless it was removed or renamed since the listing started */
+		error = nodecache_get_listed_node(parent_node, name_len, namebuffer,
+								   element_ptr->d_type == DT_DIR ? WEBDAV_DIR_TYPE : WEBDAV_FILE_TYPE, &element_node);
+		if (error)
+		{
+			if ( error != ENOENT )
+			{
+				debug_string("nodecache_get_listed_node failed");
+			}
+			error = 0;
+			goto done;
+		}
+		/* build the dirent from the element name */
+		dirent = &stream->dirent_buffer[stream->dirent_count];
+		bzero(dirent, sizeof(struct webdav_dirent));
+		bcopy(element_node->name, dirent->d_name, element_node->name_length);
+		dirent->d_namlen = element_node->name_length;
+		dirent->d_reclen = sizeof(struct webdav_dirent);
+		dirent->d_type = element_ptr->d_type;
+		
+		/* set the file number */
+		dirent->d_ino = element_node->fileid;
+		//syslog(LOG_ERR,"element_node->fileid : %d\n",element_node->fileid);
+		/*
+		 * Prepare to cache this element's attributes, since it's
+		 * highly likely a stat will follow reading the directory.
+		 */
+		
+		bzero(&statbuf, sizeof(struct webdav_stat_attr));
+		
+		/* the first thing to do is fill in the fields we cannot get from the server. */
+		statbuf.attr_stat.st_dev = 0;
+		/* Why 1 for st_nlink?
+		 * Getting the real link count for directories is expensive.
+		 * Setting it to 1 lets FTS(3) (and other utilities that assume
+		 * 1 means a file system doesn't support link counts) work.
+		 */
+		statbuf.attr_stat.st_nlink = 1;
+		statbuf.attr_stat.st_uid = UNKNOWNUID;
+		statbuf.attr_stat.st_gid = UNKNOWNUID;
+		statbuf.attr_stat.st_rdev = 0;
+		statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
+		statbuf.attr_stat.st_flags = 0;
+		statbuf.attr_stat.st_gen = 0;
+		
+		/* set all times to the last modified time since we cannot get the other times */
+		statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
+		
+		/* set create time if we have it */
+		if (element_ptr->createtime.tv_sec)
+			statbuf.attr_create_time = element_ptr->createtime;
+		if (element_ptr->d_type == DT_DIR)
+		{
+			statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
+			statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
+			/* appledoubleheadervalid is never valid for directories */
+			element_ptr->appledoubleheadervalid = FALSE;
+		}
+		else
+		{
+			statbuf.attr_stat.st_mode = S_IFREG | S_IRWXU;
+			statbuf.attr_stat.st_size = element_ptr->statsize;
+			/* appledoubleheadervalid is valid for files only if the server
+			 * returned the appledoubleheader property and file size is
+			 * the size of the appledoubleheader (APPLEDOUBLEHEADER_LENGTH bytes).
+			 */
+			element_ptr->appledoubleheadervalid =
+			(element_ptr->appledoubleheadervalid && (element_ptr->statsize == APPLEDOUBLEHEADER_LENGTH));
+			//syslog(LOG_ERR, "element_ptr->appledoubleheadervalid %d",element_ptr->appledoubleheadervalid);
+		}
+		
+		/* calculate number of S_BLKSIZE blocks */
+		statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
+		
+		/* set the fileid in statbuf*/
+		statbuf.attr_stat.st_ino = element_node->fileid;
+		
+		/* Now cache the stat structure (ignoring errors) -- unless the server doesn't have write-back's changes yet */
+		if ( !NODE_FILE_WRITEBACK_PENDING(element_node) )
+		{
+			(void) nodecache_add_attributes(element_node, stream->uid, &statbuf,
+											element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
+		}
+		
+		/* Complete the task of getting the regular name into the dirent */
+		
+		/* the dirent is in the batch -- write the batch out if it is full */
+		if ( ++stream->dirent_count == WEBDAV_DIRENT_BATCH_COUNT )
+		{
+			error = write_dirents(parent_node->file_fd, stream->dirent_buffer, &stream->dirent_count);
+		}
+	}
+	else
+	{
+		struct node_entry *temp_node;
+		/* it was the parent */
+		
+		/* we are reading this directory, so mark it "recent" */
+		(void) nodecache_get_node(parent_node, 0, NULL, TRUE, TRUE, WEBDAV_DIR_TYPE, &temp_node);
+		
+		/*
+		 * Prepare to cache this element's attributes, since it's
+		 * highly likely a stat will follow reading the directory.
+		 */
+		
+		bzero(&statbuf, sizeof(struct webdav_stat_attr));
+		
+		/* the first thing to do is fill in the fields we cannot get from the server. */
+		statbuf.attr_stat.st_dev = 0;
+		/* Why 1 for st_nlink?
+		 * Getting the real link count for directories is expensive.
+		 * Setting it to 1 lets FTS(3) (and other utilities that assume
+		 * 1 means a file system doesn't support link counts) work.
+		 */
+		statbuf.attr_stat.st_nlink = 1;
+		statbuf.attr_stat.st_uid = UNKNOWNUID;
+		statbuf.attr_stat.st_gid = UNKNOWNUID;
+		statbuf.attr_stat.st_rdev = 0;
+		statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
+		statbuf.attr_stat.st_flags = 0;
+		statbuf.attr_stat.st_gen = 0;
+		
+		/* set all times to the last modified time since we cannot get the other times */
+		statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
+		
+		/* set create time if we have it */
+		if (element_ptr->createtime.tv_sec)
+			statbuf.attr_create_time = element_ptr->createtime;
+		
+		statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
+		statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
+		
+		/* calculate number of S_BLKSIZE blocks */
+		statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
+		
+		/* set the fileid in statbuf*/
+		statbuf.attr_stat.st_ino = parent_node->fileid;
+		
+		/* Now cache the stat structure (ignoring errors) */
+		(void) nodecache_add_attributes(parent_node, stream->uid, &statbuf, NULL);
+	}
+	
+done:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * opendir_stream_add_elements turns every complete element the parser has
+ * produced so far into a dirent and writes the batch to the cache file. An
+ * element is complete once its </D:response> has been seen or another element
+ * follows it; if final is TRUE, all remaining elements are complete. When every
+ * element is done, the element chunks and href arena are recycled so that the
+ * storage needed does not grow with the size of the directory.
+ */
+static int opendir_stream_add_elements(webdav_parse_opendir_stream_t *stream,
+									   int final)
+{
+	int error;
+	webdav_parse_opendir_struct_t *struct_ptr;
+	webdav_parse_opendir_element_t *element_ptr;
+	
+	error = 0;
+	struct_ptr = &stream->opendir_struct;
+	
+	element_ptr = (stream->last_element != NULL) ? stream->last_element->next : struct_ptr->head;
+	while ( (element_ptr != NULL) &&
+			(final || (element_ptr->next != NULL) || element_ptr->seen_response_end) )
+	{
+		error = opendir_stream_add_element(stream, element_ptr);
+		require_noerr_quiet(error, opendir_stream_add_element);
+		
+		stream->last_element = element_ptr;
+		element_ptr = element_ptr->next;
+	}
+	
+	/* write out whatever is in the batch so the kernel can see it */
+	error = write_dirents(stream->parent_node->file_fd, stream->dirent_buffer, &stream->dirent_count);
+	require_noerr_quiet(error, write_dirents);
+	
+	if ( (stream->last_element != NULL) && (stream->last_element == struct_ptr->tail) )
+	{
+		reset_opendir_storage(struct_ptr);
+		stream->last_element = NULL;
+	}
+	
+write_dirents:
+opendir_stream_add_element:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * The multistatus scanner.
+ *
+ * Almost every PROPFIND response is plain ASCII XML without a DOCTYPE, comments,
+ * CDATA sections or entity references. For those, the scanner finds the tags and
+ * text in place and calls the parser_opendir_* callbacks itself, which is cheaper
+ * than running the response through libxml2. Anything the scanner does not
+ * expect makes it hand the response over to the libxml2 push parser.
+ *
+ * The callbacks for a child of the root element (a <D:response>) are only made
+ * once the scanner has scanned the whole child. So when the scanner gives up,
+ * everything it has not made callbacks for is still in pending, and libxml2 is
+ * given the prolog (the bytes through the root element's start tag, plus its
+ * end tag if that has been seen) followed by pending. Restarting the root
+ * element only makes callbacks for an element that is ignored, so libxml2 makes
+ * the same callbacks it would have made if it had parsed the whole response.
+ */
+
+/* character classes for the scanner */
+#define SCANNER_SPACE		0x01		/* white space */
+#define SCANNER_NAME_START	0x02		/* can start a name (or the local part of one) */
+#define SCANNER_NAME		0x04		/* can be in a name */
+#define SCANNER_TEXT		0x08		/* text the scanner handles: ASCII with no entity references or markup */
+
+static const UInt8 scanner_class[256] =
+{
+	['\t'] = SCANNER_SPACE | SCANNER_TEXT, ['\n'] = SCANNER_SPACE | SCANNER_TEXT,
+	['\r'] = SCANNER_SPACE | SCANNER_TEXT, [' '] = SCANNER_SPACE | SCANNER_TEXT,
+	['!' ... '%'] = SCANNER_TEXT, ['\'' ... ','] = SCANNER_TEXT,
+	['-'] = SCANNER_NAME | SCANNER_TEXT, ['.'] = SCANNER_NAME | SCANNER_TEXT, ['/'] = SCANNER_TEXT,
+	['0' ... '9'] = SCANNER_NAME | SCANNER_TEXT, [':' ... ';'] = SCANNER_TEXT, ['=' ... '@'] = SCANNER_TEXT,
+	['A' ... 'Z'] = SCANNER_NAME_START | SCANNER_NAME | SCANNER_TEXT, ['[' ... '^'] = SCANNER_TEXT,
+	['_'] = SCANNER_NAME_START | SCANNER_NAME | SCANNER_TEXT, ['`'] = SCANNER_TEXT,
+	['a' ... 'z'] = SCANNER_NAME_START | SCANNER_NAME | SCANNER_TEXT, ['{' ... 0x7f] = SCANNER_TEXT
+};
+
+#define SCANNER_IS_SPACE(c)			(scanner_class[(c)] & SCANNER_SPACE)
+#define SCANNER_IS_NAME_START(c)	(scanner_class[(c)] & SCANNER_NAME_START)
+#define SCANNER_IS_NAME(c)			(scanner_class[(c)] & SCANNER_NAME)
+#define SCANNER_IS_TEXT(c)			(scanner_class[(c)] & SCANNER_TEXT)
+
+/*
+ * scanner_name scans a qualified name. It returns the length of the name, 0 if
+ * the data ends before the name does, or -1 if the name is not one the scanner
+ * handles.
+ */
+static ssize_t scanner_name(const UInt8 *p,		/* -> the first byte of the name */
+							const UInt8 *end,	/* -> the end of the data */
+							size_t *colon)		/* <- offset of the ':' in the name, or 0 */
+{
+	const UInt8 *start;
+	size_t length;
+
+	start = p;
+	*colon = 0;
+
+	if ( p == end )
+	{
+		return ( 0 );
+	}
+	if ( !SCANNER_IS_NAME_START(*p) )
+	{
+		return ( -1 );
+	}
+	++p;
+	while ( TRUE )
+	{
+		while ( (p < end) && SCANNER_IS_NAME(*p) )
+		{
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		if ( *p != ':' )
+		{
+			break;
+		}
+		/* only one ':' and the local part must start with a name start character */
+		if ( *colon != 0 )
+		{
+			return ( -1 );
+		}
+		*colon = (size_t)(p - start);
+		if ( ++p == end )
+		{
+			return ( 0 );
+		}
+		if ( !SCANNER_IS_NAME_START(*p) )
+		{
+			return ( -1 );
+		}
+	}
+
+	length = (size_t)(p - start);
+	return ( (length < WEBDAV_SCANNER_MAX_NAME) ? (ssize_t)length : -1 );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_declared returns TRUE if the namespace prefix is in scope.
+ */
+static int scanner_declared(webdav_parse_opendir_stream_t *stream,
+							const UInt8 *prefix,
+							size_t prefix_length)
+{
+	int index;
+
+	if ( (prefix_length == 3) && (memcmp(prefix, "xml", 3) == 0) )
+	{
+		return ( TRUE );
+	}
+	for ( index = stream->namespace_count - 1; index >= 0; --index )
+	{
+		if ( (stream->namespaces[index].prefix_length == prefix_length) &&
+			 (memcmp(stream->namespaces[index].prefix, prefix, prefix_length) == 0) )
+		{
+			return ( TRUE );
+		}
+	}
+	return ( FALSE );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_tag scans the start or end tag at p. The xmlns:prefix declarations of
+ * a start tag are added to the stream's namespaces. It returns the length of
+ * the tag, 0 if the data ends before the tag does, or -1 if the tag is not one
+ * the scanner handles.
+ */
+static ssize_t scanner_tag(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+						   const UInt8 *p,							/* -> the tag's '<' */
+						   const UInt8 *end,						/* -> the end of the data */
+						   int depth,								/* -> depth of the element the tag starts */
+						   webdav_scanner_tag_t *tag)				/* <- the tag */
+{
+	const UInt8 *start;
+	const UInt8 *attribute_name[WEBDAV_SCANNER_MAX_ATTRIBUTES];
+	size_t attribute_length[WEBDAV_SCANNER_MAX_ATTRIBUTES];
+	size_t attribute_colon[WEBDAV_SCANNER_MAX_ATTRIBUTES];
+	int attribute_count;
+	int index;
+	int index2;
+	ssize_t length;
+	size_t colon;
+
+	start = p++;
+	attribute_count = 0;
+
+	if ( p == end )
+	{
+		return ( 0 );
+	}
+	tag->is_end = (*p == '/');
+	tag->is_empty = FALSE;
+	if ( tag->is_end )
+	{
+		++p;
+	}
+	length = scanner_name(p, end, &colon);
+	if ( length <= 0 )
+	{
+		return ( length );
+	}
+	tag->name = p;
+	tag->name_length = (size_t)length;
+	tag->colon = colon;
+	p += length;
+
+	if ( tag->is_end )
+	{
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		return ( (*p == '>') ? (p + 1 - start) : -1 );
+	}
+
+	while ( TRUE )
+	{
+		const UInt8 *space;
+		const UInt8 *value;
+		UInt8 quote;
+
+		space = p;
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		if ( *p == '>' )
+		{
+			++p;
+			break;
+		}
+		if ( *p == '/' )
+		{
+			if ( ++p == end )
+			{
+				return ( 0 );
+			}
+			if ( *p != '>' )
+			{
+				return ( -1 );
+			}
+			tag->is_empty = TRUE;
+			++p;
+			break;
+		}
+
+		/* an attribute -- it must be separated from what comes before it */
+		if ( (p == space) || (attribute_count == WEBDAV_SCANNER_MAX_ATTRIBUTES) )
+		{
+			return ( -1 );
+		}
+		length = scanner_name(p, end, &colon);
+		if ( length <= 0 )
+		{
+			return ( length );
+		}
+		attribute_name[attribute_count] = p;
+		attribute_length[attribute_count] = (size_t)length;
+		attribute_colon[attribute_count] = colon;
+		++attribute_count;
+		p += length;
+
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		if ( *p++ != '=' )
+		{
+			return ( -1 );
+		}
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		quote = *p++;
+		if ( (quote != '"') && (quote != '\'') )
+		{
+			return ( -1 );
+		}
+		value = p;
+		while ( (p < end) && (*p != quote) )
+		{
+			if ( !SCANNER_IS_TEXT(*p) )
+			{
+				return ( -1 );
+			}
+			++p;
+		}
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		++p;
+
+		/* xmlns:prefix="URI" declares prefix for this element and its children */
+		if ( (colon == 5) && (memcmp(attribute_name[attribute_count - 1], "xmlns", 5) == 0) )
+		{
+			webdav_scanner_namespace_t *namespace;
+			size_t prefix_length;
+
+			prefix_length = (size_t)length - 6;
+			if ( (prefix_length >= WEBDAV_SCANNER_MAX_PREFIX) ||
+				 (stream->namespace_count == WEBDAV_SCANNER_MAX_NAMESPACES) ||
+				 (value == (p - 1)) ||
+				 ((prefix_length >= 3) && (strncasecmp((const char *)attribute_name[attribute_count - 1] + 6, "xml", 3) == 0)) )
+			{
+				return ( -1 );
+			}
+			namespace = &stream->namespaces[stream->namespace_count++];
+			memcpy(namespace->prefix, attribute_name[attribute_count - 1] + 6, prefix_length);
+			namespace->prefix[prefix_length] = '\0';
+			namespace->prefix_length = prefix_length;
+			namespace->depth = depth;
+		}
+	}
+
+	/*
+	 * Every prefix must be declared and no two attributes may have the same
+	 * local name (which is stricter than XML requires, but rules out duplicate
+	 * attributes without resolving namespaces).
+	 */
+	if ( (tag->colon != 0) && !scanner_declared(stream, tag->name, tag->colon) )
+	{
+		return ( -1 );
+	}
+	for ( index = 0; index < attribute_count; ++index )
+	{
+		if ( (attribute_colon[index] != 0) &&
+			 !((attribute_colon[index] == 5) && (memcmp(attribute_name[index], "xmlns", 5) == 0)) &&
+			 !scanner_declared(stream, attribute_name[index], attribute_colon[index]) )
+		{
+			return ( -1 );
+		}
+		for ( index2 = 0; index2 < index; ++index2 )
+		{
+			size_t skip = (attribute_colon[index] != 0) ? attribute_colon[index] + 1 : 0;
+			size_t skip2 = (attribute_colon[index2] != 0) ? attribute_colon[index2] + 1 : 0;
+
+			if ( ((attribute_length[index] - skip) == (attribute_length[index2] - skip2)) &&
+				 (memcmp(attribute_name[index] + skip, attribute_name[index2] + skip2, attribute_length[index] - skip) == 0) )
+			{
+				return ( -1 );
+			}
+		}
+	}
+
+	return ( p - start );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_localname copies the local part of a name into a '\0' terminated
+ * buffer for the callbacks.
+ */
+static void scanner_localname(const UInt8 *name,		/* -> the name */
+							  size_t length,			/* -> length of the name */
+							  size_t colon,				/* -> offset of the ':' in the name, or 0 */
+							  xmlChar *localname)		/* <- WEBDAV_SCANNER_MAX_NAME bytes */
+{
+	if ( colon != 0 )
+	{
+		name += colon + 1;
+		length -= colon + 1;
+	}
+	memcpy(localname, name, length);
+	localname[length] = '\0';
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_element scans a child of the root element into the stream's tokens.
+ * It returns the length of the child (with *token_count set), 0 if the data
+ * ends before the child does, or -1 if the child is not something the scanner
+ * handles.
+ */
+static ssize_t scanner_element(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+							   const UInt8 *p,							/* -> the child's '<' */
+							   const UInt8 *end,						/* -> the end of the data */
+							   int *token_count)						/* <- number of tokens */
+{
+	const UInt8 *start;
+	const UInt8 *open_name[WEBDAV_SCANNER_MAX_DEPTH];
+	size_t open_length[WEBDAV_SCANNER_MAX_DEPTH];
+	webdav_scanner_tag_t tag;
+	webdav_scanner_token_t *token;
+	webdav_scanner_token_t *token_end;
+	ssize_t length;
+	int depth;
+
+	start = p;
+	depth = 0;	/* the depth of the root element */
+	token = stream->tokens;
+	/* leave room for the two tokens of an empty-element tag */
+	token_end = &stream->tokens[WEBDAV_SCANNER_MAX_TOKENS - 1];
+
+	do
+	{
+		if ( p == end )
+		{
+			return ( 0 );
+		}
+		if ( token >= token_end )
+		{
+			return ( -1 );
+		}
+
+		if ( *p == '<' )
+		{
+			if ( ((p + 1) < end) && ((p[1] == '!') || (p[1] == '?')) )
+			{
+				/* a comment, CDATA section or processing instruction */
+				return ( -1 );
+			}
+			if ( depth + 1 == WEBDAV_SCANNER_MAX_DEPTH )
+			{
+				return ( -1 );
+			}
+			length = scanner_tag(stream, p, end, depth + 1, &tag);
+			if ( length <= 0 )
+			{
+				return ( length );
+			}
+			p += length;
+
+			if ( !tag.is_end )
+			{
+				++depth;
+				open_name[depth] = tag.name;
+				open_length[depth] = tag.name_length;
+				token->type = WEBDAV_SCANNER_START;
+				token->data = (tag.colon != 0) ? tag.name + tag.colon + 1 : tag.name;
+				token->length = (tag.colon != 0) ? tag.name_length - tag.colon - 1 : tag.name_length;
+				++token;
+			}
+			else if ( (tag.name_length != open_length[depth]) || (memcmp(tag.name, open_name[depth], tag.name_length) != 0) )
+			{
+				/* the end tag doesn't match the start tag */
+				return ( -1 );
+			}
+
+			if ( tag.is_end || tag.is_empty )
+			{
+				/* the element is done -- its namespace declarations go out of scope */
+				while ( (stream->namespace_count != 0) && (stream->namespaces[stream->namespace_count - 1].depth >= depth) )
+				{
+					--stream->namespace_count;
+				}
+				--depth;
+				token->type = WEBDAV_SCANNER_END;
+				token->data = (tag.colon != 0) ? tag.name + tag.colon + 1 : tag.name;
+				token->length = (tag.colon != 0) ? tag.name_length - tag.colon - 1 : tag.name_length;
+				++token;
+			}
+		}
+		else
+		{
+			const UInt8 *text;
+
+			text = p;
+			while ( (p < end) && (*p != '<') )
+			{
+				/* "]]>" is not allowed in text */
+				if ( !SCANNER_IS_TEXT(*p) || ((*p == '>') && ((p - text) >= 2) && (p[-1] == ']') && (p[-2] == ']')) )
+				{
+					return ( -1 );
+				}
+				++p;
+			}
+			if ( p == end )
+			{
+				return ( 0 );
+			}
+			token->type = WEBDAV_SCANNER_TEXT;
+			token->data = text;
+			token->length = (size_t)(p - text);
+			++token;
+		}
+	} while ( depth != 0 );
+
+	*token_count = (int)(token - stream->tokens);
+	return ( p - start );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_emit makes the parser_opendir_* callbacks for the tokens of a
+ * complete child of the root element.
+ */
+static void scanner_emit(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+						 int token_count)						/* -> number of tokens */
+{
+	webdav_scanner_token_t *token;
+	xmlChar localname[WEBDAV_SCANNER_MAX_NAME];
+	const UInt8 *text;
+	const UInt8 *text_end;
+	const UInt8 *cr;
+
+	for ( token = stream->tokens; token < &stream->tokens[token_count]; ++token )
+	{
+		switch ( token->type )
+		{
+			case WEBDAV_SCANNER_START:
+				scanner_localname(token->data, token->length, 0, localname);
+				parser_opendir_create(&stream->opendir_struct, localname, NULL, NULL, 0, NULL, 0, 0, NULL);
+				break;
+
+			case WEBDAV_SCANNER_END:
+				scanner_localname(token->data, token->length, 0, localname);
+				parser_opendir_end(&stream->opendir_struct, localname, NULL, NULL);
+				break;
+
+			case WEBDAV_SCANNER_TEXT:
+				text = token->data;
+				text_end = token->data + token->length;
+				while ( text < text_end )
+				{
+					/* like libxml2, pass "\r\n" and "\r" on as "\n" */
+					cr = memchr(text, '\r', (size_t)(text_end - text));
+					if ( cr == NULL )
+					{
+						parser_opendir_add(&stream->opendir_struct, text, (int)(text_end - text));
+						break;
+					}
+					if ( cr != text )
+					{
+						parser_opendir_add(&stream->opendir_struct, text, (int)(cr - text));
+					}
+					/* the text always ends before a '<', so cr[1] is there */
+					if ( cr[1] != '\n' )
+					{
+						parser_opendir_add(&stream->opendir_struct, (const xmlChar *)"\n", 1);
+					}
+					text = cr + 1;
+				}
+				break;
+
+			default:
+				break;
+		}
+	}
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_xmldecl_attribute matches S name Eq value in an XML declaration,
+ * where value is quoted and is one of the values given. It returns TRUE and
+ * moves *pp past it if it matches.
+ */
+static int scanner_xmldecl_attribute(const UInt8 **pp,
+									 const UInt8 *end,
+									 const char *name,
+									 const char *value1,
+									 const char *value2)
+{
+	const UInt8 *p;
+	size_t length;
+	UInt8 quote;
+
+	p = *pp;
+	if ( (p == end) || !SCANNER_IS_SPACE(*p) )
+	{
+		return ( FALSE );
+	}
+	while ( (p < end) && SCANNER_IS_SPACE(*p) )
+	{
+		++p;
+	}
+	length = strlen(name);
+	if ( ((size_t)(end - p) < length) || (memcmp(p, name, length) != 0) )
+	{
+		return ( FALSE );
+	}
+	p += length;
+	while ( (p < end) && SCANNER_IS_SPACE(*p) )
+	{
+		++p;
+	}
+	if ( (p == end) || (*p++ != '=') )
+	{
+		return ( FALSE );
+	}
+	while ( (p < end) && SCANNER_IS_SPACE(*p) )
+	{
+		++p;
+	}
+	if ( (p == end) || ((*p != '"') && (*p != '\'')) )
+	{
+		return ( FALSE );
+	}
+	quote = *p++;
+
+	length = strlen(value1);
+	if ( ((size_t)(end - p) <= length) || (memcmp(p, value1, length) != 0) || (p[length] != quote) )
+	{
+		if ( value2 == NULL )
+		{
+			return ( FALSE );
+		}
+		length = strlen(value2);
+		if ( ((size_t)(end - p) <= length) || (memcmp(p, value2, length) != 0) || (p[length] != quote) )
+		{
+			return ( FALSE );
+		}
+	}
+	*pp = p + length + 1;
+
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_scan scans as much of the data as it can, making the callbacks for
+ * each complete child of the root element. It returns 0 with *consumed set to
+ * the number of bytes used (the rest must be given to it again with more data),
+ * or -1 with *consumed set to the number of bytes used before the scanner found
+ * something it does not handle.
+ */
+static int scanner_scan(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+						const UInt8 *data,						/* -> the data */
+						size_t data_length,						/* -> length of the data */
+						size_t *consumed)						/* <- bytes used */
+{
+	const UInt8 *p;
+	const UInt8 *end;
+	webdav_scanner_tag_t tag;
+	xmlChar localname[WEBDAV_SCANNER_MAX_NAME];
+	UInt8 *new_prolog;
+	ssize_t length;
+	int token_count;
+
+	p = data;
+	end = data + data_length;
+	*consumed = 0;
+
+	if ( stream->scanner_state == WEBDAV_SCANNER_PROLOG )
+	{
+		/* an XML declaration must have version 1.0 and be in UTF-8 */
+		if ( (data_length < 5) && (memcmp(data, "<?xml", data_length) == 0) )
+		{
+			return ( 0 );
+		}
+		if ( (data_length >= 5) && (memcmp(data, "<?xml", 5) == 0) )
+		{
+			const UInt8 *decl_end;
+
+			for ( decl_end = p + 5; (decl_end + 1) < end; ++decl_end )
+			{
+				if ( (decl_end[0] == '?') && (decl_end[1] == '>') )
+				{
+					break;
+				}
+			}
+			if ( (decl_end + 1) >= end )
+			{
+				return ( 0 );
+			}
+			p += 5;
+			if ( !scanner_xmldecl_attribute(&p, decl_end, "version", "1.0", NULL) )
+			{
+				return ( -1 );
+			}
+			(void) scanner_xmldecl_attribute(&p, decl_end, "encoding", "UTF-8", "utf-8");
+			(void) scanner_xmldecl_attribute(&p, decl_end, "standalone", "yes", "no");
+			while ( (p < decl_end) && SCANNER_IS_SPACE(*p) )
+			{
+				++p;
+			}
+			if ( p != decl_end )
+			{
+				return ( -1 );
+			}
+			p += 2;
+		}
+
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		if ( (p + 1) >= end )
+		{
+			return ( 0 );
+		}
+		/* the root element -- a DOCTYPE, comment or processing instruction is left to libxml2 */
+		if ( (*p != '<') || (p[1] == '!') || (p[1] == '?') )
+		{
+			return ( -1 );
+		}
+		length = scanner_tag(stream, p, end, 1, &tag);
+		if ( length <= 0 )
+		{
+			stream->namespace_count = 0;
+			return ( (int)length );
+		}
+		if ( tag.is_end )
+		{
+			return ( -1 );
+		}
+		p += length;
+
+		/* keep the prolog for the fallback */
+		stream->prolog = malloc((size_t)(p - data));
+		if ( stream->prolog == NULL )
+		{
+			return ( -1 );
+		}
+		memcpy(stream->prolog, data, (size_t)(p - data));
+		stream->prolog_length = (size_t)(p - data);
+
+		memcpy(stream->root_name, tag.name, tag.name_length);
+		stream->root_name_length = tag.name_length;
+		stream->root_namespace_count = stream->namespace_count;
+
+		scanner_localname(tag.name, tag.name_length, tag.colon, localname);
+		parser_opendir_create(&stream->opendir_struct, localname, NULL, NULL, 0, NULL, 0, 0, NULL);
+		if ( tag.is_empty )
+		{
+			parser_opendir_end(&stream->opendir_struct, localname, NULL, NULL);
+			stream->scanner_state = WEBDAV_SCANNER_EPILOG;
+		}
+		else
+		{
+			stream->scanner_state = WEBDAV_SCANNER_CONTENT;
+		}
+		*consumed = (size_t)(p - data);
+	}
+
+	while ( stream->scanner_state == WEBDAV_SCANNER_CONTENT )
+	{
+		/* white space between the children is ignored by the callbacks */
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		*consumed = (size_t)(p - data);
+		if ( (p + 1) >= end )
+		{
+			return ( 0 );
+		}
+		if ( (*p != '<') || (p[1] == '!') || (p[1] == '?') )
+		{
+			return ( -1 );
+		}
+
+		if ( p[1] == '/' )
+		{
+			/* the root element's end tag */
+			length = scanner_tag(stream, p, end, 1, &tag);
+			if ( length <= 0 )
+			{
+				return ( (int)length );
+			}
+			if ( (tag.name_length != stream->root_name_length) || (memcmp(tag.name, stream->root_name, tag.name_length) != 0) )
+			{
+				return ( -1 );
+			}
+			/* from here on, the fallback must give libxml2 a complete root element */
+			new_prolog = realloc(stream->prolog, stream->prolog_length + (size_t)length);
+			if ( new_prolog == NULL )
+			{
+				return ( -1 );
+			}
+			memcpy(&new_prolog[stream->prolog_length], p, (size_t)length);
+			stream->prolog = new_prolog;
+			stream->prolog_length += (size_t)length;
+			p += length;
+			scanner_localname(tag.name, tag.name_length, tag.colon, localname);
+			parser_opendir_end(&stream->opendir_struct, localname, NULL, NULL);
+			stream->namespace_count = 0;
+			stream->scanner_state = WEBDAV_SCANNER_EPILOG;
+		}
+		else
+		{
+			/* scan the whole child before making any callbacks for it */
+			length = scanner_element(stream, p, end, &token_count);
+			stream->namespace_count = stream->root_namespace_count;
+			if ( length <= 0 )
+			{
+				return ( (int)length );
+			}
+			scanner_emit(stream, token_count);
+			p += length;
+		}
+		*consumed = (size_t)(p - data);
+	}
+
+	if ( stream->scanner_state == WEBDAV_SCANNER_EPILOG )
+	{
+		/* only white space may follow the root element */
+		while ( (p < end) && SCANNER_IS_SPACE(*p) )
+		{
+			++p;
+		}
+		*consumed = (size_t)(p - data);
+		if ( p != end )
+		{
+			return ( -1 );
+		}
+	}
+
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+/*
+ * opendir_parse_chunk gives data to the libxml2 push parser, creating it if needed.
+ */
+static int opendir_parse_chunk(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+							   const UInt8 *xmlp,						/* -> xml data */
+							   size_t xmlp_len,							/* -> length of xml data */
+							   int terminate)							/* -> TRUE if this is the end of the data */
+{
+	int error;
+
+	error = 0;
+
+	if ( stream->parser == NULL )
+	{
+		xmlSAXHandler sh;
+
+		memset(&sh,0,sizeof(sh));
+		sh.startElementNs = parser_opendir_create;
+		sh.characters = parser_opendir_add;
+		sh.endElementNs = parser_opendir_end;
+		sh.initialized = XML_SAX2_MAGIC;
+
+		/* the push parser keeps its own copy of the SAX handler */
+		stream->parser = xmlCreatePushParserCtxt(&sh, &stream->opendir_struct, NULL, 0, NULL);
+		require_action(stream->parser != NULL, xmlCreatePushParserCtxt, error = EIO);
+	}
+
+	/* parse the XML -- exit now if error during parse */
+	(void) xmlParseChunk(stream->parser, (const char *)xmlp, (int)xmlp_len, terminate);
+	require_action(stream->parser->wellFormed, xmlParseChunk, error = EIO);
+
+xmlParseChunk:
+xmlCreatePushParserCtxt:
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_fallback turns the scanner off and gives libxml2 the prolog and
+ * everything the scanner has not made callbacks for.
+ */
+static int scanner_fallback(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+							const UInt8 *xmlp,						/* -> unused data (may be pending) */
+							size_t xmlp_len)						/* -> length of unused data */
+{
+	int error;
+
+	error = 0;
+	stream->scanner_state = WEBDAV_SCANNER_OFF;
+
+	if ( stream->prolog_length != 0 )
+	{
+		error = opendir_parse_chunk(stream, stream->prolog, stream->prolog_length, 0);
+	}
+	if ( (error == 0) && (xmlp_len != 0) )
+	{
+		error = opendir_parse_chunk(stream, xmlp, xmlp_len, 0);
+	}
+
+	free(stream->prolog);
+	stream->prolog = NULL;
+	stream->prolog_length = 0;
+	free(stream->pending);
+	stream->pending = NULL;
+	stream->pending_length = stream->pending_size = 0;
+
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * scanner_continue gives the next piece of the response to the scanner. Data
+ * that cannot be used until more arrives is kept in pending; the rest is
+ * scanned where it is.
+ */
+static int scanner_continue(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+							const UInt8 *xmlp,						/* -> the next piece of the xml data */
+							size_t xmlp_len)						/* -> length of xml data */
+{
+	const UInt8 *data;
+	size_t data_length;
+	size_t consumed;
+	size_t remaining;
+
+	if ( stream->pending_length != 0 )
+	{
+		/* finish what is pending */
+		if ( (stream->pending_length + xmlp_len) > stream->pending_size )
+		{
+			size_t new_size;
+			UInt8 *new_pending;
+
+			new_size = (stream->pending_length + xmlp_len) * 2;
+			new_pending = realloc(stream->pending, new_size);
+			if ( new_pending == NULL )
+			{
+				int error;
+
+				error = scanner_fallback(stream, stream->pending, stream->pending_length);
+				return ( (error != 0) ? error : opendir_parse_chunk(stream, xmlp, xmlp_len, 0) );
+			}
+			stream->pending = new_pending;
+			stream->pending_size = new_size;
+		}
+		memcpy(&stream->pending[stream->pending_length], xmlp, xmlp_len);
+		stream->pending_length += xmlp_len;
+		data = stream->pending;
+		data_length = stream->pending_length;
+	}
+	else
+	{
+		data = xmlp;
+		data_length = xmlp_len;
+	}
+
+	if ( scanner_scan(stream, data, data_length, &consumed) != 0 )
+	{
+		return ( scanner_fallback(stream, data + consumed, data_length - consumed) );
+	}
+
+	remaining = data_length - consumed;
+	if ( remaining > WEBDAV_SCANNER_MAX_PENDING )
+	{
+		/* a response this big is left to libxml2 rather than being scanned again and again */
+		return ( scanner_fallback(stream, data + consumed, remaining) );
+	}
+	if ( data == stream->pending )
+	{
+		memmove(stream->pending, data + consumed, remaining);
+	}
+	else if ( remaining != 0 )
+	{
+		if ( remaining > stream->pending_size )
+		{
+			UInt8 *new_pending;
+
+			new_pending = realloc(stream->pending, remaining * 2);
+			if ( new_pending == NULL )
+			{
+				return ( scanner_fallback(stream, data + consumed, remaining) );
+			}
+			stream->pending = new_pending;
+			stream->pending_size = remaining * 2;
+		}
+		memcpy(stream->pending, data + consumed, remaining);
+	}
+	stream->pending_length = remaining;
+
+	return ( 0 );
+}
+
+/*****************************************************************************/
+
+int parse_opendir_begin(CFURLRef urlRef,					/* -> the CFURL to the parent directory */
+						uid_t uid,							/* -> uid of the user making the request */
+						struct node_entry *parent_node,		/* -> pointer to the parent directory's node_entry */
+						webdav_parse_opendir_stream_t **stream_ptr)	/* <- the opendir stream */
+{
+	webdav_parse_opendir_stream_t *stream;
 	
-	xmlSAXHandler sh;
-    memset(&sh,0,sizeof(sh));
-    sh.startElementNs = parser_opendir_create;
-    sh.characters = parser_opendir_add;
-	sh.endElementNs = parser_opendir_end;
-    sh.initialized = XML_SAX2_MAGIC;
+	*stream_ptr = NULL;
+	
+	stream = calloc(1, sizeof(webdav_parse_opendir_stream_t));
+	require(stream != NULL, calloc_stream);
+	
+	/*
+	 * The dirents are collected in dirent_buffer and written to the cache
+	 * file WEBDAV_DIRENT_BATCH_COUNT at a time instead of one write per entry.
+	 */
+	stream->dirent_buffer = malloc(WEBDAV_DIRENT_BATCH_COUNT * sizeof(struct webdav_dirent));
+	require(stream->dirent_buffer != NULL, malloc_dirent_buffer);
+	
+	CFRetain(urlRef);
+	stream->urlRef = urlRef;
+	stream->uid = uid;
+	stream->parent_node = parent_node;
+	stream->scanner_state = gMultistatusScanner ? WEBDAV_SCANNER_PROLOG : WEBDAV_SCANNER_OFF;
 	
-	/* truncate the file, and reset the file pointer to 0 */
+	/* clear the flags left by a previous listing, truncate the file, and reset the file pointer to 0 */
+	require(fchflags(parent_node->file_fd, 0) == 0, fchflags);
 	require(ftruncate(parent_node->file_fd, 0) == 0, ftruncate);
 	require(lseek(parent_node->file_fd, 0, SEEK_SET) == 0, lseek);
 	
-	if(xmlp != NULL)
-	{
-		int result = xmlSAXUserParseMemory( &sh,&opendir_struct,(char*)xmlp,(int)xmlp_len);
-		require(result == 0, ParserCreate);
-		/* parse the XML -- exit now if error during parse */
-	}
-	
-	/* if the directory is not deleted, write "." and ".."  */
+	/* if the directory is not deleted, add "." and ".."  */
 	if ( !NODE_IS_DELETED(parent_node) )
 	{
-		bzero(dir_data, sizeof(dir_data));
+		struct webdav_dirent *dirent_buffer = stream->dirent_buffer;
+		
+		bzero(dirent_buffer, sizeof(struct webdav_dirent) * 2);
 		
-		dir_data[0].d_ino = parent_node->fileid;
-		dir_data[0].d_reclen = sizeof(struct webdav_dirent);
-		dir_data[0].d_type = DT_DIR;
-		dir_data[0].d_namlen = 1;
-		dir_data[0].d_name[0] = '.';
+		dirent_buffer[0].d_ino = parent_node->fileid;
+		dirent_buffer[0].d_reclen = sizeof(struct webdav_dirent);
+		dirent_buffer[0].d_type = DT_DIR;
+		dirent_buffer[0].d_namlen = 1;
+		dirent_buffer[0].d_name[0] = '.';
 		
-		dir_data[1].d_ino =
-		(dir_data[0].d_ino == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : parent_node->parent->fileid;
-		dir_data[1].d_reclen = sizeof(struct webdav_dirent);
-		dir_data[1].d_type = DT_DIR;
-		dir_data[1].d_namlen = 2;
-		dir_data[1].d_name[0] = '.';
-		dir_data[1].d_name[1] = '.';
+		dirent_buffer[1].d_ino =
+		(dirent_buffer[0].d_ino == WEBDAV_ROOTFILEID) ? WEBDAV_ROOTPARENTFILEID : parent_node->parent->fileid;
+		dirent_buffer[1].d_reclen = sizeof(struct webdav_dirent);
+		dirent_buffer[1].d_type = DT_DIR;
+		dirent_buffer[1].d_namlen = 2;
+		dirent_buffer[1].d_name[0] = '.';
+		dirent_buffer[1].d_name[1] = '.';
 		
-		size = write(parent_node->file_fd, dir_data, sizeof(struct webdav_dirent) * 2);
-		require(size == (sizeof(struct webdav_dirent) * 2), write_dot_dotdot);
+		stream->dirent_count = 2;
+		
+		require_noerr(write_dirents(parent_node->file_fd, dirent_buffer, &stream->dirent_count), write_dirents);
 	}
 	
 	/*
@@ -1609,197 +3428,204 @@ int parse_opendir(UInt8 *xmlp,					/* -> xml data returned by PROPFIND with dept
 	 */
 	
 	/* get the parent directory's path length */
-	parentPathLength = GetNormalizedPathLength(urlRef);
-	
-	/* invalidate any children nodes -- they'll be marked valid by nodecache_get_node */
-	(void) nodecache_invalidate_directory_node_time(parent_node);
+	stream->parentPathLength = GetNormalizedPathLength(urlRef);
 	
-	/* look at the list of elements */
-	for (element_ptr = opendir_struct.head; element_ptr != NULL; element_ptr = element_ptr->next)
+	/*
+	 * Get the parent directory's escaped path so GetComponentName can handle
+	 * most hrefs without CFURL, but only if decoding it that way gives the
+	 * same length CFURL did.
+	 */
+	stream->parentPath = CopyEscapedPath(urlRef);
+	if ( stream->parentPath != NULL )
 	{
-		char namebuffer[MAXNAMLEN + 1];
-		struct webdav_stat_attr statbuf;
+		char path[WEBDAV_MAX_URI_LEN];
+		CFIndex utf16Length;
 		
-		// Skip any placeholder that never saw a matching <D:href> element
-		if (element_ptr->seen_href == FALSE)
-			continue;
-		
-		/* make element_ptr->dir_data.d_name a cstring */
-		element_ptr->dir_data.d_name[element_ptr->dir_data.d_name_URI_length] = '\0';
-		//syslog(LOG_ERR,"element_ptr->dir_data.d_name is %s\n",element_ptr->dir_data.d_name);
-		/* get the component name if this element is not the parent */
-		if ( GetComponentName(urlRef, parentPathLength, element_ptr->dir_data.d_name, namebuffer) )
+		if ( (href_path_decode(stream->parentPath, stream->parentPath, path, sizeof(path), &utf16Length) <= 0) ||
+			 (utf16Length != stream->parentPathLength) )
 		{
-			/* this is a child */
-			struct node_entry *element_node;
-			size_t name_len;
-			
-			name_len = strlen(namebuffer);
-			//syslog(LOG_ERR,"namebuffer is %s\n",namebuffer);
-			/* get (or create) a cache node for this element */
-			error = nodecache_get_node(parent_node, name_len, namebuffer, TRUE, FALSE,
-									   element_ptr->dir_data.d_type == DT_DIR ? WEBDAV_DIR_TYPE : WEBDAV_FILE_TYPE, &element_node);
-			if (error)
-			{
-				debug_string("nodecache_get_node failed");
-				continue;
-			}
-			/* move just the element name over element_ptr->dir_data.d_name */
-			bcopy(element_node->name, element_ptr->dir_data.d_name, element_node->name_length);
-			
-			element_ptr->dir_data.d_name[element_node->name_length] = '\0';
-			element_ptr->dir_data.d_namlen = element_node->name_length;
-			
-			/* set the file number */
-			element_ptr->dir_data.d_ino = element_node->fileid;
-			//syslog(LOG_ERR,"element_node->fileid : %d\n",element_node->fileid);
-			/*
-			 * Prepare to cache this element's attributes, since it's
-			 * highly likely a stat will follow reading the directory.
-			 */
-			
-			bzero(&statbuf, sizeof(struct webdav_stat_attr));
-			
-			/* the first thing to do is fill in the fields we cannot get from the server. */
-			statbuf.attr_stat.st_dev = 0;
-			/* Why 1 for st_nlink?
-			 * Getting the real link count for directories is expensive.
-			 * Setting it to 1 lets FTS(3) (and other utilities that assume
-			 * 1 means a file system doesn't support link counts) work.
-			 */
-			statbuf.attr_stat.st_nlink = 1;
-			statbuf.attr_stat.st_uid = UNKNOWNUID;
-			statbuf.attr_stat.st_gid = UNKNOWNUID;
-			statbuf.attr_stat.st_rdev = 0;
-			statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
-			statbuf.attr_stat.st_flags = 0;
-			statbuf.attr_stat.st_gen = 0;
-			
-			/* set all times to the last modified time since we cannot get the other times */
-			statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
-			
-			/* set create time if we have it */
-			if (element_ptr->createtime.tv_sec)
-				statbuf.attr_create_time = element_ptr->createtime;
-			//syslog(LOG_ERR,"element_ptr->dir_data.d_type : %d\n",element_ptr->dir_data.d_type);
-			if (element_ptr->dir_data.d_type == DT_DIR)
-			{
-				statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
-				statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
-				/* appledoubleheadervalid is never valid for directories */
-				element_ptr->appledoubleheadervalid = FALSE;
-			}
-			else
-			{
-				statbuf.attr_stat.st_mode = S_IFREG | S_IRWXU;
-				statbuf.attr_stat.st_size = element_ptr->statsize;
-				/* appledoubleheadervalid is valid for files only if the server
-				 * returned the appledoubleheader property and file size is
-				 * the size of the appledoubleheader (APPLEDOUBLEHEADER_LENGTH bytes).
-				 */
-				element_ptr->appledoubleheadervalid =
-				(element_ptr->appledoubleheadervalid && (element_ptr->statsize == APPLEDOUBLEHEADER_LENGTH));
-				//syslog(LOG_ERR, "element_ptr->appledoubleheadervalid %d",element_ptr->appledoubleheadervalid);
-			}
-			
-			/* calculate number of S_BLKSIZE blocks */
-			statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
-			
-			/* set the fileid in statbuf*/
-			statbuf.attr_stat.st_ino = element_node->fileid;
-			
-			/* Now cache the stat structure (ignoring errors) */
-			(void) nodecache_add_attributes(element_node, uid, &statbuf,
-											element_ptr->appledoubleheadervalid ? element_ptr->appledoubleheader : NULL);
-			
-			/* Complete the task of getting the regular name into the dirent */
-			
-			size = write(parent_node->file_fd, (void *)&element_ptr->dir_data, element_ptr->dir_data.d_reclen);
-			require(size == element_ptr->dir_data.d_reclen, write_element);
+			free(stream->parentPath);
+			stream->parentPath = NULL;
+		}
+	}
+	
+	/* invalidate any children nodes -- they'll be marked valid by nodecache_get_listed_node */
+	(void) nodecache_begin_listing(parent_node);
+	
+	*stream_ptr = stream;
+	
+	return ( 0 );
+	
+	/**********************/
+	
+write_dirents:
+	/* directory is in unknown condition - erase whatever is there */
+	(void) ftruncate(parent_node->file_fd, 0);
+lseek:
+ftruncate:
+fchflags:
+	CFRelease(stream->urlRef);
+	free(stream->dirent_buffer);
+malloc_dirent_buffer:
+	free(stream);
+calloc_stream:
+	return ( EIO );
+}
+
+/*****************************************************************************/
+
+int parse_opendir_continue(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+						   const UInt8 *xmlp,						/* -> the next piece of the xml data returned by PROPFIND */
+						   CFIndex xmlp_len)						/* -> length of xml data */
+{
+	int error;
+	
+	error = 0;
+	
+	if ( xmlp_len != 0 )
+	{
+		if ( stream->scanner_state != WEBDAV_SCANNER_OFF )
+		{
+			error = scanner_continue(stream, xmlp, (size_t)xmlp_len);
 		}
 		else
 		{
-			struct node_entry *temp_node;
-			/* it was the parent */
-			
-			/* we are reading this directory, so mark it "recent" */
-			(void) nodecache_get_node(parent_node, 0, NULL, TRUE, TRUE, WEBDAV_DIR_TYPE, &temp_node);
-			
-			/*
-			 * Prepare to cache this element's attributes, since it's
-			 * highly likely a stat will follow reading the directory.
-			 */
-			
-			bzero(&statbuf, sizeof(struct webdav_stat_attr));
-			
-			/* the first thing to do is fill in the fields we cannot get from the server. */
-			statbuf.attr_stat.st_dev = 0;
-			/* Why 1 for st_nlink?
-			 * Getting the real link count for directories is expensive.
-			 * Setting it to 1 lets FTS(3) (and other utilities that assume
-			 * 1 means a file system doesn't support link counts) work.
-			 */
-			statbuf.attr_stat.st_nlink = 1;
-			statbuf.attr_stat.st_uid = UNKNOWNUID;
-			statbuf.attr_stat.st_gid = UNKNOWNUID;
-			statbuf.attr_stat.st_rdev = 0;
-			statbuf.attr_stat.st_blksize = WEBDAV_IOSIZE;
-			statbuf.attr_stat.st_flags = 0;
-			statbuf.attr_stat.st_gen = 0;
-			
-			/* set all times to the last modified time since we cannot get the other times */
-			statbuf.attr_stat.st_atimespec = statbuf.attr_stat.st_mtimespec = statbuf.attr_stat.st_ctimespec = element_ptr->stattime;
-			
-			/* set create time if we have it */
-			if (element_ptr->createtime.tv_sec)
-				statbuf.attr_create_time = element_ptr->createtime;
-			
-			statbuf.attr_stat.st_mode = S_IFDIR | S_IRWXU;
-			statbuf.attr_stat.st_size = WEBDAV_DIR_SIZE;
-			
-			/* calculate number of S_BLKSIZE blocks */
-			statbuf.attr_stat.st_blocks = ((statbuf.attr_stat.st_size + S_BLKSIZE - 1) / S_BLKSIZE);
-			
-			/* set the fileid in statbuf*/
-			statbuf.attr_stat.st_ino = parent_node->fileid;
-			
-			/* Now cache the stat structure (ignoring errors) */
-			(void) nodecache_add_attributes(parent_node, uid, &statbuf, NULL);
+			error = opendir_parse_chunk(stream, xmlp, (size_t)xmlp_len, 0);
+		}
+		require_noerr_quiet(error, parse_chunk);
+		
+		error = opendir_stream_add_elements(stream, FALSE);
+	}
+	
+parse_chunk:
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+/*
+ * opendir_stream_add_pending_nodes adds dirents for the files in the
+ * directory that are waiting for deferred creation. The server's listing
+ * can't have them, so their node_time is still 0.
+ */
+static int opendir_stream_add_pending_nodes(webdav_parse_opendir_stream_t *stream)
+{
+	int error;
+	struct node_entry *parent_node;
+	struct node_entry *node;
+	struct webdav_dirent *dirent;
+	
+	error = 0;
+	parent_node = stream->parent_node;
+	
+	lock_node_cache();
+	
+	LIST_FOREACH(node, &(parent_node->children), entries)
+	{
+		if ( !NODE_FILE_CREATE_PENDING(node) || (node->node_time != 0) )
+		{
+			continue;
+		}
+		
+		dirent = &stream->dirent_buffer[stream->dirent_count];
+		bzero(dirent, sizeof(struct webdav_dirent));
+		bcopy(node->name, dirent->d_name, node->name_length);
+		dirent->d_namlen = node->name_length;
+		dirent->d_reclen = sizeof(struct webdav_dirent);
+		dirent->d_type = DT_REG;
+		dirent->d_ino = node->fileid;
+		
+		/* the node is still valid */
+		node->node_time = time(NULL);
+		
+		/* the dirent is in the batch -- write the batch out if it is full */
+		if ( ++stream->dirent_count == WEBDAV_DIRENT_BATCH_COUNT )
+		{
+			error = write_dirents(parent_node->file_fd, stream->dirent_buffer, &stream->dirent_count);
+			require_noerr_quiet(error, write_dirents);
 		}
-	}	/* for element_ptr */
+	}
+	
+	error = write_dirents(parent_node->file_fd, stream->dirent_buffer, &stream->dirent_count);
+	
+write_dirents:
+	
+	unlock_node_cache();
+	
+	return ( error );
+}
+
+/*****************************************************************************/
+
+int parse_opendir_finish(webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream (freed by parse_opendir_finish) */
+						 int abort)								/* -> if TRUE, the listing is incomplete and is thrown away */
+{
+	int error;
+	struct node_entry *parent_node;
+	
+	error = 0;
+	parent_node = stream->parent_node;
+	
+	require_action_quiet(!abort, aborted, error = EIO);
+	
+	/*
+	 * If the scanner didn't see the whole response, libxml2 gets what is left
+	 * (and reports the error if the response is incomplete).
+	 */
+	if ( (stream->scanner_state != WEBDAV_SCANNER_OFF) &&
+		 ((stream->scanner_state != WEBDAV_SCANNER_EPILOG) || (stream->pending_length != 0)) )
+	{
+		error = scanner_fallback(stream, stream->pending, stream->pending_length);
+		require_noerr_quiet(error, xmlParseChunk);
+	}
+	
+	if ( stream->parser != NULL )
+	{
+		/* let the parser know there is no more data */
+		error = opendir_parse_chunk(stream, NULL, 0, 1);
+		require_noerr_quiet(error, xmlParseChunk);
+	}
+	
+	/* whatever is left is complete now */
+	error = opendir_stream_add_elements(stream, TRUE);
+	require_noerr_quiet(error, opendir_stream_add_elements);
+	
+	/* files waiting for deferred creation aren't on the server, but they're in the directory */
+	error = opendir_stream_add_pending_nodes(stream);
+	require_noerr_quiet(error, opendir_stream_add_pending_nodes);
 	
 	/* delete any children nodes that are still invalid */
 	(void) nodecache_delete_invalid_directory_nodes(parent_node);
 	
-	/* free any elements allocated */
-	element_ptr = opendir_struct.head;
-	while (element_ptr)
+opendir_stream_add_pending_nodes:
+opendir_stream_add_elements:
+xmlParseChunk:
+aborted:
+	
+	if ( error != 0 )
 	{
-		prev_element_ptr = element_ptr;
-		element_ptr = element_ptr->next;
-		free(prev_element_ptr);
+		/* directory is in unknown condition - erase whatever is there */
+		(void) ftruncate(parent_node->file_fd, 0);
 	}
 	
-	return ( 0 );
-	
-	/**********************/
+	/* stop remembering removed names */
+	nodecache_end_listing(parent_node);
 	
-write_element:
-	/* free any elements allocated */
-	element_ptr = opendir_struct.head;
-	while (element_ptr)
+	if ( stream->parser != NULL )
 	{
-		prev_element_ptr = element_ptr;
-		element_ptr = element_ptr->next;
-		free(prev_element_ptr);
+		xmlFreeParserCtxt(stream->parser);
 	}
-write_dot_dotdot:
-	/* directory is in unknown condition - erase whatever is there */
-	(void) ftruncate(parent_node->file_fd, 0);
-ParserCreate:
-lseek:
-ftruncate:
-	return ( EIO );
+	free(stream->prolog);
+	free(stream->pending);
+	/* free the elements and hrefs in one shot */
+	free_opendir_storage(&stream->opendir_struct);
+	free(stream->dirent_buffer);
+	free(stream->parentPath);
+	CFRelease(stream->urlRef);
+	free(stream);
+	
+	return ( error );
 }
 
 /*****************************************************************************/
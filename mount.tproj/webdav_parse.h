@@ -61,21 +61,6 @@ struct webdav_quotas
  */
 #define WEBDAV_MAX_URI_LEN ((MAXPATHLEN * 3) + 1)
 
-/* This structure must be exactly like "struct dirent", defined in sys/dirent.h,
-   except that d_name is long enough to hold the entire URI and the URI length
-   is stored in d_name_URI_length. */
-struct large_dirent
-{
-	webdav_ino_t d_ino;							/* file number of entry */
-	u_int16_t d_reclen;							/* sizeof(struct dirent) */
-	u_int8_t d_type;							/* file type, see below */
-	u_int8_t d_namlen;							/* length of string in d_name */
-	char d_name[WEBDAV_MAX_URI_LEN];			/* name must be no longer than this */
-	u_int32_t d_name_URI_length;				/* the length of the URI stored in
-												 * d_name until it is shortened
-												 * to a file name */
-};
-
 // XXX Dependency on __DARWIN_64_BIT_INO_T
 // struct dirent is in flux right now because __DARWIN_64_BIT_INO_T is set to 1 for user space,
 // but set to zero for kernel space.
@@ -115,9 +100,23 @@ struct webdav_dirent {
 		char d_name[__DARWIN_MAXNAMLEN + 1];	/* name must be no longer than this */
 };
 
+/* number of dirents an opendir parse collects before writing them to the directory's cache file */
+#define WEBDAV_DIRENT_BATCH_COUNT (BODY_BUFFER_SIZE / sizeof(struct webdav_dirent))
+
+/*
+ * The opendir element records are kept small so that very large directory
+ * listings don't require a WEBDAV_MAX_URI_LEN buffer per entry. The href text
+ * of each element is stored in the per-parse href arena and the element refers
+ * to it by offset and length (the href is always followed by a '\0' in the arena).
+ * Element records themselves are carved out of fixed size chunks. Both the
+ * arena and the chunks are reused once every element parsed so far has been
+ * turned into a dirent, and are freed in one shot when the parse is done.
+ */
 typedef struct webdav_parse_opendir_element_tag
 {
-	struct large_dirent dir_data;
+	size_t href_offset;			/* offset of the href in the href arena */
+	size_t href_length;			/* length of the href (not including the '\0') */
+	u_int8_t d_type;			/* DT_REG or DT_DIR */
 	struct timespec stattime;
 	struct timespec createtime;
 	u_quad_t statsize;
@@ -128,6 +127,16 @@ typedef struct webdav_parse_opendir_element_tag
 	struct webdav_parse_opendir_element_tag *next;
 } webdav_parse_opendir_element_t;
 
+#define WEBDAV_OPENDIR_CHUNK_ELEMENTS	256		/* number of element records allocated at a time */
+#define WEBDAV_OPENDIR_ARENA_MIN_SIZE	0x10000	/* the href arena starts at this size and doubles as it grows */
+
+typedef struct webdav_parse_opendir_chunk_tag
+{
+	struct webdav_parse_opendir_chunk_tag *next;
+	u_int32_t count;			/* number of elements[] handed out */
+	webdav_parse_opendir_element_t elements[WEBDAV_OPENDIR_CHUNK_ELEMENTS];
+} webdav_parse_opendir_chunk_t;
+
 typedef struct
 {
 	int error;
@@ -136,14 +145,14 @@ typedef struct
 	Boolean start; /*For characters callback to work only after start tag and no end tag*/
 	webdav_parse_opendir_element_t *head;
 	webdav_parse_opendir_element_t *tail;
+	webdav_parse_opendir_chunk_t *chunks;	/* element chunks, most recent first */
+	char *arena;				/* href arena */
+	size_t arena_length;		/* bytes used in the href arena */
+	size_t arena_size;			/* bytes allocated for the href arena */
+	size_t text_length;			/* length of the text collected for the current element */
+	UInt8 text[WEBDAV_MAX_URI_LEN];	/* the text collected for the current element ('\0' terminated) */
 } webdav_parse_opendir_struct_t;
 
-typedef struct
-{
-	CFIndex size;
-	UInt8 name[WEBDAV_MAX_URI_LEN];
-} webdav_parse_opendir_text_t;
-
 typedef struct
 {
 	int id;
@@ -193,12 +202,29 @@ typedef struct
 extern int parse_stat(const UInt8 *xmlp, CFIndex xmlp_len, struct webdav_stat_attr *statbuf);
 extern int parse_statfs(const UInt8 *xmlp, CFIndex xmlp_len, struct statfs *statfsbuf);
 extern int parse_lock(const UInt8 *xmlp, CFIndex xmlp_len, char **locktoken);
-extern int parse_opendir(
-	UInt8 *xmlp,					/* -> xml data returned by PROPFIND with depth of 1 */
-	CFIndex xmlp_len,				/* -> length of xml data */
+
+/*
+ * parse_opendir_begin, parse_opendir_continue and parse_opendir_finish parse a
+ * PROPFIND response with depth of 1 as it arrives. parse_opendir_begin truncates
+ * the directory's cache file and writes the "." and ".." entries; each call to
+ * parse_opendir_continue appends the dirents of the elements completed by that
+ * piece of the response; parse_opendir_finish completes (or, if abort is TRUE,
+ * throws away) the listing and frees the opendir stream.
+ */
+typedef struct webdav_parse_opendir_stream_tag webdav_parse_opendir_stream_t;
+
+extern int parse_opendir_begin(
 	CFURLRef urlRef,				/* -> the CFURL to the parent directory (may be a relative CFURL) */
-	uid_t uid,						/* -> uid of the user making the request */ 
-	struct node_entry *parent_node);/* -> pointer to the parent directory's node_entry */
+	uid_t uid,						/* -> uid of the user making the request */
+	struct node_entry *parent_node,	/* -> pointer to the parent directory's node_entry */
+	webdav_parse_opendir_stream_t **stream);	/* <- the opendir stream */
+extern int parse_opendir_continue(
+	webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream */
+	const UInt8 *xmlp,				/* -> the next piece of the xml data returned by PROPFIND */
+	CFIndex xmlp_len);				/* -> length of xml data */
+extern int parse_opendir_finish(
+	webdav_parse_opendir_stream_t *stream,	/* -> the opendir stream (freed by parse_opendir_finish) */
+	int abort);						/* -> if TRUE, the listing is incomplete and is thrown away */
 extern int parse_file_count(const UInt8 *xmlp, CFIndex xmlp_len, int *file_count);
 extern int parse_cachevalidators(const UInt8 *xmlp, CFIndex xmlp_len, time_t *last_modified, char **entity_tag);
 extern webdav_parse_multistatus_list_t *parse_multi_status(	UInt8 *xmlp, CFIndex xmlp_len);
@@ -58,10 +58,19 @@ typedef struct webdav_requestqueue_element_tag
 
 		struct download
 		{
+			uid_t uid;							/* uid of the user who opened the file */
 			struct node_entry *node;			/* the node */
 			struct ReadStreamRec *readStreamRecPtr; /* the ReadStreamRec */
 		} download;								/* Struct used for download requests */
 		
+		struct readdir
+		{
+			struct node_entry *node;			/* the directory node */
+			struct ReadStreamRec *readStreamRecPtr; /* the ReadStreamRec */
+			webdav_parse_opendir_stream_t *opendir_stream; /* the opendir stream */
+			struct ContentDecoder *decoder;		/* the listing's decoder, or NULL */
+		} readdir;								/* Struct used for directory listing requests */
+		
 		struct serverping
 		{
 			u_int32_t delay;					/* used for backoff delay sending ping requests to the server */
@@ -71,6 +80,17 @@ typedef struct webdav_requestqueue_element_tag
 		{
 			struct stream_put_ctx *ctx;
 		} seqwrite_read_rsp;
+		
+		struct getattr
+		{
+			int socket;							/* socket for connection */
+			struct webdav_request_getattr request; /* the request read from the socket */
+		} getattr;								/* Struct used for getattr requests finished by a request thread */
+		
+		struct writeback
+		{
+			struct node_entry *node;			/* the node whose cache file is uploaded */
+		} writeback;							/* Struct used for write-back uploads */
 				
 	} element;
 } webdav_requestqueue_element_t;
@@ -89,6 +109,9 @@ typedef struct
 #define WEBDAV_DOWNLOAD_TYPE 2
 #define WEBDAV_SERVER_PING_TYPE 3
 #define WEBDAV_SEQWRITE_MANAGER_TYPE 4
+#define WEBDAV_READDIR_TYPE 5
+#define WEBDAV_GETATTR_TYPE 6
+#define WEBDAV_WRITEBACK_TYPE 7
 
 #define WEBDAV_MAX_IDLE_TIME 10		/* in seconds */
 
@@ -107,6 +130,7 @@ static pthread_cond_t pulse_condvar;
 static int purge_cache_files;	/* TRUE if closed cache files should be immediately removed from file cache */
 
 static int handle_request_thread(void *arg);
+static int requestqueue_enqueue_getattr(webdav_requestqueue_element_t *request_element_ptr);
 
 static int gCurrThreadCount = 0;
 static int gIdleThreadCount = 0;
@@ -314,6 +338,68 @@ static void send_reply(int so, void *data, size_t size, int error)
 
 /*****************************************************************************/
 
+/*
+ * getattr_request_complete is called (usually on an event thread) when a getattr
+ * request started by filesystem_getattr_async is complete. It replies and
+ * closes the socket, or if the request needs more than one round trip,
+ * gives it to a request thread.
+ */
+static void getattr_request_complete(void *context, int error, struct webdav_reply_getattr *reply_getattr)
+{
+	webdav_requestqueue_element_t *request_element_ptr;
+	
+	request_element_ptr = (webdav_requestqueue_element_t *)context;
+	
+	if ( error == EAGAIN )
+	{
+		if ( requestqueue_enqueue_getattr(request_element_ptr) == 0 )
+		{
+			/* a request thread owns it now */
+			return;
+		}
+		error = EIO;
+	}
+	
+	send_reply(request_element_ptr->element.getattr.socket, (void *)reply_getattr, sizeof(struct webdav_reply_getattr), error);
+	close(request_element_ptr->element.getattr.socket);
+	free(request_element_ptr);
+}
+
+/*
+ * handle_getattr_request starts a getattr request on the event engine if it
+ * needs to go to the server. Returns TRUE if it did; the socket then belongs
+ * to the request until it is complete.
+ */
+static int handle_getattr_request(int so, struct webdav_request_getattr *request_getattr)
+{
+	webdav_requestqueue_element_t *request_element_ptr;
+	
+	if ( !gEventEngine )
+	{
+		return ( FALSE );
+	}
+	
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	if ( request_element_ptr == NULL )
+	{
+		return ( FALSE );
+	}
+	
+	request_element_ptr->type = WEBDAV_GETATTR_TYPE;
+	request_element_ptr->element.getattr.socket = so;
+	request_element_ptr->element.getattr.request = *request_getattr;
+	
+	if ( !filesystem_getattr_async(&request_element_ptr->element.getattr.request, getattr_request_complete, request_element_ptr) )
+	{
+		free(request_element_ptr);
+		return ( FALSE );
+	}
+	
+	return ( TRUE );
+}
+
+/*****************************************************************************/
+
 static void handle_filesystem_request(int so)
 {
 	int error;
@@ -322,6 +408,9 @@ static void handle_filesystem_request(int so)
 	size_t num_bytes;
 	char *bytes;
 	union webdav_reply reply;
+	int async;
+	
+	async = FALSE;
 	
 	/* get the request from the socket */
 	error = get_request(so, &operation, key, sizeof(key));
@@ -339,8 +428,10 @@ static void handle_filesystem_request(int so)
 				(operation==WEBDAV_FSYNC) ? "FSYNC" :
 				(operation==WEBDAV_REMOVE) ? "REMOVE" :
 				(operation==WEBDAV_RENAME) ? "RENAME" :
+				(operation==WEBDAV_COPYFILE) ? "COPYFILE" :
 				(operation==WEBDAV_MKDIR) ? "MKDIR" :
 				(operation==WEBDAV_RMDIR) ? "RMDIR" :
+				(operation==WEBDAV_RMTREE) ? "RMTREE" :
 				(operation==WEBDAV_READDIR) ? "READDIR" :
 				(operation==WEBDAV_STATFS) ? "STATFS" :
 				(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
@@ -388,6 +479,12 @@ static void handle_filesystem_request(int so)
 					break;
 
 				case WEBDAV_GETATTR:
+					/* if the attributes must come from the server, don't tie up this thread waiting for them */
+					async = handle_getattr_request(so, (struct webdav_request_getattr *)key);
+					if ( async )
+					{
+						break;
+					}
 					error = filesystem_getattr((struct webdav_request_getattr *)key,
 							(struct webdav_reply_getattr *)&reply);
 					send_reply(so, (void *)&reply, sizeof(struct webdav_reply_getattr), error);
@@ -420,6 +517,11 @@ static void handle_filesystem_request(int so)
 					send_reply(so, (void *)0, 0, error);
 					break;
 
+				case WEBDAV_COPYFILE:
+					error = filesystem_copyfile((struct webdav_request_copyfile *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+
 				case WEBDAV_MKDIR:
 					error = filesystem_mkdir((struct webdav_request_mkdir *)key,
 							(struct webdav_reply_mkdir *)&reply);
@@ -431,6 +533,11 @@ static void handle_filesystem_request(int so)
 					send_reply(so, (void *)0, 0, error);
 					break;
 
+				case WEBDAV_RMTREE:
+					error = filesystem_rmtree((struct webdav_request_rmtree *)key);
+					send_reply(so, (void *)0, 0, error);
+					break;
+
 				case WEBDAV_READDIR:
 					error = filesystem_readdir((struct webdav_request_readdir *)key);
 					send_reply(so, (void *)0, 0, error);
@@ -443,7 +550,17 @@ static void handle_filesystem_request(int so)
 					break;
 			
 				case WEBDAV_UNMOUNT:
-					webdav_kill(-2);	/* tell the main select loop to exit */
+					if ( gWriteBack )
+					{
+						/* upload everything write-back is holding before exiting */
+						pthread_mutex_lock(&pulse_lock);
+						error = filesystem_writeback_drain(((struct webdav_request_unmount *)key)->force);
+						pthread_mutex_unlock(&pulse_lock);
+					}
+					if ( error == 0 )
+					{
+						webdav_kill(-2);	/* tell the main select loop to exit */
+					}
 					send_reply(so, (void *)0, 0, error);
 					break;
 
@@ -486,8 +603,10 @@ static void handle_filesystem_request(int so)
 					(operation==WEBDAV_FSYNC) ? "FSYNC" :
 					(operation==WEBDAV_REMOVE) ? "REMOVE" :
 					(operation==WEBDAV_RENAME) ? "RENAME" :
+					(operation==WEBDAV_COPYFILE) ? "COPYFILE" :
 					(operation==WEBDAV_MKDIR) ? "MKDIR" :
 					(operation==WEBDAV_RMDIR) ? "RMDIR" :
+					(operation==WEBDAV_RMTREE) ? "RMTREE" :
 					(operation==WEBDAV_READDIR) ? "READDIR" :
 					(operation==WEBDAV_STATFS) ? "STATFS" :
 					(operation==WEBDAV_UNMOUNT) ? "UNMOUNT" :
@@ -502,7 +621,11 @@ static void handle_filesystem_request(int so)
 		send_reply(so, NULL, 0, error);
 	}
 
-	close(so);
+	/* an asynchronous request closes the socket when it's complete */
+	if ( !async )
+	{
+		close(so);
+	}
 }
 
 /*****************************************************************************/
@@ -538,6 +661,7 @@ static void pulse_thread(void *arg)
 			else
 			{
 				/* remove any closed nodes that are deleted, or that need to be aged out of the list */
+				/* (nodecache_remove_file_cache keeps cache files write-back hasn't uploaded) */
 				if ( NODE_IS_DELETED(node) || NODE_FILE_CACHE_INVALID(node) || purge_cache_files )
 				{
 					/* it's been closed for WEBDAV_CACHE_TIMEOUT seconds -- remove the node from the file cache */
@@ -576,6 +700,38 @@ pthread_mutex_unlock:
 
 /*****************************************************************************/
 
+static void writeback_thread(void *arg)
+{
+	#pragma unused(arg)
+	int error;
+	
+	error = 0;
+	while ( TRUE )
+	{
+		/* check often enough that uploads don't wait much longer than gWriteBackDelay */
+		sleep((unsigned int)((gWriteBackDelay > 1) ? (gWriteBackDelay / 2) : 1));
+		
+		/* the pulse thread walks the file cache list too */
+		error = pthread_mutex_lock(&pulse_lock);
+		require_noerr(error, pthread_mutex_lock);
+		
+		filesystem_writeback_scan();
+		
+		error = pthread_mutex_unlock(&pulse_lock);
+		require_noerr(error, pthread_mutex_unlock);
+	}
+
+pthread_mutex_lock:
+pthread_mutex_unlock:
+
+	if ( error )
+	{
+		webdav_kill(-1);	/* tell the main select loop to force unmount */
+	}
+}
+
+/*****************************************************************************/
+
 static int handle_request_thread(void *arg)
 {
 	#pragma unused(arg)
@@ -616,7 +772,8 @@ static int handle_request_thread(void *arg)
 
 				case WEBDAV_DOWNLOAD_TYPE:
 					/* finish the download */
-					error = network_finish_download(myrequest->element.download.node, myrequest->element.download.readStreamRecPtr);
+					error = network_finish_download(myrequest->element.download.uid, myrequest->element.download.node,
+						myrequest->element.download.readStreamRecPtr);
 					if (error) {
 						/* Set append to indicate that our download failed. It's a hack, but
 						 * it should work.	Be sure to still mark the download as finished so
@@ -636,6 +793,25 @@ static int handle_request_thread(void *arg)
 					error = 0;
 					break;
 
+				case WEBDAV_READDIR_TYPE:
+					/* finish the directory listing */
+					error = network_finish_readdir(myrequest->element.readdir.node, myrequest->element.readdir.readStreamRecPtr,
+						myrequest->element.readdir.opendir_stream, myrequest->element.readdir.decoder);
+					if (error) {
+						/* As with downloads, set append to indicate that the listing failed and
+						 * still mark it finished so a waiting closer or reader will be notified
+						 */
+						verify_noerr(fchflags(myrequest->element.readdir.node->file_fd, UF_APPEND));
+						myrequest->element.readdir.node->file_status = WEBDAV_DOWNLOAD_ABORTED;
+					}
+					else {
+						/* Clear flags to indicate that the listing is complete */
+						verify_noerr(fchflags(myrequest->element.readdir.node->file_fd, 0));
+						myrequest->element.readdir.node->file_status = WEBDAV_DOWNLOAD_FINISHED;
+					}
+					error = 0;
+					break;
+
 				case WEBDAV_SERVER_PING_TYPE:
 					/* Send an OPTIONS request to the server. */
 					network_server_ping(myrequest->element.serverping.delay);
@@ -646,6 +822,24 @@ static int handle_request_thread(void *arg)
 					network_seqwrite_manager(myrequest->element.seqwrite_read_rsp.ctx);
 				break;
 				
+				case WEBDAV_GETATTR_TYPE:
+					/* finish a getattr request the event engine couldn't complete */
+					{
+						struct webdav_reply_getattr reply_getattr;
+						
+						bzero(&reply_getattr, sizeof(reply_getattr));
+						error = filesystem_getattr(&myrequest->element.getattr.request, &reply_getattr);
+						send_reply(myrequest->element.getattr.socket, (void *)&reply_getattr, sizeof(struct webdav_reply_getattr), error);
+						close(myrequest->element.getattr.socket);
+						error = 0;
+					}
+				break;
+				
+				case WEBDAV_WRITEBACK_TYPE:
+					/* upload the cache file of a closed file */
+					filesystem_writeback(myrequest->element.writeback.node);
+				break;
+				
 				default:
 					/* nothing we can do, just get the next request */
 					break;
@@ -715,6 +909,7 @@ int requestqueue_init()
 	int error;
 	pthread_mutexattr_t mutexattr;
 	pthread_t the_pulse_thread;
+	pthread_t the_writeback_thread;
 	pthread_attr_t the_pulse_thread_attr;
 	
 	/* set up the lock for connectionstate */
@@ -767,6 +962,15 @@ int requestqueue_init()
 
 	error = pthread_create(&the_pulse_thread, &the_pulse_thread_attr, (void *)pulse_thread, (void *)NULL);
 	require_noerr(error, pthread_create);
+	
+	/*
+	 * Start the write-back thread
+	 */
+	if ( gWriteBack )
+	{
+		error = pthread_create(&the_writeback_thread, &the_pulse_thread_attr, (void *)writeback_thread, (void *)NULL);
+		require_noerr(error, pthread_create);
+	}
 
 pthread_create:
 pthread_attr_setdetachstate:
@@ -839,7 +1043,63 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
-int requestqueue_enqueue_download(struct node_entry *node, struct ReadStreamRec *readStreamRecPtr)
+/* requestqueue_enqueue_getattr
+ * queues a getattr request started on the event engine for a request thread to finish.
+ */
+static int requestqueue_enqueue_getattr(webdav_requestqueue_element_t *request_element_ptr)
+{
+	int error, unlock_error;
+	pthread_t request_thread;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr(error, pthread_mutex_lock);
+
+	request_element_ptr->type = WEBDAV_GETATTR_TYPE;
+	request_element_ptr->next = 0;
+	++(waiting_requests.request_count);
+
+	if (!(waiting_requests.item_tail)) {
+		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
+	}
+	else {
+		waiting_requests.item_tail->next = request_element_ptr;
+		waiting_requests.item_tail = request_element_ptr;
+	}
+
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr_action(error, pthread_cond_signal, webdav_kill(-1));
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
+		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr_action(error, pthread_create_signal, webdav_kill(-1));
+
+			gCurrThreadCount += 1;
+		}
+	}
+
+pthread_create_signal:
+pthread_cond_signal:
+
+	/* once it's queued, the element belongs to the request queue */
+	error = 0;
+	
+	unlock_error = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(unlock_error, pthread_mutex_unlock, webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
+int requestqueue_enqueue_download(uid_t uid, struct node_entry *node, struct ReadStreamRec *readStreamRecPtr)
 {
 	int error, error2;
 	webdav_requestqueue_element_t * request_element_ptr;
@@ -852,6 +1112,7 @@ int requestqueue_enqueue_download(struct node_entry *node, struct ReadStreamRec
 	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = EIO);
 
 	request_element_ptr->type = WEBDAV_DOWNLOAD_TYPE;
+	request_element_ptr->element.download.uid = uid;
 	request_element_ptr->element.download.node = node;
 	request_element_ptr->element.download.readStreamRecPtr = readStreamRecPtr;
 	
@@ -899,6 +1160,68 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
+int requestqueue_enqueue_readdir(struct node_entry *node, struct ReadStreamRec *readStreamRecPtr, webdav_parse_opendir_stream_t *opendir_stream, struct ContentDecoder *decoder)
+{
+	int error, error2;
+	webdav_requestqueue_element_t * request_element_ptr;
+	pthread_t request_thread;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = EIO);
+
+	request_element_ptr->type = WEBDAV_READDIR_TYPE;
+	request_element_ptr->element.readdir.node = node;
+	request_element_ptr->element.readdir.readStreamRecPtr = readStreamRecPtr;
+	request_element_ptr->element.readdir.opendir_stream = opendir_stream;
+	request_element_ptr->element.readdir.decoder = decoder;
+	
+	/* Like downloads, directory listings are inserted at head of request queue since they are holding a stream reference. */
+	request_element_ptr->next = waiting_requests.item_head;
+	++(waiting_requests.request_count);
+
+	if ( waiting_requests.item_head == NULL ) {
+		/* request queue was empty */
+		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
+	}
+	else {
+		/* this request is the new head */
+		waiting_requests.item_head = request_element_ptr;
+	}
+
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr(error, pthread_cond_signal);
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
+		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr(error, pthread_create_signal);
+
+			gCurrThreadCount += 1;
+		}
+	}
+
+pthread_create_signal:
+pthread_cond_signal:
+malloc_request_element_ptr:
+
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
 int requestqueue_enqueue_server_ping(u_int32_t delay)
 {
 	int error, error2;
@@ -959,6 +1282,66 @@ pthread_mutex_lock:
 
 /*****************************************************************************/
 
+int requestqueue_enqueue_writeback(struct node_entry *node)
+{
+	int error, error2;
+	webdav_requestqueue_element_t * request_element_ptr;
+	pthread_t request_thread;
+
+	error = pthread_mutex_lock(&requests_lock);
+	require_noerr_action(error, pthread_mutex_lock, webdav_kill(-1));
+
+	request_element_ptr = malloc(sizeof(webdav_requestqueue_element_t));
+	require_action(request_element_ptr != NULL, malloc_request_element_ptr, error = EIO);
+
+	request_element_ptr->type = WEBDAV_WRITEBACK_TYPE;
+	request_element_ptr->element.writeback.node = node;
+	
+	/* Insert write-back uploads at tail of request queue. They aren't in a hurry. */
+	request_element_ptr->next = 0;
+	++(waiting_requests.request_count);
+
+	if ( waiting_requests.item_tail == NULL ) {
+		/* request queue was empty */
+		waiting_requests.item_head = waiting_requests.item_tail = request_element_ptr;
+	}
+	else {
+		/* this request is the new tail */
+		waiting_requests.item_tail->next = request_element_ptr;
+		waiting_requests.item_tail = request_element_ptr;
+	}
+
+	if (gIdleThreadCount > 0) {
+		/* Already have one or more threads just waiting for work to do.  Just kick the requests_condvar to wake 
+		up the threads */
+		error = pthread_cond_signal(&requests_condvar);
+		require_noerr(error, pthread_cond_signal);
+	}
+	else {
+		/* No idle threads, so try to create one if we have not reached out maximum number of threads */
+		if (gCurrThreadCount < WEBDAV_REQUEST_THREADS) {
+			error = pthread_create(&request_thread, &gRequest_thread_attr, (void *) handle_request_thread, (void *) NULL);
+			require_noerr(error, pthread_create_signal);
+
+			gCurrThreadCount += 1;
+		}
+	}
+
+pthread_create_signal:
+pthread_cond_signal:
+malloc_request_element_ptr:
+
+	error2 = pthread_mutex_unlock(&requests_lock);
+	require_noerr_action(error2, pthread_mutex_unlock, error = (error == 0) ? error2 : error; webdav_kill(-1));
+
+pthread_mutex_unlock:
+pthread_mutex_lock:
+
+	return (error);
+}
+
+/*****************************************************************************/
+
 int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *ctx)
 {
 	int error, error2;
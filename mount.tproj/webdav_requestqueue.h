@@ -41,10 +41,17 @@ extern void set_connectionstate(int bad);
 extern int requestqueue_init(void);
 extern int requestqueue_enqueue_request(int socket);
 extern int requestqueue_enqueue_download(
+			uid_t uid,							/* uid of the user who opened the file */
 			struct node_entry *node,			/* the node */
 			struct ReadStreamRec *readStreamRecPtr); /* the ReadStreamRec */
+extern int requestqueue_enqueue_readdir(
+			struct node_entry *node,			/* the directory node */
+			struct ReadStreamRec *readStreamRecPtr, /* the ReadStreamRec */
+			webdav_parse_opendir_stream_t *opendir_stream, /* the opendir stream */
+			struct ContentDecoder *decoder);	/* the listing's decoder, or NULL */
 extern int requestqueue_enqueue_server_ping(u_int32_t delay);
 extern int requestqueue_purge_cache_files(void);
 extern int requestqueue_enqueue_seqwrite_manager(struct stream_put_ctx *);
+extern int requestqueue_enqueue_writeback(struct node_entry *node);
 
 #endif
@@ -70,6 +70,48 @@
 /* the number of threads available to handle requests from the kernel file system and downloads */
 #define WEBDAV_REQUEST_THREADS 5
 
+/*
+ * Large files can be downloaded with several concurrent Range GETs. The number
+ * of connections per download and the segment size come from the
+ * downloadconnections and downloadsegmentsize mount options, and only files at
+ * least downloadthreshold bytes long are split. The helper threads of all downloads share WEBDAV_DOWNLOAD_HELPER_THREADS
+ * extra streams so they never starve the request threads of connections.
+ */
+#define WEBDAV_DOWNLOAD_HELPER_THREADS 6
+#define WEBDAV_DEFAULT_DOWNLOAD_CONNECTIONS 1			/* parallel downloads are off by default */
+#define WEBDAV_DEFAULT_DOWNLOAD_SEGMENT_SIZE 0x00100000	/* 1M */
+#define WEBDAV_DEFAULT_DOWNLOAD_THRESHOLD 0x00800000	/* 8M */
+
+/*
+ * The first part of a file is downloaded synchronously at open. Its length is
+ * learned per filename extension from files that are closed before their
+ * download finishes, between the page size (or the firstreadsize mount option)
+ * and the firstreadmax mount option.
+ */
+#define WEBDAV_DEFAULT_FIRST_READ_MAX 0x00040000		/* 256K */
+
+/*
+ * With write-back (the writeback mount option), a file is uploaded once it has
+ * been closed for writebackdelay seconds.
+ */
+#define WEBDAV_DEFAULT_WRITEBACK_DELAY 2
+
+/*
+ * In Write Sequential mode, up to writeseqwindow chunks of
+ * BODY_BUFFER_SIZE bytes are queued on the PUT stream at once (1 waits for
+ * each chunk to be written before reading the next).
+ */
+#define WEBDAV_DEFAULT_WRITESEQ_WINDOW 8
+
+/*
+ * When uploadsegmentsize is set and a probe at mount shows the server accepts
+ * PUTs with Content-Range, files larger than uploadsegmentsize bytes are
+ * uploaded in segments of that size so an upload interrupted by a lost
+ * connection can continue from the last byte the server has instead of
+ * starting over. The default, 0, sends every file in one PUT.
+ */
+#define WEBDAV_DEFAULT_UPLOAD_SEGMENT_SIZE 0
+
 #define PRIVATE_CERT_UI_COMMAND "/System/Library/Filesystems/webdav.fs/Contents/Resources/webdav_cert_ui.app/Contents/MacOS/webdav_cert_ui"
 #define PRIVATE_UNMOUNT_COMMAND "/sbin/umount"
 #define PRIVATE_UNMOUNT_FLAGS "-f"
@@ -96,14 +138,13 @@
 #define WEBDAV_IOSIZE (4*1024)			/* should be < PIPSIZ (8K) */
 
 #define WEBDAV_WRITESEQ_RSPBUF_LEN 4096
+#define WEBDAV_WRITESEQ_RING_SLOTS 64	/* the largest writeseqwindow */
 #define WEBDAV_WRITESEQ_REQUEST_TIMEOUT 30  /* in seconds  */
 #define WEBDAV_MANAGER_STARTUP_TIMEOUT 5 /* in seconds */
 
 /* Macro to simplify common CFRelease usage */
 #define CFReleaseNull(obj) do { if(obj != NULL) { CFRelease(obj); obj = NULL; } } while (0)
 
-struct seqwrite_mgr_req;
-
 enum WriteMgrStatus {WR_MGR_VIRGIN=0, WR_MGR_RUNNING, WR_MGR_DONE};
 struct stream_put_ctx {   
 	/* Stream Pair */
@@ -129,10 +170,22 @@ struct stream_put_ctx {
 	enum WriteMgrStatus mgr_status;
 	uint32_t canAcceptBytesEvents;
 	
-	// Request queue for manager thread, and
-	// message port
-	CFMessagePortRef mgrPort;
-	struct seqwrite_mgr_req *req_head, *req_tail;
+	// Single-producer/single-consumer ring of chunks for the
+	// manager thread. The thread handling the current WEBDAV_WRITESEQ
+	// (or the close) is the only producer and only advances ringHead;
+	// the manager is the only consumer and only advances ringTail.
+	// Both are free-running, so ringHead - ringTail is the number
+	// of chunks in the ring (at most ringSlots, which is
+	// gSeqWriteWindow when the PUT started).
+	CFRunLoopSourceRef mgrSource;	// signaled to wake the manager
+	uint32_t ringSlots;
+	volatile uint32_t ringHead;
+	volatile uint32_t ringTail;
+	volatile bool producerWaiting;	// producer is waiting on ctx_condvar for room
+	volatile bool closeRequested;	// close the write stream once the ring is empty
+	unsigned char *ringBuffer;		// ringSlots chunks of BODY_BUFFER_SIZE bytes
+	CFIndex ringLen[WEBDAV_WRITESEQ_RING_SLOTS];	// bytes in each chunk
+	CFIndex chunkWritten;			// bytes of the chunk at ringTail already written
 	
 	// *************************************
 	// *** Response stream thread fields ***
@@ -157,35 +210,6 @@ struct stream_put_ctx {
 	uint32_t is_retry;
 };
 
-// Sequential write manager request
-enum SeqWriteMgrReqType {SEQWRITE_CHUNK, SEQWRITE_CLOSE};
-struct seqwrite_mgr_req
-{
-	enum SeqWriteMgrReqType type;
-	
-	struct seqwrite_mgr_req *prev, *next;
-	
-	// ***********************
-	// *** Synchronization ***
-	// ***********************
-	pthread_mutex_t req_lock;
-	pthread_cond_t req_condvar;
-	
-	// state of this request
-	struct webdav_request_writeseq *req;
-	bool request_done;
-	uint32_t is_retry;	// true if this request is a retry (due to a previous EPIPE)
-	int  error;
-	
-	// chunk state
-	CFIndex chunkLen, chunkWritten;
-	
-	uint32_t refCount;
-	
-	// Where we store data read from the cache before we throw it on the wire.
-	unsigned char *data;
-};
-
 /* Global functions */
 extern void webdav_debug_assert(const char *componentNameString, const char *assertionString, 
 	const char *exceptionLabelString, const char *errorString, 
@@ -196,6 +220,20 @@ extern void webdav_kill(int message);
 extern unsigned int gtimeout_val;		/* the pulse_thread runs at double this rate */
 extern char * gtimeout_string;			/* the length of time LOCKs are held on on the server */
 extern int gWebdavfsDebug;				/* TRUE if the WEBDAVFS_DEBUG environment variable is set */
+extern int gMultistatusScanner;			/* FALSE if the noscanner mount option is set */
+extern int gEventEngine;				/* FALSE if the noeventengine mount option is set */
+extern int gAcceptEncoding;			/* FALSE if the nocompression mount option is set */
+extern int gMmapUpload;				/* FALSE if the nommapupload mount option is set */
+extern int gLazyCreate;				/* TRUE if the lazycreate mount option is set */
+extern int gWriteBack;					/* TRUE if the writeback mount option is set */
+extern time_t gWriteBackDelay;			/* seconds a file is closed before write-back uploads it */
+extern uint32_t gSeqWriteWindow;		/* Write Sequential chunks queued on the PUT stream at once */
+extern off_t gUploadSegmentSize;		/* size of each PUT of a resumable upload, or 0 to send files in one PUT */
+extern int gDownloadConnections;		/* connections used to download a large file (1 means no parallel downloads) */
+extern size_t gDownloadSegmentSize;		/* size of each Range GET of a parallel download */
+extern off_t gDownloadThreshold;		/* smallest file downloaded with parallel Range GETs */
+extern size_t gFirstReadSize;			/* bytes downloaded at open, or 0 for the page size */
+extern size_t gFirstReadMax;			/* most bytes downloaded at open after learning from closes */
 extern uid_t gProcessUID;				/* the daemon's UID */
 extern int gSuppressAllUI;				/* if TRUE, the mount requested that all UI be supressed */
 extern int gSecureServerAuth;			/* if TRUE, the authentication for server challenges must be sent securely (not clear-text) */
@@ -227,20 +265,39 @@ extern int filesystem_close(struct webdav_request_close *request_close);
 extern int filesystem_getattr(struct webdav_request_getattr *request_getattr,
 		struct webdav_reply_getattr *reply_getattr);
 
+typedef void (*filesystem_getattr_complete)(void *context, int error, struct webdav_reply_getattr *reply_getattr);
+
+extern int filesystem_getattr_async(struct webdav_request_getattr *request_getattr,
+		filesystem_getattr_complete complete, void *context);
+
 extern int filesystem_read(struct webdav_request_read *request_read,
 		char **a_byte_addr, size_t *a_size);
 
 extern int filesystem_fsync(struct webdav_request_fsync *request_fsync);
 
+extern void filesystem_writeback(struct node_entry *node);
+
+extern void filesystem_writeback_scan(void);
+
+extern int filesystem_writeback_pending(struct node_entry *node);
+
+extern int filesystem_writeback_drain(int force);
+
+extern void filesystem_log_writeback(void);
+
 extern int filesystem_remove(struct webdav_request_remove *request_remove);
 
 extern int filesystem_rename(struct webdav_request_rename *request_rename);
 
+extern int filesystem_copyfile(struct webdav_request_copyfile *request_copyfile);
+
 extern int filesystem_mkdir(struct webdav_request_mkdir *request_mkdir,
 		struct webdav_reply_mkdir *reply_mkdir);
 		
 extern int filesystem_rmdir(struct webdav_request_rmdir *request_rmdir);
 
+extern int filesystem_rmtree(struct webdav_request_rmtree *request_rmtree);
+
 extern int filesystem_write_seq(struct webdav_request_writeseq *request_sq_wr);
 
 extern int filesystem_readdir(struct webdav_request_readdir *request_readdir);
@@ -254,6 +311,8 @@ extern int filesystem_mount(int *a_mount_args);
 
 extern int filesystem_lock(struct node_entry *node);
 
+extern int filesystem_get_scratch_file(int *fd);
+
 extern int filesystem_init(int typenum);
 
 #endif /*ifndef _WEBDAVD_H_INCLUDE */
@@ -81,6 +81,7 @@
 #define WEBDAV_WRITESEQ			28
 #define WEBDAV_DUMP_COOKIES		29
 #define WEBDAV_CLEAR_COOKIES	30
+#define WEBDAV_RMTREE			31
 
 /* Webdav file type constants */
 #define WEBDAV_FILE_TYPE		1
@@ -297,6 +298,7 @@ struct webdav_request_close
 {
 	struct webdav_cred pcr;				/* user and groups */
 	opaque_id		obj_id;				/* opaque_id of object */
+	off_t			read_frontier;		/* highest offset read since the file was opened */
 };
 
 struct webdav_reply_close
@@ -375,10 +377,14 @@ struct webdav_reply_write
 };
 
 /* WEBDAV_FSYNC */
+/* webdav_request_fsync flags */
+#define WEBDAV_FSYNC_WRITEBACK	0x00000001	/* the fsync is from a close; mount_webdav may upload the file later */
+
 struct webdav_request_fsync
 {
 	struct webdav_cred pcr;				/* user and groups */
 	opaque_id		obj_id;				/* opaque_id of object */
+	uint32_t		flags;				/* WEBDAV_FSYNC_WRITEBACK */
 };
 
 struct webdav_reply_fsync
@@ -407,6 +413,17 @@ struct webdav_reply_rmdir
 {
 };
 
+/* WEBDAV_RMTREE */
+struct webdav_request_rmtree
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		obj_id;				/* opaque_id of directory object to remove with everything in it */
+};
+
+struct webdav_reply_rmtree
+{
+};
+
 /* WEBDAV_RENAME */
 struct webdav_request_rename
 {
@@ -423,6 +440,22 @@ struct webdav_reply_rename
 {
 };
 
+/* WEBDAV_COPYFILE */
+struct webdav_request_copyfile
+{
+	struct webdav_cred pcr;				/* user and groups */
+	opaque_id		from_obj_id;		/* opaque_id for the object to be copied */
+	opaque_id		to_dir_id;			/* opaque_id for the directory to which the object is to be copied */
+	opaque_id		to_obj_id;			/* opaque_id for the object at the destination if it exists (may be NULL) */
+	uint32_t		overwrite;			/* if TRUE, the object at the destination (if any) is replaced */
+	uint32_t		to_name_length;		/* length of to_name */
+	char			to_name[];			/* name for the copy */
+};
+
+struct webdav_reply_copyfile
+{
+};
+
 /* WEBDAV_READDIR */
 struct webdav_request_readdir
 {
@@ -468,6 +501,7 @@ struct webdav_reply_statfs
 struct webdav_request_unmount
 {
 	struct webdav_cred pcr;				/* user and groups */
+	int force;							/* TRUE if the unmount is forced (MNT_FORCE) */
 };
 
 struct webdav_reply_unmount
@@ -522,7 +556,9 @@ union webdav_request
 	struct webdav_request_fsync		fsync;
 	struct webdav_request_remove	remove;
 	struct webdav_request_rmdir		rmdir;
+	struct webdav_request_rmtree	rmtree;
 	struct webdav_request_rename	rename;
+	struct webdav_request_copyfile	copyfile;
 	struct webdav_request_readdir	readdir;
 	struct webdav_request_statfs	statfs;
 	struct webdav_request_invalcaches invalcaches;
@@ -542,7 +578,9 @@ union webdav_reply
 	struct webdav_reply_fsync		fsync;
 	struct webdav_reply_remove		remove;
 	struct webdav_reply_rmdir		rmdir;
+	struct webdav_reply_rmtree		rmtree;
 	struct webdav_reply_rename		rename;
+	struct webdav_reply_copyfile	copyfile;
 	struct webdav_reply_readdir		readdir;
 	struct webdav_reply_statfs		statfs;
 	struct webdav_reply_invalcaches	invalcaches;
@@ -604,6 +642,23 @@ struct WebdavWriteSequential {
 
 #define WEBDAVIOC_RESET_COOKIES		_IOW('x', 28, int)
 
+/*
+ * The WEBDAVIOC_REMOVE_TREE command passed to fsctl(2) on a directory removes
+ * the directory and everything in it with a single DELETE request to the
+ * server, instead of a lookup, remove or rmdir for each object in the tree.
+ *
+ * Example:
+ *
+ *	result = fsctl(path, WEBDAVIOC_REMOVE_TREE, NULL, 0);
+ *
+ *	Return values:
+ *	0		-	Success
+ *	ENOTDIR	-	path is not a directory.
+ *	EBUSY	-	path is the root of the file system, or the server could not
+ *				remove some of the objects in the tree (the rest were removed).
+ */
+#define WEBDAVIOC_REMOVE_TREE		_IO('w', 2)
+
 /*
  * Sysctl values for WebDAV FS
  */
@@ -673,6 +728,7 @@ struct webdavnode
 	off_t pt_filesize;							/* what we think the filesize is */
 	u_int32_t pt_status;						/* WEBDAV_DIRTY, etc */
 	u_int32_t pt_opencount;						/* reference count of opens */
+	off_t pt_read_frontier;						/* highest offset read since the file was opened */
 	
 	/* for Write Sequential mode */
 	u_int32_t pt_opencount_write;				/* count of opens for writing */
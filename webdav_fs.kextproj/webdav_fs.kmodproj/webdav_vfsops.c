@@ -483,12 +483,22 @@ static int webdav_unmount(struct mount *mp, int mntflags, vfs_context_t context)
 	}
 
 	webdav_copy_creds(context, &request_unmount.pcr);
+	request_unmount.force = ((flags & FORCECLOSE) != 0);
 
-	/* send the unmount message message to user-land and ignore errors */
-	(void) webdav_sendmsg(WEBDAV_UNMOUNT, fmp,
-		&request_unmount, sizeof(struct webdav_request_unmount), 
-		NULL, 0, 
-		&server_error, NULL, 0);
+	/*
+	 * Send the unmount message to user-land and ignore errors, except
+	 * that user-land refuses an unforced unmount with EBUSY while it has
+	 * changes to files it couldn't upload.
+	 */
+	server_error = 0;
+	if ( (webdav_sendmsg(WEBDAV_UNMOUNT, fmp,
+			&request_unmount, sizeof(struct webdav_request_unmount), 
+			NULL, 0, 
+			&server_error, NULL, 0) == 0) &&
+		 (server_error == EBUSY) && !(flags & FORCECLOSE) )
+	{
+		return (EBUSY);
+	}
 
 	/* release reference on the root vnode taken in webdav_mount */
 	vnode_rele(rootvp);
@@ -63,6 +63,11 @@ extern lck_mtx_t *webdav_node_hash_mutex;
 
 uint64_t MAX_READ = 16 * 1024 * 1204;
 
+/* copyfile(2) flag (private in <sys/fcntl.h>) */
+#ifndef CPF_OVERWRITE
+#define CPF_OVERWRITE 0x0001
+#endif
+
 /*****************************************************************************/
 
 #if 0
@@ -392,7 +397,9 @@ again:
 				/* sock_receive DID time out */
 				if ( (++num_rcv_timeouts == WEBDAV_MAX_SOCK_RCV_TIMEOUTS ) &&
 				     (vnop != WEBDAV_WRITE) && (vnop != WEBDAV_READ) &&
-					 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) ) {
+					 (vnop != WEBDAV_FSYNC) && (vnop != WEBDAV_WRITESEQ) &&
+					 (vnop != WEBDAV_COPYFILE) && (vnop != WEBDAV_RMTREE) &&
+					 (vnop != WEBDAV_UNMOUNT) ) {
 						// This vnop has timed out.
 						printf("webdav_sendmsg: sock_receive() timeout. vnop: %d\n", vnop);
 						error = ETIMEDOUT;
@@ -1360,6 +1367,7 @@ static int webdav_vnop_open_locked(struct vnop_open_args *ap)
 
 		/* set the open count */
 		pt->pt_opencount = 1;
+		pt->pt_read_frontier = 0;
 
 		if (ap->a_mode & FWRITE)
 			pt->pt_opencount_write = 1;
@@ -1429,13 +1437,17 @@ static int webdav_vnop_open(struct vnop_open_args *ap)
  * Callers of this routine must ensure (1) the webdavnode is locked exclusively,
  * (2) the file is a regular file, and (3) there's a cache vnode.
  *
+ * Only webdav_close_mnomap passes TRUE for closing, which lets mount_webdav
+ * upload the file after the close returns (write-back). Every other caller,
+ * fsync(2) and fdatasync(2) included, waits for the upload.
+ *
  * results:
  *	0		Success.
  *	EIO		A physical I/O error has occurred, or this error was generated for
  *			implementation-defined reasons.
  *	ENOSPC	The server returned 507 Insufficient Storage (WebDAV)
  */
-static int webdav_fsync(struct vnop_fsync_args *ap)
+static int webdav_fsync(struct vnop_fsync_args *ap, int closing)
 /*
 	struct vnop_fsync_args {
 		struct vnodeop_desc *a_desc;
@@ -1580,6 +1592,8 @@ static int webdav_fsync(struct vnop_fsync_args *ap)
 	
 	webdav_copy_creds(ap->a_context, &request_fsync.pcr);
 	request_fsync.obj_id = pt->pt_obj_id;
+	/* only the fsync of a close can be written back later */
+	request_fsync.flags = closing ? WEBDAV_FSYNC_WRITEBACK : 0;
 
 	error = webdav_sendmsg(WEBDAV_FSYNC, fmp,
 		&request_fsync, sizeof(struct webdav_request_fsync), 
@@ -1645,7 +1659,7 @@ static int webdav_vnop_fsync(struct vnop_fsync_args *ap)
 	
 	if ( (pt->pt_cache_vnode != NULLVP) && vnode_isreg(ap->a_vp) )
 	{
-		error = webdav_fsync(ap);
+		error = webdav_fsync(ap, FALSE);
 	}
 	else
 	{
@@ -1700,7 +1714,8 @@ int webdav_close_mnomap(vnode_t vp, vfs_context_t context, int force_fsync)
 			fsync_args.a_vp = vp;
 			fsync_args.a_waitfor = MNT_WAIT;
 			fsync_args.a_context = context;
-			fsync_error = webdav_fsync(&fsync_args);
+			/* the data is safe in the cache file, so mount_webdav may upload it after the close */
+			fsync_error = webdav_fsync(&fsync_args, TRUE);
 			if ( fsync_error == ERESTART )
 			{
 				goto done;
@@ -1720,6 +1735,7 @@ int webdav_close_mnomap(vnode_t vp, vfs_context_t context, int force_fsync)
 			
 			webdav_copy_creds(context, &request_close.pcr);
 			request_close.obj_id = pt->pt_obj_id;
+			request_close.read_frontier = pt->pt_read_frontier;
 
 			error = webdav_sendmsg(WEBDAV_CLOSE, VFSTOWEBDAV(vnode_mount(vp)),
 				&request_close, sizeof(struct webdav_request_close), 
@@ -2084,6 +2100,9 @@ static int webdav_rdwr(struct vnop_read_args *ap)
 	{
 		/* we've access the file */
 		pt->pt_status |= WEBDAV_ACCESSED;
+		
+		/* mount_webdav learns how much of a file to download at open from how far it was read */
+		pt->pt_read_frontier = MAX(pt->pt_read_frontier, uio_offset(in_uio) + uio_resid(in_uio));
 	}
 
 	/* Start the sleep loop to wait on the background download. We will know that the webdav user
@@ -3258,6 +3277,180 @@ done:
 
 /*****************************************************************************/
 
+/*
+ * webdav_vnop_copyfile
+ *
+ * Copies fvp to tdvp/tcnp on the server with a WebDAV COPY so the data never
+ * passes through this machine. If the server can't do it, ENOTSUP is returned
+ * and copyfile(2)'s callers fall back to copying the data themselves.
+ */
+static int webdav_vnop_copyfile(struct vnop_copyfile_args *ap)
+/*
+	struct vnop_copyfile_args {
+		struct vnodeop_desc *a_desc;
+		vnode_t a_fvp;
+		vnode_t a_tdvp;
+		vnode_t a_tvp;
+		struct componentname *a_tcnp;
+		int a_mode;
+		int a_flags;
+		vfs_context_t a_context;
+	};
+*/
+{
+	vnode_t fvp = ap->a_fvp;
+	vnode_t tvp = ap->a_tvp;
+	vnode_t tdvp = ap->a_tdvp;
+	struct componentname *tcnp = ap->a_tcnp;
+	struct webdavnode *fpt;
+	struct webdavnode *tdpt;
+	struct webdavmount *wmp;
+	struct webdavnode *lock_order[3] = {NULL};
+	int lock_cnt = 0;
+	int ii;
+	int vtype;
+	int error = 0;
+	int server_error = 0;
+	struct webdav_request_copyfile request_copyfile;
+
+	START_MARKER("webdav_vnop_copyfile");
+
+	/* Check for cross-device copy */
+	if ((vnode_mount(fvp) != vnode_mount(tdvp)) ||
+		(tvp && (vnode_mount(fvp) != vnode_mount(tvp))))
+		return (EXDEV);
+
+	vtype = vnode_vtype(fvp);
+	if ( (vtype != VDIR) && (vtype != VREG) )
+		return (ENOTSUP);
+
+	if ( (tvp == fvp) || (tdvp == fvp) )
+		return (EINVAL);
+
+	wmp = VFSTOWEBDAV(vnode_mount(fvp));
+	fpt = VTOWEBDAV(fvp);
+	tdpt = VTOWEBDAV(tdvp);
+
+	/*
+	 * Lock the destination directory first, then the children in address
+	 * order, under pm_renamelock so this can't interleave with a rename's
+	 * locking of the same nodes.
+	 */
+	lck_mtx_lock(&wmp->pm_renamelock);
+	lock_order[lock_cnt++] = tdpt;
+	if ( (tvp == NULLVP) || (fpt < VTOWEBDAV(tvp)) )
+	{
+		lock_order[lock_cnt++] = fpt;
+		if ( tvp != NULLVP )
+			lock_order[lock_cnt++] = VTOWEBDAV(tvp);
+	}
+	else
+	{
+		lock_order[lock_cnt++] = VTOWEBDAV(tvp);
+		lock_order[lock_cnt++] = fpt;
+	}
+	lck_mtx_unlock(&wmp->pm_renamelock);
+
+	for (ii = 0; ii < lock_cnt; ii++)
+	{
+		webdav_lock(lock_order[ii], WEBDAV_EXCLUSIVE_LOCK);
+		lock_order[ii]->pt_lastvop = webdav_vnop_copyfile;
+	}
+
+	if ( vtype == VREG )
+	{
+		/* the server's copy is only current once sequential writes are done */
+		if ( fpt->pt_writeseq_enabled )
+		{
+			error = ENOTSUP;
+			goto done;
+		}
+
+		/* push any changes in the cache file to the server so they're copied too */
+		if ( fpt->pt_cache_vnode != NULLVP )
+		{
+			struct vnop_fsync_args fsync_args;
+			
+			fsync_args.a_vp = fvp;
+			fsync_args.a_waitfor = MNT_WAIT;
+			fsync_args.a_context = ap->a_context;
+			error = webdav_fsync(&fsync_args, FALSE);
+			if ( error )
+			{
+				goto done;
+			}
+		}
+	}
+
+	webdav_copy_creds(ap->a_context, &request_copyfile.pcr);
+	request_copyfile.from_obj_id = fpt->pt_obj_id;
+	request_copyfile.to_dir_id = tdpt->pt_obj_id;
+	request_copyfile.to_obj_id = (tvp != NULLVP) ? VTOWEBDAV(tvp)->pt_obj_id : 0;
+	request_copyfile.overwrite = (ap->a_flags & CPF_OVERWRITE) ? 1 : 0;
+	request_copyfile.to_name_length = tcnp->cn_namelen;
+
+	error = webdav_sendmsg(WEBDAV_COPYFILE, wmp,
+		&request_copyfile, offsetof(struct webdav_request_copyfile, to_name),
+		tcnp->cn_nameptr, tcnp->cn_namelen,
+		&server_error, NULL, 0);
+
+	if ( (error == 0) && (server_error != 0) )
+	{
+		if ( server_error == ESTALE )
+		{
+			/*
+			 * The object id(s) passed to userland are invalid.
+			 * Purge the vnode(s) and restart the request.
+			 */
+			webdav_purge_stale_vnode(fvp);
+			webdav_purge_stale_vnode(tdvp);
+			if ( tvp != NULLVP )
+			{
+				webdav_purge_stale_vnode(tvp);
+			}
+			error = ERESTART;
+			goto done;
+		}
+		else
+		{
+			error = server_error;
+		}
+	}
+
+	if ( (tvp != NULLVP) && (error == 0) )
+	{
+		/* tvp was replaced by the copy */
+		cache_purge(tvp);
+		VTOWEBDAV(tvp)->pt_status |= WEBDAV_DELETED;
+		(void) vnode_recycle(tvp); /* we don't care if the recycle was done or not */
+	}
+
+	/* the destination directory may have changed (even if error) so force readdir to reload */
+	tdpt->pt_status |= WEBDAV_DIR_NOT_LOADED;
+
+	/* if success, blow away statfs cache */
+	if (!error)
+		wmp->pm_statfstime = 0;
+
+	/* Purge negative cache entries in the destination directory */
+	if (tdpt->pt_status & WEBDAV_NEGNCENTRIES)
+	{
+		tdpt->pt_status &= ~WEBDAV_NEGNCENTRIES;
+		cache_purge_negatives(tdvp);
+	}
+
+done:
+	/* Unlock all nodes in reverse order */
+	for ( ii = lock_cnt - 1; ii >= 0; ii--)
+	{
+		webdav_unlock(lock_order[ii]);
+	}
+
+	RET_ERR("webdav_vnop_copyfile", error);
+}
+
+/*****************************************************************************/
+
 static int webdav_vnop_mkdir(struct vnop_mkdir_args *ap)
 /*
 	struct vnop_mkdir_args {
@@ -3690,6 +3883,65 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 			goto done;
 		}
 
+		/* The webdav user process may still be appending entries to the cache file
+		 * in the background. Like a file download, the nodump flag is set until the
+		 * listing is complete and the append only flag is set if the listing failed.
+		 * Sleep until there is at least one whole entry past the offset, or until
+		 * the listing is complete.
+		 */
+		do
+		{
+			VATTR_INIT(&vattr);
+			VATTR_WANTED(&vattr, va_flags);
+			VATTR_WANTED(&vattr, va_data_size);
+			error = vnode_getattr(cachevp, &vattr, ap->a_context);
+			if ( error )
+			{
+				goto done;
+			}
+			
+			if ( (vattr.va_flags & UF_NODUMP) &&
+				 ((off_t)vattr.va_data_size < (uio_offset(uio) + (off_t)sizeof(struct dirent))) )
+			{
+				struct timespec ts;
+				
+				/* sleep for a bit */
+				ts.tv_sec = 0;
+				ts.tv_nsec = WEBDAV_WAIT_FOR_PAGE_TIME;
+				error = msleep((caddr_t)&ts, NULL, PCATCH, "webdav_vnop_readdir", &ts);
+				if ( error )
+				{
+					if ( error == EWOULDBLOCK )
+					{
+						error = 0;
+					}
+					else
+					{
+						/* convert pseudo-errors to EIO */
+						if ( error < 0 )
+						{
+							error = EIO;
+						}
+						goto done;
+					}
+				}
+			}
+			else
+			{
+				break; /* out of while (TRUE) loop */
+			}
+		} while ( TRUE );
+		
+		if ( vattr.va_flags & UF_APPEND )
+		{
+			/* There was an error getting the listing from the server, so make sure
+			 * the next readdir asks for it again.
+			 */
+			pt->pt_status |= WEBDAV_DIR_NOT_LOADED;
+			error = EIO;
+			goto done;
+		}
+
 		count = uio_resid(uio);
 		count -= (uio_offset(uio) + count) % sizeof(struct dirent);
 		if (count <= 0)
@@ -3697,6 +3949,16 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 			error = EINVAL;
 			goto done;
 		}
+		
+		if ( vattr.va_flags & UF_NODUMP )
+		{
+			off_t available;
+			
+			/* only read the whole entries that have been written so far */
+			available = (off_t)vattr.va_data_size - uio_offset(uio);
+			available -= available % sizeof(struct dirent);
+			count = MIN(count, (user_ssize_t)available);
+		}
 
 		lost = uio_resid(uio) - count;
 		uio_setresid(uio, count);
@@ -3708,13 +3970,15 @@ static int webdav_vnop_readdir(struct vnop_readdir_args *ap)
 		if (ap->a_eofflag)
 		{
 			VATTR_INIT(&vattr);
+			VATTR_WANTED(&vattr, va_flags);
 			VATTR_WANTED(&vattr, va_data_size);
 			error = vnode_getattr(cachevp, &vattr, ap->a_context);
 			if (error)
 			{
 				goto done;
 			}
-			*ap->a_eofflag = (off_t)vattr.va_data_size <= uio_offset(uio);
+			/* we're not at EOF while entries are still being appended */
+			*ap->a_eofflag = !(vattr.va_flags & UF_NODUMP) && ((off_t)vattr.va_data_size <= uio_offset(uio));
 		}
 	}
 
@@ -3950,6 +4214,8 @@ static int webdav_vnop_pagein(struct vnop_pagein_args *ap)
 	{
 		goto exit;
 	}
+	
+	pt->pt_read_frontier = MAX(pt->pt_read_frontier, ap->a_f_offset + (off_t)ap->a_size);
 
 	/* Ok, start the sleep loop to wait on the background download
 	  We will know that the webdav user process is finished when it
@@ -4454,6 +4720,101 @@ static int webdav_vnop_ioctl(struct vnop_ioctl_args *ap)
 		}
 		break;
 			
+		case WEBDAVIOC_REMOVE_TREE:	/* remove a directory and everything in it */
+		{
+			struct webdavmount *fmp;
+			struct webdav_request_rmtree request_rmtree;
+			vnode_t dvp;
+			int server_error;
+			
+			/* Note: Since this command is coming through fsctl(), vnode_get has been called on the vnode */
+			
+			if ( !vnode_isdir(vp) )
+			{
+				error = ENOTDIR;
+				break;
+			}
+			if ( vnode_isvroot(vp) )
+			{
+				error = EBUSY;
+				break;
+			}
+			dvp = vnode_getparent(vp);
+			if ( dvp == NULLVP )
+			{
+				error = ENOENT;
+				break;
+			}
+			
+			fmp = VFSTOWEBDAV(vnode_mount(vp));
+			pt = VTOWEBDAV(vp);
+			server_error = 0;
+			
+			/* lock parent node, then child */
+			webdav_lock(VTOWEBDAV(dvp), WEBDAV_EXCLUSIVE_LOCK);
+			webdav_lock(pt, WEBDAV_EXCLUSIVE_LOCK);
+			pt->pt_lastvop = webdav_vnop_ioctl;
+			VTOWEBDAV(dvp)->pt_lastvop = webdav_vnop_ioctl;
+			
+			cache_purge(vp);
+			
+			webdav_copy_creds(ap->a_context, &request_rmtree.pcr);
+			request_rmtree.obj_id = pt->pt_obj_id;
+			
+			error = webdav_sendmsg(WEBDAV_RMTREE, fmp,
+				&request_rmtree, sizeof(struct webdav_request_rmtree),
+				NULL, 0,
+				&server_error, NULL, 0);
+			if ( (error == 0) && (server_error != 0) )
+			{
+				if ( server_error == ESTALE )
+				{
+					/*
+					 * The object id passed to userland is invalid.
+					 * Purge the vnode and restart the request.
+					 */
+					webdav_purge_stale_vnode(vp);
+					error = ERESTART;
+				}
+				else
+				{
+					error = server_error;
+				}
+			}
+			
+			/*
+			 * Some of the tree may be gone even if there was an error, so force
+			 * readdir to reload both directories. Vnodes for objects inside the
+			 * tree are found to be stale the next time they're used.
+			 */
+			VTOWEBDAV(dvp)->pt_status |= WEBDAV_DIR_NOT_LOADED;
+			pt->pt_status |= WEBDAV_DIR_NOT_LOADED;
+			
+			if ( error == 0 )
+			{
+				/* parent directory just changed, flush negative name cache entries */
+				if (VTOWEBDAV(dvp)->pt_status & WEBDAV_NEGNCENTRIES)
+				{
+					VTOWEBDAV(dvp)->pt_status &= ~WEBDAV_NEGNCENTRIES;
+					cache_purge_negatives(dvp);
+				}
+				
+				/* Get the node off of the cache so that other lookups
+				 * won't find it and think the directory still exists
+				 */
+				pt->pt_status |= WEBDAV_DELETED;
+				(void) vnode_recycle(vp); /* we don't care if the recycle was done or not */
+				
+				fmp->pm_statfstime = 0;
+			}
+			
+			/* unlock child node, then parent */
+			webdav_unlock(pt);
+			webdav_unlock(VTOWEBDAV(dvp));
+			vnode_put(dvp);
+		}
+		break;
+		
 		case WEBDAVIOC_RESET_COOKIES:	/* reset cookie list */
 		{
 			struct webdavmount *fmp;
@@ -4527,6 +4888,7 @@ struct vnodeopv_entry_desc webdav_vnodeop_entries[] = {
 	{&vnop_fsync_desc, (VOPFUNC)webdav_vnop_fsync},					/* fsync */
 	{&vnop_remove_desc, (VOPFUNC)webdav_vnop_remove},				/* remove */
 	{&vnop_rename_desc, (VOPFUNC)webdav_vnop_rename},				/* rename */
+	{&vnop_copyfile_desc, (VOPFUNC)webdav_vnop_copyfile},			/* copyfile */
 	{&vnop_mkdir_desc, (VOPFUNC)webdav_vnop_mkdir},					/* mkdir */
 	{&vnop_rmdir_desc, (VOPFUNC)webdav_vnop_rmdir},					/* rmdir */
 	{&vnop_readdir_desc, (VOPFUNC)webdav_vnop_readdir},				/* readdir */